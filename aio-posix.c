@@ -17,6 +17,11 @@
 #include "block.h"
 #include "qemu-queue.h"
 #include "qemu_socket.h"
+#include <poll.h>
+
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
 
 struct AioHandler
 {
@@ -25,6 +30,7 @@ struct AioHandler
     IOHandler *io_write;
     AioFlushHandler *io_flush;
     int deleted;
+    int pollfds_idx;
     void *opaque;
     QLIST_ENTRY(AioHandler) node;
 };
@@ -42,6 +48,144 @@ static AioHandler *find_aio_handler(AioContext *ctx, int fd)
     return NULL;
 }
 
+#ifdef CONFIG_EPOLL
+
+/* Events fetched by a single epoll_wait.  The epoll set is level-triggered,
+ * so whatever does not fit is simply reported again by the next call.  */
+#define AIO_EPOLL_MAX_EVENTS 128
+
+static uint32_t aio_epoll_events(int events)
+{
+    return (events & G_IO_IN ? EPOLLIN : 0) |
+           (events & G_IO_OUT ? EPOLLOUT : 0) |
+           (events & G_IO_HUP ? EPOLLHUP : 0) |
+           (events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static int aio_epoll_revents(uint32_t events)
+{
+    return (events & EPOLLIN ? G_IO_IN : 0) |
+           (events & EPOLLOUT ? G_IO_OUT : 0) |
+           (events & EPOLLHUP ? G_IO_HUP : 0) |
+           (events & EPOLLERR ? G_IO_ERR : 0);
+}
+
+/* Go back to polling every descriptor, for example because one of them
+ * (a regular file) cannot be added to an epoll set.  */
+static void aio_epoll_disable(AioContext *ctx)
+{
+    AioHandler *node;
+
+    ctx->epoll_enabled = false;
+    g_source_remove_poll(&ctx->source, &ctx->epoll_pfd);
+    close(ctx->epollfd);
+    ctx->epollfd = -1;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted) {
+            g_source_add_poll(&ctx->source, &node->pfd);
+        }
+    }
+}
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, int op)
+{
+    struct epoll_event event;
+
+    event.data.ptr = node;
+    event.events = aio_epoll_events(node->pfd.events);
+    if (epoll_ctl(ctx->epollfd, op, node->pfd.fd, &event) < 0 &&
+        op != EPOLL_CTL_DEL) {
+        aio_epoll_disable(ctx);
+    }
+}
+
+static void aio_free_deleted_handlers(AioContext *ctx)
+{
+    AioHandler *node, *tmp;
+
+    QLIST_FOREACH_SAFE(node, &ctx->aio_handlers, node, tmp) {
+        if (node->deleted) {
+            QLIST_REMOVE(node, node);
+            g_free(node);
+        }
+    }
+    ctx->handlers_deleted = false;
+}
+
+/* Wait for up to @timeout milliseconds and dispatch the handlers that
+ * epoll reports as ready; unlike aio_dispatch, this never looks at the
+ * handlers that have nothing to do.  */
+static bool aio_epoll_dispatch(AioContext *ctx, int timeout)
+{
+    struct epoll_event events[AIO_EPOLL_MAX_EVENTS];
+    bool progress = false;
+    int i, ret;
+
+    ret = epoll_wait(ctx->epollfd, events, ARRAY_SIZE(events), timeout);
+    if (ret <= 0) {
+        return false;
+    }
+
+    ctx->walking_handlers++;
+
+    for (i = 0; i < ret; i++) {
+        AioHandler *node = events[i].data.ptr;
+        int revents;
+
+        /* See comment in aio_pending.  */
+        revents = aio_epoll_revents(events[i].events) & node->pfd.events;
+        if (!node->deleted &&
+            revents & (G_IO_IN | G_IO_HUP | G_IO_ERR) && node->io_read) {
+            node->io_read(node->opaque);
+            progress = true;
+        }
+        if (!node->deleted &&
+            revents & (G_IO_OUT | G_IO_ERR) && node->io_write) {
+            node->io_write(node->opaque);
+            progress = true;
+        }
+    }
+
+    ctx->walking_handlers--;
+
+    if (!ctx->walking_handlers && ctx->handlers_deleted) {
+        aio_free_deleted_handlers(ctx);
+    }
+
+    return progress;
+}
+
+#endif
+
+void aio_context_setup(AioContext *ctx)
+{
+    ctx->pollfds = g_array_new(FALSE, FALSE, sizeof(struct pollfd));
+
+#ifdef CONFIG_EPOLL
+    ctx->epollfd = epoll_create(AIO_EPOLL_MAX_EVENTS);
+    if (ctx->epollfd < 0) {
+        return;
+    }
+    qemu_set_cloexec(ctx->epollfd);
+
+    ctx->epoll_pfd.fd = ctx->epollfd;
+    ctx->epoll_pfd.events = G_IO_IN;
+    g_source_add_poll(&ctx->source, &ctx->epoll_pfd);
+    ctx->epoll_enabled = true;
+#endif
+}
+
+void aio_context_cleanup(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL
+    if (ctx->epoll_enabled) {
+        close(ctx->epollfd);
+    }
+#endif
+    g_array_free(ctx->pollfds, TRUE);
+}
+
 void aio_set_fd_handler(AioContext *ctx,
                         int fd,
                         IOHandler *io_read,
@@ -50,18 +194,30 @@ void aio_set_fd_handler(AioContext *ctx,
                         void *opaque)
 {
     AioHandler *node;
+    bool is_new = false;
 
     node = find_aio_handler(ctx, fd);
 
     /* Are we deleting the fd handler? */
     if (!io_read && !io_write) {
         if (node) {
+#ifdef CONFIG_EPOLL
+            if (ctx->epoll_enabled) {
+                aio_epoll_update(ctx, node, EPOLL_CTL_DEL);
+            } else {
+                g_source_remove_poll(&ctx->source, &node->pfd);
+            }
+#else
             g_source_remove_poll(&ctx->source, &node->pfd);
+#endif
 
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
                 node->deleted = 1;
                 node->pfd.revents = 0;
+#ifdef CONFIG_EPOLL
+                ctx->handlers_deleted = true;
+#endif
             } else {
                 /* Otherwise, delete it for real.  We can't just mark it as
                  * deleted because deleted nodes are only cleaned up after
@@ -77,17 +233,30 @@ void aio_set_fd_handler(AioContext *ctx,
             node = g_malloc0(sizeof(AioHandler));
             node->pfd.fd = fd;
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
-
-            g_source_add_poll(&ctx->source, &node->pfd);
+            is_new = true;
         }
         /* Update handler with latest information */
         node->io_read = io_read;
         node->io_write = io_write;
         node->io_flush = io_flush;
         node->opaque = opaque;
+        node->pollfds_idx = -1;
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP : 0);
         node->pfd.events |= (io_write ? G_IO_OUT : 0);
+
+#ifdef CONFIG_EPOLL
+        if (ctx->epoll_enabled) {
+            aio_epoll_update(ctx, node,
+                             is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+        } else if (is_new) {
+            g_source_add_poll(&ctx->source, &node->pfd);
+        }
+#else
+        if (is_new) {
+            g_source_add_poll(&ctx->source, &node->pfd);
+        }
+#endif
     }
 
     aio_notify(ctx);
@@ -107,6 +276,13 @@ bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
 
+#ifdef CONFIG_EPOLL
+    /* epollfd is readable as long as one of the handlers is */
+    if (ctx->epoll_enabled) {
+        return ctx->epoll_pfd.revents & G_IO_IN;
+    }
+#endif
+
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         int revents;
 
@@ -129,33 +305,28 @@ bool aio_pending(AioContext *ctx)
     return false;
 }
 
-bool aio_poll(AioContext *ctx, bool blocking)
+/*
+ * Dispatch the handlers whose pfd.revents were filled in, either by the
+ * GSource or by the poll() in aio_poll.
+ *
+ * We have to walk very carefully in case qemu_aio_set_fd_handler is
+ * called while we're walking.
+ */
+static bool aio_dispatch(AioContext *ctx)
 {
-    static struct timeval tv0;
     AioHandler *node;
-    fd_set rdfds, wrfds;
-    int max_fd = -1;
-    int ret;
-    bool busy, progress;
+    bool progress = false;
 
-    progress = false;
-
-    /*
-     * If there are callbacks left that have been queued, we need to call then.
-     * Do not call select in this case, because it is possible that the caller
-     * does not need a complete flush (as is the case for qemu_aio_wait loops).
-     */
-    if (aio_bh_poll(ctx)) {
-        blocking = false;
-        progress = true;
+#ifdef CONFIG_EPOLL
+    if (ctx->epoll_enabled) {
+        if (!ctx->epoll_pfd.revents) {
+            return false;
+        }
+        ctx->epoll_pfd.revents = 0;
+        return aio_epoll_dispatch(ctx, 0);
     }
+#endif
 
-    /*
-     * Then dispatch any pending callbacks from the GSource.
-     *
-     * We have to walk very carefully in case qemu_aio_set_fd_handler is
-     * called while we're walking.
-     */
     node = QLIST_FIRST(&ctx->aio_handlers);
     while (node) {
         AioHandler *tmp;
@@ -167,11 +338,13 @@ bool aio_poll(AioContext *ctx, bool blocking)
         node->pfd.revents = 0;
 
         /* See comment in aio_pending.  */
-        if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR) && node->io_read) {
+        if (!node->deleted &&
+            revents & (G_IO_IN | G_IO_HUP | G_IO_ERR) && node->io_read) {
             node->io_read(node->opaque);
             progress = true;
         }
-        if (revents & (G_IO_OUT | G_IO_ERR) && node->io_write) {
+        if (!node->deleted &&
+            revents & (G_IO_OUT | G_IO_ERR) && node->io_write) {
             node->io_write(node->opaque);
             progress = true;
         }
@@ -187,18 +360,45 @@ bool aio_poll(AioContext *ctx, bool blocking)
         }
     }
 
+    return progress;
+}
+
+bool aio_poll(AioContext *ctx, bool blocking)
+{
+    AioHandler *node;
+    int ret;
+    bool busy, progress;
+
+    progress = false;
+
+    /*
+     * If there are callbacks left that have been queued, we need to call then.
+     * Do not call poll in this case, because it is possible that the caller
+     * does not need a complete flush (as is the case for qemu_aio_wait loops).
+     */
+    if (aio_bh_poll(ctx)) {
+        blocking = false;
+        progress = true;
+    }
+
+    /* Then dispatch any pending callbacks from the GSource. */
+    if (aio_dispatch(ctx)) {
+        progress = true;
+    }
+
     if (progress && !blocking) {
         return true;
     }
 
     ctx->walking_handlers++;
 
-    FD_ZERO(&rdfds);
-    FD_ZERO(&wrfds);
+    g_array_set_size(ctx->pollfds, 0);
 
-    /* fill fd sets */
+    /* fill pollfds, unless epoll already knows about every handler */
     busy = false;
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        node->pollfds_idx = -1;
+
         /* If there aren't pending AIO operations, don't invoke callbacks.
          * Otherwise, if there are no AIO requests, qemu_aio_wait() would
          * wait indefinitely.
@@ -209,13 +409,19 @@ bool aio_poll(AioContext *ctx, bool blocking)
             }
             busy = true;
         }
-        if (!node->deleted && node->io_read) {
-            FD_SET(node->pfd.fd, &rdfds);
-            max_fd = MAX(max_fd, node->pfd.fd + 1);
+#ifdef CONFIG_EPOLL
+        if (ctx->epoll_enabled) {
+            continue;
         }
-        if (!node->deleted && node->io_write) {
-            FD_SET(node->pfd.fd, &wrfds);
-            max_fd = MAX(max_fd, node->pfd.fd + 1);
+#endif
+        if (!node->deleted && node->pfd.events) {
+            struct pollfd pfd = {
+                .fd = node->pfd.fd,
+                .events = node->pfd.events,
+            };
+
+            node->pollfds_idx = ctx->pollfds->len;
+            g_array_append_val(ctx->pollfds, pfd);
         }
     }
 
@@ -227,41 +433,32 @@ bool aio_poll(AioContext *ctx, bool blocking)
     }
 
     /* wait until next event */
-    ret = select(max_fd, &rdfds, &wrfds, NULL, blocking ? NULL : &tv0);
+#ifdef CONFIG_EPOLL
+    if (ctx->epoll_enabled) {
+        if (aio_epoll_dispatch(ctx, blocking ? -1 : 0)) {
+            progress = true;
+        }
+        return progress;
+    }
+#endif
+
+    /* GIOCondition uses the poll(2) values on POSIX hosts */
+    ret = poll((struct pollfd *)ctx->pollfds->data, ctx->pollfds->len,
+               blocking ? -1 : 0);
 
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
-        /* we have to walk very carefully in case
-         * qemu_aio_set_fd_handler is called while we're walking */
-        node = QLIST_FIRST(&ctx->aio_handlers);
-        while (node) {
-            AioHandler *tmp;
-
-            ctx->walking_handlers++;
-
-            if (!node->deleted &&
-                FD_ISSET(node->pfd.fd, &rdfds) &&
-                node->io_read) {
-                node->io_read(node->opaque);
-                progress = true;
-            }
-            if (!node->deleted &&
-                FD_ISSET(node->pfd.fd, &wrfds) &&
-                node->io_write) {
-                node->io_write(node->opaque);
-                progress = true;
-            }
-
-            tmp = node;
-            node = QLIST_NEXT(node, node);
-
-            ctx->walking_handlers--;
-
-            if (!ctx->walking_handlers && tmp->deleted) {
-                QLIST_REMOVE(tmp, node);
-                g_free(tmp);
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            if (node->pollfds_idx != -1) {
+                struct pollfd *pfd = &g_array_index(ctx->pollfds,
+                                                    struct pollfd,
+                                                    node->pollfds_idx);
+                node->pfd.revents = pfd->revents;
             }
         }
+        if (aio_dispatch(ctx)) {
+            progress = true;
+        }
     }
 
     return progress;
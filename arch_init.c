@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#include <zlib.h>
 #include "config.h"
 #include "monitor.h"
 #include "sysemu.h"
@@ -46,6 +47,8 @@
 #include "exec-memory.h"
 #include "hw/pcspk.h"
 #include "qemu/page_cache.h"
+#include "qemu-thread.h"
+#include "postcopy-ram.h"
 #include "qmp-commands.h"
 #include "trace.h"
 
@@ -112,6 +115,8 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x100
+#define RAM_SAVE_FLAG_POSTCOPY_DISCARD 0x200
 
 #ifdef __ALTIVEC__
 #include <altivec.h>
@@ -169,6 +174,11 @@ static int is_dup_page(uint8_t *page)
     VECTYPE val = SPLAT(page);
     int i;
 
+    /* Almost all duplicate pages are zero pages */
+    if (*page == 0) {
+        return buffer_is_zero(page, TARGET_PAGE_SIZE);
+    }
+
     for (i = 0; i < TARGET_PAGE_SIZE / sizeof(VECTYPE); i++) {
         if (!ALL_EQ(val, p[i])) {
             return 0;
@@ -215,6 +225,8 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
     uint64_t xbzrle_overflows;
+    uint64_t compress_pages;
+    uint64_t compress_bytes;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -331,10 +343,337 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
     return bytes_sent;
 }
 
+/* Block of the last page written to the stream, for RAM_SAVE_FLAG_CONTINUE */
+static RAMBlock *last_sent_block;
+
+/* Multithreaded page compression.
+ *
+ * The migration thread still walks the dirty bitmap, but instead of
+ * writing a dirty page itself it hands it to an idle compression thread.
+ * The thread checks for a duplicate page and otherwise deflates the page
+ * into a private buffer.  The migration thread writes that buffer to the
+ * stream the next time it picks the same thread, so the stream is only
+ * ever touched from one thread.  All pending buffers are flushed before
+ * every RAM_SAVE_FLAG_EOS; since the dirty bitmap is only synced after
+ * that, a page can never be in flight twice.
+ */
+
+typedef struct CompressParam {
+    QemuThread thread;
+    QemuMutex mutex;            /* protects start and quit */
+    QemuCond cond;
+    bool start;
+    bool quit;
+
+    /* Input page, owned by the thread between start and done */
+    RAMBlock *block;
+    ram_addr_t offset;
+
+    /* Result and statistics, protected by comp_done_lock */
+    bool done;
+    bool pending;               /* result not written to the stream yet */
+    bool is_dup;
+    uint8_t dup_byte;
+    uint8_t *buf;
+    unsigned long len;          /* 0 if the page could not be deflated */
+    z_stream stream;
+
+    uint64_t pages;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    int64_t busy_ns;
+} CompressParam;
+
+static CompressParam *comp_param;
+static int comp_threads;
+static bool comp_active;
+static QemuMutex comp_done_lock;
+static QemuCond comp_done_cond;
+
+uint64_t compress_mig_bytes_transferred(void)
+{
+    return acct_info.compress_bytes;
+}
+
+uint64_t compress_mig_pages_transferred(void)
+{
+    return acct_info.compress_pages;
+}
+
+CompressThreadStatsList *compress_mig_thread_stats(void)
+{
+    CompressThreadStatsList *head = NULL, **tail = &head;
+    int i;
+
+    if (comp_active) {
+        qemu_mutex_lock(&comp_done_lock);
+    }
+    for (i = 0; i < comp_threads; i++) {
+        CompressParam *param = &comp_param[i];
+        CompressThreadStatsList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->id = i;
+        entry->value->pages = param->pages;
+        entry->value->bytes_in = param->bytes_in;
+        entry->value->bytes_out = param->bytes_out;
+        entry->value->busy_time = param->busy_ns / 1000000;
+        if (param->busy_ns) {
+            entry->value->throughput = (double)param->bytes_in * 1000000000 /
+                                       param->busy_ns;
+        }
+        *tail = entry;
+        tail = &entry->next;
+    }
+    if (comp_active) {
+        qemu_mutex_unlock(&comp_done_lock);
+    }
+
+    return head;
+}
+
+static void do_compress_page(CompressParam *param)
+{
+    uint8_t *p = memory_region_get_ram_ptr(param->block->mr) + param->offset;
+    int64_t start = get_clock();
+    unsigned long len = 0;
+    bool is_dup;
+
+    is_dup = is_dup_page(p);
+    if (!is_dup) {
+        z_stream *stream = &param->stream;
+
+        deflateReset(stream);
+        stream->next_in = p;
+        stream->avail_in = TARGET_PAGE_SIZE;
+        stream->next_out = param->buf;
+        stream->avail_out = compressBound(TARGET_PAGE_SIZE);
+        if (deflate(stream, Z_FINISH) == Z_STREAM_END) {
+            len = stream->total_out;
+        }
+    }
+
+    qemu_mutex_lock(&comp_done_lock);
+    param->is_dup = is_dup;
+    param->dup_byte = *p;
+    param->len = len;
+    param->pages++;
+    param->bytes_in += TARGET_PAGE_SIZE;
+    param->bytes_out += is_dup ? 1 : len;
+    param->busy_ns += get_clock() - start;
+    param->done = true;
+    qemu_cond_signal(&comp_done_cond);
+    qemu_mutex_unlock(&comp_done_lock);
+}
+
+static void *do_data_compress(void *opaque)
+{
+    CompressParam *param = opaque;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->start) {
+            param->start = false;
+            qemu_mutex_unlock(&param->mutex);
+            do_compress_page(param);
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static int compress_threads_save_setup(void)
+{
+    int level = migrate_compress_level();
+    int i;
+
+    g_free(comp_param);
+    comp_threads = migrate_compress_threads();
+    comp_param = g_new0(CompressParam, comp_threads);
+    acct_info.compress_pages = 0;
+    acct_info.compress_bytes = 0;
+
+    qemu_mutex_init(&comp_done_lock);
+    qemu_cond_init(&comp_done_cond);
+    for (i = 0; i < comp_threads; i++) {
+        CompressParam *param = &comp_param[i];
+
+        if (deflateInit(&param->stream, level) != Z_OK) {
+            fprintf(stderr, "Failed to initialize compression stream\n");
+            while (--i >= 0) {
+                deflateEnd(&comp_param[i].stream);
+            }
+            qemu_cond_destroy(&comp_done_cond);
+            qemu_mutex_destroy(&comp_done_lock);
+            comp_threads = 0;
+            return -1;
+        }
+    }
+    for (i = 0; i < comp_threads; i++) {
+        CompressParam *param = &comp_param[i];
+
+        param->buf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        param->done = true;
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, do_data_compress, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+    comp_active = true;
+
+    return 0;
+}
+
+static void compress_threads_save_cleanup(void)
+{
+    int i;
+
+    if (!comp_active) {
+        return;
+    }
+
+    for (i = 0; i < comp_threads; i++) {
+        CompressParam *param = &comp_param[i];
+
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+        qemu_thread_join(&param->thread);
+
+        qemu_cond_destroy(&param->cond);
+        qemu_mutex_destroy(&param->mutex);
+        deflateEnd(&param->stream);
+        g_free(param->buf);
+        param->buf = NULL;
+    }
+    qemu_cond_destroy(&comp_done_cond);
+    qemu_mutex_destroy(&comp_done_lock);
+
+    /* comp_param is kept around so that query-migrate can report the
+     * per-thread statistics after the migration has finished */
+    comp_active = false;
+}
+
+/* Called from the migration thread once param->done is set */
+static int save_compressed_page(QEMUFile *f, CompressParam *param)
+{
+    RAMBlock *block = param->block;
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    int bytes_sent;
+
+    if (param->is_dup) {
+        save_block_hdr(f, block, param->offset, cont, RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, param->dup_byte);
+        bytes_sent = 1;
+        acct_info.dup_pages++;
+    } else if (param->len == 0) {
+        uint8_t *p = memory_region_get_ram_ptr(block->mr) + param->offset;
+
+        save_block_hdr(f, block, param->offset, cont, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        bytes_sent = TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    } else {
+        save_block_hdr(f, block, param->offset, cont,
+                       RAM_SAVE_FLAG_COMPRESS_PAGE);
+        qemu_put_be32(f, param->len);
+        qemu_put_buffer(f, param->buf, param->len);
+        bytes_sent = param->len + 4;
+        acct_info.compress_pages++;
+        acct_info.compress_bytes += bytes_sent;
+    }
+
+    last_sent_block = block;
+    param->pending = false;
+
+    return bytes_sent;
+}
+
+static CompressParam *wait_for_compress_thread(int idx)
+{
+    CompressParam *param = NULL;
+    int i;
+
+    qemu_mutex_lock(&comp_done_lock);
+    for (;;) {
+        if (idx >= 0) {
+            if (comp_param[idx].done) {
+                param = &comp_param[idx];
+            }
+        } else {
+            for (i = 0; i < comp_threads; i++) {
+                if (comp_param[i].done) {
+                    param = &comp_param[i];
+                    break;
+                }
+            }
+        }
+        if (param) {
+            break;
+        }
+        qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+    }
+    qemu_mutex_unlock(&comp_done_lock);
+
+    return param;
+}
+
+static int compress_page_with_threads(QEMUFile *f, RAMBlock *block,
+                                      ram_addr_t offset)
+{
+    CompressParam *param = wait_for_compress_thread(-1);
+    int bytes_sent = 0;
+
+    if (param->pending) {
+        bytes_sent = save_compressed_page(f, param);
+    }
+
+    qemu_mutex_lock(&comp_done_lock);
+    param->done = false;
+    qemu_mutex_unlock(&comp_done_lock);
+
+    param->block = block;
+    param->offset = offset;
+    param->pending = true;
+
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    return bytes_sent;
+}
+
+static int flush_compressed_data(QEMUFile *f)
+{
+    int bytes_sent = 0;
+    int i;
+
+    if (!comp_active) {
+        return 0;
+    }
+
+    for (i = 0; i < comp_threads; i++) {
+        CompressParam *param = wait_for_compress_thread(i);
+
+        if (param->pending) {
+            bytes_sent += save_compressed_page(f, param);
+        }
+    }
+
+    return bytes_sent;
+}
+
 static RAMBlock *last_block;
 static ram_addr_t last_offset;
 static unsigned long *migration_bitmap;
 static uint64_t migration_dirty_pages;
+static bool ram_postcopy_active;
 
 static inline bool migration_bitmap_test_and_reset_dirty(MemoryRegion *mr,
                                                          ram_addr_t offset)
@@ -350,6 +689,20 @@ static inline bool migration_bitmap_test_and_reset_dirty(MemoryRegion *mr,
     return ret;
 }
 
+/* Returns the offset of the first dirty page at or after @start in @mr,
+ * or @mr's size if there is none.  */
+static inline ram_addr_t migration_bitmap_find_dirty(MemoryRegion *mr,
+                                                     ram_addr_t start)
+{
+    unsigned long base = mr->ram_addr >> TARGET_PAGE_BITS;
+    unsigned long nr = base + (start >> TARGET_PAGE_BITS);
+    unsigned long size = base + (memory_region_size(mr) >> TARGET_PAGE_BITS);
+    unsigned long next;
+
+    next = find_next_bit(migration_bitmap, size, nr);
+    return (ram_addr_t)(next - base) << TARGET_PAGE_BITS;
+}
+
 static inline bool migration_bitmap_set_dirty(MemoryRegion *mr,
                                               ram_addr_t offset)
 {
@@ -418,18 +771,41 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
 {
     RAMBlock *block = last_block;
     ram_addr_t offset = last_offset;
+    RAMBlock *start_block;
+    bool complete_round = false;
     int bytes_sent = -1;
     MemoryRegion *mr;
     ram_addr_t current_addr;
 
     if (!block)
         block = QLIST_FIRST(&ram_list.blocks);
+    start_block = block;
 
-    do {
+    while (true) {
         mr = block->mr;
-        if (migration_bitmap_test_and_reset_dirty(mr, offset)) {
+        /* Skip whole words of clean pages at a time */
+        offset = migration_bitmap_find_dirty(mr, offset);
+        if (complete_round && block == start_block &&
+            offset >= last_offset) {
+            break;
+        }
+        if (offset >= block->length) {
+            offset = 0;
+            block = QLIST_NEXT(block, next);
+            if (!block) {
+                block = QLIST_FIRST(&ram_list.blocks);
+                complete_round = true;
+            }
+        } else {
             uint8_t *p;
-            int cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+            int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+
+            migration_bitmap_test_and_reset_dirty(mr, offset);
+            if (comp_active) {
+                /* the compression thread checks for duplicate pages too */
+                bytes_sent = compress_page_with_threads(f, block, offset);
+                break;
+            }
 
             p = memory_region_get_ram_ptr(mr) + offset;
 
@@ -438,7 +814,7 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
                 save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_COMPRESS);
                 qemu_put_byte(f, *p);
                 bytes_sent = 1;
-            } else if (migrate_use_xbzrle()) {
+            } else if (migrate_use_xbzrle() && !ram_postcopy_active) {
                 current_addr = block->offset + offset;
                 bytes_sent = save_xbzrle_page(f, p, current_addr, block,
                                               offset, cont, last_stage);
@@ -457,18 +833,11 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
 
             /* if page is unmodified, continue to the next */
             if (bytes_sent != 0) {
+                last_sent_block = block;
                 break;
             }
         }
-
-        offset += TARGET_PAGE_SIZE;
-        if (offset >= block->length) {
-            offset = 0;
-            block = QLIST_NEXT(block, next);
-            if (!block)
-                block = QLIST_FIRST(&ram_list.blocks);
-        }
-    } while (block != last_block || offset != last_offset);
+    }
 
     last_block = block;
     last_offset = offset;
@@ -504,6 +873,149 @@ uint64_t ram_bytes_total(void)
     return total;
 }
 
+/* Post-copy, source side.  After the switch the guest is stopped here and
+ * runs on the destination.  Pages the destination faults on are queued by
+ * ram_postcopy_request() and sent before anything else; the rest of the
+ * dirty bitmap is pushed in the background under the usual rate limit.
+ */
+
+typedef struct RAMPostcopyRequest {
+    RAMBlock *block;
+    ram_addr_t offset;
+    ram_addr_t length;
+    QSIMPLEQ_ENTRY(RAMPostcopyRequest) next;
+} RAMPostcopyRequest;
+
+static QSIMPLEQ_HEAD(, RAMPostcopyRequest) postcopy_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(postcopy_requests);
+
+int ram_postcopy_request(const char *idstr, uint64_t offset, uint32_t length)
+{
+    RAMPostcopyRequest *req;
+    RAMBlock *block;
+
+    trace_ram_postcopy_request(idstr, offset, length);
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strcmp(idstr, block->idstr)) {
+            break;
+        }
+    }
+    if (!block || (offset & ~TARGET_PAGE_MASK) || length == 0 ||
+        offset >= block->length || length > block->length - offset) {
+        fprintf(stderr, "Bad post-copy page request %s 0x%" PRIx64 "+%u\n",
+                idstr, offset, length);
+        return -EINVAL;
+    }
+
+    req = g_malloc(sizeof(*req));
+    req->block = block;
+    req->offset = offset;
+    req->length = length;
+    QSIMPLEQ_INSERT_TAIL(&postcopy_requests, req, next);
+    return 0;
+}
+
+/* Sends one page without XBZRLE or compression */
+static int ram_save_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    uint8_t *p = memory_region_get_ram_ptr(block->mr) + offset;
+    int bytes_sent;
+
+    if (is_dup_page(p)) {
+        acct_info.dup_pages++;
+        save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *p);
+        bytes_sent = 1;
+    } else {
+        save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        bytes_sent = TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+    last_sent_block = block;
+
+    return bytes_sent;
+}
+
+/* Tells the destination which of the pages it already has are stale */
+static void ram_postcopy_send_discard(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        unsigned long last = first + (block->length >> TARGET_PAGE_BITS);
+        unsigned long start, end;
+
+        start = find_next_bit(migration_bitmap, last, first);
+        while (start < last) {
+            int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+
+            end = find_next_zero_bit(migration_bitmap, last, start);
+            save_block_hdr(f, block, (ram_addr_t)(start - first) <<
+                           TARGET_PAGE_BITS, cont,
+                           RAM_SAVE_FLAG_POSTCOPY_DISCARD);
+            qemu_put_be64(f, (uint64_t)(end - start) << TARGET_PAGE_BITS);
+            last_sent_block = block;
+            start = find_next_bit(migration_bitmap, last, end);
+        }
+    }
+}
+
+/*
+ * Returns:  1: if every page has been sent
+ *           0: if the rate limit was hit
+ *          <0: on error
+ */
+int ram_postcopy_send_pages(QEMUFile *f)
+{
+    RAMPostcopyRequest *req;
+    int ret;
+
+    /* The destination is blocked on these, so ignore the rate limit */
+    while ((req = QSIMPLEQ_FIRST(&postcopy_requests)) != NULL) {
+        ram_addr_t offset;
+
+        QSIMPLEQ_REMOVE_HEAD(&postcopy_requests, next);
+        for (offset = req->offset; offset < req->offset + req->length;
+             offset += TARGET_PAGE_SIZE) {
+            migration_bitmap_test_and_reset_dirty(req->block->mr, offset);
+            bytes_transferred += ram_save_page(f, req->block, offset);
+        }
+        g_free(req);
+    }
+    qemu_fflush(f);
+
+    while ((ret = qemu_file_rate_limit(f)) == 0) {
+        int bytes_sent;
+
+        bytes_sent = ram_save_block(f, true);
+        if (bytes_sent < 0) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+            g_free(migration_bitmap);
+            migration_bitmap = NULL;
+            ram_postcopy_active = false;
+            return 1;
+        }
+        bytes_transferred += bytes_sent;
+    }
+
+    return ret < 0 ? ret : 0;
+}
+
+static void ram_postcopy_cleanup(void)
+{
+    RAMPostcopyRequest *req;
+
+    while ((req = QSIMPLEQ_FIRST(&postcopy_requests)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&postcopy_requests, next);
+        g_free(req);
+    }
+    ram_postcopy_active = false;
+}
+
 static int block_compar(const void *a, const void *b)
 {
     RAMBlock * const *ablock = a;
@@ -536,8 +1048,10 @@ static void sort_ram_list(void)
 static void migration_end(void)
 {
     memory_global_dirty_log_stop();
+    compress_threads_save_cleanup();
+    ram_postcopy_cleanup();
 
-    if (migrate_use_xbzrle()) {
+    if (XBZRLE.cache) {
         cache_fini(XBZRLE.cache);
         g_free(XBZRLE.cache);
         g_free(XBZRLE.encoded_buf);
@@ -556,6 +1070,7 @@ static void ram_migration_cancel(void *opaque)
 static void reset_ram_globals(void)
 {
     last_block = NULL;
+    last_sent_block = NULL;
     last_offset = 0;
     sort_ram_list();
 }
@@ -574,7 +1089,11 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     bytes_transferred = 0;
     reset_ram_globals();
 
-    if (migrate_use_xbzrle()) {
+    if (migrate_use_compression()) {
+        if (compress_threads_save_setup() < 0) {
+            return -1;
+        }
+    } else if (migrate_use_xbzrle()) {
         XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
                                   TARGET_PAGE_SIZE,
                                   TARGET_PAGE_SIZE);
@@ -656,6 +1175,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         bwidth = 0.000001;
     }
 
+    bytes_transferred += flush_compressed_data(f);
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     expected_downtime = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
@@ -676,6 +1196,18 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     migration_bitmap_sync();
 
+    if (migration_in_postcopy(migrate_get_current())) {
+        /* Leave the remaining pages to ram_postcopy_send_pages() */
+        bytes_transferred += flush_compressed_data(f);
+        compress_threads_save_cleanup();
+        memory_global_dirty_log_stop();
+        ram_postcopy_active = true;
+
+        ram_postcopy_send_discard(f);
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 0;
+    }
+
     /* try transferring iterative blocks of memory */
 
     /* flush all remaining blocks regardless of rate limiting */
@@ -689,6 +1221,8 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
         bytes_transferred += bytes_sent;
     }
+    bytes_transferred += flush_compressed_data(f);
+    compress_threads_save_cleanup();
     memory_global_dirty_log_stop();
 
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
@@ -740,11 +1274,14 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
     return rc;
 }
 
+/* Block of the last page read from the stream, for RAM_SAVE_FLAG_CONTINUE */
+static RAMBlock *last_load_block;
+
 static inline void *host_from_stream_offset(QEMUFile *f,
                                             ram_addr_t offset,
                                             int flags)
 {
-    static RAMBlock *block = NULL;
+    RAMBlock *block = last_load_block;
     char id[256];
     uint8_t len;
 
@@ -762,14 +1299,270 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     id[len] = 0;
 
     QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            last_load_block = block;
             return memory_region_get_ram_ptr(block->mr) + offset;
+        }
     }
 
     fprintf(stderr, "Can't find block %s!\n", id);
     return NULL;
 }
 
+/* Decompression threads mirror the compression threads of the source.
+ * The loading coroutine reads the compressed data from the stream into an
+ * idle thread's buffer, and the thread inflates it straight into guest
+ * memory.  All threads are waited for at the end of each RAM section.
+ */
+
+typedef struct DecompressParam {
+    QemuThread thread;
+    QemuMutex mutex;            /* protects start and quit */
+    QemuCond cond;
+    bool start;
+    bool quit;
+
+    bool done;                  /* protected by decomp_done_lock */
+    void *des;
+    uint8_t *compbuf;
+    int len;
+    z_stream stream;
+} DecompressParam;
+
+static DecompressParam *decomp_param;
+static int decomp_threads;
+static bool decomp_failed;
+static QemuMutex decomp_done_lock;
+static QemuCond decomp_done_cond;
+
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+    z_stream *stream = &param->stream;
+    bool failed;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->start) {
+            param->start = false;
+            qemu_mutex_unlock(&param->mutex);
+
+            inflateReset(stream);
+            stream->next_in = param->compbuf;
+            stream->avail_in = param->len;
+            stream->next_out = param->des;
+            stream->avail_out = TARGET_PAGE_SIZE;
+            failed = inflate(stream, Z_FINISH) != Z_STREAM_END ||
+                     stream->total_out != TARGET_PAGE_SIZE;
+
+            qemu_mutex_lock(&decomp_done_lock);
+            if (failed) {
+                decomp_failed = true;
+            }
+            param->done = true;
+            qemu_cond_signal(&decomp_done_cond);
+            qemu_mutex_unlock(&decomp_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static int decompress_threads_load_setup(void)
+{
+    int i;
+
+    if (decomp_param) {
+        return 0;
+    }
+
+    decomp_threads = migrate_compress_threads();
+    decomp_param = g_new0(DecompressParam, decomp_threads);
+    decomp_failed = false;
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
+    for (i = 0; i < decomp_threads; i++) {
+        DecompressParam *param = &decomp_param[i];
+
+        if (inflateInit(&param->stream) != Z_OK) {
+            fprintf(stderr, "Failed to initialize decompression stream\n");
+            decomp_threads = i;
+            migrate_decompress_threads_join();
+            return -1;
+        }
+        param->compbuf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        param->done = true;
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, do_data_decompress, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    return 0;
+}
+
+void migrate_decompress_threads_join(void)
+{
+    int i;
+
+    if (!decomp_param) {
+        return;
+    }
+
+    for (i = 0; i < decomp_threads; i++) {
+        DecompressParam *param = &decomp_param[i];
+
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+        qemu_thread_join(&param->thread);
+
+        qemu_cond_destroy(&param->cond);
+        qemu_mutex_destroy(&param->mutex);
+        inflateEnd(&param->stream);
+        g_free(param->compbuf);
+    }
+    qemu_cond_destroy(&decomp_done_cond);
+    qemu_mutex_destroy(&decomp_done_lock);
+
+    g_free(decomp_param);
+    decomp_param = NULL;
+    decomp_threads = 0;
+}
+
+static int load_compressed_page(QEMUFile *f, void *host)
+{
+    DecompressParam *param = NULL;
+    int len, i;
+
+    len = qemu_get_be32(f);
+    if (len <= 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+        fprintf(stderr, "Failed to load compressed page - bad length %d\n",
+                len);
+        return -1;
+    }
+
+    if (decompress_threads_load_setup() < 0) {
+        return -1;
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    while (!param) {
+        for (i = 0; i < decomp_threads; i++) {
+            if (decomp_param[i].done) {
+                param = &decomp_param[i];
+                param->done = false;
+                break;
+            }
+        }
+        if (!param) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    qemu_get_buffer(f, param->compbuf, len);
+    param->des = host;
+    param->len = len;
+
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    return 0;
+}
+
+static int wait_for_decompress_done(void)
+{
+    int i, ret = 0;
+
+    if (!decomp_param) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    for (i = 0; i < decomp_threads; i++) {
+        while (!decomp_param[i].done) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    if (decomp_failed) {
+        fprintf(stderr, "Failed to load compressed page - inflate error!\n");
+        decomp_failed = false;
+        ret = -1;
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    return ret;
+}
+
+/* Runs in the post-copy receive thread until the source sends EOS */
+int ram_postcopy_load(QEMUFile *f)
+{
+    uint8_t *buf = g_malloc(TARGET_PAGE_SIZE);
+    int ret = 0;
+
+    for (;;) {
+        ram_addr_t addr;
+        int flags;
+        void *host;
+
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        ret = qemu_file_get_error(f);
+        if (ret < 0 || (flags & RAM_SAVE_FLAG_EOS)) {
+            break;
+        }
+
+        host = host_from_stream_offset(f, addr, flags);
+        if (!host) {
+            ret = -EINVAL;
+            break;
+        }
+
+        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            uint8_t ch = qemu_get_byte(f);
+
+            ret = qemu_file_get_error(f);
+            if (ret < 0) {
+                break;
+            }
+            if (ch == 0) {
+                ret = postcopy_place_zero_page(host);
+            } else {
+                memset(buf, ch, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(host, buf);
+            }
+        } else if (flags & RAM_SAVE_FLAG_PAGE) {
+            qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+            ret = qemu_file_get_error(f);
+            if (ret < 0) {
+                break;
+            }
+            ret = postcopy_place_page(host, buf);
+        } else {
+            fprintf(stderr, "Unexpected RAM flags 0x%x in post-copy stream\n",
+                    flags);
+            ret = -EINVAL;
+        }
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    g_free(buf);
+    return ret;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
@@ -833,39 +1626,77 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
             host = host_from_stream_offset(f, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
             ch = qemu_get_byte(f);
-            memset(host, ch, TARGET_PAGE_SIZE);
+            /* Reading a page that was never touched does not allocate it,
+             * so only write to pages that are not zero already.  */
+            if (ch != 0 || !buffer_is_zero(host, TARGET_PAGE_SIZE)) {
+                memset(host, ch, TARGET_PAGE_SIZE);
 #ifndef _WIN32
-            if (ch == 0 &&
-                (!kvm_enabled() || kvm_has_sync_mmu())) {
-                qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
-            }
+                if (ch == 0 &&
+                    (!kvm_enabled() || kvm_has_sync_mmu())) {
+                    qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+                }
 #endif
+            }
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
             void *host;
 
             host = host_from_stream_offset(f, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
         } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
             if (!migrate_use_xbzrle()) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
             void *host = host_from_stream_offset(f, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
             if (load_xbzrle(f, addr, host) < 0) {
                 ret = -EINVAL;
                 goto done;
             }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                ret = -EINVAL;
+                goto done;
+            }
+
+            if (load_compressed_page(f, host) < 0) {
+                ret = -EINVAL;
+                goto done;
+            }
+        } else if (flags & RAM_SAVE_FLAG_POSTCOPY_DISCARD) {
+            void *host = host_from_stream_offset(f, addr, flags);
+            uint64_t length = qemu_get_be64(f);
+
+            if (!host) {
+                ret = -EINVAL;
+                goto done;
+            }
+            if (addr >= last_load_block->length ||
+                length > last_load_block->length - addr) {
+                fprintf(stderr, "Post-copy discard beyond end of %s\n",
+                        last_load_block->idstr);
+                ret = -EINVAL;
+                goto done;
+            }
+            if (postcopy_ram_discard_range(host, length) < 0) {
+                ret = -EINVAL;
+                goto done;
+            }
         }
         error = qemu_file_get_error(f);
         if (error) {
@@ -875,6 +1706,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
 done:
+    if (wait_for_decompress_done() < 0 && ret == 0) {
+        ret = -EINVAL;
+    }
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
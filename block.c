@@ -34,6 +34,7 @@
 #include "qemu-coroutine.h"
 #include "qmp-commands.h"
 #include "qemu-timer.h"
+#include "host-utils.h"
 
 #ifdef CONFIG_BSD
 #include <sys/types.h>
@@ -54,6 +55,12 @@
 typedef enum {
     BDRV_REQ_COPY_ON_READ = 0x1,
     BDRV_REQ_ZERO_WRITE   = 0x2,
+
+    /* Neither copy-on-read nor waiting for overlapping requests, for reads
+     * issued from a before-write notifier on behalf of the write that is
+     * being held up
+     */
+    BDRV_REQ_NO_COPY_ON_READ = 0x4,
 } BdrvRequestFlags;
 
 static void bdrv_dev_change_media_cb(BlockDriverState *bs, bool load);
@@ -92,6 +99,28 @@ static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
         double elapsed_time, uint64_t *wait);
 static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
         bool is_write, int64_t *wait);
+static void bdrv_set_dirty_bitmaps(BlockDriverState *bs, int64_t sector_num,
+                                   int nb_sectors);
+static void bdrv_release_dirty_bitmaps(BlockDriverState *bs);
+static void bdrv_truncate_dirty_bitmaps(BlockDriverState *bs);
+
+/*
+ * Named dirty bitmaps.  Unlike the anonymous bitmap of
+ * bdrv_set_dirty_tracking(), which belongs to whichever job enabled it,
+ * these are created and dropped by the user, can coexist, and survive a
+ * restart when the image format can store them.
+ * One bit covers @granularity sectors.  Bitmaps are sized in multiples of
+ * 64 bits so that the serialized form does not depend on the host.
+ */
+struct BdrvDirtyBitmap {
+    char *name;
+    int64_t granularity;        /* in sectors, a power of two */
+    int64_t size;               /* in bits */
+    int64_t count;              /* number of set bits */
+    bool persistent;
+    unsigned long *bitmap;
+    QLIST_ENTRY(BdrvDirtyBitmap) list;
+};
 
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
@@ -314,6 +343,7 @@ BlockDriverState *bdrv_new(const char *device_name)
     }
     bdrv_iostatus_disable(bs);
     notifier_list_init(&bs->close_notifiers);
+    notifier_with_return_list_init(&bs->before_write_notifiers);
 
     return bs;
 }
@@ -323,6 +353,12 @@ void bdrv_add_close_notifier(BlockDriverState *bs, Notifier *notify)
     notifier_list_add(&bs->close_notifiers, notify);
 }
 
+void bdrv_add_before_write_notifier(BlockDriverState *bs,
+                                    NotifierWithReturn *notifier)
+{
+    notifier_with_return_list_add(&bs->before_write_notifiers, notifier);
+}
+
 BlockDriver *bdrv_find_format(const char *format_name)
 {
     BlockDriver *drv1;
@@ -1144,6 +1180,7 @@ void bdrv_close(BlockDriverState *bs)
             bs->backing_hd = NULL;
         }
         bs->drv->bdrv_close(bs);
+        bdrv_release_dirty_bitmaps(bs);
         g_free(bs->opaque);
 #ifdef _WIN32
         if (bs->is_temporary) {
@@ -1275,6 +1312,7 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     /* dirty bitmap */
     bs_dest->dirty_count        = bs_src->dirty_count;
     bs_dest->dirty_bitmap       = bs_src->dirty_bitmap;
+    bs_dest->dirty_bitmaps      = bs_src->dirty_bitmaps;
 
     /* job */
     bs_dest->in_use             = bs_src->in_use;
@@ -1305,6 +1343,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     /* bs_new must be anonymous and shouldn't have anything fancy enabled */
     assert(bs_new->device_name[0] == '\0');
     assert(bs_new->dirty_bitmap == NULL);
+    assert(QLIST_EMPTY(&bs_new->dirty_bitmaps));
     assert(bs_new->job == NULL);
     assert(bs_new->dev == NULL);
     assert(bs_new->in_use == 0);
@@ -1323,6 +1362,13 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     /* bs_new shouldn't be in bdrv_states even after the swap!  */
     assert(bs_new->device_name[0] == '\0');
 
+    /* The list heads were copied by value, point the first entries back */
+    QLIST_INIT(&bs_new->dirty_bitmaps);
+    if (!QLIST_EMPTY(&bs_old->dirty_bitmaps)) {
+        QLIST_FIRST(&bs_old->dirty_bitmaps)->list.le_prev =
+            &bs_old->dirty_bitmaps.lh_first;
+    }
+
     /* Check a few fields that should remain attached to the device */
     assert(bs_new->dev == NULL);
     assert(bs_new->job == NULL);
@@ -1616,16 +1662,6 @@ int bdrv_commit_all(void)
     return 0;
 }
 
-struct BdrvTrackedRequest {
-    BlockDriverState *bs;
-    int64_t sector_num;
-    int nb_sectors;
-    bool is_write;
-    QLIST_ENTRY(BdrvTrackedRequest) list;
-    Coroutine *co; /* owner, used for deadlock detection */
-    CoQueue wait_queue; /* coroutines blocked on this request */
-};
-
 /**
  * Remove an active request from the tracked requests list
  *
@@ -2271,14 +2307,14 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
         bdrv_io_limits_intercept(bs, false, nb_sectors);
     }
 
-    if (bs->copy_on_read) {
+    if (bs->copy_on_read && !(flags & BDRV_REQ_NO_COPY_ON_READ)) {
         flags |= BDRV_REQ_COPY_ON_READ;
     }
     if (flags & BDRV_REQ_COPY_ON_READ) {
         bs->copy_on_read_in_flight++;
     }
 
-    if (bs->copy_on_read_in_flight) {
+    if (bs->copy_on_read_in_flight && !(flags & BDRV_REQ_NO_COPY_ON_READ)) {
         wait_for_overlapping_requests(bs, sector_num, nb_sectors);
     }
 
@@ -2327,6 +2363,15 @@ int coroutine_fn bdrv_co_copy_on_readv(BlockDriverState *bs,
                             BDRV_REQ_COPY_ON_READ);
 }
 
+int coroutine_fn bdrv_co_no_copy_on_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    trace_bdrv_co_no_copy_on_readv(bs, sector_num, nb_sectors);
+
+    return bdrv_co_do_readv(bs, sector_num, nb_sectors, qiov,
+                            BDRV_REQ_NO_COPY_ON_READ);
+}
+
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors)
 {
@@ -2390,7 +2435,11 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
 
     tracked_request_begin(&req, bs, sector_num, nb_sectors, true);
 
-    if (flags & BDRV_REQ_ZERO_WRITE) {
+    ret = notifier_with_return_list_notify(&bs->before_write_notifiers, &req);
+
+    if (ret < 0) {
+        /* Do nothing, write notifier decided to fail this request */
+    } else if (flags & BDRV_REQ_ZERO_WRITE) {
         ret = bdrv_co_do_write_zeroes(bs, sector_num, nb_sectors);
     } else {
         ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
@@ -2403,6 +2452,7 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
     if (bs->dirty_bitmap) {
         bdrv_set_dirty(bs, sector_num, nb_sectors);
     }
+    bdrv_set_dirty_bitmaps(bs, sector_num, nb_sectors);
 
     if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
@@ -2448,11 +2498,32 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
     ret = drv->bdrv_truncate(bs, offset);
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
+        bdrv_truncate_dirty_bitmaps(bs);
         bdrv_dev_resize_cb(bs);
     }
     return ret;
 }
 
+/**
+ * Reserve host storage for 'bytes' bytes at 'offset' without changing the
+ * length of the file (needed only for file protocols)
+ */
+int bdrv_preallocate(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_preallocate) {
+        return -ENOTSUP;
+    }
+    if (bs->read_only) {
+        return -EACCES;
+    }
+    return drv->bdrv_preallocate(bs, offset, bytes);
+}
+
 /**
  * Length of a allocated file in bytes. Sparse files are counted by actual
  * allocated space. Return < 0 if error or unknown.
@@ -2509,6 +2580,26 @@ void bdrv_set_io_limits(BlockDriverState *bs,
     bs->io_limits_enabled = bdrv_io_limits_enabled(bs);
 }
 
+void bdrv_set_metadata_cache_size(BlockDriverState *bs,
+                                  uint64_t l2_cache_size,
+                                  uint64_t l2_cache_coverage,
+                                  uint64_t refcount_cache_size)
+{
+    bs->l2_cache_size = l2_cache_size;
+    bs->l2_cache_coverage = l2_cache_coverage;
+    bs->refcount_cache_size = refcount_cache_size;
+}
+
+void bdrv_set_prealloc_size(BlockDriverState *bs, uint64_t prealloc_size)
+{
+    bs->prealloc_size = prealloc_size;
+}
+
+void bdrv_set_lazy_refcounts(BlockDriverState *bs, int lazy_refcounts)
+{
+    bs->lazy_refcounts = lazy_refcounts;
+}
+
 void bdrv_set_on_error(BlockDriverState *bs, BlockdevOnError on_read_error,
                        BlockdevOnError on_write_error)
 {
@@ -2847,6 +2938,11 @@ BlockInfo *bdrv_query_info(BlockDriverState *bs)
         info->io_status = bs->iostatus;
     }
 
+    if (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        info->has_dirty_bitmaps = true;
+        info->dirty_bitmaps = bdrv_query_dirty_bitmaps(bs);
+    }
+
     if (bs->dirty_bitmap) {
         info->has_dirty = true;
         info->dirty = g_malloc0(sizeof(*info->dirty));
@@ -2926,6 +3022,13 @@ BlockStats *bdrv_query_stats(const BlockDriverState *bs)
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
 
+    if (bs->drv && bs->drv->bdrv_get_metadata_cache_stats) {
+        s->has_metadata_cache = true;
+        s->metadata_cache = g_malloc0(sizeof(*s->metadata_cache));
+        bs->drv->bdrv_get_metadata_cache_stats((BlockDriverState *)bs,
+                                               s->metadata_cache);
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(bs->file);
@@ -4050,6 +4153,7 @@ flush_parent:
 
 void bdrv_invalidate_cache(BlockDriverState *bs)
 {
+    bs->open_flags &= ~BDRV_O_INACTIVE;
     if (bs->drv && bs->drv->bdrv_invalidate_cache) {
         bs->drv->bdrv_invalidate_cache(bs);
     }
@@ -4073,6 +4177,21 @@ void bdrv_clear_incoming_migration_all(void)
     }
 }
 
+/*
+ * Called on the migration source once the destination owns the images:
+ * from now on nothing may write image metadata until the cache is
+ * invalidated again.
+ */
+void bdrv_inactivate_all(void)
+{
+    BlockDriverState *bs;
+
+    QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        bdrv_flush(bs);
+        bs->open_flags |= BDRV_O_INACTIVE;
+    }
+}
+
 int bdrv_flush(BlockDriverState *bs)
 {
     Coroutine *co;
@@ -4105,13 +4224,30 @@ static void coroutine_fn bdrv_discard_co_entry(void *opaque)
 int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
                                  int nb_sectors)
 {
+    BdrvTrackedRequest req;
+    int ret;
+
     if (!bs->drv) {
         return -ENOMEDIUM;
     } else if (bdrv_check_request(bs, sector_num, nb_sectors)) {
         return -EIO;
     } else if (bs->read_only) {
         return -EROFS;
-    } else if (bs->drv->bdrv_co_discard) {
+    }
+
+    /* Discarded data can be gone afterwards, so it is a write as far as
+     * the notifiers are concerned */
+    tracked_request_begin(&req, bs, sector_num, nb_sectors, true);
+    ret = notifier_with_return_list_notify(&bs->before_write_notifiers, &req);
+    tracked_request_end(&req);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Discarded sectors may read back differently afterwards */
+    bdrv_set_dirty_bitmaps(bs, sector_num, nb_sectors);
+
+    if (bs->drv->bdrv_co_discard) {
         return bs->drv->bdrv_co_discard(bs, sector_num, nb_sectors);
     } else if (bs->drv->bdrv_aio_discard) {
         BlockDriverAIOCB *acb;
@@ -4336,6 +4472,324 @@ int64_t bdrv_get_dirty_count(BlockDriverState *bs)
     return bs->dirty_count;
 }
 
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          const char *name,
+                                          int64_t granularity,
+                                          Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+    int64_t sectors, words;
+
+    if (granularity < BDRV_SECTOR_SIZE ||
+        granularity > BDRV_MAX_DIRTY_GRANULARITY ||
+        (granularity & (granularity - 1))) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
+                  "a power of two between 512 bytes and 64 MB");
+        return NULL;
+    }
+    if (bdrv_find_dirty_bitmap(bs, name)) {
+        error_setg(errp, "Dirty bitmap '%s' already exists", name);
+        return NULL;
+    }
+    sectors = bdrv_getlength(bs);
+    if (sectors < 0) {
+        error_setg(errp, "Cannot get the size of device '%s'",
+                   bs->device_name);
+        return NULL;
+    }
+    sectors >>= BDRV_SECTOR_BITS;
+
+    bitmap = g_malloc0(sizeof(*bitmap));
+    bitmap->name = g_strdup(name);
+    bitmap->granularity = granularity >> BDRV_SECTOR_BITS;
+    bitmap->size = DIV_ROUND_UP(sectors, bitmap->granularity);
+    words = DIV_ROUND_UP(bitmap->size, 64) * (64 / BITS_PER_LONG);
+    bitmap->bitmap = g_new0(unsigned long, words);
+    QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
+    return bitmap;
+}
+
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (!strcmp(bitmap->name, name)) {
+            return bitmap;
+        }
+    }
+    return NULL;
+}
+
+BdrvDirtyBitmap *bdrv_next_dirty_bitmap(BlockDriverState *bs,
+                                        BdrvDirtyBitmap *bitmap)
+{
+    if (!bitmap) {
+        return QLIST_FIRST(&bs->dirty_bitmaps);
+    }
+    return QLIST_NEXT(bitmap, list);
+}
+
+void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    QLIST_REMOVE(bitmap, list);
+    g_free(bitmap->bitmap);
+    g_free(bitmap->name);
+    g_free(bitmap);
+}
+
+static void bdrv_release_dirty_bitmaps(BlockDriverState *bs)
+{
+    while (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        bdrv_release_dirty_bitmap(bs, QLIST_FIRST(&bs->dirty_bitmaps));
+    }
+}
+
+const char *bdrv_dirty_bitmap_name(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->name;
+}
+
+int64_t bdrv_dirty_bitmap_granularity(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->granularity << BDRV_SECTOR_BITS;
+}
+
+bool bdrv_dirty_bitmap_persistent(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->persistent;
+}
+
+void bdrv_dirty_bitmap_set_persistent(BdrvDirtyBitmap *bitmap,
+                                      bool persistent)
+{
+    bitmap->persistent = persistent;
+}
+
+/* Number of dirty bytes, rounded up to the granularity */
+int64_t bdrv_dirty_bitmap_count(BdrvDirtyBitmap *bitmap)
+{
+    return (bitmap->count * bitmap->granularity) << BDRV_SECTOR_BITS;
+}
+
+static void dirty_bitmap_update(BdrvDirtyBitmap *bitmap, int64_t sector_num,
+                                int nb_sectors, bool dirty)
+{
+    int64_t start, end;
+    unsigned long mask, *word;
+
+    if (nb_sectors <= 0) {
+        return;
+    }
+    start = sector_num / bitmap->granularity;
+    end = MIN((sector_num + nb_sectors - 1) / bitmap->granularity,
+              bitmap->size - 1);
+
+    for (; start <= end; start++) {
+        word = &bitmap->bitmap[start / BITS_PER_LONG];
+        mask = 1UL << (start % BITS_PER_LONG);
+        if (dirty && !(*word & mask)) {
+            *word |= mask;
+            bitmap->count++;
+        } else if (!dirty && (*word & mask)) {
+            *word &= ~mask;
+            bitmap->count--;
+        }
+    }
+}
+
+void bdrv_dirty_bitmap_set(BdrvDirtyBitmap *bitmap, int64_t sector_num,
+                           int nb_sectors)
+{
+    dirty_bitmap_update(bitmap, sector_num, nb_sectors, true);
+}
+
+void bdrv_dirty_bitmap_reset(BdrvDirtyBitmap *bitmap, int64_t sector_num,
+                             int nb_sectors)
+{
+    dirty_bitmap_update(bitmap, sector_num, nb_sectors, false);
+}
+
+void bdrv_dirty_bitmap_clear(BdrvDirtyBitmap *bitmap)
+{
+    memset(bitmap->bitmap, 0, bdrv_dirty_bitmap_data_size(bitmap));
+    bitmap->count = 0;
+}
+
+static void dirty_bitmap_trim(BdrvDirtyBitmap *bitmap);
+
+/* Move the bits of @bitmap to a new bitmap, which belongs to no device and
+ * so does not record writes, and clear @bitmap.  The result can only be
+ * freed with bdrv_dirty_bitmap_put_back(). */
+BdrvDirtyBitmap *bdrv_dirty_bitmap_take(BdrvDirtyBitmap *bitmap)
+{
+    BdrvDirtyBitmap *taken;
+    size_t size = bdrv_dirty_bitmap_data_size(bitmap);
+
+    taken = g_malloc0(sizeof(*taken));
+    taken->granularity = bitmap->granularity;
+    taken->size = bitmap->size;
+    taken->count = bitmap->count;
+    taken->bitmap = g_malloc(size);
+    memcpy(taken->bitmap, bitmap->bitmap, size);
+    bdrv_dirty_bitmap_clear(bitmap);
+    return taken;
+}
+
+/* Set the bits that are still set in @taken, which came from
+ * bdrv_dirty_bitmap_take(@bitmap), in @bitmap again, and free @taken */
+void bdrv_dirty_bitmap_put_back(BdrvDirtyBitmap *bitmap,
+                                BdrvDirtyBitmap *taken)
+{
+    int64_t words, i;
+
+    assert(bitmap->granularity == taken->granularity);
+    words = DIV_ROUND_UP(MIN(bitmap->size, taken->size), 64) *
+            (64 / BITS_PER_LONG);
+    for (i = 0; i < words; i++) {
+        bitmap->bitmap[i] |= taken->bitmap[i];
+    }
+    dirty_bitmap_trim(bitmap);
+
+    g_free(taken->bitmap);
+    g_free(taken);
+}
+
+/* Drop the bits past the end of the device and recount the others */
+static void dirty_bitmap_trim(BdrvDirtyBitmap *bitmap)
+{
+    int64_t chunk, words;
+
+    words = DIV_ROUND_UP(bitmap->size, 64) * (64 / BITS_PER_LONG);
+    for (chunk = bitmap->size; chunk < words * BITS_PER_LONG; chunk++) {
+        bitmap->bitmap[chunk / BITS_PER_LONG] &=
+            ~(1UL << (chunk % BITS_PER_LONG));
+    }
+    bitmap->count = 0;
+    while (words--) {
+        bitmap->count += ctpop64(bitmap->bitmap[words]);
+    }
+}
+
+/* Follow a resize of the device.  Any new area counts as dirty, since the
+ * last backup does not have it. */
+static void bdrv_truncate_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bitmap;
+    int64_t chunk, old_size, old_words, words;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        old_size = bitmap->size;
+        old_words = DIV_ROUND_UP(old_size, 64) * (64 / BITS_PER_LONG);
+        bitmap->size = DIV_ROUND_UP(bs->total_sectors, bitmap->granularity);
+        words = DIV_ROUND_UP(bitmap->size, 64) * (64 / BITS_PER_LONG);
+        bitmap->bitmap = g_renew(unsigned long, bitmap->bitmap, words);
+        if (words > old_words) {
+            memset(bitmap->bitmap + old_words, 0,
+                   (words - old_words) * sizeof(unsigned long));
+        }
+        for (chunk = old_size; chunk < bitmap->size; chunk++) {
+            bitmap->bitmap[chunk / BITS_PER_LONG] |=
+                1UL << (chunk % BITS_PER_LONG);
+        }
+        dirty_bitmap_trim(bitmap);
+    }
+}
+
+static void bdrv_set_dirty_bitmaps(BlockDriverState *bs, int64_t sector_num,
+                                   int nb_sectors)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        dirty_bitmap_update(bitmap, sector_num, nb_sectors, true);
+    }
+}
+
+/*
+ * Return the first sector of the first dirty chunk at or after
+ * @sector_num, or -1 if there is none.
+ */
+int64_t bdrv_dirty_bitmap_next(BdrvDirtyBitmap *bitmap, int64_t sector_num)
+{
+    int64_t chunk = sector_num / bitmap->granularity;
+    unsigned long word;
+
+    while (chunk < bitmap->size) {
+        word = bitmap->bitmap[chunk / BITS_PER_LONG] >>
+            (chunk % BITS_PER_LONG);
+        if (word) {
+            chunk += ctz64(word);
+            break;
+        }
+        chunk = (chunk | (BITS_PER_LONG - 1)) + 1;
+    }
+    if (chunk >= bitmap->size) {
+        return -1;
+    }
+    return chunk * bitmap->granularity;
+}
+
+/* Size in bytes of the serialized bitmap, bit N of byte M covering chunk
+ * M * 8 + N */
+size_t bdrv_dirty_bitmap_data_size(BdrvDirtyBitmap *bitmap)
+{
+    return DIV_ROUND_UP(bitmap->size, 64) * 8;
+}
+
+void bdrv_dirty_bitmap_serialize(BdrvDirtyBitmap *bitmap, uint8_t *buf)
+{
+    size_t i, len = bdrv_dirty_bitmap_data_size(bitmap);
+
+    for (i = 0; i < len; i++) {
+        buf[i] = bitmap->bitmap[i / sizeof(unsigned long)] >>
+            ((i % sizeof(unsigned long)) * 8);
+    }
+}
+
+void bdrv_dirty_bitmap_deserialize(BdrvDirtyBitmap *bitmap,
+                                   const uint8_t *buf)
+{
+    size_t i, len = bdrv_dirty_bitmap_data_size(bitmap);
+
+    bdrv_dirty_bitmap_clear(bitmap);
+    for (i = 0; i < len; i++) {
+        bitmap->bitmap[i / sizeof(unsigned long)] |=
+            (unsigned long)buf[i] << ((i % sizeof(unsigned long)) * 8);
+    }
+
+    dirty_bitmap_trim(bitmap);
+}
+
+BlockDirtyBitmapInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
+{
+    BlockDirtyBitmapInfoList *head = NULL, **p_next = &head;
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        BlockDirtyBitmapInfoList *entry = g_malloc0(sizeof(*entry));
+        BlockDirtyBitmapInfo *info = g_malloc0(sizeof(*info));
+
+        info->name = g_strdup(bitmap->name);
+        info->granularity = bdrv_dirty_bitmap_granularity(bitmap);
+        info->count = bdrv_dirty_bitmap_count(bitmap);
+        info->persistent = bitmap->persistent;
+        entry->value = info;
+        *p_next = entry;
+        p_next = &entry->next;
+    }
+    return head;
+}
+
+bool bdrv_can_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    return drv && drv->bdrv_can_store_dirty_bitmaps &&
+           drv->bdrv_can_store_dirty_bitmaps(bs);
+}
+
 void bdrv_set_in_use(BlockDriverState *bs, int in_use)
 {
     assert(bs->in_use != in_use);
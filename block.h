@@ -83,6 +83,7 @@ typedef struct BlockDevOps {
 #define BDRV_O_INCOMING    0x0800  /* consistency hint for incoming migration */
 #define BDRV_O_CHECK       0x1000  /* open solely for consistency check */
 #define BDRV_O_ALLOW_RDWR  0x2000  /* allow reopen to change from r/o to r/w */
+#define BDRV_O_INACTIVE    0x4000  /* image handed over to a migration target */
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_CACHE_WB | BDRV_O_NO_FLUSH)
 
@@ -172,6 +173,8 @@ int coroutine_fn bdrv_co_readv(BlockDriverState *bs, int64_t sector_num,
     int nb_sectors, QEMUIOVector *qiov);
 int coroutine_fn bdrv_co_copy_on_readv(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
+int coroutine_fn bdrv_co_no_copy_on_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
 int coroutine_fn bdrv_co_writev(BlockDriverState *bs, int64_t sector_num,
     int nb_sectors, QEMUIOVector *qiov);
 /*
@@ -192,6 +195,7 @@ BlockDriverState *bdrv_find_backing_image(BlockDriverState *bs,
     const char *backing_file);
 int bdrv_get_backing_file_depth(BlockDriverState *bs);
 int bdrv_truncate(BlockDriverState *bs, int64_t offset);
+int bdrv_preallocate(BlockDriverState *bs, int64_t offset, int64_t bytes);
 int64_t bdrv_getlength(BlockDriverState *bs);
 int64_t bdrv_get_allocated_file_size(BlockDriverState *bs);
 void bdrv_get_geometry(BlockDriverState *bs, uint64_t *nb_sectors_ptr);
@@ -265,6 +269,7 @@ void bdrv_invalidate_cache(BlockDriverState *bs);
 void bdrv_invalidate_cache_all(void);
 
 void bdrv_clear_incoming_migration_all(void);
+void bdrv_inactivate_all(void);
 
 /* Ensure contents are flushed to disk.  */
 int bdrv_flush(BlockDriverState *bs);
@@ -359,6 +364,41 @@ void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors);
 int64_t bdrv_get_next_dirty(BlockDriverState *bs, int64_t sector);
 int64_t bdrv_get_dirty_count(BlockDriverState *bs);
 
+#define BDRV_MAX_DIRTY_GRANULARITY (64 * 1024 * 1024)
+
+typedef struct BdrvDirtyBitmap BdrvDirtyBitmap;
+
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          const char *name,
+                                          int64_t granularity,
+                                          Error **errp);
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name);
+BdrvDirtyBitmap *bdrv_next_dirty_bitmap(BlockDriverState *bs,
+                                        BdrvDirtyBitmap *bitmap);
+void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap);
+const char *bdrv_dirty_bitmap_name(BdrvDirtyBitmap *bitmap);
+int64_t bdrv_dirty_bitmap_granularity(BdrvDirtyBitmap *bitmap);
+bool bdrv_dirty_bitmap_persistent(BdrvDirtyBitmap *bitmap);
+void bdrv_dirty_bitmap_set_persistent(BdrvDirtyBitmap *bitmap,
+                                      bool persistent);
+int64_t bdrv_dirty_bitmap_count(BdrvDirtyBitmap *bitmap);
+void bdrv_dirty_bitmap_set(BdrvDirtyBitmap *bitmap, int64_t sector_num,
+                           int nb_sectors);
+void bdrv_dirty_bitmap_reset(BdrvDirtyBitmap *bitmap, int64_t sector_num,
+                             int nb_sectors);
+void bdrv_dirty_bitmap_clear(BdrvDirtyBitmap *bitmap);
+BdrvDirtyBitmap *bdrv_dirty_bitmap_take(BdrvDirtyBitmap *bitmap);
+void bdrv_dirty_bitmap_put_back(BdrvDirtyBitmap *bitmap,
+                                BdrvDirtyBitmap *taken);
+int64_t bdrv_dirty_bitmap_next(BdrvDirtyBitmap *bitmap, int64_t sector_num);
+size_t bdrv_dirty_bitmap_data_size(BdrvDirtyBitmap *bitmap);
+void bdrv_dirty_bitmap_serialize(BdrvDirtyBitmap *bitmap, uint8_t *buf);
+void bdrv_dirty_bitmap_deserialize(BdrvDirtyBitmap *bitmap,
+                                   const uint8_t *buf);
+BlockDirtyBitmapInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs);
+bool bdrv_can_store_dirty_bitmaps(BlockDriverState *bs);
+
 void bdrv_enable_copy_on_read(BlockDriverState *bs);
 void bdrv_disable_copy_on_read(BlockDriverState *bs);
 
@@ -431,4 +471,13 @@ typedef enum {
 #define BLKDBG_EVENT(bs, evt) bdrv_debug_event(bs, evt)
 void bdrv_debug_event(BlockDriverState *bs, BlkDebugEvent event);
 
+#ifdef CONFIG_LINUX_AIO
+int raw_get_aio_fd(BlockDriverState *bs);
+#else
+static inline int raw_get_aio_fd(BlockDriverState *bs)
+{
+    return -ENOTSUP;
+}
+#endif
+
 #endif
@@ -35,9 +35,14 @@
 #endif
 
 #define CURL_NUM_STATES 8
+#define CURL_MAX_STATES 32
 #define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
 #define READ_AHEAD_SIZE (256 * 1024)
+#define READ_AHEAD_MAX  (4 * 1024 * 1024)
+
+#define CURL_CACHE_MAGIC        0x51435543  /* "QCUC" */
+#define CURL_CACHE_CHUNK_SIZE   (64 * 1024)
 
 #define FIND_RET_NONE   0
 #define FIND_RET_OK     1
@@ -71,15 +76,43 @@ typedef struct CURLState
     char in_use;
 } CURLState;
 
+/*
+ * The local chunk cache file starts with this header, followed by a bitmap
+ * with one bit per CURL_CACHE_CHUNK_SIZE chunk of the remote file.  The
+ * chunks themselves follow at the next chunk aligned offset, at their
+ * offset in the remote file, so that the cache file is sparse.
+ */
+typedef struct CURLCacheHeader {
+    uint32_t magic;
+    uint32_t chunk_size;
+    uint64_t len;
+    int64_t filetime;
+} QEMU_PACKED CURLCacheHeader;
+
 typedef struct BDRVCURLState {
     CURLM *multi;
     size_t len;
-    CURLState states[CURL_NUM_STATES];
+    long filetime;
+    CURLState *states;
+    int num_states;
     char *url;
+
+    /* Read-ahead starts at readahead_size and doubles, up to
+     * READ_AHEAD_MAX, for as long as the guest keeps reading sequentially */
     size_t readahead_size;
+    size_t readahead_cur;
+    size_t last_end;
+
+    char *cache_path;
+    int cache_fd;
+    uint8_t *cache_map;
+    size_t cache_map_size;
+    off_t cache_data_offset;
+    bool cache_dirty;
 } BDRVCURLState;
 
 static void curl_clean_state(CURLState *s);
+static void curl_cache_store(BDRVCURLState *s, CURLState *state);
 static void curl_multi_do(void *arg);
 static int curl_aio_flush(void *opaque);
 
@@ -132,6 +165,7 @@ static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
 
     memcpy(s->orig_buf + s->buf_off, ptr, realsize);
     s->buf_off += realsize;
+    curl_cache_store(s->s, s);
 
     for(i=0; i<CURL_NUM_ACB; i++) {
         CURLAIOCB *acb = s->acb[i];
@@ -158,7 +192,7 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
     int i;
     size_t end = start + len;
 
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    for (i=0; i<s->num_states; i++) {
         CURLState *state = &s->states[i];
         size_t buf_end = (state->buf_start + state->buf_off);
         size_t buf_fend = (state->buf_start + state->buf_len);
@@ -205,6 +239,135 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
     return FIND_RET_NONE;
 }
 
+static bool curl_cache_test(BDRVCURLState *s, size_t chunk)
+{
+    return s->cache_map[chunk / 8] & (1 << (chunk % 8));
+}
+
+/* Completes @acb from the chunk cache if all of it is there */
+static bool curl_cache_read(BDRVCURLState *s, CURLAIOCB *acb,
+                            size_t start, size_t len)
+{
+    size_t chunk;
+    char *buf;
+    bool ret = false;
+
+    if (s->cache_fd < 0) {
+        return false;
+    }
+    for (chunk = start / CURL_CACHE_CHUNK_SIZE;
+         chunk * CURL_CACHE_CHUNK_SIZE < start + len; chunk++) {
+        if (!curl_cache_test(s, chunk)) {
+            return false;
+        }
+    }
+
+    buf = g_malloc(len);
+    if (pread(s->cache_fd, buf, len, s->cache_data_offset + start) == len) {
+        qemu_iovec_from_buf(acb->qiov, 0, buf, len);
+        ret = true;
+    }
+    g_free(buf);
+    return ret;
+}
+
+/* Saves the chunks that a transfer has received completely */
+static void curl_cache_store(BDRVCURLState *s, CURLState *state)
+{
+    size_t end = state->buf_start + state->buf_off;
+    size_t start, chunk_end, chunk;
+
+    if (s->cache_fd < 0) {
+        return;
+    }
+    for (start = QEMU_ALIGN_UP(state->buf_start, CURL_CACHE_CHUNK_SIZE);
+         start < end; start = chunk_end) {
+        chunk = start / CURL_CACHE_CHUNK_SIZE;
+        chunk_end = MIN(start + CURL_CACHE_CHUNK_SIZE, s->len);
+        if (chunk_end > end) {
+            break;
+        }
+        if (curl_cache_test(s, chunk)) {
+            continue;
+        }
+        if (pwrite(s->cache_fd, state->orig_buf + (start - state->buf_start),
+                   chunk_end - start, s->cache_data_offset + start) ==
+            chunk_end - start) {
+            s->cache_map[chunk / 8] |= 1 << (chunk % 8);
+            s->cache_dirty = true;
+        }
+    }
+}
+
+static int curl_cache_open(BDRVCURLState *s)
+{
+    CURLCacheHeader header;
+    size_t nb_chunks = DIV_ROUND_UP(s->len, CURL_CACHE_CHUNK_SIZE);
+
+    s->cache_map_size = DIV_ROUND_UP(nb_chunks, 8);
+    s->cache_map = g_malloc0(s->cache_map_size);
+    s->cache_data_offset = QEMU_ALIGN_UP(sizeof(header) + s->cache_map_size,
+                                         CURL_CACHE_CHUNK_SIZE);
+
+    s->cache_fd = qemu_open(s->cache_path, O_RDWR | O_CREAT | O_BINARY, 0644);
+    if (s->cache_fd < 0) {
+        fprintf(stderr, "CURL: Could not open cache file %s: %s\n",
+                s->cache_path, strerror(errno));
+        return -errno;
+    }
+
+    if (pread(s->cache_fd, &header, sizeof(header), 0) == sizeof(header) &&
+        be32_to_cpu(header.magic) == CURL_CACHE_MAGIC &&
+        be32_to_cpu(header.chunk_size) == CURL_CACHE_CHUNK_SIZE &&
+        be64_to_cpu(header.len) == s->len &&
+        be64_to_cpu(header.filetime) == s->filetime &&
+        pread(s->cache_fd, s->cache_map, s->cache_map_size, sizeof(header)) ==
+        s->cache_map_size) {
+        return 0;
+    }
+
+    /* Missing, or made for a different version of the remote file */
+    DPRINTF("CURL: Starting with an empty cache\n");
+    memset(s->cache_map, 0, s->cache_map_size);
+    if (ftruncate(s->cache_fd, 0) < 0 ||
+        ftruncate(s->cache_fd, s->cache_data_offset + s->len) < 0) {
+        fprintf(stderr, "CURL: Could not resize cache file %s: %s\n",
+                s->cache_path, strerror(errno));
+        return -errno;
+    }
+    s->cache_dirty = true;
+    return 0;
+}
+
+/* Chunks only count as cached once the data is stable, and the bitmap
+ * is written last */
+static void curl_cache_close(BDRVCURLState *s)
+{
+    CURLCacheHeader header = {
+        .magic      = cpu_to_be32(CURL_CACHE_MAGIC),
+        .chunk_size = cpu_to_be32(CURL_CACHE_CHUNK_SIZE),
+        .len        = cpu_to_be64(s->len),
+        .filetime   = cpu_to_be64(s->filetime),
+    };
+
+    if (s->cache_fd >= 0 && s->cache_dirty &&
+        (qemu_fdatasync(s->cache_fd) < 0 ||
+         pwrite(s->cache_fd, s->cache_map, s->cache_map_size,
+                sizeof(header)) != s->cache_map_size ||
+         pwrite(s->cache_fd, &header, sizeof(header), 0) != sizeof(header))) {
+        fprintf(stderr, "CURL: Could not update cache file %s: %s\n",
+                s->cache_path, strerror(errno));
+    }
+    if (s->cache_fd >= 0) {
+        close(s->cache_fd);
+        s->cache_fd = -1;
+    }
+    g_free(s->cache_map);
+    s->cache_map = NULL;
+    g_free(s->cache_path);
+    s->cache_path = NULL;
+}
+
 static void curl_multi_do(void *arg)
 {
     BDRVCURLState *s = (BDRVCURLState *)arg;
@@ -268,7 +431,7 @@ static CURLState *curl_init_state(BDRVCURLState *s)
     int i, j;
 
     do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
+        for (i=0; i<s->num_states; i++) {
             for (j=0; j<CURL_NUM_ACB; j++)
                 if (s->states[i].acb[j])
                     continue;
@@ -320,47 +483,73 @@ static void curl_clean_state(CURLState *s)
     s->in_use = 0;
 }
 
+/*
+ * Strips trailing ":readahead=#", ":connections=#" and ":cache=path"
+ * options off the URL.  The last one must be followed by a ':', e.g.
+ * "http://host/image:connections=4:cache=/var/cache/image:".
+ */
+static int curl_parse_filename(BDRVCURLState *s, char *file)
+{
+    char *end, *opt, *val_end;
+    const char *val;
+    bool parsed = false;
+    int64_t size;
+    long n;
+
+    end = file + strlen(file) - 1;
+    if (end <= file || *end != ':') {
+        return 0;
+    }
+    *end = '\0';
+
+    while ((opt = strrchr(file, ':')) != NULL) {
+        if (strstart(opt, ":readahead=", &val)) {
+            size = strtosz_suffix(val, &val_end, STRTOSZ_DEFSUFFIX_B);
+            if (size < 0 || *val_end) {
+                fprintf(stderr, "CURL: Invalid readahead size %s\n", val);
+                return -EINVAL;
+            }
+            s->readahead_size = size;
+        } else if (strstart(opt, ":connections=", &val)) {
+            n = strtol(val, &val_end, 10);
+            if (*val_end || n < 1 || n > CURL_MAX_STATES) {
+                fprintf(stderr, "CURL: connections must be between 1 and %d\n",
+                        CURL_MAX_STATES);
+                return -EINVAL;
+            }
+            s->num_states = n;
+        } else if (strstart(opt, ":cache=", &val)) {
+            g_free(s->cache_path);
+            s->cache_path = g_strdup(val);
+        } else {
+            break;
+        }
+        *opt = '\0';
+        parsed = true;
+    }
+
+    if (!parsed) {
+        *end = ':';
+    }
+    return 0;
+}
+
 static int curl_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVCURLState *s = bs->opaque;
     CURLState *state = NULL;
     double d;
-
-    #define RA_OPTSTR ":readahead="
     char *file;
-    char *ra;
-    const char *ra_val;
-    int parse_state = 0;
 
     static int inited = 0;
 
     file = g_strdup(filename);
     s->readahead_size = READ_AHEAD_SIZE;
+    s->num_states = CURL_NUM_STATES;
+    s->cache_fd = -1;
 
-    /* Parse a trailing ":readahead=#:" param, if present. */
-    ra = file + strlen(file) - 1;
-    while (ra >= file) {
-        if (parse_state == 0) {
-            if (*ra == ':')
-                parse_state++;
-            else
-                break;
-        } else if (parse_state == 1) {
-            if (*ra > '9' || *ra < '0') {
-                char *opt_start = ra - strlen(RA_OPTSTR) + 1;
-                if (opt_start > file &&
-                    strncmp(opt_start, RA_OPTSTR, strlen(RA_OPTSTR)) == 0) {
-                    ra_val = ra + 1;
-                    ra -= strlen(RA_OPTSTR) - 1;
-                    *ra = '\0';
-                    s->readahead_size = atoi(ra_val);
-                    break;
-                } else {
-                    break;
-                }
-            }
-        }
-        ra--;
+    if (curl_parse_filename(s, file) < 0) {
+        goto out_noclean;
     }
 
     if ((s->readahead_size & 0x1ff) != 0) {
@@ -369,6 +558,9 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
         goto out_noclean;
     }
 
+    s->readahead_cur = s->readahead_size;
+    s->states = g_malloc0(s->num_states * sizeof(CURLState));
+
     if (!inited) {
         curl_global_init(CURL_GLOBAL_ALL);
         inited = 1;
@@ -383,10 +575,12 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
     // Get file size
 
     curl_easy_setopt(state->curl, CURLOPT_NOBODY, 1);
+    curl_easy_setopt(state->curl, CURLOPT_FILETIME, 1);
     curl_easy_setopt(state->curl, CURLOPT_WRITEFUNCTION, (void *)curl_size_cb);
     if (curl_easy_perform(state->curl))
         goto out;
     curl_easy_getinfo(state->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &d);
+    curl_easy_getinfo(state->curl, CURLINFO_FILETIME, &s->filetime);
     curl_easy_setopt(state->curl, CURLOPT_WRITEFUNCTION, (void *)curl_read_cb);
     curl_easy_setopt(state->curl, CURLOPT_NOBODY, 0);
     if (d)
@@ -399,12 +593,26 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
 
+    // The cache is only valid for this size and modification time, so
+    // a server that reports neither cannot be cached
+    if (s->cache_path && (d <= 0 || s->filetime == -1)) {
+        fprintf(stderr, "CURL: %s has no known size and modification time, "
+                "not using cache file %s\n", file, s->cache_path);
+        g_free(s->cache_path);
+        s->cache_path = NULL;
+    }
+    if (s->cache_path && curl_cache_open(s) < 0) {
+        curl_cache_close(s);
+        goto out_noclean;
+    }
+
     // Now we know the file exists and its size, so let's
     // initialize the multi interface!
 
     s->multi = curl_multi_init();
     curl_multi_setopt( s->multi, CURLMOPT_SOCKETDATA, s); 
     curl_multi_setopt( s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb ); 
+    curl_multi_setopt(s->multi, CURLMOPT_MAXCONNECTS, (long)s->num_states);
     curl_multi_do(s);
 
     return 0;
@@ -414,6 +622,8 @@ out:
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
 out_noclean:
+    g_free(s->states);
+    g_free(s->cache_path);
     g_free(file);
     return -EINVAL;
 }
@@ -423,7 +633,7 @@ static int curl_aio_flush(void *opaque)
     BDRVCURLState *s = opaque;
     int i, j;
 
-    for (i=0; i < CURL_NUM_STATES; i++) {
+    for (i=0; i < s->num_states; i++) {
         for(j=0; j < CURL_NUM_ACB; j++) {
             if (s->states[i].acb[j]) {
                 return 1;
@@ -455,11 +665,15 @@ static void curl_readv_bh_cb(void *p)
     acb->bh = NULL;
 
     size_t start = acb->sector_num * SECTOR_SIZE;
-    size_t end;
+    size_t len = acb->nb_sectors * SECTOR_SIZE;
+    size_t end, buf_start, ra_end, chunk;
+    bool sequential = (start == s->last_end);
+
+    s->last_end = start + len;
 
     // In case we have the requested data already (e.g. read-ahead),
     // we can just call the callback and be done.
-    switch (curl_find_buf(s, start, acb->nb_sectors * SECTOR_SIZE, acb)) {
+    switch (curl_find_buf(s, start, len, acb)) {
         case FIND_RET_OK:
             qemu_aio_release(acb);
             // fall through
@@ -469,6 +683,19 @@ static void curl_readv_bh_cb(void *p)
             break;
     }
 
+    if (curl_cache_read(s, acb, start, len)) {
+        acb->common.cb(acb->common.opaque, 0);
+        qemu_aio_release(acb);
+        return;
+    }
+
+    if (sequential) {
+        s->readahead_cur = MIN(s->readahead_cur * 2,
+                               MAX(s->readahead_size, READ_AHEAD_MAX));
+    } else {
+        s->readahead_cur = s->readahead_size;
+    }
+
     // No cache found, so let's start a new request
     state = curl_init_state(s);
     if (!state) {
@@ -477,21 +704,38 @@ static void curl_readv_bh_cb(void *p)
         return;
     }
 
-    acb->start = 0;
-    acb->end = (acb->nb_sectors * SECTOR_SIZE);
+    // Fetch whole chunks for the cache, but stop the read-ahead at the
+    // first chunk that is cached already
+    buf_start = start;
+    ra_end = start + len + s->readahead_cur;
+    if (s->cache_fd >= 0) {
+        buf_start = QEMU_ALIGN_DOWN(start, CURL_CACHE_CHUNK_SIZE);
+        ra_end = QEMU_ALIGN_UP(ra_end, CURL_CACHE_CHUNK_SIZE);
+        for (chunk = DIV_ROUND_UP(start + len, CURL_CACHE_CHUNK_SIZE);
+             chunk * CURL_CACHE_CHUNK_SIZE < MIN(ra_end, s->len); chunk++) {
+            if (curl_cache_test(s, chunk)) {
+                ra_end = chunk * CURL_CACHE_CHUNK_SIZE;
+                break;
+            }
+        }
+        ra_end = MAX(ra_end, QEMU_ALIGN_UP(start + len, CURL_CACHE_CHUNK_SIZE));
+    }
+
+    acb->start = start - buf_start;
+    acb->end = acb->start + len;
 
     state->buf_off = 0;
     if (state->orig_buf)
         g_free(state->orig_buf);
-    state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
-    end = MIN(start + state->buf_len, s->len) - 1;
+    state->buf_start = buf_start;
+    state->buf_len = ra_end - buf_start;
+    end = MIN(buf_start + state->buf_len, s->len) - 1;
     state->orig_buf = g_malloc(state->buf_len);
     state->acb[0] = acb;
 
-    snprintf(state->range, 127, "%zd-%zd", start, end);
-    DPRINTF("CURL (AIO): Reading %d at %zd (%s)\n",
-            (acb->nb_sectors * SECTOR_SIZE), start, state->range);
+    snprintf(state->range, 127, "%zd-%zd", buf_start, end);
+    DPRINTF("CURL (AIO): Reading %zd at %zd (%s)\n",
+            len, start, state->range);
     curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
 
     curl_multi_add_handle(s->multi, state->curl);
@@ -528,7 +772,7 @@ static void curl_close(BlockDriverState *bs)
     int i;
 
     DPRINTF("CURL: Close\n");
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    for (i=0; i<s->num_states; i++) {
         if (s->states[i].in_use)
             curl_clean_state(&s->states[i]);
         if (s->states[i].curl) {
@@ -542,6 +786,8 @@ static void curl_close(BlockDriverState *bs)
     }
     if (s->multi)
         curl_multi_cleanup(s->multi);
+    curl_cache_close(s);
+    g_free(s->states);
     g_free(s->url);
 }
 
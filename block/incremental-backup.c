@@ -0,0 +1,236 @@
+/*
+ * Incremental backup: copy the chunks of a device that are dirty in a
+ * named dirty bitmap to an existing image
+ *
+ * The backup is the contents of the device when the job started.  The
+ * dirty chunks are moved from the named bitmap, which goes on recording
+ * writes for the next backup, to a copy bitmap of the job.  A guest write
+ * to a chunk that the job has not copied yet first copies the old data.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "blockjob.h"
+#include "block_int.h"
+#include "qemu/ratelimit.h"
+#include "qemu-coroutine.h"
+
+enum {
+    /* Consecutive dirty chunks are copied together, up to this many bytes */
+    BACKUP_BUFFER_SIZE = 1024 * 1024,
+};
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+typedef struct IncrementalBackupJob {
+    BlockJob common;
+    RateLimit limit;
+    BlockDriverState *target;
+    BdrvDirtyBitmap *bitmap;
+    /* chunks that were dirty when the job started and are not copied yet */
+    BdrvDirtyBitmap *copy_bitmap;
+    int64_t granularity;            /* in sectors */
+    int64_t end;                    /* in sectors */
+    int64_t buf_sectors;
+    /* serializes the copies of the job and of guest writes, which share
+     * the buffer */
+    CoMutex copy_lock;
+    NotifierWithReturn before_write;
+    uint8_t *buf;
+} IncrementalBackupJob;
+
+/* Number of sectors from @sector_num that are dirty in the copy bitmap and
+ * fit in the buffer, or 0 if the chunk at @sector_num is clean */
+static int backup_dirty_run(IncrementalBackupJob *s, int64_t sector_num)
+{
+    int64_t nb_sectors;
+
+    if (bdrv_dirty_bitmap_next(s->copy_bitmap, sector_num) != sector_num) {
+        return 0;
+    }
+    nb_sectors = s->granularity;
+    while (nb_sectors + s->granularity <= s->buf_sectors &&
+           sector_num + nb_sectors < s->end &&
+           bdrv_dirty_bitmap_next(s->copy_bitmap, sector_num + nb_sectors) ==
+           sector_num + nb_sectors) {
+        nb_sectors += s->granularity;
+    }
+    return MIN(nb_sectors, s->end - sector_num);
+}
+
+/* Copy the chunks that overlap the given sectors and are still dirty in the
+ * copy bitmap */
+static int coroutine_fn backup_copy(IncrementalBackupJob *s,
+                                    int64_t sector_num, int nb_sectors)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t end;
+    int n, ret = 0;
+
+    end = MIN(sector_num + nb_sectors, s->end);
+    sector_num = QEMU_ALIGN_DOWN(sector_num, s->granularity);
+
+    qemu_co_mutex_lock(&s->copy_lock);
+    while (sector_num < end) {
+        n = backup_dirty_run(s, sector_num);
+        if (n == 0) {
+            sector_num += s->granularity;
+            continue;
+        }
+
+        iov.iov_base = s->buf;
+        iov.iov_len  = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        trace_incremental_backup_copy(s, sector_num, n);
+        /* When called from the before-write notifier, copy-on-read would
+         * wait for the very write that is waiting for us */
+        ret = bdrv_co_no_copy_on_readv(s->common.bs, sector_num, n, &qiov);
+        if (ret >= 0) {
+            ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+        }
+        if (ret < 0) {
+            break;
+        }
+        bdrv_dirty_bitmap_reset(s->copy_bitmap, sector_num, n);
+        sector_num += n;
+    }
+    qemu_co_mutex_unlock(&s->copy_lock);
+    return ret;
+}
+
+static int coroutine_fn backup_before_write_notify(
+        NotifierWithReturn *notifier,
+        void *opaque)
+{
+    IncrementalBackupJob *s = container_of(notifier, IncrementalBackupJob,
+                                           before_write);
+    BdrvTrackedRequest *req = opaque;
+
+    return backup_copy(s, req->sector_num, req->nb_sectors);
+}
+
+static void coroutine_fn backup_run(void *opaque)
+{
+    IncrementalBackupJob *s = opaque;
+    int64_t sector_num;
+    int ret = 0;
+
+    sector_num = 0;
+    while (!block_job_is_cancelled(&s->common)) {
+        uint64_t delay_ns = 0;
+        int nb_sectors;
+
+        sector_num = bdrv_dirty_bitmap_next(s->copy_bitmap, sector_num);
+        if (sector_num < 0 || sector_num >= s->end) {
+            break;
+        }
+        nb_sectors = backup_dirty_run(s, sector_num);
+
+        if (s->common.speed) {
+            delay_ns = ratelimit_calculate_delay(&s->limit, nb_sectors);
+        }
+
+        /* Note that even when no rate limit is applied we need to yield
+         * with no pending I/O here so that qemu_aio_flush() returns.
+         */
+        block_job_sleep_ns(&s->common, rt_clock, delay_ns);
+        if (block_job_is_cancelled(&s->common)) {
+            break;
+        }
+
+        /* a guest write may have copied some of the chunks meanwhile */
+        ret = backup_copy(s, sector_num, nb_sectors);
+        if (ret < 0) {
+            goto out;
+        }
+
+        sector_num += nb_sectors;
+        s->common.offset = sector_num * BDRV_SECTOR_SIZE;
+    }
+
+    ret = bdrv_co_flush(s->target);
+    if (ret >= 0 && !block_job_is_cancelled(&s->common)) {
+        s->common.offset = s->common.len;
+    }
+
+out:
+    notifier_with_return_remove(&s->before_write);
+    /* wait for a copy from a guest write */
+    qemu_co_mutex_lock(&s->copy_lock);
+    qemu_co_mutex_unlock(&s->copy_lock);
+
+    /* Chunks not copied, because of an error or cancellation, go in the
+     * next backup */
+    bdrv_dirty_bitmap_put_back(s->bitmap, s->copy_bitmap);
+    qemu_vfree(s->buf);
+    bdrv_close(s->target);
+    bdrv_delete(s->target);
+    block_job_completed(&s->common, ret);
+}
+
+static void backup_set_speed(BlockJob *job, int64_t speed, Error **errp)
+{
+    IncrementalBackupJob *s = container_of(job, IncrementalBackupJob, common);
+
+    if (speed < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER, "speed");
+        return;
+    }
+    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
+}
+
+static BlockJobType incremental_backup_job_type = {
+    .instance_size = sizeof(IncrementalBackupJob),
+    .job_type      = "backup",
+    .set_speed     = backup_set_speed,
+};
+
+void incremental_backup_start(BlockDriverState *bs, BlockDriverState *target,
+                              BdrvDirtyBitmap *bitmap, int64_t speed,
+                              BlockDriverCompletionFunc *cb,
+                              void *opaque, Error **errp)
+{
+    IncrementalBackupJob *s;
+    int64_t len;
+
+    len = bdrv_getlength(bs);
+    if (len < 0) {
+        error_setg(errp, "Cannot get the size of device '%s'",
+                   bs->device_name);
+        return;
+    }
+
+    s = block_job_create(&incremental_backup_job_type, bs, speed,
+                         cb, opaque, errp);
+    if (!s) {
+        return;
+    }
+
+    s->target = target;
+    s->bitmap = bitmap;
+    s->common.len = len;
+    s->end = len >> BDRV_SECTOR_BITS;
+    s->granularity = bdrv_dirty_bitmap_granularity(bitmap) >> BDRV_SECTOR_BITS;
+    s->buf_sectors = MAX(BACKUP_BUFFER_SIZE >> BDRV_SECTOR_BITS,
+                         s->granularity);
+    s->buf = qemu_blockalign(bs, s->buf_sectors * BDRV_SECTOR_SIZE);
+    qemu_co_mutex_init(&s->copy_lock);
+
+    /* This is the point in time of the backup: from now on, guest writes
+     * only go in the named bitmap, after copying the old data if needed.
+     * Writes in flight have not been through the notifier, so let them
+     * complete and reach the bitmap first. */
+    bdrv_drain_all();
+    s->copy_bitmap = bdrv_dirty_bitmap_take(bitmap);
+    s->before_write.notify = backup_before_write_notify;
+    bdrv_add_before_write_notifier(bs, &s->before_write);
+
+    s->common.co = qemu_coroutine_create(backup_run);
+    trace_incremental_backup_start(bs, s, s->common.co, opaque);
+    qemu_coroutine_enter(s->common.co, s);
+}
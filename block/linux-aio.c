@@ -9,6 +9,7 @@
  */
 #include "qemu-common.h"
 #include "qemu-aio.h"
+#include "main-loop.h"
 #include "qemu-queue.h"
 #include "block/raw-aio.h"
 #include "event_notifier.h"
@@ -190,7 +191,7 @@ out_free_aiocb:
     return NULL;
 }
 
-void *laio_init(void)
+void *laio_init_aio_context(AioContext *aio_context)
 {
     struct qemu_laio_state *s;
 
@@ -203,8 +204,8 @@ void *laio_init(void)
         goto out_close_efd;
     }
 
-    qemu_aio_set_event_notifier(&s->e, qemu_laio_completion_cb,
-                                qemu_laio_flush_cb);
+    aio_set_event_notifier(aio_context, &s->e, qemu_laio_completion_cb,
+                           qemu_laio_flush_cb);
 
     return s;
 
@@ -214,3 +215,19 @@ out_free_state:
     g_free(s);
     return NULL;
 }
+
+void *laio_init(void)
+{
+    return laio_init_aio_context(qemu_get_aio_context());
+}
+
+void laio_cleanup(void *aio_ctx, AioContext *aio_context)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->count == 0);
+    aio_set_event_notifier(aio_context, &s->e, NULL, NULL);
+    io_destroy(s->ctx);
+    event_notifier_cleanup(&s->e);
+    g_free(s);
+}
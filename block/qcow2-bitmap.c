@@ -0,0 +1,288 @@
+/*
+ * Persistent dirty bitmaps for qcow2
+ *
+ * Named dirty bitmaps live in memory while the image is open.  On close,
+ * the persistent ones are written to a single area of clusters that is
+ * described by a header extension, and the DIRTY_BITMAPS autoclear bit is
+ * set.  On open the bitmaps are loaded and, if the image is writable, the
+ * area is freed and the bit cleared again: a bitmap that was not saved by
+ * a clean close cannot be trusted, and an older version that writes to the
+ * image drops the autoclear bit and with it the stale bitmaps.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "block/qcow2.h"
+
+/* Layout of the area: all directory entries, then the bitmap data */
+typedef struct QEMU_PACKED Qcow2DirtyBitmapEntry {
+    /* header is 8 byte aligned */
+    uint64_t data_offset;
+    uint64_t granularity;           /* in bytes */
+    uint64_t nb_bits;
+    uint32_t data_size;
+    uint16_t name_size;
+    uint16_t reserved;
+    /* name follows, padded to 8 bytes */
+} Qcow2DirtyBitmapEntry;
+
+int qcow2_read_dirty_bitmaps_ext(BlockDriverState *bs, uint64_t offset,
+                                 uint32_t len)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DirtyBitmapsExt ext;
+    int ret;
+
+    if (len != sizeof(ext)) {
+        error_report("Invalid dirty bitmaps header extension");
+        return -EINVAL;
+    }
+
+    ret = bdrv_pread(bs->file, offset, &ext, sizeof(ext));
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->dirty_bitmaps_offset = be64_to_cpu(ext.offset);
+    s->dirty_bitmaps_size = be64_to_cpu(ext.size);
+    s->nb_dirty_bitmaps = be32_to_cpu(ext.nb_bitmaps);
+    return 0;
+}
+
+static int qcow2_parse_dirty_bitmaps(BlockDriverState *bs, uint8_t *area)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DirtyBitmapEntry e;
+    BdrvDirtyBitmap *bitmap;
+    Error *local_err = NULL;
+    uint64_t offset = 0, data_offset;
+    uint8_t *data;
+    char *name;
+    int i;
+
+    for (i = 0; i < s->nb_dirty_bitmaps; i++) {
+        offset = align_offset(offset, 8);
+        if (offset + sizeof(e) > s->dirty_bitmaps_size) {
+            return -EINVAL;
+        }
+        memcpy(&e, area + offset, sizeof(e));
+        offset += sizeof(e);
+
+        e.data_offset = be64_to_cpu(e.data_offset);
+        e.granularity = be64_to_cpu(e.granularity);
+        e.nb_bits = be64_to_cpu(e.nb_bits);
+        e.data_size = be32_to_cpu(e.data_size);
+        e.name_size = be16_to_cpu(e.name_size);
+
+        data_offset = e.data_offset - s->dirty_bitmaps_offset;
+        if (offset + e.name_size > s->dirty_bitmaps_size ||
+            e.data_offset < s->dirty_bitmaps_offset ||
+            data_offset + e.data_size > s->dirty_bitmaps_size) {
+            return -EINVAL;
+        }
+        name = g_strndup((char *)area + offset, e.name_size);
+        offset += e.name_size;
+
+        /* Already known, e.g. after invalidating the cache */
+        if (bdrv_find_dirty_bitmap(bs, name)) {
+            g_free(name);
+            continue;
+        }
+
+        bitmap = bdrv_create_dirty_bitmap(bs, name, e.granularity,
+                                          &local_err);
+        if (!bitmap) {
+            error_report("Dropping dirty bitmap '%s': %s", name,
+                         error_get_pretty(local_err));
+            error_free(local_err);
+            local_err = NULL;
+            g_free(name);
+            continue;
+        }
+        if (bdrv_dirty_bitmap_data_size(bitmap) != e.data_size ||
+            DIV_ROUND_UP(bs->total_sectors * BDRV_SECTOR_SIZE,
+                         e.granularity) != e.nb_bits) {
+            /* The image was resized behind our back */
+            error_report("Dropping dirty bitmap '%s': size mismatch", name);
+            bdrv_release_dirty_bitmap(bs, bitmap);
+            g_free(name);
+            continue;
+        }
+
+        data = area + data_offset;
+        bdrv_dirty_bitmap_deserialize(bitmap, data);
+        bdrv_dirty_bitmap_set_persistent(bitmap, true);
+        g_free(name);
+    }
+    return 0;
+}
+
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint8_t *area;
+    int ret;
+
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_BITMAPS)) {
+        return 0;
+    }
+
+    if (s->dirty_bitmaps_size > QCOW2_MAX_DIRTY_BITMAPS_SIZE) {
+        error_report("Dirty bitmaps area too large");
+        return -EINVAL;
+    }
+
+    area = g_malloc(s->dirty_bitmaps_size);
+    ret = bdrv_pread(bs->file, s->dirty_bitmaps_offset, area,
+                     s->dirty_bitmaps_size);
+    if (ret >= 0) {
+        ret = qcow2_parse_dirty_bitmaps(bs, area);
+        if (ret < 0) {
+            error_report("Invalid dirty bitmaps area, dropping it");
+        }
+    }
+    g_free(area);
+    if (ret < 0 && ret != -EINVAL) {
+        return ret;
+    }
+
+    if (bs->read_only) {
+        return 0;
+    }
+
+    /* From now on the bitmaps on disk would go stale */
+    qcow2_free_clusters(bs, s->dirty_bitmaps_offset, s->dirty_bitmaps_size);
+    s->dirty_bitmaps_offset = 0;
+    s->dirty_bitmaps_size = 0;
+    s->nb_dirty_bitmaps = 0;
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    return qcow2_update_header(bs);
+}
+
+int qcow2_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DirtyBitmapEntry e;
+    BdrvDirtyBitmap *bitmap;
+    uint64_t offset, data_offset, size;
+    int64_t area_offset;
+    uint8_t *area;
+    const char *name;
+    int nb_bitmaps, ret;
+
+    if (bs->read_only || s->qcow_version < 3) {
+        return 0;
+    }
+
+    /* compute the size of the directory, then of the data */
+    offset = 0;
+    nb_bitmaps = 0;
+    for (bitmap = bdrv_next_dirty_bitmap(bs, NULL); bitmap;
+         bitmap = bdrv_next_dirty_bitmap(bs, bitmap)) {
+        if (bdrv_dirty_bitmap_persistent(bitmap)) {
+            offset = align_offset(offset, 8);
+            offset += sizeof(e) + strlen(bdrv_dirty_bitmap_name(bitmap));
+            nb_bitmaps++;
+        }
+    }
+    if (nb_bitmaps == 0) {
+        return 0;
+    }
+    data_offset = align_offset(offset, 8);
+    size = data_offset;
+    for (bitmap = bdrv_next_dirty_bitmap(bs, NULL); bitmap;
+         bitmap = bdrv_next_dirty_bitmap(bs, bitmap)) {
+        if (bdrv_dirty_bitmap_persistent(bitmap)) {
+            size += bdrv_dirty_bitmap_data_size(bitmap);
+        }
+    }
+    if (size > QCOW2_MAX_DIRTY_BITMAPS_SIZE) {
+        error_report("Dirty bitmaps too large to be saved");
+        return -EFBIG;
+    }
+
+    area_offset = qcow2_alloc_clusters(bs, size);
+    if (area_offset < 0) {
+        return area_offset;
+    }
+
+    area = g_malloc0(size);
+    offset = 0;
+    for (bitmap = bdrv_next_dirty_bitmap(bs, NULL); bitmap;
+         bitmap = bdrv_next_dirty_bitmap(bs, bitmap)) {
+        if (!bdrv_dirty_bitmap_persistent(bitmap)) {
+            continue;
+        }
+        name = bdrv_dirty_bitmap_name(bitmap);
+
+        memset(&e, 0, sizeof(e));
+        e.data_offset = cpu_to_be64(area_offset + data_offset);
+        e.granularity = cpu_to_be64(bdrv_dirty_bitmap_granularity(bitmap));
+        e.nb_bits = cpu_to_be64(DIV_ROUND_UP(bs->total_sectors *
+                                             BDRV_SECTOR_SIZE,
+                                             bdrv_dirty_bitmap_granularity(bitmap)));
+        e.data_size = cpu_to_be32(bdrv_dirty_bitmap_data_size(bitmap));
+        e.name_size = cpu_to_be16(strlen(name));
+
+        offset = align_offset(offset, 8);
+        memcpy(area + offset, &e, sizeof(e));
+        offset += sizeof(e);
+        memcpy(area + offset, name, strlen(name));
+        offset += strlen(name);
+
+        bdrv_dirty_bitmap_serialize(bitmap, area + data_offset);
+        data_offset += bdrv_dirty_bitmap_data_size(bitmap);
+    }
+
+    ret = bdrv_pwrite(bs->file, area_offset, area, size);
+    g_free(area);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* The area and its refcounts must be stable before the header
+     * points to them */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->dirty_bitmaps_offset = area_offset;
+    s->dirty_bitmaps_size = size;
+    s->nb_dirty_bitmaps = nb_bitmaps;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    s->dirty_bitmaps_offset = 0;
+    s->dirty_bitmaps_size = 0;
+    s->nb_dirty_bitmaps = 0;
+    qcow2_free_clusters(bs, area_offset, size);
+    return ret;
+}
+
+/* Drop the bitmaps that were loaded from (and would be stored to) the image */
+void qcow2_release_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bitmap, *next;
+
+    for (bitmap = bdrv_next_dirty_bitmap(bs, NULL); bitmap; bitmap = next) {
+        next = bdrv_next_dirty_bitmap(bs, bitmap);
+        if (bdrv_dirty_bitmap_persistent(bitmap)) {
+            bdrv_release_dirty_bitmap(bs, bitmap);
+        }
+    }
+}
@@ -31,7 +31,7 @@ typedef struct Qcow2CachedTable {
     void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
+    uint64_t lru_counter;
     int     ref;
 } Qcow2CachedTable;
 
@@ -40,6 +40,11 @@ struct Qcow2Cache {
     struct Qcow2Cache*      depends;
     int                     size;
     bool                    depends_on_flush;
+    void*                   table_array;
+    int                     table_size;
+    uint64_t                lru_counter;
+    uint64_t                hits;
+    uint64_t                misses;
 };
 
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
@@ -50,10 +55,12 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
+    c->table_size = s->cluster_size;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->table_array = qemu_blockalign(bs, (size_t)num_tables * c->table_size);
 
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        c->entries[i].table = c->table_array + (size_t)i * c->table_size;
     }
 
     return c;
@@ -65,15 +72,33 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->table_array);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+void qcow2_cache_get_stats(Qcow2Cache *c, int64_t *size, int64_t *hits,
+    int64_t *misses)
+{
+    *size = (int64_t)c->size * c->table_size;
+    *hits = c->hits;
+    *misses = c->misses;
+}
+
+/* Tables are laid out contiguously, so no need to search for them */
+static int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
+    int idx = table_offset / c->table_size;
+
+    assert(idx >= 0 && idx < c->size && table_offset % c->table_size == 0);
+    return idx;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -120,6 +145,7 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
+    s->metadata_writes++;
     ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
         s->cluster_size);
     if (ret < 0) {
@@ -131,7 +157,12 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     return 0;
 }
 
-int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+/*
+ * Writes all dirty tables back to the image file, respecting dependencies,
+ * but doesn't flush the image file afterwards.  Use this where the caller
+ * flushes bs->file itself anyway.
+ */
+int qcow2_cache_write(BlockDriverState *bs, Qcow2Cache *c)
 {
     BDRVQcowState *s = bs->opaque;
     int result = 0;
@@ -147,14 +178,19 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
         }
     }
 
-    if (result == 0) {
+    return result;
+}
+
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int ret;
+
+    ret = qcow2_cache_write(bs, c);
+    if (ret == 0) {
         ret = bdrv_flush(bs->file);
-        if (ret < 0) {
-            result = ret;
-        }
     }
 
-    return result;
+    return ret;
 }
 
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
@@ -185,26 +221,22 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
     c->depends_on_flush = true;
 }
 
+/* Evict the least recently used table that nobody holds a reference to */
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
     int i;
-    int min_count = INT_MAX;
+    uint64_t min_lru_counter = UINT64_MAX;
     int min_index = -1;
 
-
     for (i = 0; i < c->size; i++) {
         if (c->entries[i].ref) {
             continue;
         }
 
-        if (c->entries[i].cache_hits < min_count) {
+        if (c->entries[i].lru_counter < min_lru_counter) {
             min_index = i;
-            min_count = c->entries[i].cache_hits;
+            min_lru_counter = c->entries[i].lru_counter;
         }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
     }
 
     if (min_index == -1) {
@@ -215,6 +247,20 @@ static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
     return min_index;
 }
 
+/* Returns the index of the cached table at @offset, or -1 */
+static int qcow2_cache_find(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
@@ -226,10 +272,10 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_find(c, offset);
+    if (i >= 0) {
+        c->hits++;
+        goto found;
     }
 
     /* If not, write a table back and replace it */
@@ -253,20 +299,17 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
+        c->misses++;
         ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
     c->entries[i].offset = offset;
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
     c->entries[i].ref++;
     *table = c->entries[i].table;
 
@@ -288,36 +331,44 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
-int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
+/*
+ * Like qcow2_cache_get(), but fails with -EAGAIN instead of loading a table
+ * that isn't cached.  This never yields, so it is safe without s->lock as
+ * long as the caller doesn't yield either before putting the table back.
+ */
+int qcow2_cache_get_cached(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, void **table)
 {
-    int i;
+    int i = qcow2_cache_find(c, offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
+    if (i < 0) {
+        return -EAGAIN;
     }
-    return -ENOENT;
 
-found:
+    c->hits++;
+    c->entries[i].ref++;
+    *table = c->entries[i].table;
+    return 0;
+}
+
+int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
+{
+    int i = qcow2_cache_get_table_idx(c, *table);
+
     c->entries[i].ref--;
     *table = NULL;
 
+    if (c->entries[i].ref == 0) {
+        c->entries[i].lru_counter = ++c->lru_counter;
+    }
+
     assert(c->entries[i].ref >= 0);
     return 0;
 }
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
-
-found:
     c->entries[i].dirty = true;
 }
@@ -142,6 +142,7 @@ static int write_l1_entry(BlockDriverState *bs, int l1_index)
     }
 
     BLKDBG_EVENT(bs->file, BLKDBG_L1_UPDATE);
+    s->metadata_writes++;
     ret = bdrv_pwrite_sync(bs->file, s->l1_table_offset + 8 * l1_start_index,
         buf, sizeof(buf));
     if (ret < 0) {
@@ -386,9 +387,14 @@ out:
  *
  * Returns the cluster type (QCOW2_CLUSTER_*) on success, -errno in error
  * cases.
+ *
+ * If @nowait is true, only L2 tables that are in the cache are looked at and
+ * -EAGAIN is returned for any other.  If @copied is non-NULL, a run of normal
+ * clusters also stops where QCOW_OFLAG_COPIED changes, and *copied tells
+ * whether the clusters can be overwritten in place.
  */
-int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
-    int *num, uint64_t *cluster_offset)
+static int get_cluster_offset(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset, bool nowait, bool *copied)
 {
     BDRVQcowState *s = bs->opaque;
     unsigned int l1_index, l2_index;
@@ -418,6 +424,9 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     }
 
     *cluster_offset = 0;
+    if (copied) {
+        *copied = false;
+    }
 
     /* seek the the l2 offset in the l1 table */
 
@@ -435,7 +444,12 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     /* load the l2 table in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
+    if (nowait) {
+        ret = qcow2_cache_get_cached(bs, s->l2_table_cache, l2_offset,
+                                     (void**) &l2_table);
+    } else {
+        ret = l2_load(bs, l2_offset, &l2_table);
+    }
     if (ret < 0) {
         return ret;
     }
@@ -445,6 +459,9 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
     *cluster_offset = be64_to_cpu(l2_table[l2_index]);
     nb_clusters = size_to_clusters(s, nb_needed << 9);
+    if (copied) {
+        *copied = !!(*cluster_offset & QCOW_OFLAG_COPIED);
+    }
 
     ret = qcow2_get_cluster_type(*cluster_offset);
     switch (ret) {
@@ -468,7 +485,8 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         /* how many allocated clusters ? */
         c = count_contiguous_clusters(nb_clusters, s->cluster_size,
                 &l2_table[l2_index], 0,
-                QCOW_OFLAG_COMPRESSED | QCOW_OFLAG_ZERO);
+                QCOW_OFLAG_COMPRESSED | QCOW_OFLAG_ZERO |
+                (copied ? QCOW_OFLAG_COPIED : 0));
         *cluster_offset &= L2E_OFFSET_MASK;
         break;
     default:
@@ -488,6 +506,23 @@ out:
     return ret;
 }
 
+int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset)
+{
+    return get_cluster_offset(bs, offset, num, cluster_offset, false, NULL);
+}
+
+/*
+ * Like qcow2_get_cluster_offset(), but only uses cached L2 tables and never
+ * yields, so that requests can look up clusters without taking s->lock.
+ * Returns -EAGAIN if the L2 table would have to be read from the image.
+ */
+int qcow2_get_cluster_offset_nowait(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset, bool *copied)
+{
+    return get_cluster_offset(bs, offset, num, cluster_offset, true, copied);
+}
+
 /*
  * get_cluster_table
  *
@@ -594,6 +629,11 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
         return 0;
     }
 
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
+
     nb_csectors = ((cluster_offset + compressed_size - 1) >> 9) -
                   (cluster_offset >> 9);
 
@@ -742,6 +782,31 @@ out:
     return i;
 }
 
+/*
+ * Reserves s->prealloc_size bytes of host storage after the clusters that
+ * have just been allocated up to @end, if they go past the reserved area.
+ * The file system can then lay out the image file in large extents instead
+ * of a cluster at a time.  Preallocation is only a hint, so it is silently
+ * disabled if the protocol doesn't support it.
+ */
+static void preallocate_clusters(BlockDriverState *bs, uint64_t end)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (!s->prealloc_size || end <= s->prealloc_end) {
+        return;
+    }
+
+    ret = bdrv_preallocate(bs->file, s->prealloc_end,
+                           end + s->prealloc_size - s->prealloc_end);
+    if (ret < 0) {
+        s->prealloc_size = 0;
+        return;
+    }
+    s->prealloc_end = end + s->prealloc_size;
+}
+
 /*
  * Allocates new clusters for the given guest_offset.
  *
@@ -816,15 +881,17 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
             return cluster_offset;
         }
         *host_offset = cluster_offset;
-        return 0;
     } else {
         int ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
         if (ret < 0) {
             return ret;
         }
         *nb_clusters = ret;
-        return 0;
     }
+
+    preallocate_clusters(bs, *host_offset +
+                         ((uint64_t)*nb_clusters << s->cluster_bits));
+    return 0;
 }
 
 /*
@@ -25,6 +25,7 @@
 #include "qemu-common.h"
 #include "block_int.h"
 #include "block/qcow2.h"
+#include "bitmap.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
@@ -51,6 +52,7 @@ int qcow2_refcount_init(BlockDriverState *bs)
         for(i = 0; i < s->refcount_table_size; i++)
             be64_to_cpus(&s->refcount_table[i]);
     }
+    s->refblock_full = bitmap_new(s->refcount_table_size);
     return 0;
  fail:
     return -ENOMEM;
@@ -60,6 +62,7 @@ void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
     g_free(s->refcount_table);
+    g_free(s->refblock_full);
 }
 
 
@@ -262,6 +265,7 @@ static int alloc_refcount_block(BlockDriverState *bs,
     if (refcount_table_index < s->refcount_table_size) {
         uint64_t data64 = cpu_to_be64(new_block);
         BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_ALLOC_HOOKUP);
+        s->metadata_writes++;
         ret = bdrv_pwrite_sync(bs->file,
             s->refcount_table_offset + refcount_table_index * sizeof(uint64_t),
             &data64, sizeof(data64));
@@ -391,6 +395,9 @@ static int alloc_refcount_block(BlockDriverState *bs,
     s->refcount_table_size = table_size;
     s->refcount_table_offset = table_offset;
 
+    g_free(s->refblock_full);
+    s->refblock_full = bitmap_new(table_size);
+
     /* Free old table. Remember, we must not change free_cluster_index */
     uint64_t old_free_cluster_index = s->free_cluster_index;
     qcow2_free_clusters(bs, old_table_offset, old_table_size * sizeof(uint64_t));
@@ -479,6 +486,9 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         if (refcount == 0 && cluster_index < s->free_cluster_index) {
             s->free_cluster_index = cluster_index;
         }
+        if (refcount == 0) {
+            clear_bit(table_index, s->refblock_full);
+        }
         refcount_block[block_index] = cpu_to_be16(refcount);
     }
 
@@ -538,30 +548,94 @@ static int update_cluster_refcount(BlockDriverState *bs,
 
 
 
+/*
+ * Returns how many of the clusters starting at cluster_index are free (or
+ * used, if free is false) in a row.  At most max_clusters are looked at, and
+ * the search stops at the end of the refcount block so that each block is
+ * loaded only once.  Returns -errno on error.
+ */
+static int64_t count_refcount_run(BlockDriverState *bs, int64_t cluster_index,
+    int64_t max_clusters, bool free)
+{
+    BDRVQcowState *s = bs->opaque;
+    int block_clusters = 1 << (s->cluster_bits - REFCOUNT_SHIFT);
+    int64_t table_index = cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
+    int block_index = cluster_index & (block_clusters - 1);
+    int64_t refcount_block_offset;
+    uint16_t *refcount_block;
+    int64_t n;
+    int ret;
+
+    max_clusters = MIN(max_clusters, block_clusters - block_index);
+
+    if (table_index >= s->refcount_table_size ||
+        !s->refcount_table[table_index]) {
+        /* No refcount block means that all of its clusters are free */
+        return free ? max_clusters : 0;
+    }
+    if (!free && test_bit(table_index, s->refblock_full)) {
+        return max_clusters;
+    }
+
+    refcount_block_offset = s->refcount_table[table_index];
+    ret = qcow2_cache_get(bs, s->refcount_block_cache, refcount_block_offset,
+        (void**) &refcount_block);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (n = 0; n < max_clusters; n++) {
+        if ((refcount_block[block_index + n] == 0) != free) {
+            break;
+        }
+    }
+    if (!free && n == block_clusters) {
+        set_bit(table_index, s->refblock_full);
+    }
+
+    ret = qcow2_cache_put(bs, s->refcount_block_cache,
+        (void**) &refcount_block);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return n;
+}
+
 /* return < 0 if error */
 static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size)
 {
     BDRVQcowState *s = bs->opaque;
-    int i, nb_clusters, refcount;
+    int64_t i, n, nb_clusters, cluster_index;
 
     nb_clusters = size_to_clusters(s, size);
 retry:
-    for(i = 0; i < nb_clusters; i++) {
-        int64_t next_cluster_index = s->free_cluster_index++;
-        refcount = get_refcount(bs, next_cluster_index);
-
-        if (refcount < 0) {
-            return refcount;
-        } else if (refcount != 0) {
+    /* Skip used clusters, whole refcount blocks at a time if possible */
+    do {
+        n = count_refcount_run(bs, s->free_cluster_index, INT64_MAX, false);
+        if (n < 0) {
+            return n;
+        }
+        s->free_cluster_index += n;
+    } while (n > 0);
+
+    /* And check that enough of them are free in a row */
+    cluster_index = s->free_cluster_index;
+    for (i = 0; i < nb_clusters; i += n) {
+        n = count_refcount_run(bs, cluster_index + i, nb_clusters - i, true);
+        if (n < 0) {
+            return n;
+        }
+        s->free_cluster_index += n;
+        if (n == 0) {
             goto retry;
         }
     }
 #ifdef DEBUG_ALLOC2
     fprintf(stderr, "alloc_clusters: size=%" PRId64 " -> %" PRId64 "\n",
-            size,
-            (s->free_cluster_index - nb_clusters) << s->cluster_bits);
+            size, cluster_index << s->cluster_bits);
 #endif
-    return (s->free_cluster_index - nb_clusters) << s->cluster_bits;
+    return cluster_index << s->cluster_bits;
 }
 
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size)
@@ -618,12 +692,16 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
 }
 
 /* only used to allocate compressed sectors. We try to allocate
-   contiguous sectors. size must be <= cluster_size */
+   contiguous sectors. size must be <= cluster_size
+
+   The refcount updates stay in the cache; the caller must make the L2 table
+   depend on the refcount block cache before pointing to the new sectors. */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
 {
     BDRVQcowState *s = bs->opaque;
     int64_t offset, cluster_offset;
     int free_in_cluster;
+    int ret;
 
     BLKDBG_EVENT(bs->file, BLKDBG_CLUSTER_ALLOC_BYTES);
     assert(size > 0 && size <= s->cluster_size);
@@ -644,8 +722,12 @@ int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
         free_in_cluster -= size;
         if (free_in_cluster == 0)
             s->free_byte_offset = 0;
-        if ((offset & (s->cluster_size - 1)) != 0)
-            update_cluster_refcount(bs, offset >> s->cluster_bits, 1);
+        if ((offset & (s->cluster_size - 1)) != 0) {
+            ret = update_refcount(bs, offset, 1, 1);
+            if (ret < 0) {
+                return ret;
+            }
+        }
     } else {
         offset = qcow2_alloc_clusters(bs, s->cluster_size);
         if (offset < 0) {
@@ -655,7 +737,10 @@ int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
         if ((cluster_offset + s->cluster_size) == offset) {
             /* we are lucky: contiguous data */
             offset = s->free_byte_offset;
-            update_cluster_refcount(bs, offset >> s->cluster_bits, 1);
+            ret = update_refcount(bs, offset, 1, 1);
+            if (ret < 0) {
+                return ret;
+            }
             s->free_byte_offset += size;
         } else {
             s->free_byte_offset = offset;
@@ -663,7 +748,6 @@ int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
         }
     }
 
-    bdrv_flush(bs->file);
     return offset;
 }
 
@@ -1149,6 +1233,12 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->snapshots_offset, s->snapshots_size);
 
+    /* dirty bitmaps saved by the last close */
+    if (s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_BITMAPS) {
+        inc_refcounts(bs, res, refcount_table, nb_clusters,
+            s->dirty_bitmaps_offset, s->dirty_bitmaps_size);
+    }
+
     /* refcount data */
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->refcount_table_offset,
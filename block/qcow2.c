@@ -56,6 +56,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_DIRTY_BITMAPS 0x23852875
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -148,6 +149,16 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_DIRTY_BITMAPS:
+            /* Without the autoclear bit the bitmaps are stale: drop them */
+            if (s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_BITMAPS) {
+                ret = qcow2_read_dirty_bitmaps_ext(bs, offset, ext.len);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -285,12 +296,50 @@ static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
     return ret;
 }
 
+/* Turn the cache sizes requested for @bs into numbers of tables */
+static int qcow2_cache_sizes(BlockDriverState *bs, int *l2_tables,
+                             int *refcount_blocks)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l2_cache_size, refcount_cache_size;
+
+    if (bs->l2_cache_coverage) {
+        /* Each L2 table maps l2_size clusters */
+        uint64_t table_coverage = (uint64_t)s->l2_size << s->cluster_bits;
+        l2_cache_size = DIV_ROUND_UP(bs->l2_cache_coverage, table_coverage)
+                        << s->cluster_bits;
+    } else if (bs->l2_cache_size) {
+        l2_cache_size = bs->l2_cache_size;
+    } else {
+        l2_cache_size = (uint64_t)L2_CACHE_SIZE << s->cluster_bits;
+    }
+
+    if (bs->refcount_cache_size) {
+        refcount_cache_size = bs->refcount_cache_size;
+    } else {
+        refcount_cache_size = (uint64_t)REFCOUNT_CACHE_SIZE << s->cluster_bits;
+    }
+
+    if (l2_cache_size > MAX_CACHE_BYTES ||
+        refcount_cache_size > MAX_CACHE_BYTES) {
+        error_report("qcow2: metadata cache size must not exceed %d bytes",
+                     MAX_CACHE_BYTES);
+        return -EINVAL;
+    }
+
+    *l2_tables = MAX(l2_cache_size >> s->cluster_bits, MIN_L2_CACHE_SIZE);
+    *refcount_blocks = MAX(refcount_cache_size >> s->cluster_bits,
+                           REFCOUNT_CACHE_SIZE);
+    return 0;
+}
+
 static int qcow2_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
     int len, i, ret = 0;
     QCowHeader header;
     uint64_t ext_end;
+    int l2_cache_tables, refcount_cache_blocks;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -369,6 +418,18 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         goto fail;
     }
 
+    s->use_lazy_refcounts = s->compatible_features &
+                            QCOW2_COMPAT_LAZY_REFCOUNTS;
+    if (bs->lazy_refcounts) {
+        if (bs->lazy_refcounts > 0 && s->qcow_version < 3) {
+            error_report("Lazy refcounts require a qcow2 image with at least "
+                         "qemu 1.1 compatibility level");
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->use_lazy_refcounts = bs->lazy_refcounts > 0;
+    }
+
     /* Check support for various header values */
     if (header.refcount_order != 4) {
         report_unsupported(bs, "%d bit reference counts",
@@ -430,8 +491,12 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
+    ret = qcow2_cache_sizes(bs, &l2_cache_tables, &refcount_cache_blocks);
+    if (ret < 0) {
+        goto fail;
+    }
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_tables);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_blocks);
 
     s->cluster_cache = g_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -440,6 +505,14 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     s->cluster_cache_offset = -1;
     s->flags = flags;
 
+    if (bs->prealloc_size && !bs->read_only) {
+        int64_t file_size = bdrv_getlength(bs->file);
+        if (file_size >= 0) {
+            s->prealloc_size = align_offset(bs->prealloc_size, s->cluster_size);
+            s->prealloc_end = file_size;
+        }
+    }
+
     ret = qcow2_refcount_init(bs);
     if (ret != 0) {
         goto fail;
@@ -473,14 +546,23 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && s->autoclear_features != 0) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             goto fail;
         }
     }
 
+    /* On an incoming migration the source still owns the bitmaps; they
+     * are loaded when the cache is invalidated */
+    if (!(bs->open_flags & BDRV_O_INCOMING)) {
+        ret = qcow2_load_dirty_bitmaps(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
 
@@ -504,6 +586,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     return ret;
 
  fail:
+    qcow2_release_dirty_bitmaps(bs);
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
@@ -512,6 +595,9 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     if (s->l2_table_cache) {
         qcow2_cache_destroy(bs, s->l2_table_cache);
     }
+    if (s->refcount_block_cache) {
+        qcow2_cache_destroy(bs, s->refcount_block_cache);
+    }
     g_free(s->cluster_cache);
     qemu_vfree(s->cluster_data);
     return ret;
@@ -577,9 +663,14 @@ static int coroutine_fn qcow2_co_is_allocated(BlockDriverState *bs,
     *pnum = nb_sectors;
     /* FIXME We can get errors here, but the bdrv_co_is_allocated interface
      * can't pass them on today */
-    qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_get_cluster_offset(bs, sector_num << 9, pnum, &cluster_offset);
-    qemu_co_mutex_unlock(&s->lock);
+    ret = qcow2_get_cluster_offset_nowait(bs, sector_num << 9, pnum,
+                                          &cluster_offset, NULL);
+    if (ret == -EAGAIN) {
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_get_cluster_offset(bs, sector_num << 9, pnum,
+                                       &cluster_offset);
+        qemu_co_mutex_unlock(&s->lock);
+    }
     if (ret < 0) {
         *pnum = 0;
     }
@@ -618,8 +709,6 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    qemu_co_mutex_lock(&s->lock);
-
     while (remaining_sectors != 0) {
 
         /* prepare next request */
@@ -629,8 +718,16 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                 QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors);
         }
 
-        ret = qcow2_get_cluster_offset(bs, sector_num << 9,
-            &cur_nr_sectors, &cluster_offset);
+        /* Reads don't change any metadata, so they only need s->lock to
+         * load an L2 table that isn't cached yet */
+        ret = qcow2_get_cluster_offset_nowait(bs, sector_num << 9,
+            &cur_nr_sectors, &cluster_offset, NULL);
+        if (ret == -EAGAIN) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_cluster_offset(bs, sector_num << 9,
+                &cur_nr_sectors, &cluster_offset);
+            qemu_co_mutex_unlock(&s->lock);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -650,10 +747,8 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                     sector_num, cur_nr_sectors);
                 if (n1 > 0) {
                     BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-                    qemu_co_mutex_unlock(&s->lock);
                     ret = bdrv_co_readv(bs->backing_hd, sector_num,
                                         n1, &hd_qiov);
-                    qemu_co_mutex_lock(&s->lock);
                     if (ret < 0) {
                         goto fail;
                     }
@@ -674,14 +769,18 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
 
         case QCOW2_CLUSTER_COMPRESSED:
             /* add AIO support for compressed blocks ? */
+            /* s->cluster_cache is shared, so this still needs the lock */
+            qemu_co_mutex_lock(&s->lock);
             ret = qcow2_decompress_cluster(bs, cluster_offset);
             if (ret < 0) {
+                qemu_co_mutex_unlock(&s->lock);
                 goto fail;
             }
 
             qemu_iovec_from_buf(&hd_qiov, 0,
                 s->cluster_cache + index_in_cluster * 512,
                 512 * cur_nr_sectors);
+            qemu_co_mutex_unlock(&s->lock);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -708,11 +807,9 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             }
 
             BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
-            qemu_co_mutex_unlock(&s->lock);
             ret = bdrv_co_readv(bs->file,
                                 (cluster_offset >> 9) + index_in_cluster,
                                 cur_nr_sectors, &hd_qiov);
-            qemu_co_mutex_lock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
@@ -737,8 +834,6 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
     ret = 0;
 
 fail:
-    qemu_co_mutex_unlock(&s->lock);
-
     qemu_iovec_destroy(&hd_qiov);
     qemu_vfree(cluster_data);
 
@@ -774,6 +869,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     QEMUIOVector hd_qiov;
     uint64_t bytes_done = 0;
     uint8_t *cluster_data = NULL;
+    bool copied;
     QCowL2Meta l2meta = {
         .nb_clusters = 0,
     };
@@ -787,8 +883,6 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
     s->cluster_cache_offset = -1; /* disable compressed cache */
 
-    qemu_co_mutex_lock(&s->lock);
-
     while (remaining_sectors != 0) {
 
         trace_qcow2_writev_start_part(qemu_coroutine_self());
@@ -799,18 +893,29 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             n_end = QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors;
         }
 
-        ret = qcow2_alloc_cluster_offset(bs, sector_num << 9,
-            index_in_cluster, n_end, &cur_nr_sectors, &l2meta);
-        if (ret < 0) {
-            goto fail;
-        }
+        /* Overwriting clusters that are allocated and not shared with a
+         * snapshot doesn't touch any metadata, so it doesn't need s->lock
+         * either if the L2 table is cached.  Everything else goes through
+         * qcow2_alloc_cluster_offset(). */
+        cur_nr_sectors = n_end - index_in_cluster;
+        ret = qcow2_get_cluster_offset_nowait(bs, sector_num << 9,
+            &cur_nr_sectors, &cluster_offset, &copied);
+        if (ret != QCOW2_CLUSTER_NORMAL || !copied) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_alloc_cluster_offset(bs, sector_num << 9,
+                index_in_cluster, n_end, &cur_nr_sectors, &l2meta);
+            if (ret < 0) {
+                qemu_co_mutex_unlock(&s->lock);
+                goto fail;
+            }
 
-        if (l2meta.nb_clusters > 0 &&
-            (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS)) {
-            qcow2_mark_dirty(bs);
-        }
+            if (l2meta.nb_clusters > 0 && s->use_lazy_refcounts) {
+                qcow2_mark_dirty(bs);
+            }
+            qemu_co_mutex_unlock(&s->lock);
 
-        cluster_offset = l2meta.cluster_offset;
+            cluster_offset = l2meta.cluster_offset;
+        }
         assert((cluster_offset & 511) == 0);
 
         qemu_iovec_reset(&hd_qiov);
@@ -836,23 +941,27 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
         }
 
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
-        qemu_co_mutex_unlock(&s->lock);
         trace_qcow2_writev_data(qemu_coroutine_self(),
                                 (cluster_offset >> 9) + index_in_cluster);
         ret = bdrv_co_writev(bs->file,
                              (cluster_offset >> 9) + index_in_cluster,
                              cur_nr_sectors, &hd_qiov);
-        qemu_co_mutex_lock(&s->lock);
         if (ret < 0) {
             goto fail;
         }
 
-        ret = qcow2_alloc_cluster_link_l2(bs, &l2meta);
-        if (ret < 0) {
-            goto fail;
-        }
+        if (l2meta.nb_clusters > 0) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_alloc_cluster_link_l2(bs, &l2meta);
+            if (ret < 0) {
+                qemu_co_mutex_unlock(&s->lock);
+                goto fail;
+            }
 
-        run_dependent_requests(s, &l2meta);
+            run_dependent_requests(s, &l2meta);
+            l2meta.nb_clusters = 0;
+            qemu_co_mutex_unlock(&s->lock);
+        }
 
         remaining_sectors -= cur_nr_sectors;
         sector_num += cur_nr_sectors;
@@ -862,9 +971,11 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     ret = 0;
 
 fail:
-    run_dependent_requests(s, &l2meta);
-
-    qemu_co_mutex_unlock(&s->lock);
+    if (l2meta.nb_clusters > 0) {
+        qemu_co_mutex_lock(&s->lock);
+        run_dependent_requests(s, &l2meta);
+        qemu_co_mutex_unlock(&s->lock);
+    }
 
     qemu_iovec_destroy(&hd_qiov);
     qemu_vfree(cluster_data);
@@ -873,15 +984,44 @@ fail:
     return ret;
 }
 
+/*
+ * Gives back the host storage that prealloc-size reserved past the end of
+ * the image file.  Truncating a file to its own length releases the blocks
+ * that fallocate(FALLOC_FL_KEEP_SIZE) reserved beyond it.
+ */
+static void qcow2_release_prealloc(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t file_size;
+
+    file_size = bdrv_getlength(bs->file);
+    if (file_size < 0 || file_size >= s->prealloc_end) {
+        return;
+    }
+
+    bdrv_truncate(bs->file, file_size);
+    s->prealloc_end = file_size;
+}
+
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    /* The header belongs to the other side of a migration */
+    bool inactive = bs->open_flags & (BDRV_O_INACTIVE | BDRV_O_INCOMING);
+
+    if (!inactive && qcow2_store_dirty_bitmaps(bs) < 0) {
+        error_report("Failed to save the dirty bitmaps of %s", bs->filename);
+    }
+
     g_free(s->l1_table);
 
     qcow2_cache_flush(bs, s->l2_table_cache);
     qcow2_cache_flush(bs, s->refcount_block_cache);
 
-    qcow2_mark_clean(bs);
+    if (!inactive) {
+        qcow2_mark_clean(bs);
+        qcow2_release_prealloc(bs);
+    }
 
     qcow2_cache_destroy(bs, s->l2_table_cache);
     qcow2_cache_destroy(bs, s->refcount_block_cache);
@@ -914,6 +1054,8 @@ static void qcow2_invalidate_cache(BlockDriverState *bs)
         memcpy(&aes_decrypt_key, &s->aes_decrypt_key, sizeof(aes_decrypt_key));
     }
 
+    /* The bitmaps on disk supersede the ones in memory */
+    qcow2_release_dirty_bitmaps(bs);
     qcow2_close(bs);
 
     memset(s, 0, sizeof(BDRVQcowState));
@@ -1045,6 +1187,24 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Dirty bitmaps header extension */
+    if (s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_BITMAPS) {
+        Qcow2DirtyBitmapsExt bitmaps_ext = {
+            .offset     = cpu_to_be64(s->dirty_bitmaps_offset),
+            .size       = cpu_to_be64(s->dirty_bitmaps_size),
+            .nb_bitmaps = cpu_to_be32(s->nb_dirty_bitmaps),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DIRTY_BITMAPS,
+                             &bitmaps_ext, sizeof(bitmaps_ext), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Feature table */
     Qcow2Feature features[] = {
         {
@@ -1057,6 +1217,11 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR,
+            .name = "dirty bitmaps",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1433,6 +1598,13 @@ static coroutine_fn int qcow2_co_discard(BlockDriverState *bs,
     return ret;
 }
 
+static bool qcow2_can_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    return s->qcow_version >= 3 && !bs->read_only;
+}
+
 static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1555,15 +1727,18 @@ static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     int ret;
 
+    /* bdrv_co_flush() flushes bs->file next, so only write the tables here.
+     * With lazy refcounts, an allocating write followed by a guest flush
+     * then costs a single disk flush. */
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    ret = qcow2_cache_write(bs, s->l2_table_cache);
     if (ret < 0) {
         qemu_co_mutex_unlock(&s->lock);
         return ret;
     }
 
     if (qcow2_need_accurate_refcounts(s)) {
-        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        ret = qcow2_cache_write(bs, s->refcount_block_cache);
         if (ret < 0) {
             qemu_co_mutex_unlock(&s->lock);
             return ret;
@@ -1587,6 +1762,20 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static void qcow2_get_metadata_cache_stats(BlockDriverState *bs,
+                                           BlockMetadataCacheStats *stats)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    qcow2_cache_get_stats(s->l2_table_cache, &stats->l2_cache_size,
+                          &stats->l2_cache_hits, &stats->l2_cache_misses);
+    qcow2_cache_get_stats(s->refcount_block_cache,
+                          &stats->refcount_cache_size,
+                          &stats->refcount_cache_hits,
+                          &stats->refcount_cache_misses);
+    stats->metadata_writes = s->metadata_writes;
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -1710,6 +1899,8 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_list     = qcow2_snapshot_list,
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
+    .bdrv_get_metadata_cache_stats = qcow2_get_metadata_cache_stats,
+    .bdrv_can_store_dirty_bitmaps = qcow2_can_store_dirty_bitmaps,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
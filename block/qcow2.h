@@ -51,11 +51,18 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Default number of cached tables, unless the user asked for more */
 #define L2_CACHE_SIZE 16
 
+/* Must be at least 2: one table may be copied into a newly allocated one */
+#define MIN_L2_CACHE_SIZE 2
+
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
 
+/* Upper bound for the memory used by each metadata cache */
+#define MAX_CACHE_BYTES (INT_MAX / 2)
+
 #define DEFAULT_CLUSTER_SIZE 65536
 
 typedef struct QCowHeader {
@@ -126,6 +133,25 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR = 0,
+    QCOW2_AUTOCLEAR_DIRTY_BITMAPS       =
+        1 << QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK                = QCOW2_AUTOCLEAR_DIRTY_BITMAPS,
+};
+
+/* Upper bound for the memory used to load or save the dirty bitmaps */
+#define QCOW2_MAX_DIRTY_BITMAPS_SIZE (256 * 1024 * 1024)
+
+typedef struct Qcow2DirtyBitmapsExt {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t nb_bitmaps;
+    uint32_t reserved;
+} QEMU_PACKED Qcow2DirtyBitmapsExt;
+
 typedef struct Qcow2Feature {
     uint8_t type;
     uint8_t bit;
@@ -154,12 +180,26 @@ typedef struct BDRVQcowState {
     uint64_t cluster_cache_offset;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
+    /* L1, L2 and refcount table writes, for the metadata cache stats */
+    uint64_t metadata_writes;
+
+    bool use_lazy_refcounts;
+
+    /* Host storage is reserved up to prealloc_end, see prealloc-size */
+    uint64_t prealloc_size;
+    uint64_t prealloc_end;
+
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
+    /* Refcount blocks that had no free entry when they were last searched,
+     * one bit per refcount table entry.  Only a hint for the allocator. */
+    unsigned long *refblock_full;
     int64_t free_cluster_index;
     int64_t free_byte_offset;
 
+    /* Serialises metadata updates and L2 table loads.  Lookups in cached
+     * L2 tables don't yield and are done without it. */
     CoMutex lock;
 
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
@@ -171,6 +211,10 @@ typedef struct BDRVQcowState {
     int nb_snapshots;
     QCowSnapshot *snapshots;
 
+    uint64_t dirty_bitmaps_offset;
+    uint64_t dirty_bitmaps_size;
+    uint32_t nb_dirty_bitmaps;
+
     int flags;
     int qcow_version;
 
@@ -296,6 +340,8 @@ void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
 
 int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *cluster_offset);
+int qcow2_get_cluster_offset_nowait(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset, bool *copied);
 int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int n_start, int n_end, int *num, QCowL2Meta *m);
 uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
@@ -317,11 +363,21 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs, const char *snapshot_name);
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+int qcow2_read_dirty_bitmaps_ext(BlockDriverState *bs, uint64_t offset,
+                                 uint32_t len);
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs);
+int qcow2_store_dirty_bitmaps(BlockDriverState *bs);
+void qcow2_release_dirty_bitmaps(BlockDriverState *bs);
+
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, int64_t *size, int64_t *hits,
+    int64_t *misses);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
+int qcow2_cache_write(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency);
@@ -331,6 +387,8 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
+int qcow2_cache_get_cached(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
 
 #endif
@@ -27,6 +27,7 @@
 #include "block_int.h"
 #include "module.h"
 #include "migration.h"
+#include "thread-pool.h"
 #include <zlib.h>
 
 #define VMDK3_MAGIC (('C' << 24) | ('O' << 16) | ('W' << 8) | 'D')
@@ -66,7 +67,8 @@ typedef struct {
     uint16_t compressAlgorithm;
 } QEMU_PACKED VMDK4Header;
 
-#define L2_CACHE_SIZE 16
+/* Maximum number of grain tables cached per extent */
+#define L2_CACHE_SIZE 512
 
 typedef struct VmdkExtent {
     BlockDriverState *file;
@@ -85,13 +87,17 @@ typedef struct VmdkExtent {
 
     unsigned int l2_size;
     uint32_t *l2_cache;
-    uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    unsigned int l2_cache_size;
+    uint32_t *l2_cache_offsets;
+    uint32_t *l2_cache_counts;
 
     unsigned int cluster_sectors;
 } VmdkExtent;
 
 typedef struct BDRVVmdkState {
+    /* Protects the grain tables and their cache, grain allocation and the
+     * CID.  Reads and rewrites of allocated grains drop it for the guest
+     * data I/O. */
     CoMutex lock;
     int desc_offset;
     bool cid_updated;
@@ -196,6 +202,8 @@ static void vmdk_free_extents(BlockDriverState *bs)
         e = &s->extents[i];
         g_free(e->l1_table);
         g_free(e->l2_cache);
+        g_free(e->l2_cache_offsets);
+        g_free(e->l2_cache_counts);
         g_free(e->l1_backup_table);
         if (e->file != bs->file) {
             bdrv_delete(e->file);
@@ -435,8 +443,14 @@ static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent)
         }
     }
 
-    extent->l2_cache =
-        g_malloc(extent->l2_size * L2_CACHE_SIZE * sizeof(uint32_t));
+    /* No point in caching more grain tables than the extent has */
+    extent->l2_cache_size = MIN(MAX(extent->l1_size, 1), L2_CACHE_SIZE);
+    extent->l2_cache = g_malloc(extent->l2_size * extent->l2_cache_size *
+                                sizeof(uint32_t));
+    extent->l2_cache_offsets =
+        g_malloc0(extent->l2_cache_size * sizeof(uint32_t));
+    extent->l2_cache_counts =
+        g_malloc0(extent->l2_cache_size * sizeof(uint32_t));
     return 0;
  fail_l1b:
     g_free(extent->l1_backup_table);
@@ -857,11 +871,11 @@ static int get_cluster_offset(BlockDriverState *bs,
     if (!l2_offset) {
         return -1;
     }
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
+    for (i = 0; i < extent->l2_cache_size; i++) {
         if (l2_offset == extent->l2_cache_offsets[i]) {
             /* increment the hit count */
             if (++extent->l2_cache_counts[i] == 0xffffffff) {
-                for (j = 0; j < L2_CACHE_SIZE; j++) {
+                for (j = 0; j < extent->l2_cache_size; j++) {
                     extent->l2_cache_counts[j] >>= 1;
                 }
             }
@@ -872,7 +886,7 @@ static int get_cluster_offset(BlockDriverState *bs,
     /* not found: load a new entry in the least used one */
     min_index = 0;
     min_count = 0xffffffff;
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
+    for (i = 0; i < extent->l2_cache_size; i++) {
         if (extent->l2_cache_counts[i] < min_count) {
             min_count = extent->l2_cache_counts[i];
             min_index = i;
@@ -1020,9 +1034,25 @@ static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
-                            int64_t offset_in_cluster, uint8_t *buf,
-                            int nb_sectors)
+typedef struct VmdkInflate {
+    uint8_t *dest;
+    uLongf dest_len;
+    const uint8_t *source;
+    uLong source_len;
+} VmdkInflate;
+
+static int vmdk_inflate_worker(void *opaque)
+{
+    VmdkInflate *inflate = opaque;
+
+    return uncompress(inflate->dest, &inflate->dest_len,
+                      inflate->source, inflate->source_len);
+}
+
+static int coroutine_fn vmdk_read_extent(VmdkExtent *extent,
+                                         int64_t cluster_offset,
+                                         int64_t offset_in_cluster,
+                                         uint8_t *buf, int nb_sectors)
 {
     int ret;
     int cluster_bytes, buf_bytes;
@@ -1030,8 +1060,7 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     uint8_t *uncomp_buf;
     uint32_t data_len;
     VmdkGrainMarker *marker;
-    uLongf buf_len;
-
+    VmdkInflate inflate;
 
     if (!extent->compressed) {
         ret = bdrv_pread(extent->file,
@@ -1055,7 +1084,6 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
         goto out;
     }
     compressed_data = cluster_buf;
-    buf_len = cluster_bytes;
     data_len = cluster_bytes;
     if (extent->has_marker) {
         marker = (VmdkGrainMarker *)cluster_buf;
@@ -1066,14 +1094,22 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
         ret = -EINVAL;
         goto out;
     }
-    ret = uncompress(uncomp_buf, &buf_len, compressed_data, data_len);
+
+    /* Inflate in a worker thread, so that grains read by concurrent
+     * requests are decompressed in parallel */
+    inflate = (VmdkInflate) {
+        .dest = uncomp_buf,
+        .dest_len = cluster_bytes,
+        .source = compressed_data,
+        .source_len = data_len,
+    };
+    ret = thread_pool_submit_co(vmdk_inflate_worker, &inflate);
     if (ret != Z_OK) {
         ret = -EINVAL;
         goto out;
-
     }
     if (offset_in_cluster < 0 ||
-            offset_in_cluster + nb_sectors * 512 > buf_len) {
+            offset_in_cluster + nb_sectors * 512 > inflate.dest_len) {
         ret = -EINVAL;
         goto out;
     }
@@ -1086,8 +1122,9 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/* Called with s->lock held, which is dropped around the data I/O */
+static int coroutine_fn vmdk_read(BlockDriverState *bs, int64_t sector_num,
+                                  uint8_t *buf, int nb_sectors)
 {
     BDRVVmdkState *s = bs->opaque;
     int ret;
@@ -1117,7 +1154,9 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
                 if (!vmdk_is_cid_valid(bs)) {
                     return -EINVAL;
                 }
+                qemu_co_mutex_unlock(&s->lock);
                 ret = bdrv_read(bs->backing_hd, sector_num, buf, n);
+                qemu_co_mutex_lock(&s->lock);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1125,9 +1164,11 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
                 memset(buf, 0, 512 * n);
             }
         } else {
+            qemu_co_mutex_unlock(&s->lock);
             ret = vmdk_read_extent(extent,
                             cluster_offset, index_in_cluster * 512,
                             buf, n);
+            qemu_co_mutex_lock(&s->lock);
             if (ret) {
                 return ret;
             }
@@ -1150,8 +1191,11 @@ static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
     return ret;
 }
 
-static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
-                     const uint8_t *buf, int nb_sectors)
+/* Called with s->lock held.  Only writes to grains that are already
+ * allocated drop it: allocating writes must update the grain table before
+ * anyone else can see the new grain. */
+static int coroutine_fn vmdk_write(BlockDriverState *bs, int64_t sector_num,
+                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVVmdkState *s = bs->opaque;
     VmdkExtent *extent = NULL;
@@ -1208,9 +1252,17 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
             n = nb_sectors;
         }
 
-        ret = vmdk_write_extent(extent,
-                        cluster_offset, index_in_cluster * 512,
-                        buf, n, sector_num);
+        if (m_data.valid || extent->compressed) {
+            ret = vmdk_write_extent(extent,
+                            cluster_offset, index_in_cluster * 512,
+                            buf, n, sector_num);
+        } else {
+            qemu_co_mutex_unlock(&s->lock);
+            ret = vmdk_write_extent(extent,
+                            cluster_offset, index_in_cluster * 512,
+                            buf, n, sector_num);
+            qemu_co_mutex_lock(&s->lock);
+        }
         if (ret) {
             return ret;
         }
@@ -56,7 +56,15 @@
 #define BLOCK_OPT_COMPAT_LEVEL      "compat"
 #define BLOCK_OPT_LAZY_REFCOUNTS    "lazy_refcounts"
 
-typedef struct BdrvTrackedRequest BdrvTrackedRequest;
+typedef struct BdrvTrackedRequest {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    bool is_write;
+    QLIST_ENTRY(BdrvTrackedRequest) list;
+    Coroutine *co; /* owner, used for deadlock detection */
+    CoQueue wait_queue; /* coroutines blocked on this request */
+} BdrvTrackedRequest;
 
 typedef struct BlockIOLimit {
     int64_t bps[3];
@@ -141,6 +149,11 @@ struct BlockDriver {
 
     const char *protocol_name;
     int (*bdrv_truncate)(BlockDriverState *bs, int64_t offset);
+    int (*bdrv_preallocate)(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes);
+
+    /* Named dirty bitmaps marked persistent are saved on close when true */
+    bool (*bdrv_can_store_dirty_bitmaps)(BlockDriverState *bs);
     int64_t (*bdrv_getlength)(BlockDriverState *bs);
     int64_t (*bdrv_get_allocated_file_size)(BlockDriverState *bs);
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
@@ -156,6 +169,8 @@ struct BlockDriver {
     int (*bdrv_snapshot_load_tmp)(BlockDriverState *bs,
                                   const char *snapshot_name);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    void (*bdrv_get_metadata_cache_stats)(BlockDriverState *bs,
+                                          BlockMetadataCacheStats *stats);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, const uint8_t *buf,
                              int64_t pos, int size);
@@ -248,6 +263,23 @@ struct BlockDriverState {
     QEMUTimer    *block_timer;
     bool         io_limits_enabled;
 
+    /* Sizes of the format driver's metadata caches in bytes, 0 leaves the
+     * choice to the driver.  l2_cache_coverage is the amount of guest disk
+     * that the L2 cache should map, as an alternative to l2_cache_size.
+     * Only looked at when the image is opened. */
+    uint64_t l2_cache_size;
+    uint64_t l2_cache_coverage;
+    uint64_t refcount_cache_size;
+
+    /* Host storage that the format driver reserves ahead of newly allocated
+     * clusters, 0 to disable.  Only looked at when the image is opened. */
+    uint64_t prealloc_size;
+
+    /* Overrides the image's setting for lazy refcount updates: 1 enables
+     * them, -1 disables them, 0 keeps the image's setting.  Only looked at
+     * when the image is opened. */
+    int lazy_refcounts;
+
     /* I/O stats (display with "info blockstats"). */
     uint64_t nr_bytes[BDRV_MAX_IOTYPE];
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
@@ -271,11 +303,15 @@ struct BlockDriverState {
     char device_name[32];
     unsigned long *dirty_bitmap;
     int64_t dirty_count;
+    QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
     int in_use; /* users other than guest access, eg. block migration */
     QTAILQ_ENTRY(BlockDriverState) list;
 
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
 
+    /* Callback before write request is processed */
+    NotifierWithReturnList before_write_notifiers;
+
     /* long-running background operation */
     BlockJob *job;
 
@@ -285,6 +321,23 @@ int get_tmp_filename(char *filename, int size);
 
 void bdrv_set_io_limits(BlockDriverState *bs,
                         BlockIOLimit *io_limits);
+void bdrv_set_metadata_cache_size(BlockDriverState *bs,
+                                  uint64_t l2_cache_size,
+                                  uint64_t l2_cache_coverage,
+                                  uint64_t refcount_cache_size);
+void bdrv_set_prealloc_size(BlockDriverState *bs, uint64_t prealloc_size);
+void bdrv_set_lazy_refcounts(BlockDriverState *bs, int lazy_refcounts);
+
+/**
+ * bdrv_add_before_write_notifier:
+ *
+ * Register a callback that is invoked before write requests are processed but
+ * after any throttling or waiting for overlapping requests.  The callback gets
+ * the BdrvTrackedRequest of the write, or of the discard, and can fail it by
+ * returning a negative errno.
+ */
+void bdrv_add_before_write_notifier(BlockDriverState *bs,
+                                    NotifierWithReturn *notifier);
 
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
@@ -357,4 +410,24 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp);
 
+/*
+ * incremental_backup_start:
+ * @bs: Block device to operate on.
+ * @target: Block device to write to.
+ * @bitmap: Dirty bitmap of @bs that selects the chunks to copy.
+ * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @cb: Completion function for the job.
+ * @opaque: Opaque pointer value passed to @cb.
+ * @errp: Error object.
+ *
+ * Copy the chunks of @bs that are dirty in @bitmap to @target, clearing
+ * them as they are copied, in a single pass over the device.  Chunks that
+ * are written again behind the job stay dirty for the next backup, and so
+ * do the ones that were not copied if the job fails or is cancelled.
+ */
+void incremental_backup_start(BlockDriverState *bs, BlockDriverState *target,
+                              BdrvDirtyBitmap *bitmap, int64_t speed,
+                              BlockDriverCompletionFunc *cb,
+                              void *opaque, Error **errp);
+
 #endif /* BLOCK_INT_H */
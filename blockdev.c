@@ -294,6 +294,9 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     const char *devaddr;
     DriveInfo *dinfo;
     BlockIOLimit io_limits;
+    uint64_t l2_cache_size, l2_cache_coverage, refcount_cache_size;
+    uint64_t prealloc_size;
+    int lazy_refcounts = 0;
     int snapshot = 0;
     bool copy_on_read;
     int ret;
@@ -433,6 +436,20 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         return NULL;
     }
 
+    l2_cache_size = qemu_opt_get_size(opts, "l2-cache-size", 0);
+    l2_cache_coverage = qemu_opt_get_size(opts, "l2-cache-coverage", 0);
+    refcount_cache_size = qemu_opt_get_size(opts, "refcount-cache-size", 0);
+    if (l2_cache_size && l2_cache_coverage) {
+        error_report("l2-cache-size and l2-cache-coverage "
+                     "cannot be used at the same time");
+        return NULL;
+    }
+    prealloc_size = qemu_opt_get_size(opts, "prealloc-size", 0);
+    if (qemu_opt_get(opts, "lazy-refcounts")) {
+        lazy_refcounts = qemu_opt_get_bool(opts, "lazy-refcounts", false) ?
+                         1 : -1;
+    }
+
     if (qemu_opt_get(opts, "boot") != NULL) {
         fprintf(stderr, "qemu-kvm: boot=on|off is deprecated and will be "
                 "ignored. Future versions will reject this parameter. Please "
@@ -554,6 +571,11 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     /* disk I/O throttling */
     bdrv_set_io_limits(dinfo->bdrv, &io_limits);
 
+    bdrv_set_metadata_cache_size(dinfo->bdrv, l2_cache_size,
+                                 l2_cache_coverage, refcount_cache_size);
+    bdrv_set_prealloc_size(dinfo->bdrv, prealloc_size);
+    bdrv_set_lazy_refcounts(dinfo->bdrv, lazy_refcounts);
+
     switch(type) {
     case IF_IDE:
     case IF_SCSI:
@@ -1321,6 +1343,176 @@ void qmp_drive_mirror(const char *device, const char *target,
     drive_get_ref(drive_get_by_blockdev(bs));
 }
 
+static BdrvDirtyBitmap *find_dirty_bitmap(const char *device, const char *name,
+                                          BlockDriverState **pbs,
+                                          Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return NULL;
+    }
+
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (!bitmap) {
+        error_setg(errp, "Dirty bitmap '%s' not found", name);
+        return NULL;
+    }
+
+    *pbs = bs;
+    return bitmap;
+}
+
+void qmp_block_dirty_bitmap_add(const char *device, const char *name,
+                                bool has_granularity, int64_t granularity,
+                                bool has_persistent, bool persistent,
+                                Error **errp)
+{
+    BlockDriverInfo bdi;
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    if (has_persistent && persistent && !bdrv_can_store_dirty_bitmaps(bs)) {
+        error_setg(errp, "Device '%s' cannot store persistent dirty bitmaps",
+                   device);
+        return;
+    }
+
+    if (!has_granularity) {
+        /* Tracking at cluster granularity copies no more than a full
+         * rewrite of the cluster would. */
+        granularity = 65536;
+        if (bdrv_get_info(bs, &bdi) >= 0 &&
+            bdi.cluster_size >= BDRV_SECTOR_SIZE &&
+            bdi.cluster_size <= BDRV_MAX_DIRTY_GRANULARITY &&
+            !(bdi.cluster_size & (bdi.cluster_size - 1))) {
+            granularity = bdi.cluster_size;
+        }
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, name, granularity, errp);
+    if (bitmap) {
+        bdrv_dirty_bitmap_set_persistent(bitmap, has_persistent && persistent);
+    }
+}
+
+void qmp_block_dirty_bitmap_remove(const char *device, const char *name,
+                                   Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = find_dirty_bitmap(device, name, &bs, errp);
+    if (!bitmap) {
+        return;
+    }
+
+    if (bdrv_in_use(bs)) {
+        error_set(errp, QERR_DEVICE_IN_USE, device);
+        return;
+    }
+
+    bdrv_release_dirty_bitmap(bs, bitmap);
+}
+
+void qmp_block_dirty_bitmap_clear(const char *device, const char *name,
+                                  Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = find_dirty_bitmap(device, name, &bs, errp);
+    if (!bitmap) {
+        return;
+    }
+
+    if (bdrv_in_use(bs)) {
+        error_set(errp, QERR_DEVICE_IN_USE, device);
+        return;
+    }
+
+    bdrv_dirty_bitmap_clear(bitmap);
+}
+
+void qmp_block_backup_incremental(const char *device, const char *bitmap_name,
+                                  const char *target,
+                                  bool has_format, const char *format,
+                                  bool has_speed, int64_t speed,
+                                  Error **errp)
+{
+    BlockDriverState *bs, *target_bs;
+    BdrvDirtyBitmap *bitmap;
+    BlockDriver *drv = NULL;
+    Error *local_err = NULL;
+    int ret;
+
+    if (!has_speed) {
+        speed = 0;
+    }
+
+    bitmap = find_dirty_bitmap(device, bitmap_name, &bs, errp);
+    if (!bitmap) {
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    if (bdrv_in_use(bs)) {
+        error_set(errp, QERR_DEVICE_IN_USE, device);
+        return;
+    }
+
+    if (has_format) {
+        drv = bdrv_find_format(format);
+        if (!drv) {
+            error_set(errp, QERR_INVALID_BLOCK_FORMAT, format);
+            return;
+        }
+    }
+
+    target_bs = bdrv_new("");
+    ret = bdrv_open(target_bs, target, bs->open_flags | BDRV_O_RDWR, drv);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        error_set(errp, QERR_OPEN_FILE_FAILED, target);
+        return;
+    }
+
+    if (bdrv_getlength(target_bs) < bdrv_getlength(bs)) {
+        bdrv_delete(target_bs);
+        error_setg(errp, "Image '%s' is smaller than device '%s'",
+                   target, device);
+        return;
+    }
+
+    incremental_backup_start(bs, target_bs, bitmap, speed,
+                             block_job_cb, bs, &local_err);
+    if (local_err != NULL) {
+        bdrv_delete(target_bs);
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    drive_get_ref(drive_get_by_blockdev(bs));
+}
+
 static BlockJob *find_block_job(const char *device)
 {
     BlockDriverState *bs;
@@ -90,6 +90,7 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
     tb_page_addr_t phys_pc, phys_page1;
     target_ulong virt_page2;
 
+    tb_lock();
     tb_invalidated_flag = 0;
 
     /* find translated block using physical mappings */
@@ -133,6 +134,7 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
     }
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    tb_unlock();
     return tb;
 }
 
@@ -154,6 +156,35 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
     return tb;
 }
 
+/* Called by translated code at the end of a TB that ends with an
+   indirect branch (see tcg_gen_lookup_and_goto_ptr).  Returns the host
+   code to continue with: the next TB if it is in the jump cache, or
+   the epilogue that takes us back to cpu_exec.  */
+void *tcg_helper_lookup_tb_ptr(void *opaque)
+{
+    CPUArchState *env = opaque;
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+
+    /* cpu_exit and cpu_interrupt unchain env->current_tb, so it has to
+       follow us before we look at the pending requests.  */
+    env->current_tb = tb;
+    barrier();
+    if (unlikely(exit_request || env->exit_request ||
+                 env->interrupt_request)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    return tb->tc_ptr;
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 void cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -262,8 +293,19 @@ int cpu_exec(CPUArchState *env)
 
             next_tb = 0; /* force lookup of first TB */
             for(;;) {
+#ifdef CONFIG_MTTCG
+                if (mttcg_enabled) {
+                    /* cpu_exit() sets this to break out of a TB chain;
+                       rearm it before looking at what was requested */
+                    env->icount_decr.u16.high = 0;
+                    smp_mb();
+                }
+#endif
                 interrupt_request = env->interrupt_request;
                 if (unlikely(interrupt_request)) {
+                    /* interrupt delivery may touch device state */
+                    bool locked = tcg_io_lock();
+
                     if (unlikely(env->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -538,6 +580,7 @@ int cpu_exec(CPUArchState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+                    tcg_io_unlock(locked);
                 }
                 if (unlikely(env->exit_request)) {
                     env->exit_request = 0;
@@ -563,7 +606,6 @@ int cpu_exec(CPUArchState *env)
 #endif
                 }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
-                spin_lock(&tb_lock);
                 tb = tb_find_fast(env);
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
@@ -583,9 +625,17 @@ int cpu_exec(CPUArchState *env)
                    spans two pages, we cannot safely do a direct
                    jump. */
                 if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
+                    tb_lock();
+                    /* Another vCPU thread may have invalidated the TB
+                       since we looked it up, which removes it from every
+                       tb_jmp_cache; never chain to a dead TB.  */
+                    if (env->tb_jmp_cache[tb_jmp_cache_hash_func(tb->pc)]
+                        == tb) {
+                        tb_add_jump((TranslationBlock *)(next_tb & ~3),
+                                    next_tb & 3, tb);
+                    }
+                    tb_unlock();
                 }
-                spin_unlock(&tb_lock);
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -623,6 +673,13 @@ int cpu_exec(CPUArchState *env)
                             next_tb = 0;
                             cpu_loop_exit(env);
                         }
+                    } else if ((next_tb & 3) == 3) {
+                        /* The TB became hot before running any
+                           instruction: replace it with a superblock.  */
+                        tb = (TranslationBlock *)(next_tb & ~3);
+                        cpu_pc_from_tb(env, tb);
+                        tb_gen_superblock(env, tb);
+                        next_tb = 0;
                     }
                 }
                 env->current_tb = NULL;
@@ -633,6 +690,11 @@ int cpu_exec(CPUArchState *env)
             /* Reload env after longjmp - the compiler may have smashed all
              * local variables as longjmp is marked 'noreturn'. */
             env = cpu_single_env;
+            /* An exception raised while generating code or invalidating
+               TBs leaves tb_lock held, and with mttcg_enabled one raised
+               from an I/O access leaves the iothread lock held.  */
+            tb_lock_reset();
+            tcg_io_lock_reset();
         }
     } /* for(;;) */
 
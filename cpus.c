@@ -37,6 +37,7 @@
 #include "qtest.h"
 #include "main-loop.h"
 #include "bitmap.h"
+#include "qemu-tls.h"
 
 #ifndef _WIN32
 #include "compatfd.h"
@@ -385,6 +386,34 @@ void configure_icount(const char *option)
                    qemu_get_clock_ns(vm_clock) + get_ticks_per_sec() / 10);
 }
 
+void configure_tcg_threads(const char *option)
+{
+    if (!option || !strcmp(option, "single")) {
+        return;
+    }
+    if (strcmp(option, "multi") != 0) {
+        error_report("Invalid tcg-thread option: %s", option);
+        exit(1);
+    }
+#if !defined(CONFIG_MTTCG)
+    error_report("multithreaded TCG is not supported on this host");
+    exit(1);
+#elif !defined(TARGET_SUPPORTS_MTTCG)
+    error_report("multithreaded TCG is not supported for this target");
+    exit(1);
+#else
+    if (!tcg_enabled()) {
+        error_report("tcg-thread=multi requires the TCG accelerator");
+        exit(1);
+    }
+    if (use_icount) {
+        error_report("tcg-thread=multi is incompatible with -icount");
+        exit(1);
+    }
+    mttcg_enabled = true;
+#endif
+}
+
 /***********************************************************/
 void hw_error(const char *fmt, ...)
 {
@@ -616,6 +645,9 @@ static void qemu_tcg_init_cpu_signals(void)
 static QemuMutex qemu_global_mutex;
 static QemuCond qemu_io_proceeded_cond;
 static bool iothread_requesting_mutex;
+/* set while this thread holds qemu_global_mutex via
+   qemu_mutex_lock_iothread() */
+static DEFINE_TLS(bool, iothread_locked);
 
 static QemuThread io_thread;
 
@@ -628,6 +660,14 @@ static QemuCond qemu_cpu_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
 
+/* To flush the translation cache with multithreaded TCG, all vCPUs are
+   forced out of cpu_exec() like for exclusive operations in linux-user.
+   env->running is only updated under exclusive_lock.  */
+static QemuMutex exclusive_lock;
+static QemuCond exclusive_cond;
+static QemuCond exclusive_resume;
+static int pending_cpus;
+
 void qemu_init_cpu_loop(void)
 {
     qemu_init_sigbus();
@@ -636,6 +676,9 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
     qemu_mutex_init(&qemu_global_mutex);
+    qemu_mutex_init(&exclusive_lock);
+    qemu_cond_init(&exclusive_cond);
+    qemu_cond_init(&exclusive_resume);
 
     qemu_thread_get_self(&io_thread);
 }
@@ -659,6 +702,7 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     cpu->queued_work_last = &wi;
     wi.next = NULL;
     wi.done = false;
+    wi.free = false;
 
     qemu_cpu_kick(cpu);
     while (!wi.done) {
@@ -669,6 +713,45 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     }
 }
 
+void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
+{
+    struct qemu_work_item *wi;
+
+    if (qemu_cpu_is_self(cpu)) {
+        func(data);
+        return;
+    }
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    if (cpu->queued_work_first == NULL) {
+        cpu->queued_work_first = wi;
+    } else {
+        cpu->queued_work_last->next = wi;
+    }
+    cpu->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+
+    qemu_cpu_kick(cpu);
+}
+
+static void cpu_nop(void *data)
+{
+}
+
+/* Wait until every other vCPU thread has left cpu_exec() at least once */
+void cpu_synchronize_tcg_vcpus(void)
+{
+    CPUArchState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        run_on_cpu(ENV_GET_CPU(env), cpu_nop, NULL);
+    }
+}
+
 static void flush_queued_work(CPUState *cpu)
 {
     struct qemu_work_item *wi;
@@ -681,6 +764,9 @@ static void flush_queued_work(CPUState *cpu)
         cpu->queued_work_first = wi->next;
         wi->func(wi->data);
         wi->done = true;
+        if (wi->free) {
+            g_free(wi);
+        }
     }
     cpu->queued_work_last = NULL;
     qemu_cond_broadcast(&qemu_work_cond);
@@ -808,6 +894,147 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 #endif
 }
 
+/* Wait for pending exclusive operations to complete.  The exclusive lock
+   must be held.  */
+static void exclusive_idle(void)
+{
+    while (pending_cpus) {
+        qemu_cond_wait(&exclusive_resume, &exclusive_lock);
+    }
+}
+
+/* Whether a vCPU was asked to stop or to run work.  The one that asked
+   may be inside cpu_exec, waiting for that vCPU, which itself waits in
+   cpu_exec_end() or start_exclusive() for the exclusive section.  */
+static bool exclusive_must_yield(void)
+{
+    CPUArchState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        CPUState *cpu = ENV_GET_CPU(env);
+        if (cpu->stop || cpu->queued_work_first) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Start an exclusive operation.  Must only be called from outside
+   cpu_exec, without the iothread lock.  Gives up and returns false if
+   exclusive_must_yield() while waiting for the other vCPUs.  */
+static bool start_exclusive(void)
+{
+    CPUArchState *other;
+
+    qemu_mutex_lock(&exclusive_lock);
+    exclusive_idle();
+
+    pending_cpus = 1;
+    /* Make all other cpus stop executing.  */
+    for (other = first_cpu; other; other = other->next_cpu) {
+        if (other->running) {
+            pending_cpus++;
+            cpu_exit(other);
+        }
+    }
+    while (pending_cpus > 1) {
+        if (exclusive_must_yield()) {
+            /* vCPUs that already left cpu_exec() are in exclusive_idle()
+               and those still running will not decrement pending_cpus */
+            pending_cpus = 0;
+            qemu_cond_broadcast(&exclusive_resume);
+            qemu_mutex_unlock(&exclusive_lock);
+            return false;
+        }
+        qemu_cond_wait(&exclusive_cond, &exclusive_lock);
+    }
+    return true;
+}
+
+/* Finish an exclusive operation.  */
+static void end_exclusive(void)
+{
+    pending_cpus = 0;
+    qemu_cond_broadcast(&exclusive_resume);
+    qemu_mutex_unlock(&exclusive_lock);
+}
+
+/* Wait for exclusive ops to finish, and begin cpu execution.  */
+static void cpu_exec_start(CPUArchState *env)
+{
+    qemu_mutex_lock(&exclusive_lock);
+    exclusive_idle();
+    env->running = 1;
+    qemu_mutex_unlock(&exclusive_lock);
+}
+
+/* Mark cpu as not executing, and release pending exclusive ops.  */
+static void cpu_exec_end(CPUArchState *env)
+{
+    qemu_mutex_lock(&exclusive_lock);
+    env->running = 0;
+    if (pending_cpus > 1) {
+        pending_cpus--;
+        if (pending_cpus == 1) {
+            qemu_cond_signal(&exclusive_cond);
+        }
+    }
+    exclusive_idle();
+    qemu_mutex_unlock(&exclusive_lock);
+}
+
+static void qemu_mttcg_wait_io_event(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    while (cpu_thread_is_idle(env)) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
+static int tcg_cpu_exec(CPUArchState *env);
+
+/* With mttcg_enabled, each vCPU runs translated code in its own thread
+   and only takes the iothread lock around device accesses.  */
+static void *qemu_mttcg_cpu_thread_fn(void *arg)
+{
+    CPUArchState *env = arg;
+    CPUState *cpu = ENV_GET_CPU(env);
+    int r;
+
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+    cpu->thread_id = qemu_get_thread_id();
+
+    /* signal CPU creation */
+    cpu->created = true;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            qemu_mutex_unlock_iothread();
+            cpu_exec_start(env);
+            r = tcg_cpu_exec(env);
+            cpu_exec_end(env);
+            /* retried after the next cpu_exec() if start_exclusive()
+               gives up */
+            if (tb_flush_pending && start_exclusive()) {
+                tb_flush_exclusive(env);
+                end_exclusive();
+            }
+            qemu_mutex_lock_iothread();
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(env);
+            }
+        }
+        qemu_mttcg_wait_io_event(env);
+    }
+
+    return NULL;
+}
+
 static void tcg_exec_all(void);
 
 static void *qemu_tcg_cpu_thread_fn(void *arg)
@@ -869,7 +1096,22 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
 
 void qemu_cpu_kick(CPUState *cpu)
 {
+    CPUArchState *env;
+
     qemu_cond_broadcast(cpu->halt_cond);
+    if (mttcg_enabled) {
+        /* no signal needed, the vCPU checks for cpu_exit() at every TB */
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            if (ENV_GET_CPU(env) == cpu) {
+                cpu_exit(env);
+            }
+        }
+        /* and let start_exclusive() see cpu->stop or the queued work */
+        qemu_mutex_lock(&exclusive_lock);
+        qemu_cond_broadcast(&exclusive_cond);
+        qemu_mutex_unlock(&exclusive_lock);
+        return;
+    }
     if (!tcg_enabled() && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
@@ -903,7 +1145,8 @@ static bool qemu_in_vcpu_thread(void)
 
 void qemu_mutex_lock_iothread(void)
 {
-    if (!tcg_enabled()) {
+    /* multithreaded TCG vCPUs do not hold the lock while running code */
+    if (!tcg_enabled() || mttcg_enabled) {
         qemu_mutex_lock(&qemu_global_mutex);
     } else {
         iothread_requesting_mutex = true;
@@ -914,13 +1157,42 @@ void qemu_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    tls_var(iothread_locked) = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    tls_var(iothread_locked) = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+/* Called by TCG around accesses to devices and other state protected by
+   the iothread lock.  Returns whether the lock was taken, to be passed to
+   tcg_io_unlock(); without mttcg_enabled the lock is always held.  */
+bool tcg_io_lock(void)
+{
+    if (!mttcg_enabled || tls_var(iothread_locked)) {
+        return false;
+    }
+    qemu_mutex_lock_iothread();
+    return true;
+}
+
+void tcg_io_unlock(bool locked)
+{
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+/* Drop the lock if an exception was raised while it was held */
+void tcg_io_lock_reset(void)
+{
+    if (mttcg_enabled && tls_var(iothread_locked)) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 static int all_vcpus_paused(void)
 {
     CPUArchState *penv = first_cpu;
@@ -950,7 +1222,8 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        /* the other vCPUs only run concurrently with KVM or mttcg */
+        if (!kvm_enabled() && !mttcg_enabled) {
             while (penv) {
                 CPUState *pcpu = ENV_GET_CPU(penv);
                 pcpu->stop = 0;
@@ -985,6 +1258,20 @@ void resume_all_vcpus(void)
     }
 }
 
+static void qemu_mttcg_start_vcpu(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    cpu->thread = g_malloc0(sizeof(QemuThread));
+    cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+    qemu_cond_init(cpu->halt_cond);
+    qemu_thread_create(cpu->thread, qemu_mttcg_cpu_thread_fn, env,
+                       QEMU_THREAD_JOINABLE);
+    while (!cpu->created) {
+        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+    }
+}
+
 static void qemu_tcg_init_vcpu(CPUState *cpu)
 {
     /* share a single thread for all cpus with TCG */
@@ -1046,6 +1333,8 @@ void qemu_init_vcpu(void *_env)
     cpu->stopped = true;
     if (kvm_enabled()) {
         qemu_kvm_start_vcpu(env);
+    } else if (tcg_enabled() && mttcg_enabled) {
+        qemu_mttcg_start_vcpu(env);
     } else if (tcg_enabled()) {
         qemu_tcg_init_vcpu(cpu);
     } else {
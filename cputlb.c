@@ -32,6 +32,8 @@
 
 /* statistics */
 int tlb_flush_count;
+int tlb_victim_hit_count;
+int tlb_fill_count;
 
 static const CPUTLBEntry s_cputlb_empty_entry = {
     .addr_read  = -1,
@@ -70,6 +72,14 @@ void tlb_flush(CPUArchState *env, int flush_global)
             env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
     }
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        int mmu_idx;
+
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
+    }
+    env->vtlb_index = 0;
 
     memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
@@ -118,6 +128,15 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
     }
 
+    /* check whether there are entries that need to be flushed in the vtlb */
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+        }
+    }
+
     tb_flush_jmp_cache(env, addr);
 }
 
@@ -151,6 +170,14 @@ void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
     if (tlb_is_dirty_ram(tlb_entry)) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
+#ifdef CONFIG_MTTCG
+            if (mttcg_enabled) {
+                /* the entry may belong to a vCPU running in another
+                   thread, which could be refilling it concurrently */
+                __sync_fetch_and_or(&tlb_entry->addr_write, TLB_NOTDIRTY);
+                return;
+            }
+#endif
             tlb_entry->addr_write |= TLB_NOTDIRTY;
         }
     }
@@ -185,6 +212,10 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
     }
 }
@@ -208,6 +239,45 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
     }
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
+    }
+}
+
+/* Called on a miss in the main TLB, before falling back to tlb_fill().
+   If the page of 'addr' is in the victim TLB, swap the entry with the
+   one at 'index' in the main TLB and return true.  'elt_ofs' is the
+   offset in CPUTLBEntry of the address field to compare, which depends
+   on the access type.  */
+bool tlb_victim_hit(CPUArchState *env, int mmu_idx, int index,
+                    size_t elt_ofs, target_ulong addr)
+{
+    target_ulong page = addr & TARGET_PAGE_MASK;
+    int vidx;
+
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        CPUTLBEntry *vtlb = &env->tlb_v_table[mmu_idx][vidx];
+        target_ulong cmp = *(target_ulong *)((uintptr_t)vtlb + elt_ofs);
+
+        if ((cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) == page) {
+            CPUTLBEntry *tlb = &env->tlb_table[mmu_idx][index];
+            CPUTLBEntry tmptlb = *tlb;
+            hwaddr tmpiotlb = env->iotlb[mmu_idx][index];
+
+            *tlb = *vtlb;
+            *vtlb = tmptlb;
+            env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][vidx];
+            env->iotlb_v[mmu_idx][vidx] = tmpiotlb;
+            tlb_victim_hit_count++;
+            return true;
+        }
+    }
+    return false;
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
@@ -278,8 +348,18 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                                             &address);
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    /* do not discard the translation in te, evict it into the victim tlb */
+    if (te->addr_read != -1 || te->addr_write != -1 || te->addr_code != -1) {
+        unsigned int vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    }
+    tlb_fill_count++;
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -341,6 +421,57 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     return qemu_ram_addr_from_host_nofail(p);
 }
 
+/* Return a host pointer for an atomic read-modify-write of 'size'
+ * bytes of guest RAM at 'addr', which must not cross a page.  The
+ * page is treated as written: translated code on it is invalidated and
+ * it is marked dirty, as a store through the notdirty slow path would.
+ * Returns NULL for MMIO, ROM and watched pages, which the caller must
+ * handle with ordinary loads and stores.
+ * NOTE: this function can trigger an exception
+ */
+void *tlb_vaddr_to_host_rmw(CPUArchState *env, target_ulong addr,
+                            int size, int mmu_idx, uintptr_t retaddr)
+{
+    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    CPUTLBEntry *te = &env->tlb_table[mmu_idx][index];
+    target_ulong tlb_addr = te->addr_write;
+    void *host;
+
+    if ((addr & TARGET_PAGE_MASK) !=
+        (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        if (!tlb_victim_hit(env, mmu_idx, index,
+                            offsetof(CPUTLBEntry, addr_write), addr)) {
+            tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        }
+        tlb_addr = te->addr_write;
+    }
+    if (tlb_addr & TLB_MMIO) {
+        return NULL;
+    }
+
+    host = (void *)((uintptr_t)addr + te->addend);
+    if (tlb_addr & TLB_NOTDIRTY) {
+        ram_addr_t ram_addr = qemu_ram_addr_from_host_nofail(host);
+        bool locked = tcg_io_lock();
+        int dirty_flags;
+
+        dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
+        if (!(dirty_flags & CODE_DIRTY_FLAG)) {
+            env->mem_io_pc = retaddr;
+            env->mem_io_vaddr = addr;
+            tb_invalidate_phys_page_range(ram_addr, ram_addr + size, 1);
+            dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
+        }
+        dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
+        cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
+        if (dirty_flags == 0xff) {
+            tlb_set_dirty(env, addr);
+        }
+        tcg_io_unlock(locked);
+    }
+    return host;
+}
+
 #define MMUSUFFIX _cmmu
 #undef GETPC
 #define GETPC() ((uintptr_t)0)
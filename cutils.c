@@ -142,13 +142,7 @@ int qemu_fdatasync(int fd)
 #endif
 }
 
-/*
- * Checks if a buffer is all zeroes
- *
- * Attention! The len must be a multiple of 4 * sizeof(long) due to
- * restriction of optimizations in this function.
- */
-bool buffer_is_zero(const void *buf, size_t len)
+static bool buffer_is_zero_long(const void *buf, size_t len)
 {
     /*
      * Use long as the biggest available internal data type that fits into the
@@ -160,7 +154,6 @@ bool buffer_is_zero(const void *buf, size_t len)
     long d0, d1, d2, d3;
     const long * const data = buf;
 
-    assert(len % (4 * sizeof(long)) == 0);
     len /= sizeof(long);
 
     for (i = 0; i < len; i += 4) {
@@ -177,6 +170,90 @@ bool buffer_is_zero(const void *buf, size_t len)
     return true;
 }
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* len must be a multiple of 64 */
+static bool buffer_is_zero_sse2(const void *buf, size_t len)
+{
+    const __m128i *p = buf;
+    const __m128i *end = buf + len;
+    __m128i zero = _mm_setzero_si128();
+
+    for (; p < end; p += 4) {
+        __m128i t = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p + 0),
+                                              _mm_loadu_si128(p + 1)),
+                                 _mm_or_si128(_mm_loadu_si128(p + 2),
+                                              _mm_loadu_si128(p + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xFFFF) {
+            return false;
+        }
+    }
+
+    return true;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#include <immintrin.h>
+
+/* len must be a multiple of 128 */
+static bool __attribute__((target("avx2")))
+buffer_is_zero_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = buf;
+    const __m256i *end = buf + len;
+
+    for (; p < end; p += 4) {
+        __m256i t = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(p + 0),
+                                                    _mm256_loadu_si256(p + 1)),
+                                    _mm256_or_si256(_mm256_loadu_si256(p + 2),
+                                                    _mm256_loadu_si256(p + 3)));
+        if (!_mm256_testz_si256(t, t)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+#endif
+
+/* The fastest routine the host supports, and the granularity it needs */
+#if defined(__SSE2__)
+static bool (*buffer_is_zero_accel)(const void *, size_t) = buffer_is_zero_sse2;
+static size_t buffer_is_zero_accel_len = 64;
+#else
+static bool (*buffer_is_zero_accel)(const void *, size_t) = buffer_is_zero_long;
+static size_t buffer_is_zero_accel_len = 4 * sizeof(long);
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+static void __attribute__((constructor)) init_buffer_is_zero(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        buffer_is_zero_accel = buffer_is_zero_avx2;
+        buffer_is_zero_accel_len = 128;
+    }
+}
+#endif
+
+/*
+ * Checks if a buffer is all zeroes
+ *
+ * Attention! The len must be a multiple of 4 * sizeof(long) due to
+ * restriction of optimizations in this function.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    assert(len % (4 * sizeof(long)) == 0);
+
+    if (len % buffer_is_zero_accel_len == 0) {
+        return buffer_is_zero_accel(buf, len);
+    }
+    return buffer_is_zero_long(buf, len);
+}
+
 #ifndef _WIN32
 /* Sets a specific flag */
 int fcntl_setfl(int fd, int flag)
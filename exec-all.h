@@ -143,9 +143,10 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_SUPERBLOCK  0x10000 /* follow direct jumps, see tb_hot_threshold */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
@@ -170,6 +171,9 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* decremented by the generated code on each entry; the TB is
+       retranslated as a superblock when it goes negative */
+    int32_t hot_count;
 };
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
@@ -283,9 +287,21 @@ TranslationBlock *tb_find_pc(uintptr_t pc_ptr);
 
 #include "qemu-lock.h"
 
-extern spinlock_t tb_lock;
+#if defined(CONFIG_USER_ONLY)
+extern spinlock_t tb_spinlock;
+#endif
+void tb_lock(void);
+void tb_unlock(void);
+bool tb_lock_held(void);
+void tb_lock_reset(void);
 
 extern int tb_invalidated_flag;
+/* Values of tb_flush_pending */
+#define TB_FLUSH_REGION 1   /* evict the oldest code region */
+#define TB_FLUSH_ALL    2
+extern int tb_flush_pending;
+void tb_flush_exclusive(CPUArchState *env);
+void tb_gen_superblock(CPUArchState *env, TranslationBlock *tb);
 
 /* The return address may point to the start of the next instruction.
    Subtracting one gets us the call instruction itself.  */
@@ -386,9 +402,32 @@ static inline tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong
 {
     return addr;
 }
+
+static inline bool tcg_io_lock(void)
+{
+    return false;
+}
+
+static inline void tcg_io_unlock(bool locked)
+{
+}
+
+static inline void tcg_io_lock_reset(void)
+{
+}
 #else
 /* cputlb.c */
 tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr);
+void *tlb_vaddr_to_host_rmw(CPUArchState *env, target_ulong addr,
+                            int size, int mmu_idx, uintptr_t retaddr);
+bool tlb_victim_hit(CPUArchState *env, int mmu_idx, int index,
+                    size_t elt_ofs, target_ulong addr);
+
+/* cpus.c */
+bool tcg_io_lock(void);
+void tcg_io_unlock(bool locked);
+void tcg_io_lock_reset(void);
+void cpu_synchronize_tcg_vcpus(void);
 #endif
 
 typedef void (CPUDebugExcpHandler)(CPUArchState *env);
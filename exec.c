@@ -33,9 +33,12 @@
 #include "kvm.h"
 #include "hw/xen.h"
 #include "qemu-timer.h"
+#include "qemu-thread.h"
+#include "qemu-barrier.h"
 #include "memory.h"
 #include "dma.h"
 #include "exec-memory.h"
+#include "bitops.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -83,8 +86,17 @@ static TranslationBlock *tbs;
 static int code_gen_max_blocks;
 TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
 static int nb_tbs;
-/* any access to the tbs or the page table must use this lock */
-spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
+/* any access to the tbs or the page table must use tb_lock() */
+#if defined(CONFIG_USER_ONLY)
+spinlock_t tb_spinlock = SPIN_LOCK_UNLOCKED;
+#else
+/* Only taken when vCPUs run in parallel, see mttcg_enabled */
+static QemuMutex tb_mutex;
+#endif
+static DEFINE_TLS(bool, have_tb_lock);
+/* A flush requested by a vCPU thread while others may be running
+   translated code, see tb_flush() */
+int tb_flush_pending;
 
 uint8_t *code_gen_prologue;
 static uint8_t *code_gen_buffer;
@@ -93,6 +105,30 @@ static size_t code_gen_buffer_size;
 static size_t code_gen_buffer_max_size;
 static uint8_t *code_gen_ptr;
 
+/* The translation buffer is split into regions that are filled in turn.
+   When the last one is full, the oldest region is evicted and filled
+   again, so that running out of room costs retranslating one region's
+   worth of code instead of everything.  */
+#define CODE_GEN_MAX_REGIONS 8
+
+typedef struct CodeGenRegion {
+    uint8_t *start;
+    uint8_t *threshold;     /* no TB is started past this point */
+    uint8_t *end_ptr;       /* code_gen_ptr when the region was left */
+    int first_tb;           /* the region owns tbs[first_tb...] */
+    int nb_tbs;
+} CodeGenRegion;
+
+static CodeGenRegion code_gen_regions[CODE_GEN_MAX_REGIONS];
+static int code_gen_nb_regions;
+static int code_gen_cur_region;
+static size_t code_gen_region_size;
+static int code_gen_region_max_blocks;
+
+/* Remembers which code was evicted, to count retranslations */
+#define TB_EVICTED_BITS (1 << 16)
+static unsigned long tb_evicted_map[BITS_TO_LONGS(TB_EVICTED_BITS)];
+
 #if !defined(CONFIG_USER_ONLY)
 int phys_ram_fd;
 static int in_migration;
@@ -119,6 +155,9 @@ DEFINE_TLS(CPUArchState *,cpu_single_env);
    1 = Precise instruction counting.
    2 = Adaptive rate instruction counting.  */
 int use_icount = 0;
+/* One host thread per vCPU instead of a single round-robin TCG thread */
+bool mttcg_enabled;
+int tb_hot_threshold;
 
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
@@ -200,6 +239,10 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
 /* statistics */
 static int tb_flush_count;
 static int tb_phys_invalidate_count;
+static int tb_evict_count;
+static int tb_evicted_count;
+static int tb_retranslate_count;
+static int tb_superblock_count;
 
 #ifdef _WIN32
 static inline void map_exec(void *addr, long size)
@@ -621,13 +664,44 @@ static inline void code_gen_alloc(size_t tb_size)
     tbs = g_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
 }
 
+static void code_gen_init_regions(void)
+{
+    size_t slack = TCG_MAX_OP_SIZE * OPC_BUF_SIZE;
+    int i, n;
+
+    /* Each region must have room for a good number of maximum-size TBs;
+       with a single region, running out of room is a full flush.  */
+    n = code_gen_buffer_size / (slack * 4);
+    n = MAX(1, MIN(n, CODE_GEN_MAX_REGIONS));
+
+    code_gen_region_size = (code_gen_buffer_size / n) & ~(CODE_GEN_ALIGN - 1);
+    code_gen_region_max_blocks = code_gen_max_blocks / n;
+    for (i = 0; i < n; i++) {
+        CodeGenRegion *r = &code_gen_regions[i];
+
+        r->start = code_gen_buffer + i * code_gen_region_size;
+        /* A TB started before the threshold cannot spill into the next
+           region, as 'slack' is the largest possible TB.  */
+        r->threshold = r->start + code_gen_region_size - slack;
+        r->end_ptr = r->start;
+        r->first_tb = i * code_gen_region_max_blocks;
+        r->nb_tbs = 0;
+    }
+    code_gen_nb_regions = n;
+    code_gen_cur_region = 0;
+}
+
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
    (in bytes) allocated to the translation buffer. Zero means default
    size. */
 void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
+#if !defined(CONFIG_USER_ONLY)
+    qemu_mutex_init(&tb_mutex);
+#endif
     code_gen_alloc(tb_size);
+    code_gen_init_regions();
     code_gen_ptr = code_gen_buffer;
     tcg_register_jit(code_gen_buffer, code_gen_buffer_size);
     page_init();
@@ -728,16 +802,55 @@ void cpu_exec_init(CPUArchState *env)
 #endif
 }
 
+void tb_lock(void)
+{
+#if defined(CONFIG_USER_ONLY)
+    spin_lock(&tb_spinlock);
+#else
+    if (mttcg_enabled) {
+        qemu_mutex_lock(&tb_mutex);
+    }
+#endif
+    tls_var(have_tb_lock) = true;
+}
+
+void tb_unlock(void)
+{
+    tls_var(have_tb_lock) = false;
+#if defined(CONFIG_USER_ONLY)
+    spin_unlock(&tb_spinlock);
+#else
+    if (mttcg_enabled) {
+        qemu_mutex_unlock(&tb_mutex);
+    }
+#endif
+}
+
+bool tb_lock_held(void)
+{
+    return tls_var(have_tb_lock);
+}
+
+/* Drop tb_lock if a longjmp out of code generation left it held */
+void tb_lock_reset(void)
+{
+    if (tls_var(have_tb_lock)) {
+        tb_unlock();
+    }
+}
+
 /* Allocate a new translation block. Flush the translation buffer if
    too many translation blocks or too much generated code. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    CodeGenRegion *r = &code_gen_regions[code_gen_cur_region];
     TranslationBlock *tb;
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size)
+    if (r->nb_tbs >= code_gen_region_max_blocks ||
+        code_gen_ptr >= r->threshold)
         return NULL;
-    tb = &tbs[nb_tbs++];
+    tb = &tbs[r->first_tb + r->nb_tbs++];
+    nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
     return tb;
@@ -745,15 +858,30 @@ static TranslationBlock *tb_alloc(target_ulong pc)
 
 void tb_free(TranslationBlock *tb)
 {
+    CodeGenRegion *r = &code_gen_regions[code_gen_cur_region];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
+    if (r->nb_tbs > 0 && tb == &tbs[r->first_tb + r->nb_tbs - 1]) {
         code_gen_ptr = tb->tc_ptr;
+        r->nb_tbs--;
         nb_tbs--;
     }
 }
 
+static inline unsigned int tb_evicted_hash(TranslationBlock *tb)
+{
+    return (tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK) + tb->flags) %
+        TB_EVICTED_BITS;
+}
+
+/* A TB that is still linked, as opposed to one already invalidated */
+static inline bool tb_is_valid(TranslationBlock *tb)
+{
+    return tb->page_addr[0] != -1;
+}
+
 static inline void invalidate_page_bitmap(PageDesc *p)
 {
     if (p->code_bitmap) {
@@ -795,10 +923,10 @@ static void page_flush_tb(void)
 }
 
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUArchState *env1)
+static void tb_do_flush(CPUArchState *env1)
 {
     CPUArchState *env;
+    int i, j;
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
            (unsigned long)(code_gen_ptr - code_gen_buffer),
@@ -808,6 +936,19 @@ void tb_flush(CPUArchState *env1)
     if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
 
+    for (i = 0; i < code_gen_nb_regions; i++) {
+        CodeGenRegion *r = &code_gen_regions[i];
+
+        for (j = 0; j < r->nb_tbs; j++) {
+            TranslationBlock *tb = &tbs[r->first_tb + j];
+            if (tb_is_valid(tb)) {
+                set_bit(tb_evicted_hash(tb), tb_evicted_map);
+            }
+        }
+        r->nb_tbs = 0;
+        r->end_ptr = r->start;
+    }
+    code_gen_cur_region = 0;
     nb_tbs = 0;
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
@@ -823,6 +964,74 @@ void tb_flush(CPUArchState *env1)
     tb_flush_count++;
 }
 
+/* Make room in the translation buffer by evicting its oldest region,
+   the one after the current region.  The same rules as for tb_flush()
+   apply: no vCPU may go back to code from that region.  */
+static void tb_evict_region(CPUArchState *env1)
+{
+    CodeGenRegion *r;
+    int i;
+
+    if (code_gen_nb_regions == 1) {
+        tb_do_flush(env1);
+        return;
+    }
+
+    code_gen_regions[code_gen_cur_region].end_ptr = code_gen_ptr;
+    code_gen_cur_region = (code_gen_cur_region + 1) % code_gen_nb_regions;
+    r = &code_gen_regions[code_gen_cur_region];
+
+    /* tb_phys_invalidate() unchains the jumps from the TBs that survive
+       into the evicted ones, and drops them from the jump caches.  */
+    for (i = 0; i < r->nb_tbs; i++) {
+        TranslationBlock *tb = &tbs[r->first_tb + i];
+
+        if (tb_is_valid(tb)) {
+            set_bit(tb_evicted_hash(tb), tb_evicted_map);
+            tb_phys_invalidate(tb, -1);
+            tb_evicted_count++;
+        }
+    }
+    nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    r->end_ptr = r->start;
+    code_gen_ptr = r->start;
+    tb_evict_count++;
+}
+
+/* Outside of cpu_exec() this must only be called while the vCPUs are
+   stopped.  From a vCPU thread with mttcg_enabled, other vCPUs may be
+   executing translated code, so the flush is only recorded here and
+   every vCPU is made to leave cpu_exec(); the vCPU threads then carry
+   it out with tb_flush_exclusive().  */
+void tb_flush(CPUArchState *env1)
+{
+    CPUArchState *env;
+
+    if (mttcg_enabled && cpu_single_env) {
+        tb_flush_pending = TB_FLUSH_ALL;
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            cpu_exit(env);
+        }
+        return;
+    }
+    tb_do_flush(env1);
+}
+
+/* Perform a flush requested by tb_flush() or tb_gen_code().  The caller
+   must make sure that no vCPU is inside cpu_exec().  */
+void tb_flush_exclusive(CPUArchState *env)
+{
+    tb_lock();
+    if (tb_flush_pending == TB_FLUSH_ALL) {
+        tb_do_flush(env);
+    } else if (tb_flush_pending == TB_FLUSH_REGION) {
+        tb_evict_region(env);
+    }
+    tb_flush_pending = 0;
+    tb_unlock();
+}
+
 #ifdef DEBUG_TB_CHECK
 
 static void tb_invalidate_check(target_ulong address)
@@ -982,6 +1191,9 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     }
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
 
+    /* mark it as gone, see tb_is_valid() */
+    tb->page_addr[0] = -1;
+
     tb_phys_invalidate_count++;
 }
 
@@ -1053,8 +1265,23 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+        if (mttcg_enabled) {
+            CPUArchState *env1;
+
+            /* Other vCPUs may still be running code from the region:
+               request the eviction and leave cpu_exec() until it is
+               done */
+            if (tb_flush_pending < TB_FLUSH_REGION) {
+                tb_flush_pending = TB_FLUSH_REGION;
+            }
+            for (env1 = first_cpu; env1 != NULL; env1 = env1->next_cpu) {
+                cpu_exit(env1);
+            }
+            env->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(env);
+        }
+        /* room must be made */
+        tb_evict_region(env);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
@@ -1065,6 +1292,7 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    tb->hot_count = tb_hot_threshold;
     cpu_gen_code(env, tb, &code_gen_size);
     code_gen_ptr = (void *)(((uintptr_t)code_gen_ptr + code_gen_size +
                              CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
@@ -1076,9 +1304,34 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
     tb_link_page(tb, phys_pc, phys_page2);
+
+    if (test_and_clear_bit(tb_evicted_hash(tb), tb_evicted_map)) {
+        tb_retranslate_count++;
+    }
     return tb;
 }
 
+/* Replace a TB whose execution counter ran out with a superblock.  The
+   old TB is unlinked from the hash tables and from the TBs jumping to
+   it, and its code is reclaimed along with its region.  */
+void tb_gen_superblock(CPUArchState *env, TranslationBlock *tb)
+{
+    target_ulong pc, cs_base;
+    uint64_t flags;
+
+    tb_lock();
+    /* another vCPU may have got here first */
+    if (tb_is_valid(tb)) {
+        pc = tb->pc;
+        cs_base = tb->cs_base;
+        flags = tb->flags;
+        tb_phys_invalidate(tb, -1);
+        tb_gen_code(env, pc, cs_base, flags, CF_SUPERBLOCK);
+        tb_superblock_count++;
+    }
+    tb_unlock();
+}
+
 /*
  * Invalidate all TBs which intersect with the target physical address range
  * [start;end[. NOTE: start and end may refer to *different* physical pages.
@@ -1123,6 +1376,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p)
         return;
+    tb_lock();
     if (!p->code_bitmap &&
         ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD &&
         is_cpu_write_access) {
@@ -1206,6 +1460,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
         cpu_resume_from_signal(env, NULL);
     }
 #endif
+    tb_unlock();
 }
 
 /* len must be <= 8 and start must be a multiple of len */
@@ -1410,19 +1665,29 @@ bool is_tcg_gen_code(uintptr_t tc_ptr)
    tb[1].tc_ptr. Return NULL if not found */
 TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
-    int m_min, m_max, m;
+    int m_min, m_max, m, i;
     uintptr_t v;
     TranslationBlock *tb;
+    CodeGenRegion *r;
 
     if (nb_tbs <= 0)
         return NULL;
     if (tc_ptr < (uintptr_t)code_gen_buffer ||
-        tc_ptr >= (uintptr_t)code_gen_ptr) {
+        tc_ptr >= (uintptr_t)code_gen_buffer + code_gen_buffer_size) {
+        return NULL;
+    }
+    /* TBs are sorted by tc_ptr within each region */
+    i = MIN((tc_ptr - (uintptr_t)code_gen_buffer) / code_gen_region_size,
+            code_gen_nb_regions - 1);
+    r = &code_gen_regions[i];
+    if (r->nb_tbs <= 0 ||
+        tc_ptr >= (uintptr_t)(i == code_gen_cur_region ? code_gen_ptr
+                                                       : r->end_ptr)) {
         return NULL;
     }
     /* binary search (cf Knuth) */
-    m_min = 0;
-    m_max = nb_tbs - 1;
+    m_min = r->first_tb;
+    m_max = r->first_tb + r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
         tb = &tbs[m];
@@ -1435,6 +1700,9 @@ TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
+    if (m_max < r->first_tb) {
+        return NULL;
+    }
     return &tbs[m_max];
 }
 
@@ -1715,6 +1983,16 @@ static void tcg_handle_interrupt(CPUArchState *env, int mask)
     CPUState *cpu = ENV_GET_CPU(env);
     int old_mask;
 
+#ifdef CONFIG_MTTCG
+    if (mttcg_enabled) {
+        /* Devices raise interrupts from any thread; cpu_exit() makes the
+           vCPU notice at the start of its next TB */
+        __sync_fetch_and_or(&env->interrupt_request, mask);
+        qemu_cpu_kick(cpu);
+        return;
+    }
+#endif
+
     old_mask = env->interrupt_request;
     env->interrupt_request |= mask;
 
@@ -1751,12 +2029,26 @@ void cpu_interrupt(CPUArchState *env, int mask)
 
 void cpu_reset_interrupt(CPUArchState *env, int mask)
 {
+#ifdef CONFIG_MTTCG
+    if (mttcg_enabled) {
+        __sync_fetch_and_and(&env->interrupt_request, ~mask);
+        return;
+    }
+#endif
     env->interrupt_request &= ~mask;
 }
 
 void cpu_exit(CPUArchState *env)
 {
     env->exit_request = 1;
+    if (mttcg_enabled) {
+        /* Unchaining TBs is not safe while other threads patch jumps,
+           so have the vCPU check icount_decr at the start of every TB
+           instead (see gen_icount_start) */
+        smp_wmb();
+        env->icount_decr.u16.high = 0xffff;
+        return;
+    }
     cpu_unlink_tb(env);
 }
 
@@ -1876,6 +2168,13 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
 
     if (tcg_enabled()) {
         tlb_reset_dirty_range_all(start, end, length);
+        if (mttcg_enabled && !cpu_single_env &&
+            (dirty_flags & MIGRATION_DIRTY_FLAG)) {
+            /* A vCPU may still be completing a store through a TLB entry
+               it loaded before the reset; wait until every vCPU has left
+               cpu_exec() so that such stores are not lost to migration */
+            cpu_synchronize_tcg_vcpus();
+        }
     }
 }
 
@@ -2977,8 +3276,10 @@ static void check_watchpoint(int offset, int len_mask, int flags)
                               "pc=%p", (void *)env->mem_io_pc);
                 }
                 cpu_restore_state(tb, env, env->mem_io_pc);
+                tb_lock();
                 tb_phys_invalidate(tb, -1);
                 if (wp->flags & BP_STOP_BEFORE_ACCESS) {
+                    tb_unlock();
                     env->exception_index = EXCP_DEBUG;
                     cpu_loop_exit(env);
                 } else {
@@ -3199,6 +3500,11 @@ static void core_begin(MemoryListener *listener)
     phys_section_watch = dummy_section(&io_mem_watch);
 }
 
+static void tcg_commit_flush(void *opaque)
+{
+    tlb_flush(opaque, 1);
+}
+
 static void tcg_commit(MemoryListener *listener)
 {
     CPUArchState *env;
@@ -3207,7 +3513,12 @@ static void tcg_commit(MemoryListener *listener)
        reset the modified entries */
     /* XXX: slow ! */
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
-        tlb_flush(env, 1);
+        if (mttcg_enabled && env != cpu_single_env) {
+            /* the TLB belongs to another running vCPU thread */
+            async_run_on_cpu(ENV_GET_CPU(env), tcg_commit_flush, env);
+        } else {
+            tlb_flush(env, 1);
+        }
     }
 }
 
@@ -4151,8 +4462,9 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    size_t code_size;
     TranslationBlock *tb;
 
     target_code_size = 0;
@@ -4160,32 +4472,43 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for(i = 0; i < nb_tbs; i++) {
-        tb = &tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size)
-            max_target_code_size = tb->size;
-        if (tb->page_addr[1] != -1)
-            cross_page++;
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    code_size = 0;
+    for (j = 0; j < code_gen_nb_regions; j++) {
+        CodeGenRegion *r = &code_gen_regions[j];
+
+        code_size += (j == code_gen_cur_region ? code_gen_ptr : r->end_ptr) -
+                     r->start;
+        for (i = r->first_tb; i < r->first_tb + r->nb_tbs; i++) {
+            tb = &tbs[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n",
+                code_size, code_gen_buffer_max_size);
     cpu_fprintf(f, "TB count            %d/%d\n", 
                 nb_tbs, code_gen_max_blocks);
+    cpu_fprintf(f, "code regions        %d (current %d)\n",
+                code_gen_nb_regions, code_gen_cur_region);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer) / target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+                nb_tbs ? code_size / nb_tbs : 0,
+                target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
             nb_tbs ? (cross_page * 100) / nb_tbs : 0);
@@ -4196,8 +4519,14 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    cpu_fprintf(f, "TB region evictions %d (%d TBs)\n",
+                tb_evict_count, tb_evicted_count);
+    cpu_fprintf(f, "TB retranslations   %d\n", tb_retranslate_count);
+    cpu_fprintf(f, "TB superblocks      %d\n", tb_superblock_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TLB victim hits     %d\n", tlb_victim_hit_count);
+    cpu_fprintf(f, "TLB full fills      %d\n", tlb_fill_count);
     tcg_dump_info(f, cpu_fprintf);
 }
 
@@ -4,13 +4,51 @@
 
 static TCGArg *icount_arg;
 static int icount_label;
+static int hot_label;
 
-static inline void gen_icount_start(void)
+/* Count executions of TBs that may become superblocks.  The check runs
+   before the first guest instruction, so the TB can be left and
+   retranslated without any guest state to recover but the PC.  */
+static inline void gen_hot_count(TranslationBlock *tb)
 {
+#ifdef TARGET_SUPPORTS_SUPERBLOCKS
+    TCGv_ptr ptr;
     TCGv_i32 count;
 
-    if (!use_icount)
+    if (tb_hot_threshold == 0 || tb->cflags != 0) {
         return;
+    }
+    hot_label = gen_new_label();
+    ptr = tcg_const_ptr((tcg_target_long)&tb->hot_count);
+    count = tcg_temp_new_i32();
+    tcg_gen_ld_i32(count, ptr, 0);
+    tcg_gen_subi_i32(count, count, 1);
+    tcg_gen_st_i32(count, ptr, 0);
+    tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, hot_label);
+    tcg_temp_free_i32(count);
+    tcg_temp_free_ptr(ptr);
+#endif
+}
+
+static inline void gen_icount_start(TranslationBlock *tb)
+{
+    TCGv_i32 count;
+
+    hot_label = -1;
+    if (!use_icount) {
+        gen_hot_count(tb);
+        if (mttcg_enabled) {
+            /* cpu_exit() from another thread cannot safely unchain the
+               running TB, so it makes icount_decr negative instead */
+            icount_label = gen_new_label();
+            count = tcg_temp_new_i32();
+            tcg_gen_ld_i32(count, cpu_env,
+                           offsetof(CPUArchState, icount_decr.u32));
+            tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, icount_label);
+            tcg_temp_free_i32(count);
+        }
+        return;
+    }
 
     icount_label = gen_new_label();
     count = tcg_temp_local_new_i32();
@@ -26,10 +64,17 @@ static inline void gen_icount_start(void)
 
 static void gen_icount_end(TranslationBlock *tb, int num_insns)
 {
+    if (hot_label >= 0) {
+        gen_set_label(hot_label);
+        tcg_gen_exit_tb((tcg_target_long)tb + 3);
+    }
     if (use_icount) {
         *icount_arg = num_insns;
         gen_set_label(icount_label);
         tcg_gen_exit_tb((tcg_target_long)tb + 2);
+    } else if (mttcg_enabled) {
+        gen_set_label(icount_label);
+        tcg_gen_exit_tb((tcg_target_long)tb + 2);
     }
 }
 
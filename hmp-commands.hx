@@ -873,6 +873,22 @@ STEXI
 @findex migrate_cancel
 Cancel the current VM migration.
 
+ETEXI
+
+    {
+        .name       = "migrate_start_postcopy",
+        .args_type  = "",
+        .params     = "",
+        .help       = "switch the current migration to post-copy",
+        .mhandler.cmd = hmp_migrate_start_postcopy,
+    },
+
+STEXI
+@item migrate_start_postcopy
+@findex migrate_start_postcopy
+Switch the current migration to post-copy.  The destination starts running
+the guest and fetches the rest of its memory on demand.  Needs the
+postcopy-ram capability.
 ETEXI
 
     {
@@ -892,6 +908,22 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "migrate_set_compress_params",
+        .args_type  = "level:l?,threads:l?",
+        .params     = "[level] [threads]",
+        .help       = "set zlib level (0-9) and number of threads (1-255) "
+                      "used when the compress capability is on",
+        .mhandler.cmd = hmp_migrate_set_compress_params,
+    },
+
+STEXI
+@item migrate_set_compress_params [@var{level}] [@var{threads}]
+@findex migrate_set_compress_params
+Set the zlib compression @var{level} and the number of compression
+@var{threads} used by migrations with the compress capability.
 ETEXI
 
     {
@@ -204,6 +204,29 @@ void hmp_info_migrate(Monitor *mon)
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_compress) {
+        CompressThreadStatsList *thread;
+
+        monitor_printf(mon, "compress level: %" PRId64 "\n",
+                       info->compress->level);
+        monitor_printf(mon, "compress transferred: %" PRIu64 " kbytes\n",
+                       info->compress->bytes >> 10);
+        monitor_printf(mon, "compress pages: %" PRIu64 " pages\n",
+                       info->compress->pages);
+        for (thread = info->compress->threads; thread;
+             thread = thread->next) {
+            monitor_printf(mon, "compress thread %" PRId64 ": "
+                           "pages %" PRIu64 " in %" PRIu64 " kbytes "
+                           "out %" PRIu64 " kbytes busy %" PRIu64 " ms "
+                           "(%" PRIu64 " kbytes/s)\n",
+                           thread->value->id, thread->value->pages,
+                           thread->value->bytes_in >> 10,
+                           thread->value->bytes_out >> 10,
+                           thread->value->busy_time,
+                           thread->value->throughput >> 10);
+        }
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -354,6 +377,29 @@ void hmp_info_blockstats(Monitor *mon)
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
                        stats->value->stats->flush_total_time_ns);
+        if (stats->value->has_metadata_cache) {
+            BlockMetadataCacheStats *cache = stats->value->metadata_cache;
+            int64_t wr_bytes = stats->value->stats->wr_bytes;
+
+            monitor_printf(mon, "    l2_cache_size=%" PRId64
+                           " l2_cache_hits=%" PRId64
+                           " l2_cache_misses=%" PRId64
+                           " refcount_cache_size=%" PRId64
+                           " refcount_cache_hits=%" PRId64
+                           " refcount_cache_misses=%" PRId64
+                           " metadata_writes=%" PRId64
+                           " metadata_writes_per_gb=%.1f"
+                           "\n",
+                           cache->l2_cache_size,
+                           cache->l2_cache_hits,
+                           cache->l2_cache_misses,
+                           cache->refcount_cache_size,
+                           cache->refcount_cache_hits,
+                           cache->refcount_cache_misses,
+                           cache->metadata_writes,
+                           wr_bytes ? (double)cache->metadata_writes *
+                                      (1 << 30) / wr_bytes : 0.0);
+        }
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -825,7 +871,18 @@ void hmp_snapshot_blkdev(Monitor *mon, const QDict *qdict)
 
 void hmp_migrate_cancel(Monitor *mon, const QDict *qdict)
 {
-    qmp_migrate_cancel(NULL);
+    Error *err = NULL;
+
+    qmp_migrate_cancel(&err);
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_migrate_start_postcopy(&err);
+    hmp_handle_error(mon, &err);
 }
 
 void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
@@ -847,6 +904,23 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_compress_params(Monitor *mon, const QDict *qdict)
+{
+    bool has_level = qdict_haskey(qdict, "level");
+    bool has_threads = qdict_haskey(qdict, "threads");
+    int64_t level = qdict_get_try_int(qdict, "level", 0);
+    int64_t threads = qdict_get_try_int(qdict, "threads", 0);
+    Error *err = NULL;
+
+    qmp_migrate_set_compress_params(has_level, level, has_threads, threads,
+                                    &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+}
+
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
@@ -16,15 +16,29 @@
 #include "fsdev/qemu-fsdev.h"
 #include "qemu-thread.h"
 #include "qemu-coroutine.h"
+#include "qemu-barrier.h"
 #include "virtio-9p-coth.h"
 
 /* v9fs glib thread pool */
 static V9fsThPool v9fs_pool;
 
-void co_run_in_worker_bh(void *opaque)
+/*
+ * Hand all the coroutines that yielded since the last run over to the
+ * worker threads, so that a burst of requests costs a single bottom half.
+ */
+static void v9fs_submit_bh(void *opaque)
 {
-    Coroutine *co = opaque;
-    g_thread_pool_push(v9fs_pool.pool, co, NULL);
+    Coroutine *co;
+
+    while ((co = g_queue_pop_head(v9fs_pool.submitted)) != NULL) {
+        g_thread_pool_push(v9fs_pool.pool, co, NULL);
+    }
+}
+
+void v9fs_co_submit(Coroutine *co)
+{
+    g_queue_push_tail(v9fs_pool.submitted, co);
+    qemu_bh_schedule(v9fs_pool.submit_bh);
 }
 
 static void v9fs_qemu_process_req_done(void *arg)
@@ -37,6 +51,14 @@ static void v9fs_qemu_process_req_done(void *arg)
         len = read(v9fs_pool.rfd, &byte, sizeof(byte));
     } while (len == -1 &&  errno == EINTR);
 
+    /*
+     * Rearm the notification before looking at the queue: a request that
+     * completes after this point writes to the pipe again, one that
+     * completed before is found below.
+     */
+    g_atomic_int_set(&v9fs_pool.notified, 0);
+    smp_mb();
+
     while ((co = g_async_queue_try_pop(v9fs_pool.completed)) != NULL) {
         qemu_coroutine_enter(co, NULL);
     }
@@ -51,6 +73,11 @@ static void v9fs_thread_routine(gpointer data, gpointer user_data)
     qemu_coroutine_enter(co, NULL);
 
     g_async_queue_push(v9fs_pool.completed, co);
+
+    /* Only the first request completed in a batch wakes up the iothread */
+    if (!g_atomic_int_compare_and_exchange(&v9fs_pool.notified, 0, 1)) {
+        return;
+    }
     do {
         len = write(v9fs_pool.wfd, &byte, sizeof(byte));
     } while (len == -1 && errno == EINTR);
@@ -85,6 +112,8 @@ int v9fs_init_worker_threads(void)
         ret = -1;
         goto err_out;
     }
+    p->submitted = g_queue_new();
+    p->submit_bh = qemu_bh_new(v9fs_submit_bh, NULL);
     p->rfd = notifier_fds[0];
     p->wfd = notifier_fds[1];
 
@@ -25,6 +25,9 @@ typedef struct V9fsThPool {
     int wfd;
     GThreadPool *pool;
     GAsyncQueue *completed;
+    gint notified;              /* a byte is pending on wfd */
+    GQueue *submitted;          /* coroutines waiting for submit_bh */
+    QEMUBH *submit_bh;
 } V9fsThPool;
 
 /*
@@ -35,26 +38,24 @@ typedef struct V9fsThPool {
  *   2. Submit the coroutine to a worker thread.
  *   3. Enter the coroutine in the worker thread.
  * we cannot swap step 1 and 2, because that would imply worker thread
- * can enter coroutine while step1 is still running
+ * can enter coroutine while step1 is still running.
+ * v9fs_co_submit() only queues the coroutine; a single bottom half then
+ * submits everything that was queued in the meantime.
  */
 #define v9fs_co_run_in_worker(code_block)                               \
     do {                                                                \
-        QEMUBH *co_bh;                                                  \
-        co_bh = qemu_bh_new(co_run_in_worker_bh,                        \
-                            qemu_coroutine_self());                     \
-        qemu_bh_schedule(co_bh);                                        \
+        v9fs_co_submit(qemu_coroutine_self());                          \
         /*                                                              \
          * yield in qemu thread and re-enter back                       \
          * in glib worker thread                                        \
          */                                                             \
         qemu_coroutine_yield();                                         \
-        qemu_bh_delete(co_bh);                                          \
         code_block;                                                     \
         /* re-enter back to qemu thread */                              \
         qemu_coroutine_yield();                                         \
     } while (0)
 
-extern void co_run_in_worker_bh(void *);
+extern void v9fs_co_submit(Coroutine *co);
 extern int v9fs_init_worker_threads(void);
 extern int v9fs_co_readlink(V9fsPDU *, V9fsPath *, V9fsString *);
 extern int v9fs_co_readdir_r(V9fsPDU *, V9fsFidState *,
@@ -0,0 +1,424 @@
+/*
+ * Dedicated thread for virtio-blk I/O processing
+ *
+ * The I/O thread owns an AioContext that monitors the virtqueue's ioeventfd
+ * and a Linux AIO context for the image file.  Requests are submitted and
+ * their completions waited for without the global mutex; completions are
+ * signalled to the guest through the queue's guest notifier, which is an
+ * irqfd when KVM supports it.
+ *
+ * The vring itself is still accessed through the generic virtio code, which
+ * translates guest physical addresses with the memory map that the main loop
+ * updates under the global mutex (e.g. when a PCI BAR moves).  The thread
+ * therefore takes the global mutex around virtqueue_pop(), virtqueue_push()
+ * and the notification helpers, popping all available requests in one go.
+ * The main loop, in turn, only touches the virtqueue after stopping the
+ * thread, which happens on reset and on status changes.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "qemu-thread.h"
+#include "qemu-queue.h"
+#include "main-loop.h"
+#include "qemu-aio.h"
+#include "block.h"
+#include "block/raw-aio.h"
+#include "kvm.h"
+#include "migration.h"
+#include "hw/virtio-blk.h"
+#include "hw/dataplane/virtio-blk.h"
+
+typedef struct VirtIOBlockRequest {
+    VirtIOBlockDataPlane *s;
+    VirtQueueElement elem;          /* saved data from the virtqueue */
+    struct virtio_blk_inhdr *in;    /* status byte in guest memory */
+    QEMUIOVector qiov;              /* data buffers in guest memory */
+    bool is_read;
+    QSIMPLEQ_ENTRY(VirtIOBlockRequest) next;
+} VirtIOBlockRequest;
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool stopping;
+    bool disabled;                  /* ioeventfd unavailable, don't retry */
+
+    VirtIOBlkConf *blk;
+    int fd;                         /* image file descriptor */
+
+    VirtIODevice *vdev;
+    VirtQueue *vq;                  /* virtqueue vring */
+    EventNotifier *host_notifier;   /* doorbell */
+
+    /* The I/O thread waits for the host notifier and Linux AIO completions
+     * in its own AioContext, independent of the main loop.
+     */
+    QemuThread thread;
+    AioContext *ctx;
+    void *laio;                     /* Linux AIO state for s->fd */
+    QEMUBH *notify_bh;              /* coalesces guest interrupts */
+    unsigned int num_reqs;          /* requests in flight */
+
+    Error *migration_blocker;
+};
+
+static void notify_guest_bh(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+
+    /* Reads the vring's interrupt suppression flags */
+    qemu_mutex_lock_iothread();
+    virtio_notify_irqfd(s->vdev, s->vq);
+    qemu_mutex_unlock_iothread();
+}
+
+static void complete_request(VirtIOBlockRequest *req, uint8_t status)
+{
+    VirtIOBlockDataPlane *s = req->s;
+    unsigned int len = sizeof(*req->in);
+
+    trace_virtio_blk_data_plane_complete_request(s, req, status);
+
+    if (req->is_read) {
+        len += req->qiov.size;
+    }
+
+    stb_p(&req->in->status, status);
+    qemu_mutex_lock_iothread();
+    virtqueue_push(s->vq, &req->elem, len);
+    qemu_mutex_unlock_iothread();
+
+    /* Interrupts are raised once per aio_poll() iteration rather than once
+     * per request.
+     */
+    qemu_bh_schedule(s->notify_bh);
+
+    s->num_reqs--;
+    g_slice_free(VirtIOBlockRequest, req);
+}
+
+static void complete_rw(void *opaque, int ret)
+{
+    VirtIOBlockRequest *req = opaque;
+
+    complete_request(req, ret == 0 ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR);
+}
+
+static void do_get_id_cmd(VirtIOBlockRequest *req)
+{
+    VirtIOBlockDataPlane *s = req->s;
+
+    /*
+     * NB: per existing s/n string convention the string is
+     * terminated by '\0' only when shorter than buffer.
+     */
+    strncpy(req->elem.in_sg[0].iov_base,
+            s->blk->serial ? s->blk->serial : "",
+            MIN(req->elem.in_sg[0].iov_len, VIRTIO_BLK_ID_BYTES));
+    complete_request(req, VIRTIO_BLK_S_OK);
+}
+
+static void do_rdwr_cmd(VirtIOBlockRequest *req, uint64_t sector)
+{
+    VirtIOBlockDataPlane *s = req->s;
+    int type = req->is_read ? QEMU_AIO_READ : QEMU_AIO_WRITE;
+
+    if (req->qiov.size % s->blk->conf.logical_block_size ||
+        sector & ((s->blk->conf.logical_block_size / BDRV_SECTOR_SIZE) - 1)) {
+        complete_request(req, VIRTIO_BLK_S_IOERR);
+        return;
+    }
+
+    if (!laio_submit(s->blk->conf.bs, s->laio, s->fd, sector, &req->qiov,
+                     req->qiov.size / BDRV_SECTOR_SIZE,
+                     complete_rw, req, type)) {
+        complete_request(req, VIRTIO_BLK_S_IOERR);
+    }
+}
+
+static void process_request(VirtIOBlockDataPlane *s, VirtIOBlockRequest *req)
+{
+    struct virtio_blk_outhdr *out;
+    uint32_t type;
+
+    if (req->elem.out_num < 1 || req->elem.in_num < 1) {
+        error_report("virtio-blk missing headers");
+        exit(1);
+    }
+
+    if (req->elem.out_sg[0].iov_len < sizeof(*out) ||
+        req->elem.in_sg[req->elem.in_num - 1].iov_len < sizeof(*req->in)) {
+        error_report("virtio-blk header not in correct element");
+        exit(1);
+    }
+
+    out = (void *)req->elem.out_sg[0].iov_base;
+    req->in = (void *)req->elem.in_sg[req->elem.in_num - 1].iov_base;
+    type = ldl_p(&out->type);
+
+    trace_virtio_blk_data_plane_process_request(s, req, type);
+
+    if (type & VIRTIO_BLK_T_FLUSH) {
+        /* Only writes that have completed need to be stable, and the I/O
+         * thread may block, so a synchronous flush is good enough here.
+         */
+        complete_request(req, qemu_fdatasync(s->fd) == 0 ?
+                         VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR);
+    } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
+        complete_request(req, VIRTIO_BLK_S_UNSUPP);
+    } else if (type & VIRTIO_BLK_T_GET_ID) {
+        do_get_id_cmd(req);
+    } else if (type & VIRTIO_BLK_T_OUT) {
+        qemu_iovec_init_external(&req->qiov, &req->elem.out_sg[1],
+                                 req->elem.out_num - 1);
+        req->is_read = false;
+        do_rdwr_cmd(req, ldq_p(&out->sector));
+    } else {
+        qemu_iovec_init_external(&req->qiov, &req->elem.in_sg[0],
+                                 req->elem.in_num - 1);
+        req->is_read = true;
+        do_rdwr_cmd(req, ldq_p(&out->sector));
+    }
+}
+
+/* Called with the global mutex held */
+static VirtIOBlockRequest *get_request(VirtIOBlockDataPlane *s)
+{
+    VirtIOBlockRequest *req = g_slice_new0(VirtIOBlockRequest);
+
+    if (!virtqueue_pop(s->vq, &req->elem)) {
+        g_slice_free(VirtIOBlockRequest, req);
+        return NULL;
+    }
+
+    req->s = s;
+    s->num_reqs++;
+    return req;
+}
+
+static void handle_notify(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockRequest *req;
+    QSIMPLEQ_HEAD(, VirtIOBlockRequest) reqs;
+    bool empty;
+
+    event_notifier_test_and_clear(s->host_notifier);
+
+    do {
+        QSIMPLEQ_INIT(&reqs);
+
+        qemu_mutex_lock_iothread();
+
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        virtio_queue_set_notification(s->vq, 0);
+
+        while ((req = get_request(s))) {
+            QSIMPLEQ_INSERT_TAIL(&reqs, req, next);
+        }
+
+        /* Re-enable guest->host notifies and check again, since the guest
+         * may have added requests between the last pop and the re-enable.
+         */
+        virtio_queue_set_notification(s->vq, 1);
+        empty = virtio_queue_empty(s->vq);
+
+        qemu_mutex_unlock_iothread();
+
+        /* Submission may complete requests right away, which pushes them
+         * back under the global mutex */
+        while ((req = QSIMPLEQ_FIRST(&reqs))) {
+            QSIMPLEQ_REMOVE_HEAD(&reqs, next);
+            process_request(s, req);
+        }
+    } while (!empty);
+}
+
+static int flush_notify(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+
+    /* Keep aio_poll() blocking on the doorbell until we are told to stop */
+    return !s->stopping;
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+
+    do {
+        aio_poll(s->ctx, true);
+    } while (!s->stopping || s->num_reqs > 0);
+
+    /* Raise the interrupt for the last completions, if any */
+    aio_poll(s->ctx, false);
+    return NULL;
+}
+
+bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
+                                  VirtIOBlockDataPlane **dataplane)
+{
+    VirtIOBlockDataPlane *s;
+    int fd;
+
+    *dataplane = NULL;
+
+    if (!blk->data_plane) {
+        return true;
+    }
+
+    if (blk->scsi) {
+        error_report("device is incompatible with x-data-plane, use scsi=off");
+        return false;
+    }
+
+    fd = raw_get_aio_fd(blk->conf.bs);
+    if (fd < 0) {
+        error_report("drive is incompatible with x-data-plane, "
+                     "use format=raw,cache=none,aio=native");
+        return false;
+    }
+
+    s = g_new0(VirtIOBlockDataPlane, 1);
+    s->vdev = vdev;
+    s->fd = fd;
+    s->blk = blk;
+
+    /* Prevent block operations that conflict with data plane thread */
+    bdrv_set_in_use(blk->conf.bs, 1);
+
+    error_setg(&s->migration_blocker,
+               "x-data-plane does not support migration");
+    migrate_add_blocker(s->migration_blocker);
+
+    *dataplane = s;
+    return true;
+}
+
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+
+    virtio_blk_data_plane_stop(s);
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+    bdrv_set_in_use(s->blk->conf.bs, 0);
+    g_free(s);
+}
+
+bool virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    const VirtIOBindings *binding = s->vdev->binding;
+    void *opaque = s->vdev->binding_opaque;
+
+    if (s->started) {
+        return true;
+    }
+
+    if (s->stopping || s->disabled) {
+        return false;
+    }
+
+    /* Without ioeventfd, kicks would still arrive in the main loop */
+    if (!binding->set_host_notifier || !binding->set_guest_notifiers ||
+        !kvm_has_many_ioeventfds()) {
+        error_report("x-data-plane requires ioeventfd support, "
+                     "falling back to the main loop");
+        s->disabled = true;
+        return false;
+    }
+
+    s->vq = virtio_get_queue(s->vdev, 0);
+
+    /* Set up guest notifier (irq) */
+    if (binding->set_guest_notifiers(opaque, true) != 0) {
+        error_report("virtio-blk failed to set guest notifier, "
+                     "falling back to the main loop");
+        s->disabled = true;
+        return false;
+    }
+
+    /* Set up virtqueue notify */
+    if (binding->set_host_notifier(opaque, 0, true) != 0) {
+        error_report("virtio-blk failed to set host notifier, "
+                     "falling back to the main loop");
+        binding->set_guest_notifiers(opaque, false);
+        s->disabled = true;
+        return false;
+    }
+    s->host_notifier = virtio_queue_get_host_notifier(s->vq);
+
+    s->ctx = aio_context_new();
+    s->laio = laio_init_aio_context(s->ctx);
+    if (!s->laio) {
+        error_report("virtio-blk failed to set up Linux AIO, "
+                     "falling back to the main loop");
+        aio_context_unref(s->ctx);
+        s->ctx = NULL;
+        binding->set_host_notifier(opaque, 0, false);
+        binding->set_guest_notifiers(opaque, false);
+        s->disabled = true;
+        return false;
+    }
+    s->notify_bh = aio_bh_new(s->ctx, notify_guest_bh, s);
+    aio_set_fd_handler(s->ctx, event_notifier_get_fd(s->host_notifier),
+                       handle_notify, NULL, flush_notify, s);
+
+    trace_virtio_blk_data_plane_start(s);
+
+    s->started = true;
+
+    /* Kick right away to begin processing requests already in vring */
+    event_notifier_set(s->host_notifier);
+
+    qemu_thread_create(&s->thread, data_plane_thread,
+                       s, QEMU_THREAD_JOINABLE);
+    return true;
+}
+
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    const VirtIOBindings *binding = s->vdev->binding;
+    void *opaque = s->vdev->binding_opaque;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_blk_data_plane_stop(s);
+
+    /* Tell the thread to stop and wait for in-flight requests to drain.
+     * Their completions take the global mutex, so drop it meanwhile.
+     */
+    aio_notify(s->ctx);
+    qemu_mutex_unlock_iothread();
+    qemu_thread_join(&s->thread);
+    qemu_mutex_lock_iothread();
+
+    aio_set_fd_handler(s->ctx, event_notifier_get_fd(s->host_notifier),
+                       NULL, NULL, NULL, NULL);
+    qemu_bh_delete(s->notify_bh);
+    laio_cleanup(s->laio, s->ctx);
+    aio_context_unref(s->ctx);
+    s->ctx = NULL;
+    s->laio = NULL;
+
+    /* Kicks that arrive from now on are processed in the main loop until
+     * the next start; s->stopping makes sure we do not restart from the
+     * host notifier's final flush.
+     */
+    binding->set_host_notifier(opaque, 0, false);
+
+    /* Clean up guest notifier (irq) */
+    binding->set_guest_notifiers(opaque, false);
+
+    s->started = false;
+    s->stopping = false;
+}
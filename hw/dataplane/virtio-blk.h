@@ -0,0 +1,37 @@
+/*
+ * Dedicated thread for virtio-blk I/O processing
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HW_DATAPLANE_VIRTIO_BLK_H
+#define HW_DATAPLANE_VIRTIO_BLK_H
+
+#include "hw/virtio-blk.h"
+
+typedef struct VirtIOBlockDataPlane VirtIOBlockDataPlane;
+
+/**
+ * virtio_blk_data_plane_create: Set up a dedicated I/O thread for a device
+ *
+ * Returns false and reports an error if x-data-plane was requested but the
+ * configuration cannot support it.  *dataplane is left NULL when data plane
+ * was not requested.
+ */
+bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
+                                  VirtIOBlockDataPlane **dataplane);
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s);
+
+/**
+ * virtio_blk_data_plane_start: Hand the virtqueue over to the I/O thread
+ *
+ * Returns true if the I/O thread is processing the virtqueue, false if the
+ * caller must process requests itself (e.g. because ioeventfd is not
+ * available).
+ */
+bool virtio_blk_data_plane_start(VirtIOBlockDataPlane *s);
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s);
+
+#endif /* HW_DATAPLANE_VIRTIO_BLK_H */
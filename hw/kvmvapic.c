@@ -442,6 +442,8 @@ static void patch_instruction(VAPICROMState *s, CPUX86State *env, target_ulong i
 
     if (!kvm_enabled()) {
         env->current_tb = NULL;
+        /* released by cpu_exec() after the longjmp */
+        tb_lock();
         tb_gen_code(env, current_pc, current_cs_base, current_flags, 1);
         cpu_resume_from_signal(env, NULL);
     }
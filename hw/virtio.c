@@ -700,6 +700,15 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     return &vdev->vq[i];
 }
 
+void virtio_del_queue(VirtIODevice *vdev, int n)
+{
+    if (n < 0 || n >= VIRTIO_PCI_QUEUE_MAX) {
+        abort();
+    }
+
+    vdev->vq[n].vring.num = 0;
+}
+
 void virtio_irq(VirtQueue *vq)
 {
     trace_virtio_irq(vq);
@@ -754,6 +763,20 @@ void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
     virtio_notify_vector(vdev, vq->vector);
 }
 
+/* Like virtio_notify, but raise the interrupt by kicking the queue's guest
+ * notifier directly.  The caller must have assigned guest notifiers (and
+ * should be using irqfd), so this can be called outside the global mutex.
+ */
+void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
+{
+    if (!vring_notify(vdev, vq)) {
+        return;
+    }
+
+    trace_virtio_notify_irqfd(vdev, vq);
+    event_notifier_set(&vq->guest_notifier);
+}
+
 void virtio_notify_config(VirtIODevice *vdev)
 {
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK))
@@ -136,5 +136,16 @@ bool cpu_is_stopped(CPUState *cpu);
  */
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * async_run_on_cpu:
+ * @cpu: The vCPU to run on.
+ * @func: The function to be executed.
+ * @data: Data to pass to the function.
+ *
+ * Schedules the function @func for execution on the vCPU @cpu, without
+ * waiting for it to complete.  Must be called with the iothread lock held.
+ */
+void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
+
 
 #endif
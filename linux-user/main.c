@@ -106,7 +106,7 @@ static int pending_cpus;
 /* Make sure everything is in a consistent state for calling fork().  */
 void fork_start(void)
 {
-    pthread_mutex_lock(&tb_lock);
+    pthread_mutex_lock(&tb_spinlock);
     pthread_mutex_lock(&exclusive_lock);
     mmap_fork_start();
 }
@@ -124,11 +124,11 @@ void fork_end(int child)
         pthread_mutex_init(&cpu_list_mutex, NULL);
         pthread_cond_init(&exclusive_cond, NULL);
         pthread_cond_init(&exclusive_resume, NULL);
-        pthread_mutex_init(&tb_lock, NULL);
+        pthread_mutex_init(&tb_spinlock, NULL);
         gdbserver_fork(thread_env);
     } else {
         pthread_mutex_unlock(&exclusive_lock);
-        pthread_mutex_unlock(&tb_lock);
+        pthread_mutex_unlock(&tb_spinlock);
     }
 }
 
@@ -3197,6 +3197,14 @@ static void handle_arg_singlestep(const char *arg)
     singlestep = 1;
 }
 
+static void handle_arg_tb_hot(const char *arg)
+{
+    tb_hot_threshold = atoi(arg);
+    if (tb_hot_threshold < 0) {
+        tb_hot_threshold = 0;
+    }
+}
+
 static void handle_arg_strace(const char *arg)
 {
     do_strace = 1;
@@ -3251,6 +3259,8 @@ static const struct qemu_argument arg_table[] = {
      "pagesize",   "set the host page size to 'pagesize'"},
     {"singlestep", "QEMU_SINGLESTEP",  false, handle_arg_singlestep,
      "",           "run in singlestep mode"},
+    {"tb-hot",     "QEMU_TB_HOT",      true,  handle_arg_tb_hot,
+     "count",      "retranslate blocks run 'count' times as superblocks"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
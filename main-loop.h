@@ -303,4 +303,13 @@ void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int rc
 QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque);
 void qemu_bh_schedule_idle(QEMUBH *bh);
 
+/**
+ * qemu_get_aio_context: Return the AioContext of the main loop.
+ *
+ * Code that creates its own AioContext (for example to run it in a
+ * separate thread) can use this to attach sources to the main loop
+ * explicitly instead.
+ */
+AioContext *qemu_get_aio_context(void);
+
 #endif
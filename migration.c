@@ -22,6 +22,8 @@
 #include "qemu_socket.h"
 #include "block-migration.h"
 #include "qmp-commands.h"
+#include "postcopy-ram.h"
+#include "trace.h"
 
 //#define DEBUG_MIGRATION
 
@@ -46,6 +48,11 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Migration compression defaults */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREADS 8
+#define MAX_MIGRATE_COMPRESS_THREADS 255
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -59,6 +66,8 @@ MigrationState *migrate_get_current(void)
         .state = MIG_STATE_SETUP,
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .compress_level = DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .compress_threads = DEFAULT_MIGRATE_COMPRESS_THREADS,
     };
 
     return &current_migration;
@@ -89,8 +98,11 @@ static void process_incoming_migration_co(void *opaque)
     int ret;
 
     ret = qemu_loadvm_state(f);
-    qemu_set_fd_handler(qemu_get_fd(f), NULL, NULL, NULL);
-    qemu_fclose(f);
+    migrate_decompress_threads_join();
+    if (!postcopy_ram_incoming_started()) {
+        qemu_set_fd_handler(qemu_get_fd(f), NULL, NULL, NULL);
+        qemu_fclose(f);
+    }
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(0);
@@ -174,6 +186,18 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
     }
 }
 
+static void get_compress_stats(MigrationInfo *info)
+{
+    if (migrate_use_compression()) {
+        info->has_compress = true;
+        info->compress = g_malloc0(sizeof(*info->compress));
+        info->compress->level = migrate_compress_level();
+        info->compress->pages = compress_mig_pages_transferred();
+        info->compress->bytes = compress_mig_bytes_transferred();
+        info->compress->threads = compress_mig_thread_stats();
+    }
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -185,7 +209,8 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIG_STATE_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        info->status = g_strdup(s->postcopy_active ? "postcopy-active"
+                                                   : "active");
         info->has_total_time = true;
         info->total_time = qemu_get_clock_ms(rt_clock)
             - s->total_time;
@@ -212,9 +237,11 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compress_stats(info);
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compress_stats(info);
 
         info->has_status = true;
         info->status = g_strdup("completed");
@@ -291,17 +318,30 @@ static void migrate_fd_completed(MigrationState *s)
         s->state = MIG_STATE_ERROR;
     } else {
         s->state = MIG_STATE_COMPLETED;
+        bdrv_inactivate_all();
         runstate_set(RUN_STATE_POSTMIGRATE);
     }
     notifier_list_notify(&migration_state_notifiers, s);
 }
 
+static void migrate_fd_put_notify(void *opaque);
+static void migrate_postcopy_rp_read(void *opaque);
+
+static void migrate_fd_update_handlers(MigrationState *s)
+{
+    qemu_set_fd_handler2(s->fd, NULL,
+                         s->postcopy_active ? migrate_postcopy_rp_read : NULL,
+                         s->fd_write_blocked ? migrate_fd_put_notify : NULL,
+                         s);
+}
+
 static void migrate_fd_put_notify(void *opaque)
 {
     MigrationState *s = opaque;
     int ret;
 
-    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+    s->fd_write_blocked = false;
+    migrate_fd_update_handlers(s);
     ret = qemu_file_put_notify(s->file);
     if (ret) {
         migrate_fd_error(s);
@@ -325,12 +365,102 @@ ssize_t migrate_fd_put_buffer(MigrationState *s, const void *data,
         ret = -(s->get_error(s));
 
     if (ret == -EAGAIN) {
-        qemu_set_fd_handler2(s->fd, NULL, NULL, migrate_fd_put_notify, s);
+        s->fd_write_blocked = true;
+        migrate_fd_update_handlers(s);
     }
 
     return ret;
 }
 
+/* Page requests from the destination of a post-copy migration */
+static void migrate_postcopy_rp_read(void *opaque)
+{
+    MigrationState *s = opaque;
+    size_t pos = 0;
+    ssize_t len;
+
+    do {
+        len = qemu_recv(s->fd, s->rp_buf + s->rp_len,
+                        sizeof(s->rp_buf) - s->rp_len, 0);
+    } while (len == -1 && s->get_error(s) == EINTR);
+
+    if (len == -1 && s->get_error(s) == EAGAIN) {
+        return;
+    }
+    if (len <= 0) {
+        DPRINTF("return path closed\n");
+        migrate_fd_error(s);
+        return;
+    }
+    s->rp_len += len;
+
+    while (pos < s->rp_len) {
+        uint8_t *msg = s->rp_buf + pos;
+        size_t idlen = msg[0];
+        char idstr[256];
+
+        if (s->rp_len - pos < 1 + idlen + 8 + 4) {
+            break;
+        }
+        memcpy(idstr, msg + 1, idlen);
+        idstr[idlen] = 0;
+        if (ram_postcopy_request(idstr, ldq_be_p(msg + 1 + idlen),
+                                 ldl_be_p(msg + 1 + idlen + 8)) < 0) {
+            migrate_fd_error(s);
+            return;
+        }
+        pos += 1 + idlen + 8 + 4;
+    }
+    memmove(s->rp_buf, s->rp_buf + pos, s->rp_len - pos);
+    s->rp_len -= pos;
+
+    /* Send the requested pages right away */
+    migrate_fd_put_ready(s);
+}
+
+static void migrate_postcopy_start(MigrationState *s)
+{
+    int old_vm_running = runstate_is_running();
+    int64_t start_time;
+
+    DPRINTF("switching to post-copy\n");
+    trace_migrate_postcopy_start();
+    start_time = qemu_get_clock_ms(rt_clock);
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+
+    s->postcopy_active = true;
+    if (qemu_savevm_state_postcopy(s->file) < 0) {
+        /* The destination exits when it loses the stream, so the guest
+         * can safely go on running here. */
+        s->postcopy_active = false;
+        migrate_fd_error(s);
+        if (old_vm_running) {
+            vm_start();
+        }
+        return;
+    }
+    s->downtime = qemu_get_clock_ms(rt_clock) - start_time;
+
+    /* From now on the destination runs the guest, listen for its faults */
+    migrate_fd_update_handlers(s);
+}
+
+static void migrate_postcopy_iterate(MigrationState *s)
+{
+    int ret;
+
+    ret = ram_postcopy_send_pages(s->file);
+    if (ret < 0) {
+        /* Neither side has the whole guest anymore, leave it stopped */
+        migrate_fd_error(s);
+    } else if (ret == 1) {
+        DPRINTF("post-copy done\n");
+        migrate_fd_completed(s);
+        s->total_time = qemu_get_clock_ms(rt_clock) - s->total_time;
+    }
+}
+
 void migrate_fd_put_ready(MigrationState *s)
 {
     int ret;
@@ -340,6 +470,15 @@ void migrate_fd_put_ready(MigrationState *s)
         return;
     }
 
+    if (s->postcopy_active) {
+        migrate_postcopy_iterate(s);
+        return;
+    }
+    if (s->start_postcopy) {
+        migrate_postcopy_start(s);
+        return;
+    }
+
     DPRINTF("iterate\n");
     ret = qemu_savevm_state_iterate(s->file);
     if (ret < 0) {
@@ -443,6 +582,11 @@ bool migration_has_failed(MigrationState *s)
             s->state == MIG_STATE_ERROR);
 }
 
+bool migration_in_postcopy(MigrationState *s)
+{
+    return s->postcopy_active;
+}
+
 void migrate_fd_connect(MigrationState *s)
 {
     int ret;
@@ -466,6 +610,8 @@ static MigrationState *migrate_init(const MigrationParams *params)
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int compress_level = s->compress_level;
+    int compress_threads = s->compress_threads;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
@@ -476,6 +622,8 @@ static MigrationState *migrate_init(const MigrationParams *params)
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    s->compress_level = compress_level;
+    s->compress_threads = compress_threads;
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
@@ -522,6 +670,13 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    /* Post-copy needs a return path for page requests */
+    if (migrate_postcopy_ram() &&
+        !strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+        error_setg(errp, "post-copy migration needs a tcp: or unix: URI");
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -550,7 +705,32 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
 
 void qmp_migrate_cancel(Error **errp)
 {
-    migrate_fd_cancel(migrate_get_current());
+    MigrationState *s = migrate_get_current();
+
+    /* The destination already owns the pages it has received and the
+     * source cannot take them back, so there is nothing to cancel to */
+    if (s->state == MIG_STATE_ACTIVE && s->postcopy_active) {
+        error_setg(errp, "migration cannot be cancelled once post-copy "
+                   "has started");
+        return;
+    }
+    migrate_fd_cancel(s);
+}
+
+void qmp_migrate_start_postcopy(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_postcopy_ram()) {
+        error_setg(errp, "enable the postcopy-ram capability first");
+        return;
+    }
+    if (s->state != MIG_STATE_ACTIVE) {
+        error_setg(errp, "no migration in progress");
+        return;
+    }
+
+    s->start_postcopy = true;
 }
 
 void qmp_migrate_set_cache_size(int64_t value, Error **errp)
@@ -572,6 +752,38 @@ int64_t qmp_query_migrate_cache_size(Error **errp)
     return migrate_xbzrle_cache_size();
 }
 
+void qmp_migrate_set_compress_params(bool has_level, int64_t level,
+                                     bool has_threads, int64_t threads,
+                                     Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (has_level && (level < 0 || level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "level",
+                  "an integer in the range of 0 to 9");
+        return;
+    }
+
+    if (has_threads &&
+        (threads < 1 || threads > MAX_MIGRATE_COMPRESS_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "threads",
+                  "an integer in the range of 1 to 255");
+        return;
+    }
+
+    if (has_level) {
+        s->compress_level = level;
+    }
+    if (has_threads) {
+        s->compress_threads = threads;
+    }
+}
+
 void qmp_migrate_set_speed(int64_t value, Error **errp)
 {
     MigrationState *s;
@@ -609,3 +821,39 @@ int64_t migrate_xbzrle_cache_size(void)
 
     return s->xbzrle_cache_size;
 }
+
+bool migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_threads;
+}
+
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
+}
@@ -28,6 +28,16 @@ struct MigrationParams {
 
 typedef struct MigrationState MigrationState;
 
+/*
+ * Post-copy return path.  The destination asks for the pages it faults on
+ * with messages of the following form, integers in big endian:
+ *
+ *   u8 idlen, char idstr[idlen], u64 offset, u32 length
+ *
+ * offset and length are in bytes within the RAMBlock called idstr.
+ */
+#define POSTCOPY_REQUEST_MAX_SIZE (1 + 255 + 8 + 4)
+
 struct MigrationState
 {
     int64_t bandwidth_limit;
@@ -45,6 +55,13 @@ struct MigrationState
     int64_t dirty_pages_rate;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
+    int compress_level;
+    int compress_threads;
+    bool fd_write_blocked;
+    bool start_postcopy;
+    bool postcopy_active;
+    uint8_t rp_buf[16 * POSTCOPY_REQUEST_MAX_SIZE];
+    size_t rp_len;
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -88,12 +105,17 @@ void remove_migration_state_change_notifier(Notifier *notify);
 bool migration_is_active(MigrationState *);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
+bool migration_in_postcopy(MigrationState *);
 MigrationState *migrate_get_current(void);
 
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
 
+int ram_postcopy_request(const char *idstr, uint64_t offset, uint32_t length);
+int ram_postcopy_send_pages(QEMUFile *f);
+int ram_postcopy_load(QEMUFile *f);
+
 extern SaveVMHandlers savevm_ram_handlers;
 
 uint64_t dup_mig_bytes_transferred(void);
@@ -104,6 +126,9 @@ uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t compress_mig_bytes_transferred(void);
+uint64_t compress_mig_pages_transferred(void);
+CompressThreadStatsList *compress_mig_thread_stats(void);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -128,4 +153,12 @@ int64_t migrate_xbzrle_cache_size(void);
 
 int64_t xbzrle_cache_resize(int64_t new_size);
 
+bool migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+
+void migrate_decompress_threads_join(void);
+
+bool migrate_postcopy_ram(void);
+
 #endif
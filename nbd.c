@@ -86,6 +86,8 @@ struct NBDRequest {
     QSIMPLEQ_ENTRY(NBDRequest) entry;
     NBDClient *client;
     uint8_t *data;
+    struct iovec iov;
+    QEMUIOVector qiov;      /* request payload, points into data */
 };
 
 struct NBDExport {
@@ -98,7 +100,6 @@ struct NBDExport {
     off_t size;
     uint32_t nbdflags;
     QTAILQ_HEAD(, NBDClient) clients;
-    QSIMPLEQ_HEAD(, NBDRequest) requests;
     QTAILQ_ENTRY(NBDExport) next;
 };
 
@@ -119,6 +120,10 @@ struct NBDClient {
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
+
+    /* Requests (and their buffers) that are not in flight, at most
+     * MAX_NBD_REQUESTS of them.  */
+    QSIMPLEQ_HEAD(, NBDRequest) free_requests;
 };
 
 /* That's all folks */
@@ -776,11 +781,8 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
+static void nbd_encode_reply(uint8_t *buf, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
-    ssize_t ret;
-
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
@@ -789,19 +791,6 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     cpu_to_be32w((uint32_t*)buf, NBD_REPLY_MAGIC);
     cpu_to_be32w((uint32_t*)(buf + 4), reply->error);
     cpu_to_be64w((uint64_t*)(buf + 8), reply->handle);
-
-    TRACE("Sending response to client");
-
-    ret = write_sync(csock, buf, sizeof(buf));
-    if (ret < 0) {
-        return ret;
-    }
-
-    if (ret != sizeof(buf)) {
-        LOG("writing to socket failed");
-        return -EINVAL;
-    }
-    return 0;
 }
 
 #define MAX_NBD_REQUESTS 16
@@ -818,6 +807,14 @@ void nbd_client_put(NBDClient *client)
          * which is called by nbd_client_close.
          */
         assert(client->closing);
+        assert(client->nb_requests == 0);
+
+        while (!QSIMPLEQ_EMPTY(&client->free_requests)) {
+            NBDRequest *first = QSIMPLEQ_FIRST(&client->free_requests);
+            QSIMPLEQ_REMOVE_HEAD(&client->free_requests, entry);
+            qemu_vfree(first->data);
+            g_free(first);
+        }
 
         qemu_set_fd_handler2(client->sock, NULL, NULL, NULL, NULL);
         close(client->sock);
@@ -857,12 +854,12 @@ static NBDRequest *nbd_request_get(NBDClient *client)
     assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
     client->nb_requests++;
 
-    if (QSIMPLEQ_EMPTY(&exp->requests)) {
+    if (QSIMPLEQ_EMPTY(&client->free_requests)) {
         req = g_malloc0(sizeof(NBDRequest));
         req->data = qemu_blockalign(exp->bs, NBD_BUFFER_SIZE);
     } else {
-        req = QSIMPLEQ_FIRST(&exp->requests);
-        QSIMPLEQ_REMOVE_HEAD(&exp->requests, entry);
+        req = QSIMPLEQ_FIRST(&client->free_requests);
+        QSIMPLEQ_REMOVE_HEAD(&client->free_requests, entry);
     }
     nbd_client_get(client);
     req->client = client;
@@ -872,7 +869,7 @@ static NBDRequest *nbd_request_get(NBDClient *client)
 static void nbd_request_put(NBDRequest *req)
 {
     NBDClient *client = req->client;
-    QSIMPLEQ_INSERT_HEAD(&client->exp->requests, req, entry);
+    QSIMPLEQ_INSERT_HEAD(&client->free_requests, req, entry);
     if (client->nb_requests-- == MAX_NBD_REQUESTS) {
         qemu_notify_event();
     }
@@ -884,7 +881,6 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
                           void (*close)(NBDExport *))
 {
     NBDExport *exp = g_malloc0(sizeof(NBDExport));
-    QSIMPLEQ_INIT(&exp->requests);
     exp->refcount = 1;
     QTAILQ_INIT(&exp->clients);
     exp->bs = bs;
@@ -960,13 +956,6 @@ void nbd_export_put(NBDExport *exp)
             exp->close(exp);
         }
 
-        while (!QSIMPLEQ_EMPTY(&exp->requests)) {
-            NBDRequest *first = QSIMPLEQ_FIRST(&exp->requests);
-            QSIMPLEQ_REMOVE_HEAD(&exp->requests, entry);
-            qemu_vfree(first->data);
-            g_free(first);
-        }
-
         g_free(exp);
     }
 }
@@ -994,25 +983,30 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
 {
     NBDClient *client = req->client;
     int csock = client->sock;
-    ssize_t rc, ret;
+    uint8_t buf[NBD_REPLY_SIZE];
+    struct iovec iov[2];
+    ssize_t rc;
+
+    nbd_encode_reply(buf, reply);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = sizeof(buf);
+    iov[1].iov_base = req->data;
+    iov[1].iov_len = len;
 
     qemu_co_mutex_lock(&client->send_lock);
     qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
                          nbd_restart_write, client);
     client->send_coroutine = qemu_coroutine_self();
 
-    if (!len) {
-        rc = nbd_send_reply(csock, reply);
+    /* Header and payload go out together, with a single sendmsg in the
+     * common case.  */
+    TRACE("Sending response to client");
+    rc = qemu_co_sendv(csock, iov, len ? 2 : 1, 0, sizeof(buf) + len);
+    if (rc != sizeof(buf) + len) {
+        LOG("writing to socket failed");
+        rc = -EIO;
     } else {
-        socket_set_cork(csock, 1);
-        rc = nbd_send_reply(csock, reply);
-        if (rc >= 0) {
-            ret = qemu_co_send(csock, req->data, len);
-            if (ret != len) {
-                rc = -EIO;
-            }
-        }
-        socket_set_cork(csock, 0);
+        rc = 0;
     }
 
     client->send_coroutine = NULL;
@@ -1065,6 +1059,9 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
 out:
     client->recv_coroutine = NULL;
+    req->iov.iov_base = req->data;
+    req->iov.iov_len = rc < 0 ? 0 : request->len;
+    qemu_iovec_init_external(&req->qiov, &req->iov, 1);
     return rc;
 }
 
@@ -1121,8 +1118,8 @@ static void nbd_trip(void *opaque)
             }
         }
 
-        ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
-                        req->data, request.len / 512);
+        ret = bdrv_co_readv(exp->bs, (request.from + exp->dev_offset) / 512,
+                            request.len / 512, &req->qiov);
         if (ret < 0) {
             LOG("reading from file failed");
             reply.error = -ret;
@@ -1144,8 +1141,8 @@ static void nbd_trip(void *opaque)
 
         TRACE("Writing to device");
 
-        ret = bdrv_write(exp->bs, (request.from + exp->dev_offset) / 512,
-                         req->data, request.len / 512);
+        ret = bdrv_co_writev(exp->bs, (request.from + exp->dev_offset) / 512,
+                             request.len / 512, &req->qiov);
         if (ret < 0) {
             LOG("writing to file failed");
             reply.error = -ret;
@@ -1253,6 +1250,7 @@ NBDClient *nbd_client_new(NBDExport *exp, int csock,
         return NULL;
     }
     client->close = close;
+    QSIMPLEQ_INIT(&client->free_requests);
     qemu_co_mutex_init(&client->send_lock);
     qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
 
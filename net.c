@@ -181,17 +181,12 @@ static char *assign_name(NetClientState *nc1, const char *model)
     return g_strdup(buf);
 }
 
-NetClientState *qemu_new_net_client(NetClientInfo *info,
-                                    NetClientState *peer,
-                                    const char *model,
-                                    const char *name)
+static void qemu_net_client_setup(NetClientState *nc,
+                                  NetClientInfo *info,
+                                  NetClientState *peer,
+                                  const char *model,
+                                  const char *name)
 {
-    NetClientState *nc;
-
-    assert(info->size >= sizeof(NetClientState));
-
-    nc = g_malloc0(info->size);
-
     nc->info = info;
     nc->model = g_strdup(model);
     if (name) {
@@ -208,31 +203,94 @@ NetClientState *qemu_new_net_client(NetClientInfo *info,
     QTAILQ_INSERT_TAIL(&net_clients, nc, next);
 
     nc->send_queue = qemu_new_net_queue(nc);
+}
+
+NetClientState *qemu_new_net_client(NetClientInfo *info,
+                                    NetClientState *peer,
+                                    const char *model,
+                                    const char *name)
+{
+    NetClientState *nc;
+
+    assert(info->size >= sizeof(NetClientState));
+
+    nc = g_malloc0(info->size);
+    qemu_net_client_setup(nc, info, peer, model, name);
 
     return nc;
 }
 
+/*
+ * A NIC with more than one queue is peered with a multiqueue backend, whose
+ * queues are separate net clients sharing the netdev's name.  Queue 0 is the
+ * NetClientState embedded in the NICState; the others are allocated in the
+ * same block, right after it, so that qemu_get_nic() can find their NIC.
+ */
 NICState *qemu_new_nic(NetClientInfo *info,
                        NICConf *conf,
                        const char *model,
                        const char *name,
                        void *opaque)
 {
-    NetClientState *nc;
+    NetClientState *peers[MAX_QUEUE_NUM];
     NICState *nic;
+    int i, queues = MAX(1, conf->queues);
 
     assert(info->type == NET_CLIENT_OPTIONS_KIND_NIC);
     assert(info->size >= sizeof(NICState));
 
-    nc = qemu_new_net_client(info, conf->peer, model, name);
+    peers[0] = conf->peer;
+    if (queues > 1) {
+        int found;
+
+        assert(conf->peer);
+        found = qemu_find_net_clients_except(conf->peer->name, peers,
+                                             NET_CLIENT_OPTIONS_KIND_NIC,
+                                             MAX_QUEUE_NUM);
+        assert(found >= queues && peers[0] == conf->peer);
+    }
 
-    nic = DO_UPCAST(NICState, nc, nc);
+    nic = g_malloc0(info->size + sizeof(NetClientState) * (queues - 1));
+    nic->queues = queues;
+    if (queues > 1) {
+        nic->subqueues = (void *)nic + info->size;
+    }
     nic->conf = conf;
     nic->opaque = opaque;
 
+    qemu_net_client_setup(&nic->nc, info, peers[0], model, name);
+    for (i = 1; i < queues; i++) {
+        NetClientState *nc = qemu_get_subqueue(nic, i);
+
+        qemu_net_client_setup(nc, info, peers[i], model, nic->nc.name);
+        nc->queue_index = i;
+    }
+
     return nic;
 }
 
+NetClientState *qemu_get_subqueue(NICState *nic, int queue_index)
+{
+    assert(queue_index < nic->queues);
+    return queue_index ? &nic->subqueues[queue_index - 1] : &nic->nc;
+}
+
+NICState *qemu_get_nic(NetClientState *nc)
+{
+    NetClientState *first_subqueue;
+
+    if (!nc->queue_index) {
+        return DO_UPCAST(NICState, nc, nc);
+    }
+    first_subqueue = nc - (nc->queue_index - 1);
+    return (NICState *)((void *)first_subqueue - nc->info->size);
+}
+
+void *qemu_get_nic_opaque(NetClientState *nc)
+{
+    return qemu_get_nic(nc)->opaque;
+}
+
 static void qemu_cleanup_net_client(NetClientState *nc)
 {
     QTAILQ_REMOVE(&net_clients, nc, next);
@@ -252,37 +310,77 @@ static void qemu_free_net_client(NetClientState *nc)
     }
     g_free(nc->name);
     g_free(nc->model);
-    g_free(nc);
+    /* NIC subqueues live in the same allocation as queue 0 */
+    if (nc->info->type != NET_CLIENT_OPTIONS_KIND_NIC || !nc->queue_index) {
+        g_free(nc);
+    }
+}
+
+static void qemu_del_nic(NICState *nic)
+{
+    int i;
+
+    /* If the peer has already been deleted, free it now. */
+    if (nic->peer_deleted) {
+        for (i = 0; i < nic->queues; i++) {
+            qemu_free_net_client(qemu_get_subqueue(nic, i)->peer);
+        }
+    }
+
+    /* Only queue 0 runs the NIC's cleanup callback; it goes last since
+     * freeing it frees the whole NIC. */
+    for (i = nic->queues - 1; i > 0; i--) {
+        NetClientState *nc = qemu_get_subqueue(nic, i);
+
+        QTAILQ_REMOVE(&net_clients, nc, next);
+        qemu_free_net_client(nc);
+    }
+    qemu_cleanup_net_client(&nic->nc);
+    qemu_free_net_client(&nic->nc);
 }
 
 void qemu_del_net_client(NetClientState *nc)
 {
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    int queues, i;
+
+    if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
+        qemu_del_nic(qemu_get_nic(nc));
+        return;
+    }
+
+    /* The queues of a multiqueue backend go away together */
+    queues = qemu_find_net_clients_except(nc->name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_NIC,
+                                          MAX_QUEUE_NUM);
+    assert(queues != 0);
+
     /* If there is a peer NIC, delete and cleanup client, but do not free. */
     if (nc->peer && nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
-        NICState *nic = DO_UPCAST(NICState, nc, nc->peer);
+        NICState *nic = qemu_get_nic(nc->peer);
         if (nic->peer_deleted) {
             return;
         }
         nic->peer_deleted = true;
         /* Let NIC know peer is gone. */
-        nc->peer->link_down = true;
+        for (i = 0; i < queues; i++) {
+            if (ncs[i]->peer) {
+                ncs[i]->peer->link_down = true;
+            }
+        }
         if (nc->peer->info->link_status_changed) {
             nc->peer->info->link_status_changed(nc->peer);
         }
-        qemu_cleanup_net_client(nc);
+        for (i = 0; i < queues; i++) {
+            qemu_cleanup_net_client(ncs[i]);
+        }
         return;
     }
 
-    /* If this is a peer NIC and peer has already been deleted, free it now. */
-    if (nc->peer && nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
-        NICState *nic = DO_UPCAST(NICState, nc, nc);
-        if (nic->peer_deleted) {
-            qemu_free_net_client(nc->peer);
-        }
+    for (i = 0; i < queues; i++) {
+        qemu_cleanup_net_client(ncs[i]);
+        qemu_free_net_client(ncs[i]);
     }
-
-    qemu_cleanup_net_client(nc);
-    qemu_free_net_client(nc);
 }
 
 void qemu_foreach_nic(qemu_nic_foreach func, void *opaque)
@@ -290,7 +388,8 @@ void qemu_foreach_nic(qemu_nic_foreach func, void *opaque)
     NetClientState *nc;
 
     QTAILQ_FOREACH(nc, &net_clients, next) {
-        if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
+        if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC &&
+            nc->queue_index == 0) {
             func(DO_UPCAST(NICState, nc, nc), opaque);
         }
     }
@@ -443,6 +542,34 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
+int qemu_deliver_packet_batch(const struct iovec *packets,
+                              int count,
+                              void *opaque)
+{
+    NetClientState *nc = opaque;
+    int ret;
+
+    if (!nc->info->receive_batch) {
+        return -ENOTSUP;
+    }
+
+    if (nc->link_down) {
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    ret = nc->info->receive_batch(nc, packets, count);
+
+    if (ret == 0) {
+        nc->receive_disabled = 1;
+    }
+
+    return ret;
+}
+
 ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                 const struct iovec *iov, int iovcnt,
                                 NetPacketSent *sent_cb)
@@ -481,6 +608,24 @@ NetClientState *qemu_find_netdev(const char *id)
     return NULL;
 }
 
+int qemu_find_net_clients_except(const char *id, NetClientState **ncs,
+                                 NetClientOptionsKind type, int max)
+{
+    NetClientState *nc;
+    int ret = 0;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        if (nc->info->type == type) {
+            continue;
+        }
+        if (!strcmp(nc->name, id) && ret < max) {
+            ncs[ret++] = nc;
+        }
+    }
+
+    return ret;
+}
+
 static int nic_get_free_idx(void)
 {
     int index;
@@ -679,6 +824,19 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
             return -1;
         }
     }
+
+    if (is_netdev && u.netdev->has_queue_bytes) {
+        NetClientState *ncs[MAX_QUEUE_NUM];
+        int queues, i;
+
+        queues = qemu_find_net_clients_except(name, ncs,
+                                              NET_CLIENT_OPTIONS_KIND_NIC,
+                                              MAX_QUEUE_NUM);
+        for (i = 0; i < queues; i++) {
+            qemu_net_queue_set_max_bytes(ncs[i]->send_queue,
+                                         u.netdev->queue_bytes);
+        }
+    }
     return 0;
 }
 
@@ -879,20 +1037,22 @@ void do_info_network(Monitor *mon)
 
 void qmp_set_link(const char *name, bool up, Error **errp)
 {
-    NetClientState *nc = NULL;
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    NetClientState *nc;
+    int queues, i;
 
-    QTAILQ_FOREACH(nc, &net_clients, next) {
-        if (!strcmp(nc->name, name)) {
-            goto done;
-        }
-    }
-done:
-    if (!nc) {
+    queues = qemu_find_net_clients_except(name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_MAX,
+                                          MAX_QUEUE_NUM);
+    if (queues == 0) {
         error_set(errp, QERR_DEVICE_NOT_FOUND, name);
         return;
     }
+    nc = ncs[0];
 
-    nc->link_down = !up;
+    for (i = 0; i < queues; i++) {
+        ncs[i]->link_down = !up;
+    }
 
     if (nc->info->link_status_changed) {
         nc->info->link_status_changed(nc);
@@ -912,9 +1072,12 @@ done:
 
 void net_cleanup(void)
 {
-    NetClientState *nc, *next_vc;
+    NetClientState *nc;
 
-    QTAILQ_FOREACH_SAFE(nc, &net_clients, next, next_vc) {
+    /* Deleting a client may delete its sibling queues as well, so not
+     * even QTAILQ_FOREACH_SAFE() is safe here. */
+    while (!QTAILQ_EMPTY(&net_clients)) {
+        nc = QTAILQ_FIRST(&net_clients);
         qemu_del_net_client(nc);
     }
 }
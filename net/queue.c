@@ -24,6 +24,7 @@
 #include "net/queue.h"
 #include "qemu-queue.h"
 #include "net.h"
+#include "iov.h"
 
 /* The delivery handler may only return zero if it will call
  * qemu_net_queue_flush() when it determines that it is once again able
@@ -36,9 +37,24 @@
  * the packet.
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
- * unbounded queueing.
+ * unbounded queueing.  This happens once the queue holds more than
+ * nq_max_bytes of packet data; packets with a sent callback are always
+ * queued, since their sender stops until the callback is invoked.
+ *
+ * Packets of up to NET_PACKET_POOL_SIZE bytes are recycled through a
+ * per-queue free list instead of going back to the allocator, so that a
+ * queue under load does not allocate memory for every packet.
+ *
+ * If the receiver has a receive_batch handler, qemu_net_queue_flush()
+ * hands it up to NET_QUEUE_BATCH_MAX packets at a time.
  */
 
+/* Large enough for an Ethernet frame with a VLAN tag and a vnet header */
+#define NET_PACKET_POOL_SIZE  2048
+#define NET_QUEUE_POOL_MAX    256
+
+#define NET_QUEUE_BATCH_MAX   64
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
@@ -50,9 +66,15 @@ struct NetPacket {
 
 struct NetQueue {
     void *opaque;
+    size_t nq_bytes;
+    size_t nq_max_bytes;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
 
+    /* free packets of NET_PACKET_POOL_SIZE bytes */
+    QTAILQ_HEAD(, NetPacket) pool;
+    int pool_count;
+
     unsigned delivering : 1;
 };
 
@@ -63,14 +85,26 @@ NetQueue *qemu_new_net_queue(void *opaque)
     queue = g_malloc0(sizeof(NetQueue));
 
     queue->opaque = opaque;
+    queue->nq_max_bytes = NET_QUEUE_DEFAULT_MAX_BYTES;
 
     QTAILQ_INIT(&queue->packets);
+    QTAILQ_INIT(&queue->pool);
 
     queue->delivering = 0;
 
     return queue;
 }
 
+void qemu_net_queue_set_max_bytes(NetQueue *queue, size_t max_bytes)
+{
+    queue->nq_max_bytes = max_bytes;
+}
+
+size_t qemu_net_queue_bytes(NetQueue *queue)
+{
+    return queue->nq_bytes;
+}
+
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
@@ -79,10 +113,51 @@ void qemu_del_net_queue(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         g_free(packet);
     }
+    QTAILQ_FOREACH_SAFE(packet, &queue->pool, entry, next) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
+        g_free(packet);
+    }
 
     g_free(queue);
 }
 
+static NetPacket *qemu_net_packet_alloc(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+
+    if (size > NET_PACKET_POOL_SIZE) {
+        return g_malloc(sizeof(NetPacket) + size);
+    }
+
+    packet = QTAILQ_FIRST(&queue->pool);
+    if (packet) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
+        queue->pool_count--;
+        return packet;
+    }
+    return g_malloc(sizeof(NetPacket) + NET_PACKET_POOL_SIZE);
+}
+
+/* The packet must already be off the queue */
+static void qemu_net_packet_free(NetQueue *queue, NetPacket *packet)
+{
+    queue->nq_bytes -= packet->size;
+
+    if (packet->size > NET_PACKET_POOL_SIZE ||
+        queue->pool_count >= NET_QUEUE_POOL_MAX) {
+        g_free(packet);
+        return;
+    }
+    QTAILQ_INSERT_HEAD(&queue->pool, packet, entry);
+    queue->pool_count++;
+}
+
+static bool qemu_net_queue_full(NetQueue *queue, size_t size,
+                                NetPacketSent *sent_cb)
+{
+    return !sent_cb && queue->nq_bytes + size > queue->nq_max_bytes;
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -92,13 +167,18 @@ static void qemu_net_queue_append(NetQueue *queue,
 {
     NetPacket *packet;
 
-    packet = g_malloc(sizeof(NetPacket) + size);
+    if (qemu_net_queue_full(queue, size, sent_cb)) {
+        return; /* drop */
+    }
+
+    packet = qemu_net_packet_alloc(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
     memcpy(packet->data, buf, size);
 
+    queue->nq_bytes += size;
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
 }
 
@@ -110,26 +190,19 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
                                       NetPacketSent *sent_cb)
 {
     NetPacket *packet;
-    size_t max_len = 0;
-    int i;
+    size_t max_len = iov_size(iov, iovcnt);
 
-    for (i = 0; i < iovcnt; i++) {
-        max_len += iov[i].iov_len;
+    if (qemu_net_queue_full(queue, max_len, sent_cb)) {
+        return; /* drop */
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_packet_alloc(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
-    packet->size = 0;
-
-    for (i = 0; i < iovcnt; i++) {
-        size_t len = iov[i].iov_len;
-
-        memcpy(packet->data + packet->size, iov[i].iov_base, len);
-        packet->size += len;
-    }
+    packet->size = iov_to_buf(iov, iovcnt, 0, packet->data, max_len);
 
+    queue->nq_bytes += packet->size;
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
 }
 
@@ -220,17 +293,74 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
-            g_free(packet);
+            qemu_net_packet_free(queue, packet);
         }
     }
 }
 
+/*
+ * Hand the packets at the head of the queue to the receiver in one go.
+ * Returns the number of packets sent, 0 if the receiver is full and a
+ * negative value if it cannot take a batch.
+ */
+static int qemu_net_queue_flush_batch(NetQueue *queue)
+{
+    QTAILQ_HEAD(, NetPacket) sent;
+    struct iovec iov[NET_QUEUE_BATCH_MAX];
+    NetPacket *packet;
+    int count = 0, ret, i;
+
+    QTAILQ_FOREACH(packet, &queue->packets, entry) {
+        if (count == NET_QUEUE_BATCH_MAX ||
+            packet->flags != QEMU_NET_PACKET_FLAG_NONE) {
+            break;
+        }
+        iov[count].iov_base = packet->data;
+        iov[count].iov_len = packet->size;
+        count++;
+    }
+    if (count < 2) {
+        return -ENOTSUP;
+    }
+
+    queue->delivering = 1;
+    ret = qemu_deliver_packet_batch(iov, count, queue->opaque);
+    queue->delivering = 0;
+    if (ret <= 0) {
+        return ret;
+    }
+
+    /* Take all of them off the queue first, a sent callback may send
+     * more packets and flush the queue again */
+    QTAILQ_INIT(&sent);
+    for (i = 0; i < ret; i++) {
+        packet = QTAILQ_FIRST(&queue->packets);
+        QTAILQ_REMOVE(&queue->packets, packet, entry);
+        QTAILQ_INSERT_TAIL(&sent, packet, entry);
+    }
+    while ((packet = QTAILQ_FIRST(&sent))) {
+        QTAILQ_REMOVE(&sent, packet, entry);
+        if (packet->sent_cb) {
+            packet->sent_cb(packet->sender, packet->size);
+        }
+        qemu_net_packet_free(queue, packet);
+    }
+    return ret;
+}
+
 bool qemu_net_queue_flush(NetQueue *queue)
 {
     while (!QTAILQ_EMPTY(&queue->packets)) {
         NetPacket *packet;
         int ret;
 
+        ret = qemu_net_queue_flush_batch(queue);
+        if (ret == 0) {
+            return false;
+        } else if (ret > 0) {
+            continue;
+        }
+
         packet = QTAILQ_FIRST(&queue->packets);
         QTAILQ_REMOVE(&queue->packets, packet, entry);
 
@@ -248,7 +378,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_packet_free(queue, packet);
     }
     return true;
 }
@@ -34,10 +34,16 @@ typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
 
+/* Packets without a sent callback are dropped beyond this */
+#define NET_QUEUE_DEFAULT_MAX_BYTES (1024 * 1024)
+
 NetQueue *qemu_new_net_queue(void *opaque);
 
 void qemu_del_net_queue(NetQueue *queue);
 
+void qemu_net_queue_set_max_bytes(NetQueue *queue, size_t max_bytes);
+size_t qemu_net_queue_bytes(NetQueue *queue);
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
                             unsigned flags,
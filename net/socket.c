@@ -124,6 +124,54 @@ static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t
     return size;
 }
 
+/* Send several packets with a single writev() */
+static int net_socket_receive_batch(NetClientState *nc,
+                                    const struct iovec *packets, int count)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    uint32_t lens[count];
+    struct iovec iov[count * 2];
+    size_t remaining, done;
+    ssize_t ret;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        lens[i] = htonl(packets[i].iov_len);
+        iov[i * 2].iov_base = &lens[i];
+        iov[i * 2].iov_len = sizeof(lens[i]);
+        iov[i * 2 + 1] = packets[i];
+    }
+
+    remaining = iov_size(iov, count * 2) - s->send_index;
+    ret = iov_send(s->fd, iov, count * 2, s->send_index, remaining);
+
+    if (ret == -1 && errno == EAGAIN) {
+        ret = 0; /* handled further down */
+    }
+    if (ret == -1) {
+        /* Drop the first packet, like net_socket_receive() does */
+        s->send_index = 0;
+        return 1;
+    }
+
+    /* Count the packets that went out completely, and remember how
+     * much of the next one did */
+    done = s->send_index + ret;
+    for (i = 0; i < count; i++) {
+        size_t len = sizeof(uint32_t) + packets[i].iov_len;
+
+        if (done < len) {
+            break;
+        }
+        done -= len;
+    }
+    s->send_index = done;
+    if (i < count) {
+        net_socket_write_poll(s, true);
+    }
+    return i;
+}
+
 static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
@@ -142,6 +190,40 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
     return ret;
 }
 
+#ifdef CONFIG_SENDMMSG
+/* Send several datagrams with a single sendmmsg() */
+static int net_socket_receive_batch_dgram(NetClientState *nc,
+                                          const struct iovec *packets,
+                                          int count)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    struct mmsghdr msgs[count];
+    int ret, i;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < count; i++) {
+        msgs[i].msg_hdr.msg_name = &s->dgram_dst;
+        msgs[i].msg_hdr.msg_namelen = sizeof(s->dgram_dst);
+        msgs[i].msg_hdr.msg_iov = (struct iovec *)&packets[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    do {
+        ret = sendmmsg(s->fd, msgs, count, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1 && errno == EAGAIN) {
+        net_socket_write_poll(s, true);
+        return 0;
+    }
+    if (ret == -1) {
+        /* Drop the first packet, like net_socket_receive_dgram() does */
+        return 1;
+    }
+    return ret;
+}
+#endif
+
 static void net_socket_send(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -338,6 +420,9 @@ static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
+#ifdef CONFIG_SENDMMSG
+    .receive_batch = net_socket_receive_batch_dgram,
+#endif
     .cleanup = net_socket_cleanup,
 };
 
@@ -420,6 +505,7 @@ static NetClientInfo net_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive,
+    .receive_batch = net_socket_receive_batch,
     .cleanup = net_socket_cleanup,
 };
 
@@ -0,0 +1,346 @@
+/*
+ * Post-copy live migration of RAM, destination side
+ *
+ * Guest RAM that has not arrived yet is left unpopulated and registered
+ * with userfaultfd.  Any access to it, from a vCPU, from KVM or from
+ * device emulation, blocks until the page has been fetched from the
+ * source and placed with UFFDIO_COPY.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "cpu.h"
+#include "qemu-file.h"
+#include "qemu-thread.h"
+#include "main-loop.h"
+#include "qemu_socket.h"
+#include "event_notifier.h"
+#include "migration.h"
+#include "postcopy-ram.h"
+#include "trace.h"
+
+#ifdef CONFIG_POSTCOPY_RAM
+
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <linux/userfaultfd.h>
+
+typedef struct PostcopyIncoming {
+    QEMUFile *file;
+    int fd;                     /* return path to the source */
+    int uffd;
+    EventNotifier quit;
+    QemuThread fault_thread;
+    QemuThread listen_thread;
+} PostcopyIncoming;
+
+static PostcopyIncoming *postcopy_incoming;
+static bool postcopy_incoming_started;
+
+bool postcopy_ram_incoming_started(void)
+{
+    return postcopy_incoming_started;
+}
+
+int postcopy_ram_discard_range(void *host, size_t length)
+{
+    trace_postcopy_ram_discard_range(host, length);
+    if (qemu_madvise(host, length, QEMU_MADV_DONTNEED) < 0) {
+        error_report("postcopy: failed to discard %zu bytes at %p: %s",
+                     length, host, strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+int postcopy_place_page(void *host, const void *from)
+{
+    struct uffdio_copy copy = {
+        .dst = (uintptr_t)host,
+        .src = (uintptr_t)from,
+        .len = TARGET_PAGE_SIZE,
+    };
+
+    /* EEXIST means the page has already been placed by an earlier copy */
+    if (ioctl(postcopy_incoming->uffd, UFFDIO_COPY, &copy) < 0 &&
+        errno != EEXIST) {
+        error_report("postcopy: failed to place page at %p: %s",
+                     host, strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+int postcopy_place_zero_page(void *host)
+{
+    struct uffdio_zeropage zero = {
+        .range.start = (uintptr_t)host,
+        .range.len = TARGET_PAGE_SIZE,
+    };
+
+    if (ioctl(postcopy_incoming->uffd, UFFDIO_ZEROPAGE, &zero) < 0 &&
+        errno != EEXIST) {
+        error_report("postcopy: failed to place zero page at %p: %s",
+                     host, strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+static RAMBlock *postcopy_find_block(uint8_t *host, ram_addr_t *offset)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (host >= block->host && host < block->host + block->length) {
+            *offset = host - block->host;
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/* See migration.h for the layout of a return path request */
+static int postcopy_request_page(PostcopyIncoming *pc, RAMBlock *block,
+                                 ram_addr_t offset)
+{
+    uint8_t msg[POSTCOPY_REQUEST_MAX_SIZE];
+    size_t idlen = strlen(block->idstr);
+    size_t len = 0;
+
+    msg[len++] = idlen;
+    memcpy(msg + len, block->idstr, idlen);
+    len += idlen;
+    stq_be_p(msg + len, offset);
+    len += 8;
+    stl_be_p(msg + len, TARGET_PAGE_SIZE);
+    len += 4;
+
+    return send_all(pc->fd, msg, len) == len ? 0 : -EIO;
+}
+
+static void *postcopy_ram_fault_thread(void *opaque)
+{
+    PostcopyIncoming *pc = opaque;
+    struct pollfd pfd[2];
+
+    pfd[0].fd = pc->uffd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = event_notifier_get_fd(&pc->quit);
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        struct uffd_msg msg;
+        RAMBlock *block;
+        ram_addr_t offset;
+        uint8_t *host;
+        ssize_t len;
+
+        if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("postcopy: poll failed: %s", strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        len = read(pc->uffd, &msg, sizeof(msg));
+        if (len != sizeof(msg)) {
+            if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            error_report("postcopy: failed to read userfault event");
+            break;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        host = (uint8_t *)(uintptr_t)(msg.arg.pagefault.address &
+                                      ~(uint64_t)(TARGET_PAGE_SIZE - 1));
+        block = postcopy_find_block(host, &offset);
+        if (!block) {
+            error_report("postcopy: fault at %p outside of guest RAM", host);
+            continue;
+        }
+
+        trace_postcopy_ram_fault(host, block->idstr, offset);
+        if (postcopy_request_page(pc, block, offset) < 0) {
+            error_report("postcopy: failed to request page from source");
+            exit(1);
+        }
+    }
+
+    return NULL;
+}
+
+static void postcopy_ram_unregister(PostcopyIncoming *pc)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        struct uffdio_range range = {
+            .start = (uintptr_t)block->host,
+            .len = block->length,
+        };
+
+        /* This also wakes up anybody still waiting on a missing page,
+         * which can only be a page that the source never sent because
+         * it was all zeroes. */
+        ioctl(pc->uffd, UFFDIO_UNREGISTER, &range);
+    }
+}
+
+static int postcopy_ram_register(PostcopyIncoming *pc)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        struct uffdio_register reg = {
+            .range.start = (uintptr_t)block->host,
+            .range.len = block->length,
+            .mode = UFFDIO_REGISTER_MODE_MISSING,
+        };
+
+        if (ioctl(pc->uffd, UFFDIO_REGISTER, &reg) < 0) {
+            error_report("postcopy: failed to register RAM block %s: %s",
+                         block->idstr, strerror(errno));
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+static void *postcopy_ram_listen_thread(void *opaque)
+{
+    PostcopyIncoming *pc = opaque;
+    int ret;
+
+    ret = ram_postcopy_load(pc->file);
+    if (ret < 0) {
+        /* The guest is already running here and the source has stopped,
+         * so there is nowhere to fetch the missing memory from. */
+        error_report("postcopy: lost the migration stream: %s",
+                     strerror(-ret));
+        exit(1);
+    }
+
+    event_notifier_set(&pc->quit);
+    qemu_thread_join(&pc->fault_thread);
+    postcopy_ram_unregister(pc);
+
+    postcopy_incoming = NULL;
+
+    close(pc->uffd);
+    event_notifier_cleanup(&pc->quit);
+    qemu_fclose(pc->file);
+    g_free(pc);
+
+    trace_postcopy_ram_incoming_end();
+    return NULL;
+}
+
+int postcopy_ram_incoming_start(QEMUFile *f)
+{
+    PostcopyIncoming *pc;
+    struct uffdio_api api = { .api = UFFD_API };
+    int ret;
+
+    if (qemu_real_host_page_size != TARGET_PAGE_SIZE) {
+        error_report("postcopy: target page size differs from host page size");
+        return -ENOTSUP;
+    }
+
+    pc = g_malloc0(sizeof(*pc));
+    pc->file = f;
+    pc->fd = qemu_get_fd(f);
+    if (pc->fd < 0) {
+        error_report("postcopy: migration stream has no return path");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    pc->uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (pc->uffd < 0) {
+        error_report("postcopy: userfaultfd not available: %s",
+                     strerror(errno));
+        ret = -errno;
+        goto fail;
+    }
+    if (ioctl(pc->uffd, UFFDIO_API, &api) < 0) {
+        error_report("postcopy: userfaultfd API mismatch: %s",
+                     strerror(errno));
+        ret = -errno;
+        goto fail_uffd;
+    }
+
+    ret = postcopy_ram_register(pc);
+    if (ret < 0) {
+        goto fail_register;
+    }
+
+    ret = event_notifier_init(&pc->quit, false);
+    if (ret < 0) {
+        goto fail_register;
+    }
+
+    /* The stream now belongs to the post-copy threads, which block on it */
+    qemu_set_fd_handler(pc->fd, NULL, NULL, NULL);
+    socket_set_block(pc->fd);
+
+    postcopy_incoming = pc;
+    postcopy_incoming_started = true;
+    trace_postcopy_ram_incoming_start();
+
+    qemu_thread_create(&pc->fault_thread, postcopy_ram_fault_thread, pc,
+                       QEMU_THREAD_JOINABLE);
+    qemu_thread_create(&pc->listen_thread, postcopy_ram_listen_thread, pc,
+                       QEMU_THREAD_DETACHED);
+    return 0;
+
+fail_register:
+    postcopy_ram_unregister(pc);
+fail_uffd:
+    close(pc->uffd);
+fail:
+    g_free(pc);
+    return ret;
+}
+
+#else /* !CONFIG_POSTCOPY_RAM */
+
+bool postcopy_ram_incoming_started(void)
+{
+    return false;
+}
+
+int postcopy_ram_discard_range(void *host, size_t length)
+{
+    error_report("postcopy: not supported on this host");
+    return -ENOTSUP;
+}
+
+int postcopy_place_page(void *host, const void *from)
+{
+    abort();
+}
+
+int postcopy_place_zero_page(void *host)
+{
+    abort();
+}
+
+int postcopy_ram_incoming_start(QEMUFile *f)
+{
+    error_report("postcopy: not supported on this host");
+    return -ENOTSUP;
+}
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * Post-copy live migration of RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_POSTCOPY_RAM_H
+#define QEMU_POSTCOPY_RAM_H
+
+#include "qemu-common.h"
+
+/*
+ * Destination side.  Once postcopy_ram_incoming_start() returns, guest
+ * RAM is registered with userfaultfd: a thread turns faults on missing
+ * pages into requests on the return path, and another thread receives
+ * pages from @f and places them atomically.  Both threads go away when
+ * the source has sent every page, and close @f.
+ */
+int postcopy_ram_incoming_start(QEMUFile *f);
+
+/* True once the incoming stream has been handed to post-copy */
+bool postcopy_ram_incoming_started(void);
+
+/* Drop pages that became dirty on the source after they were sent */
+int postcopy_ram_discard_range(void *host, size_t length);
+
+/* Only valid from the post-copy receive thread */
+int postcopy_place_page(void *host, const void *from);
+int postcopy_place_zero_page(void *host);
+
+#endif
@@ -63,6 +63,20 @@ typedef struct AioContext {
 
     /* Used for aio_notify.  */
     EventNotifier notifier;
+
+    /* Scratch array of descriptors for poll(), rebuilt by aio_poll */
+    GArray *pollfds;
+
+#ifdef CONFIG_EPOLL
+    /* When epoll is usable, handlers are registered with epollfd as they
+     * come and go, and only epollfd itself is exposed to the GSource.  */
+    bool epoll_enabled;
+    int epollfd;
+    GPollFD epoll_pfd;
+
+    /* Set when a handler was only marked as deleted, see aio_poll */
+    bool handlers_deleted;
+#endif
 } AioContext;
 
 /* Returns 1 if there are still outstanding AIO requests; 0 otherwise */
@@ -77,6 +91,16 @@ typedef int (AioFlushEventNotifierHandler)(EventNotifier *e);
  */
 AioContext *aio_context_new(void);
 
+/**
+ * aio_context_setup: Initialize the host-specific parts of an AioContext.
+ * aio_context_cleanup: Release them.
+ *
+ * Implemented by aio-posix.c and aio-win32.c, and only called by
+ * aio_context_new and when the context is finalized.
+ */
+void aio_context_setup(AioContext *ctx);
+void aio_context_cleanup(AioContext *ctx);
+
 /**
  * aio_context_ref:
  * @ctx: The AioContext to operate on.
@@ -127,6 +127,15 @@ static inline char *realpath(const char *path, char *resolved_path)
 void configure_icount(const char *option);
 extern int use_icount;
 
+/* multithreaded TCG: one host thread per vCPU */
+void configure_tcg_threads(const char *option);
+extern bool mttcg_enabled;
+
+/* Number of executions after which a TB is retranslated as a superblock,
+   0 to disable.  Only targets defining TARGET_SUPPORTS_SUPERBLOCKS count
+   executions.  */
+extern int tb_hot_threshold;
+
 /* FIXME: Remove NEED_CPU_H.  */
 #ifndef NEED_CPU_H
 
@@ -335,6 +344,7 @@ struct qemu_work_item {
     void (*func)(void *data);
     void *data;
     int done;
+    bool free;
 };
 
 #ifdef CONFIG_USER_ONLY
@@ -114,6 +114,26 @@ static QemuOptsList qemu_drive_opts = {
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
             .help = "copy read data from backing file into image file",
+        },{
+            .name = "l2-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the image format's L2 table cache",
+        },{
+            .name = "l2-cache-coverage",
+            .type = QEMU_OPT_SIZE,
+            .help = "amount of guest disk mapped by the L2 table cache",
+        },{
+            .name = "refcount-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the image format's refcount block cache",
+        },{
+            .name = "prealloc-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "host storage to reserve ahead of new image clusters",
+        },{
+            .name = "lazy-refcounts",
+            .type = QEMU_OPT_BOOL,
+            .help = "defer refcount updates of the image format",
         },{
             .name = "boot",
             .type = QEMU_OPT_BOOL,
@@ -627,6 +647,11 @@ static QemuOptsList qemu_machine_opts = {
             .name = "usb",
             .type = QEMU_OPT_BOOL,
             .help = "Set on/off to enable/disable usb",
+        }, {
+            .name = "tcg-thread",
+            .type = QEMU_OPT_STRING,
+            .help = "single or multi, run all vCPUs in one TCG thread or "
+                    "each in its own",
         },
         { /* End of list */ }
     },
@@ -30,6 +30,7 @@
 #include "osdep.h"
 #include "sysemu.h"
 #include "block_int.h"
+#include "qemu-timer.h"
 #include <getopt.h>
 #include <stdio.h>
 
@@ -88,6 +89,8 @@ static void help(void)
            "  '-p' show progress of command (only certain commands)\n"
            "  '-S' indicates the consecutive number of bytes that must contain only zeros\n"
            "       for qemu-img to create a sparse image during conversion\n"
+           "  '-m' number of parallel coroutines for convert (1 to 16, default 1)\n"
+           "  '-W' allow convert to write to the target out of order (requires '-m')\n"
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "\n"
            "Parameters to check subcommand:\n"
@@ -658,6 +661,274 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+#define MAX_COROUTINES 16
+
+enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_ZERO,
+    BLK_BACKING_FILE,
+};
+
+/* State of a convert with several requests in flight, see convert_do_copy */
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int src_cur;
+    int64_t src_cur_offset;
+    int64_t total_sectors;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool target_has_backing;
+    int min_sparse;
+    int num_coroutines;
+    bool wr_in_order;
+
+    CoMutex lock;               /* protects sector_num and src_cur */
+    int64_t sector_num;         /* first sector that nobody has claimed */
+    int64_t wr_offs;            /* in order: next sector that may be written */
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    float local_progress;
+    int ret;
+} ImgConvertState;
+
+/* Returns the source image that @sector_num is in; sectors are claimed in
+ * increasing order, so the search only ever moves forward.  */
+static void convert_select_part(ImgConvertState *s, int64_t sector_num)
+{
+    while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
+        s->src_cur_offset += s->src_sectors[s->src_cur];
+        s->src_cur++;
+        assert(s->src_cur < s->src_num);
+    }
+}
+
+/* Claims the next chunk of the image.  Returns its length in sectors, or 0
+ * at the end of the image, and stores what it contains in @status.  */
+static int coroutine_fn convert_co_claim(ImgConvertState *s,
+                                         int64_t *sector_num,
+                                         enum ImgConvertBlockStatus *status,
+                                         BlockDriverState **src,
+                                         int64_t *src_sector)
+{
+    int64_t left;
+    int len, n, ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    left = s->total_sectors - s->sector_num;
+    if (left <= 0 || s->ret != -EINPROGRESS) {
+        qemu_co_mutex_unlock(&s->lock);
+        return 0;
+    }
+
+    convert_select_part(s, s->sector_num);
+    *sector_num = s->sector_num;
+    *src = s->src[s->src_cur];
+    *src_sector = s->sector_num - s->src_cur_offset;
+    len = MIN(left, IO_BUF_SIZE / BDRV_SECTOR_SIZE);
+    len = MIN(len, s->src_sectors[s->src_cur] - *src_sector);
+    n = len;
+
+    if (s->target_has_backing && s->has_zero_init) {
+        /* Sectors that are unallocated in the input are left to the
+         * output's backing file, as in the serial path */
+        ret = bdrv_co_is_allocated(*src, *src_sector, n, &n);
+        *status = ret > 0 ? BLK_DATA : BLK_BACKING_FILE;
+    } else {
+        /* Sectors that nobody in the backing chain has written are zero */
+        ret = bdrv_co_is_allocated_above(*src, NULL, *src_sector, n, &n);
+        *status = ret > 0 ? BLK_DATA : BLK_ZERO;
+    }
+    if (ret < 0) {
+        error_report("error while reading block status of sector %" PRId64
+                     ": %s", *src_sector, strerror(-ret));
+        s->ret = ret;
+        n = 0;
+    } else if (n == 0) {
+        /* A backing file that is shorter than the image reports nothing
+         * past its end; just read the chunk */
+        n = len;
+        *status = BLK_DATA;
+    }
+
+    s->sector_num += n;
+    qemu_co_mutex_unlock(&s->lock);
+    return n;
+}
+
+/* Wakes up the coroutine that waits to write at s->wr_offs, or all waiting
+ * coroutines after an error */
+static void convert_wake_waiters(ImgConvertState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] != -1 &&
+            (s->ret != -EINPROGRESS || s->wait_sector_num[i] == s->wr_offs)) {
+            s->wait_sector_num[i] = -1;
+            qemu_coroutine_enter(s->co[i], NULL);
+        }
+    }
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int n, uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    bool write;
+    int ret, n1;
+
+    switch (status) {
+    case BLK_BACKING_FILE:
+        return 0;
+    case BLK_ZERO:
+        if (s->has_zero_init) {
+            return 0;
+        }
+        return bdrv_co_write_zeroes(s->target, sector_num, n);
+    case BLK_DATA:
+        break;
+    }
+
+    while (n > 0) {
+        /* Same sparse detection as the serial path */
+        if (s->has_zero_init && !s->target_has_backing) {
+            write = is_allocated_sectors_min(buf, n, &n1, s->min_sparse);
+        } else {
+            write = true;
+            n1 = n;
+        }
+        if (write) {
+            iov.iov_base = buf;
+            iov.iov_len = n1 * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_writev(s->target, sector_num, n1, &qiov);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        sector_num += n1;
+        n -= n1;
+        buf += n1 * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int index = -1;
+    int i, n, ret;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    buf = qemu_blockalign(s->target, IO_BUF_SIZE);
+
+    for (;;) {
+        enum ImgConvertBlockStatus status;
+        BlockDriverState *src;
+        int64_t sector_num, src_sector;
+
+        n = convert_co_claim(s, &sector_num, &status, &src, &src_sector);
+        if (n == 0) {
+            break;
+        }
+
+        if (status == BLK_DATA) {
+            QEMUIOVector qiov;
+            struct iovec iov = {
+                .iov_base = buf,
+                .iov_len = n * BDRV_SECTOR_SIZE,
+            };
+
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_readv(src, src_sector, n, &qiov);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64 ": %s",
+                             src_sector, strerror(-ret));
+                s->ret = ret;
+                break;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* Chunks are claimed in order, so the one that s->wr_offs
+             * waits for is never stuck behind us */
+            while (s->ret == -EINPROGRESS && s->wr_offs != sector_num) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            if (s->ret != -EINPROGRESS) {
+                break;
+            }
+        }
+
+        ret = convert_co_write(s, sector_num, n, buf, status);
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64 ": %s",
+                         sector_num, strerror(-ret));
+            s->ret = ret;
+            break;
+        }
+
+        if (s->wr_in_order) {
+            s->wr_offs = sector_num + n;
+            convert_wake_waiters(s);
+        }
+        qemu_progress_print(s->local_progress * n, 100);
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (s->ret != -EINPROGRESS) {
+        convert_wake_waiters(s);
+    }
+}
+
+/* Copies all the sources to the target with s->num_coroutines requests in
+ * flight.  Unless s->wr_in_order is set, writes complete in whatever order
+ * the reads do.  */
+static int convert_do_copy(ImgConvertState *s)
+{
+    int i;
+
+    qemu_co_mutex_init(&s->lock);
+    s->ret = -EINPROGRESS;
+    if (s->total_sectors != 0) {
+        s->local_progress = (float)100 / s->total_sectors;
+    }
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+    }
+    s->running_coroutines = s->num_coroutines;
+    for (i = 0; i < s->num_coroutines; i++) {
+        qemu_coroutine_enter(s->co[i], s);
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+
+    if (s->ret == -EINPROGRESS) {
+        s->ret = 0;
+    }
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
     int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
@@ -676,6 +947,9 @@ static int img_convert(int argc, char **argv)
     const char *snapshot_name = NULL;
     float local_progress = 0;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
+    int num_coroutines = 1;
+    bool wr_in_order = true;
+    int64_t start_time = 0, elapsed = -1;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -683,7 +957,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:m:W");
         if (c == -1) {
             break;
         }
@@ -737,9 +1011,30 @@ static int img_convert(int argc, char **argv)
         case 't':
             cache = optarg;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
+    if (!wr_in_order && num_coroutines == 1) {
+        error_report("Out of order writes (-W) require parallel conversion "
+                     "(-m with more than one coroutine)");
+        return 1;
+    }
+
     bs_n = argc - optind - 1;
     if (bs_n < 1) {
         help();
@@ -763,6 +1058,7 @@ static int img_convert(int argc, char **argv)
     }
 
     qemu_progress_print(0, 100);
+    start_time = get_clock();
 
     bs = g_malloc0(bs_n * sizeof(BlockDriverState *));
 
@@ -983,6 +1279,26 @@ static int img_convert(int argc, char **argv)
         }
         /* signal EOF to align */
         bdrv_write_compressed(out_bs, 0, NULL, 0);
+    } else if (num_coroutines > 1) {
+        ImgConvertState state = {
+            .src = bs,
+            .src_num = bs_n,
+            .total_sectors = total_sectors,
+            .target = out_bs,
+            .has_zero_init = bdrv_has_zero_init(out_bs),
+            .target_has_backing = !!out_baseimg,
+            .min_sparse = min_sparse,
+            .num_coroutines = num_coroutines,
+            .wr_in_order = wr_in_order,
+        };
+
+        state.src_sectors = g_new(int64_t, bs_n);
+        for (bs_i = 0; bs_i < bs_n; bs_i++) {
+            bdrv_get_geometry(bs[bs_i], &bs_sectors);
+            state.src_sectors[bs_i] = bs_sectors;
+        }
+        ret = convert_do_copy(&state);
+        g_free(state.src_sectors);
     } else {
         int has_zero_init = bdrv_has_zero_init(out_bs);
 
@@ -1071,8 +1387,20 @@ static int img_convert(int argc, char **argv)
             qemu_progress_print(local_progress, 100);
         }
     }
+    elapsed = get_clock() - start_time;
 out:
     qemu_progress_end();
+    if (progress && ret == 0 && elapsed >= 0) {
+        char size_buf[128], rate_buf[128];
+
+        get_human_readable_size(size_buf, sizeof(size_buf),
+                                total_sectors * BDRV_SECTOR_SIZE);
+        get_human_readable_size(rate_buf, sizeof(rate_buf),
+                                (double)total_sectors * BDRV_SECTOR_SIZE *
+                                get_ticks_per_sec() / MAX(elapsed, 1));
+        printf("Converted %s in %.3f seconds (%s/s)\n", size_buf,
+               (double)elapsed / get_ticks_per_sec(), rate_buf);
+    }
     free_option_parameters(create_options);
     free_option_parameters(param);
     qemu_vfree(buf);
@@ -1678,7 +1678,8 @@ static const cmdinfo_t close_cmd = {
     .oneline    = "close the current open file",
 };
 
-static int openfile(char *name, int flags, int growable)
+static int openfile(char *name, int flags, int growable,
+                    int64_t l2_cache_size, int64_t refcount_cache_size)
 {
     if (bs) {
         fprintf(stderr, "file open already, try 'help close'\n");
@@ -1692,6 +1693,8 @@ static int openfile(char *name, int flags, int growable)
         }
     } else {
         bs = bdrv_new("hda");
+        bdrv_set_metadata_cache_size(bs, l2_cache_size, 0,
+                                     refcount_cache_size);
 
         if (bdrv_open(bs, name, flags, NULL) < 0) {
             fprintf(stderr, "%s: can't open device %s\n", progname, name);
@@ -1717,7 +1720,9 @@ static void open_help(void)
 " -r, -- open file read-only\n"
 " -s, -- use snapshot file\n"
 " -n, -- disable host cache\n"
-" -g, -- allow file to grow (only applies to protocols)"
+" -g, -- allow file to grow (only applies to protocols)\n"
+" -L, -- size of the image format's L2 table cache\n"
+" -R, -- size of the image format's refcount block cache\n"
 "\n");
 }
 
@@ -1730,7 +1735,7 @@ static const cmdinfo_t open_cmd = {
     .argmin     = 1,
     .argmax     = -1,
     .flags      = CMD_NOFILE_OK,
-    .args       = "[-Crsn] [path]",
+    .args       = "[-Crsn] [-L size] [-R size] [path]",
     .oneline    = "open the file specified by path",
     .help       = open_help,
 };
@@ -1740,9 +1745,10 @@ static int open_f(int argc, char **argv)
     int flags = 0;
     int readonly = 0;
     int growable = 0;
+    int64_t l2_cache_size = 0, refcount_cache_size = 0;
     int c;
 
-    while ((c = getopt(argc, argv, "snrg")) != EOF) {
+    while ((c = getopt(argc, argv, "snrgL:R:")) != EOF) {
         switch (c) {
         case 's':
             flags |= BDRV_O_SNAPSHOT;
@@ -1756,6 +1762,21 @@ static int open_f(int argc, char **argv)
         case 'g':
             growable = 1;
             break;
+        case 'L':
+            l2_cache_size = cvtnum(optarg);
+            if (l2_cache_size < 0) {
+                printf("non-numeric L2 cache size argument -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'R':
+            refcount_cache_size = cvtnum(optarg);
+            if (refcount_cache_size < 0) {
+                printf("non-numeric refcount cache size argument -- %s\n",
+                       optarg);
+                return 0;
+            }
+            break;
         default:
             return command_usage(&open_cmd);
         }
@@ -1769,7 +1790,8 @@ static int open_f(int argc, char **argv)
         return command_usage(&open_cmd);
     }
 
-    return openfile(argv[optind], flags, growable);
+    return openfile(argv[optind], flags, growable, l2_cache_size,
+                    refcount_cache_size);
 }
 
 static int init_args_command(int index)
@@ -1926,7 +1948,7 @@ int main(int argc, char **argv)
     }
 
     if ((argc - optind) == 1) {
-        openfile(argv[optind], flags, growable);
+        openfile(argv[optind], flags, growable, 0, 0);
     }
     command_loop();
 
@@ -35,7 +35,8 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
-    "                mem-merge=on|off controls memory merge support (default: on)\n",
+    "                mem-merge=on|off controls memory merge support (default: on)\n"
+    "                tcg-thread=single|multi runs TCG vCPUs in one thread or one thread each (default: single)\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -machine [type=]@var{name}[,prop=@var{value}[,...]]
@@ -58,6 +59,11 @@ Include guest memory in a core dump. The default is on.
 Enables or disables memory merge support. This feature, when supported by
 the host, de-duplicates identical memory pages among VMs instances
 (enabled by default).
+@item tcg-thread=single|multi
+With the TCG accelerator, run all vCPUs in a single host thread
+(@code{single}, the default) or each vCPU in its own host thread
+(@code{multi}).  @code{multi} is only available for some host/target
+combinations and cannot be combined with @option{-icount}.
 @end table
 ETEXI
 
@@ -150,6 +156,8 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,l2-cache-size=size|,l2-cache-coverage=size][,refcount-cache-size=size]\n"
+    "       [,prealloc-size=size][,lazy-refcounts=on|off]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
@@ -204,6 +212,25 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item l2-cache-size=@var{size}
+Size in bytes of the cache of L2 tables kept by the image format (qcow2).
+Larger caches avoid re-reading metadata on random I/O to large images.
+@item l2-cache-coverage=@var{size}
+Alternative to @option{l2-cache-size}: make the L2 table cache large enough
+to map @var{size} bytes of guest disk, e.g. the whole disk.
+@item refcount-cache-size=@var{size}
+Size in bytes of the cache of refcount blocks kept by the image format.
+@item prealloc-size=@var{size}
+When the image format (qcow2) allocates new clusters at the end of the
+image file, reserve @var{size} more bytes of host storage after them with
+fallocate().  The file system can then keep the image file contiguous.  The
+image file does not grow until the space is used, and space that is still
+unused when the image is closed is released.
+@item lazy-refcounts=@var{lazy-refcounts}
+@var{lazy-refcounts} is "on" or "off" and overrides the setting of the image
+(qcow2 version 3 only).  With lazy refcounts, allocating writes do not wait
+for refcount updates to reach the disk.  If QEMU does not shut down cleanly,
+the refcounts are repaired the next time the image is opened.
 @end table
 
 By default, the @option{cache=writeback} mode is used. It will report data
@@ -1201,6 +1228,14 @@ everybody else.  'ignore' completely ignores the shared flag and
 allows everybody connect unconditionally.  Doesn't conform to the rfb
 spec but is traditional QEMU behavior.
 
+@item workers=@var{n}
+
+Encode framebuffer updates with @var{n} threads, between 1 (the default)
+and 16.  Updates of different clients are encoded in parallel; with the
+raw and hextile encodings, a large update of a single client is split
+across the threads as well.  Updates of a client are always sent in
+order.
+
 @end table
 ETEXI
 
@@ -1330,7 +1365,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net tap[,vlan=n][,name=str],ifname=name\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
 #else
-    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off]\n"
+    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off][,queues=n][,fds=x:y:...:z][,vhostfds=x:y:...:z]\n"
     "                connect the host TAP network interface to VLAN 'n' \n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                to configure it and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1347,6 +1382,10 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                    (only has effect for virtio guests which use MSIX)\n"
     "                use vhostforce=on to force vhost on for non-MSIX virtio guests\n"
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
+    "                use 'queues=n' to open 'n' queues of a multiqueue capable tap device,\n"
+    "                    each with its own vhost net device when vhost=on\n"
+    "                use 'fds=x:y:...:z' and 'vhostfds=x:y:...:z' to connect to the\n"
+    "                    already opened queues of a multiqueue tap device\n"
     "-net bridge[,vlan=n][,name=str][,br=bridge][,helper=helper]\n"
     "                connects a host TAP network interface to a host bridge device 'br'\n"
     "                (default=" DEFAULT_BRIDGE_INTERFACE ") using the program 'helper'\n"
@@ -1380,7 +1419,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
 #ifdef CONFIG_VDE
     "vde|"
 #endif
-    "socket],id=str[,option][,option][,...]\n", QEMU_ARCH_ALL)
+    "socket],id=str[,queue-bytes=n][,option][,option][,...]\n"
+    "                queue-bytes=n bounds the packets waiting for delivery\n"
+    "                to the backend to n bytes (default 1M)\n", QEMU_ARCH_ALL)
 STEXI
 @item -net nic[,vlan=@var{n}][,macaddr=@var{mac}][,model=@var{type}] [,name=@var{name}][,addr=@var{addr}][,vectors=@var{v}]
 @findex -net
@@ -1400,6 +1441,11 @@ Valid values for @var{type} are
 Not all devices are supported on all targets.  Use @code{-net nic,model=help}
 for a list of available devices for your target.
 
+Every @option{-netdev} backend accepts @option{queue-bytes=@var{n}}.  When
+the backend cannot take packets, QEMU queues them until it can; once
+@var{n} bytes are queued (1M by default), further packets whose sender
+does not wait for completion are dropped.
+
 @item -netdev user,id=@var{id}[,@var{option}][,@var{option}][,...]
 @item -net user[,@var{option}][,@var{option}][,...]
 Use the user mode network stack which requires no administrator
@@ -1547,7 +1593,7 @@ processed and applied to -net user. Mixing them with the new configuration
 syntax gives undefined results. Their use for new applications is discouraged
 as they will be removed from future versions.
 
-@item -netdev tap,id=@var{id}[,fd=@var{h}][,ifname=@var{name}][,script=@var{file}][,downscript=@var{dfile}][,helper=@var{helper}]
+@item -netdev tap,id=@var{id}[,fd=@var{h}][,ifname=@var{name}][,script=@var{file}][,downscript=@var{dfile}][,helper=@var{helper}][,queues=@var{n}]
 @item -net tap[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}][,ifname=@var{name}][,script=@var{file}][,downscript=@var{dfile}][,helper=@var{helper}]
 Connect the host TAP network interface @var{name} to VLAN @var{n}.
 
@@ -1565,6 +1611,13 @@ helper executable is @file{/usr/local/libexec/qemu-bridge-helper}.
 @option{fd}=@var{h} can be used to specify the handle of an already
 opened host TAP interface.
 
+@option{queues}=@var{n} opens @var{n} queues of a multiqueue capable TAP
+interface.  Together with @option{mq=on} on a virtio-net device, each queue
+backs one of the guest's queue pairs and, with @option{vhost=on}, gets its
+own vhost-net device.  @option{fds}=@var{x}:@var{y}:...:@var{z} and
+@option{vhostfds}=@var{x}:@var{y}:...:@var{z} pass already opened queues
+and vhost-net devices instead.
+
 Examples:
 
 @example
@@ -1587,6 +1640,13 @@ qemu-system-i386 linux.img \
                  -net nic -net tap,"helper=/usr/local/libexec/qemu-bridge-helper"
 @end example
 
+@example
+#launch a QEMU instance with a 4 queue pair virtio-net device
+qemu-system-i386 linux.img -smp 4 \
+                 -netdev tap,id=hn0,queues=4,vhost=on \
+                 -device virtio-net-pci,netdev=hn0,mq=on,vectors=10
+@end example
+
 @item -netdev bridge,id=@var{id}[,br=@var{bridge}][,helper=@var{helper}]
 @item -net bridge[,vlan=@var{n}][,name=@var{name}][,br=@var{bridge}][,helper=@var{helper}]
 Connect a host TAP network interface to a host bridge device.
@@ -2753,6 +2813,18 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("tb-hot", HAS_ARG, QEMU_OPTION_tb_hot, \
+    "-tb-hot n       retranslate blocks run n times as superblocks\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-hot @var{n}
+@findex -tb-hot
+Retranslate a block of guest code once it has run @var{n} times, following
+direct jumps so that hot paths are translated as a single superblock.  The
+default of 0 disables this.  Only x86 guests form superblocks, and not with
+@option{-icount}.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming p     prepare for incoming migration, listen on port p\n",
     QEMU_ARCH_ALL)
@@ -559,7 +559,9 @@ SQMP
 migrate_cancel
 --------------
 
-Cancel the current migration.
+Cancel the current migration.  A migration that has switched to post-copy
+cannot be cancelled anymore, because the destination is already running the
+guest.
 
 Arguments: None.
 
@@ -612,6 +614,53 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch the current migration to post-copy.  The destination starts running
+the guest and fetches the RAM that has not been sent yet on demand.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate-set-compress-params",
+        .args_type  = "level:i?,threads:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_compress_params,
+    },
+
+SQMP
+migrate-set-compress-params
+---------------------------
+
+Set the parameters used by migration when the "compress" capability is on
+
+Arguments:
+
+- "level": zlib compression level, 0-9 (json-int, optional)
+- "threads": number of compression threads, 1-255 (json-int, optional)
+
+Example:
+
+-> { "execute": "migrate-set-compress-params",
+     "arguments": { "level": 1, "threads": 4 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -981,6 +1030,124 @@ Example:
                                                "format": "qcow2" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-add",
+        .args_type  = "device:B,name:s,granularity:i?,persistent:b?",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
+    },
+
+SQMP
+block-dirty-bitmap-add
+----------------------
+
+Start tracking the writes to a block device in a new named dirty bitmap.
+A persistent bitmap is saved in the image when the device is closed and
+loaded again when it is opened; this needs a qcow2 version 3 image.
+
+Arguments:
+
+- "device": device name to operate on (json-string)
+- "name": name of the new bitmap (json-string)
+- "granularity": bytes covered by each bit, a power of two (json-int,
+  optional, default is the cluster size or 64k)
+- "persistent": save the bitmap in the image (json-bool, optional,
+  default false)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-add", "arguments": { "device": "ide-hd0",
+                                                         "name": "nightly",
+                                                         "persistent": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-remove",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_remove,
+    },
+
+SQMP
+block-dirty-bitmap-remove
+-------------------------
+
+Stop tracking writes in a dirty bitmap and drop it, from the image too if
+it is persistent.
+
+Arguments:
+
+- "device": device name to operate on (json-string)
+- "name": name of the bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-remove", "arguments": { "device": "ide-hd0",
+                                                            "name": "nightly" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-clear",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_clear,
+    },
+
+SQMP
+block-dirty-bitmap-clear
+------------------------
+
+Mark every chunk of a dirty bitmap clean.
+
+Arguments:
+
+- "device": device name to operate on (json-string)
+- "name": name of the bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-clear", "arguments": { "device": "ide-hd0",
+                                                           "name": "nightly" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-backup-incremental",
+        .args_type  = "device:B,bitmap:s,target:s,format:s?,speed:i?",
+        .mhandler.cmd_new = qmp_marshal_input_block_backup_incremental,
+    },
+
+SQMP
+block-backup-incremental
+------------------------
+
+Start a block job that copies the chunks of a device that are dirty in a
+bitmap to an existing image, marking them clean as it goes.  The target is
+usually an overlay whose backing file is the previous backup.  Chunks that
+the guest writes behind the job, or that were not copied because the job
+failed or was cancelled, stay dirty for the next backup.
+
+Arguments:
+
+- "device": device name to operate on (json-string)
+- "bitmap": name of the dirty bitmap (json-string)
+- "target": name of the existing image to write to (json-string)
+- "format": format of the target image (json-string, optional, default
+  is to probe)
+- "speed": maximum speed of the job, in bytes per second (json-int,
+  optional)
+
+Example:
+
+-> { "execute": "block-backup-incremental", "arguments": { "device": "ide-hd0",
+                                                           "bitmap": "nightly",
+                                                           "target": "/backup/inc1.qcow2" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1611,6 +1778,13 @@ Each json-object contain the following:
                and the VM is configured to stop on errors. It's always reset
                to "ok" when the "cont" command is issued (json_string, optional)
              - Possible values: "ok", "failed", "nospace"
+- "dirty-bitmaps": named dirty bitmaps, only present if there is at least
+                   one (json-array, optional)
+         - Each bitmap is a json-object with:
+         - "name": bitmap name (json-string)
+         - "granularity": bytes covered by each bit (json-int)
+         - "count": number of dirty bytes (json-int)
+         - "persistent": true if the bitmap is saved in the image (json-bool)
 
 Example:
 
@@ -1690,6 +1864,20 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+- "metadata-cache": A json-object with the statistics of the image format's
+                    metadata caches.  Only present for formats that have
+                    them (json-object, optional), it contains:
+    - "l2-cache-size": size of the L2 table cache in bytes (json-int)
+    - "l2-cache-hits": L2 table lookups served from the cache (json-int)
+    - "l2-cache-misses": L2 tables read from the image file (json-int)
+    - "refcount-cache-size": size of the refcount block cache in bytes
+                             (json-int)
+    - "refcount-cache-hits": refcount block lookups served from the cache
+                             (json-int)
+    - "refcount-cache-misses": refcount blocks read from the image file
+                               (json-int)
+    - "metadata-writes": L1, L2 and refcount table writes to the image file
+                         (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2353,7 +2541,8 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "active", "completed", "failed", "cancelled"
+     - Possible values: "active", "postcopy-active", "completed", "failed",
+       "cancelled"
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
 		 time (json-int)
@@ -2382,6 +2571,18 @@ The main json-object contains the following:
          - "pages": number of XBZRLE compressed pages
          - "cache-miss": number of cache misses
          - "overflow": number of XBZRLE overflows
+- "compress": only present if the compress capability is on.
+  It is a json-object with the following compression information:
+         - "level": zlib compression level
+         - "bytes": total compressed bytes transferred
+         - "pages": number of compressed pages
+         - "threads": json-array of per-thread json-objects:
+           - "id": thread index
+           - "pages": number of pages handled by the thread
+           - "bytes-in": uncompressed bytes handled by the thread
+           - "bytes-out": compressed bytes produced by the thread
+           - "busy-time": milliseconds spent compressing
+           - "throughput": uncompressed bytes per second while busy
 Examples:
 
 1. Before the first migration
@@ -2497,6 +2698,8 @@ migrate-set-capabilities
 Enable/Disable migration capabilities
 
 - "xbzrle": xbzrle support
+- "compress": multithreaded zlib compression of RAM pages
+- "postcopy-ram": allow switching to post-copy with migrate-start-postcopy
 
 Arguments:
 
@@ -2521,6 +2724,8 @@ Query current migration capabilities
 
 - "capabilities": migration capabilities state
          - "xbzrle" : XBZRLE state (json-bool)
+         - "compress" : compression state (json-bool)
+         - "postcopy-ram" : post-copy state (json-bool)
 
 Arguments:
 
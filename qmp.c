@@ -163,6 +163,11 @@ void qmp_cont(Error **errp)
         return;
     }
 
+    /* The destination may have changed the images after migration */
+    if (runstate_check(RUN_STATE_POSTMIGRATE)) {
+        bdrv_invalidate_cache_all();
+    }
+
     if (runstate_check(RUN_STATE_INMIGRATE)) {
         autostart = 1;
     } else {
@@ -87,6 +87,7 @@
 #include "qmp-commands.h"
 #include "trace.h"
 #include "bitops.h"
+#include "postcopy-ram.h"
 
 #define SELF_ANNOUNCE_ROUNDS 5
 
@@ -447,6 +448,47 @@ static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
     return qemu_fopen_ops(bs, &bdrv_read_ops);
 }
 
+/* QEMUFile backed by a GByteArray, used to ship the device state of a
+ * post-copy migration as a single blob */
+
+static int buf_put_buffer(void *opaque, const uint8_t *buf,
+                          int64_t pos, int size)
+{
+    GByteArray *array = opaque;
+
+    g_byte_array_append(array, buf, size);
+    return size;
+}
+
+static int buf_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    GByteArray *array = opaque;
+
+    if (pos >= array->len) {
+        return 0;
+    }
+    size = MIN(size, array->len - pos);
+    memcpy(buf, array->data + pos, size);
+    return size;
+}
+
+static const QEMUFileOps buf_read_ops = {
+    .get_buffer = buf_get_buffer,
+};
+
+static const QEMUFileOps buf_write_ops = {
+    .put_buffer = buf_put_buffer,
+};
+
+/* The caller keeps ownership of @array */
+static QEMUFile *qemu_fopen_buf(GByteArray *array, int is_writable)
+{
+    if (is_writable) {
+        return qemu_fopen_ops(array, &buf_write_ops);
+    }
+    return qemu_fopen_ops(array, &buf_read_ops);
+}
+
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 {
     QEMUFile *f;
@@ -473,7 +515,7 @@ static void qemu_file_set_error(QEMUFile *f, int ret)
 /** Flushes QEMUFile buffer
  *
  */
-static int qemu_fflush(QEMUFile *f)
+int qemu_fflush(QEMUFile *f)
 {
     int ret = 0;
 
@@ -1586,6 +1628,7 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_POSTCOPY_PACKAGE     0x06
 
 bool qemu_savevm_state_blocked(Error **errp)
 {
@@ -1703,13 +1746,11 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-int qemu_savevm_state_complete(QEMUFile *f)
+static int qemu_savevm_state_complete_live(QEMUFile *f)
 {
     SaveStateEntry *se;
     int ret;
 
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
@@ -1731,6 +1772,13 @@ int qemu_savevm_state_complete(QEMUFile *f)
         }
     }
 
+    return 0;
+}
+
+static void qemu_savevm_state_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
+
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
 
@@ -1755,10 +1803,64 @@ int qemu_savevm_state_complete(QEMUFile *f)
     }
 
     qemu_put_byte(f, QEMU_VM_EOF);
+}
+
+int qemu_savevm_state_complete(QEMUFile *f)
+{
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    ret = qemu_savevm_state_complete_live(f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_savevm_state_devices(f);
 
     return qemu_file_get_error(f);
 }
 
+/*
+ * Switch an outgoing migration to post-copy.  The live sections are
+ * completed as usual (RAM only sends the list of pages that are still
+ * dirty), then the device state is sent as one package.  The destination
+ * starts demand paging before loading the package, so that devices can
+ * touch guest memory while they are loaded.  The remaining RAM follows
+ * the package, see ram_postcopy_send_pages().
+ */
+int qemu_savevm_state_postcopy(QEMUFile *f)
+{
+    GByteArray *package;
+    QEMUFile *pf;
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    ret = qemu_savevm_state_complete_live(f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    package = g_byte_array_new();
+    pf = qemu_fopen_buf(package, 1);
+    qemu_put_be32(pf, QEMU_VM_FILE_MAGIC);
+    qemu_put_be32(pf, QEMU_VM_FILE_VERSION);
+    qemu_savevm_state_devices(pf);
+    qemu_fclose(pf);
+
+    qemu_put_byte(f, QEMU_VM_POSTCOPY_PACKAGE);
+    qemu_put_be32(f, package->len);
+    qemu_put_buffer(f, package->data, package->len);
+    g_byte_array_free(package, TRUE);
+
+    ret = qemu_file_get_error(f);
+    if (ret == 0) {
+        ret = qemu_fflush(f);
+    }
+    return ret < 0 ? ret : 0;
+}
+
 void qemu_savevm_state_cancel(QEMUFile *f)
 {
     SaveStateEntry *se;
@@ -1935,6 +2037,37 @@ static void vmstate_subsection_save(QEMUFile *f, const VMStateDescription *vmsd,
     }
 }
 
+static int qemu_loadvm_postcopy_package(QEMUFile *f)
+{
+    GByteArray *package;
+    QEMUFile *pf;
+    uint32_t len;
+    int ret;
+
+    len = qemu_get_be32(f);
+    package = g_byte_array_sized_new(len);
+    g_byte_array_set_size(package, len);
+    qemu_get_buffer(f, package->data, len);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* From now on missing pages are fetched from the source on demand */
+    ret = postcopy_ram_incoming_start(f);
+    if (ret < 0) {
+        goto out;
+    }
+
+    pf = qemu_fopen_buf(package, 0);
+    ret = qemu_loadvm_state(pf);
+    qemu_fclose(pf);
+
+out:
+    g_byte_array_free(package, TRUE);
+    return ret;
+}
+
 typedef struct LoadStateEntry {
     QLIST_ENTRY(LoadStateEntry) entry;
     SaveStateEntry *se;
@@ -1950,6 +2083,7 @@ int qemu_loadvm_state(QEMUFile *f)
     uint8_t section_type;
     unsigned int v;
     int ret;
+    bool postcopy = false;
 
     if (qemu_savevm_state_blocked(NULL)) {
         return -EINVAL;
@@ -2037,14 +2171,27 @@ int qemu_loadvm_state(QEMUFile *f)
                 goto out;
             }
             break;
+        case QEMU_VM_POSTCOPY_PACKAGE:
+            ret = qemu_loadvm_postcopy_package(f);
+            if (ret < 0) {
+                goto out;
+            }
+            postcopy = true;
+            break;
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
             ret = -EINVAL;
             goto out;
         }
+        if (postcopy) {
+            /* the rest of the stream belongs to the post-copy thread */
+            break;
+        }
     }
 
-    cpu_synchronize_all_post_init();
+    if (!postcopy) {
+        cpu_synchronize_all_post_init();
+    }
 
     ret = 0;
 
@@ -2054,7 +2201,7 @@ out:
         g_free(le);
     }
 
-    if (ret == 0) {
+    if (ret == 0 && !postcopy) {
         ret = qemu_file_get_error(f);
     }
 
@@ -2319,6 +2466,7 @@ int load_vmstate(const char *name)
 
     qemu_system_reset(VMRESET_SILENT);
     ret = qemu_loadvm_state(f);
+    migrate_decompress_threads_join();
 
     qemu_fclose(f);
     if (ret < 0) {
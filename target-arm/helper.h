@@ -52,6 +52,10 @@ DEF_HELPER_FLAGS_3(sel_flags, TCG_CALL_NO_RWG_SE,
                    i32, i32, i32, i32)
 DEF_HELPER_2(exception, void, env, i32)
 DEF_HELPER_1(wfi, void, env)
+#if defined(CONFIG_MTTCG) && !defined(CONFIG_USER_ONLY)
+DEF_HELPER_5(strex, i32, env, i32, i32, i32, i32)
+DEF_HELPER_4(swp, i32, env, i32, i32, i32)
+#endif
 
 DEF_HELPER_3(cpsr_write, void, env, i32, i32)
 DEF_HELPER_1(cpsr_read, i32, env)
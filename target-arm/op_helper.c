@@ -91,6 +91,133 @@ void tlb_fill(CPUARMState *env, target_ulong addr, int is_write, int mmu_idx,
         raise_exception(env, env->exception_index);
     }
 }
+
+#ifdef CONFIG_MTTCG
+/* Store-exclusive with multithreaded TCG.  The store only succeeds if
+   memory still holds the value read by the load-exclusive, checked and
+   written with a single host compare-and-swap so that a store by a vCPU
+   in another thread cannot slip in between.  'info' holds the access
+   size in bits [1:0] and the MMU index above.  Returns the value for Rd.
+   CONFIG_MTTCG implies a little-endian x86_64 host.  */
+uint32_t HELPER(strex)(CPUARMState *env, uint32_t addr, uint32_t val,
+                       uint32_t val_high, uint32_t info)
+{
+    int size = info & 3;
+    int mmu_idx = info >> 2;
+    int len = size == 3 ? 8 : 1 << size;
+    uint64_t old, cur;
+    void *host = NULL;
+    bool ok, locked;
+
+    if (addr != env->exclusive_addr) {
+        return 1;
+    }
+    if (!(addr & (len - 1))) {
+        host = tlb_vaddr_to_host_rmw(env, addr, len, mmu_idx, GETPC());
+    }
+
+    if (host) {
+        switch (size) {
+        case 0:
+            ok = __sync_bool_compare_and_swap((uint8_t *)host,
+                                              env->exclusive_val, val);
+            break;
+        case 1:
+            ok = __sync_bool_compare_and_swap((uint16_t *)host,
+                                              tswap16(env->exclusive_val),
+                                              tswap16(val));
+            break;
+        case 2:
+            ok = __sync_bool_compare_and_swap((uint32_t *)host,
+                                              tswap32(env->exclusive_val),
+                                              tswap32(val));
+            break;
+        default:
+            old = tswap32(env->exclusive_val) |
+                  ((uint64_t)tswap32(env->exclusive_high) << 32);
+            cur = tswap32(val) | ((uint64_t)tswap32(val_high) << 32);
+            ok = __sync_bool_compare_and_swap((uint64_t *)host, old, cur);
+            break;
+        }
+        return !ok;
+    }
+
+    /* Device memory or an unaligned address: other vCPUs can only get
+       in the way through the same devices, so hold the iothread lock.  */
+    locked = tcg_io_lock();
+    switch (size) {
+    case 0:
+        cur = helper_ldb_mmu(env, addr, mmu_idx);
+        break;
+    case 1:
+        cur = helper_ldw_mmu(env, addr, mmu_idx);
+        break;
+    default:
+        cur = helper_ldl_mmu(env, addr, mmu_idx);
+        break;
+    }
+    ok = cur == env->exclusive_val;
+    if (ok && size == 3) {
+        ok = helper_ldl_mmu(env, addr + 4, mmu_idx) == env->exclusive_high;
+    }
+    if (ok) {
+        switch (size) {
+        case 0:
+            helper_stb_mmu(env, addr, val, mmu_idx);
+            break;
+        case 1:
+            helper_stw_mmu(env, addr, val, mmu_idx);
+            break;
+        default:
+            helper_stl_mmu(env, addr, val, mmu_idx);
+            break;
+        }
+        if (size == 3) {
+            helper_stl_mmu(env, addr + 4, val_high, mmu_idx);
+        }
+    }
+    tcg_io_unlock(locked);
+    return !ok;
+}
+
+/* SWP and SWPB with multithreaded TCG, as a single host exchange.
+   'info' holds the access size (0 or 2) in bits [1:0] and the MMU index
+   above.  Returns the old memory contents.  */
+uint32_t HELPER(swp)(CPUARMState *env, uint32_t addr, uint32_t val,
+                     uint32_t info)
+{
+    int size = info & 3;
+    int mmu_idx = info >> 2;
+    int len = 1 << size;
+    uint32_t old;
+    void *host = NULL;
+    bool locked;
+
+    if (!(addr & (len - 1))) {
+        host = tlb_vaddr_to_host_rmw(env, addr, len, mmu_idx, GETPC());
+    }
+    if (host) {
+        /* a full barrier on x86, despite the name */
+        if (size == 0) {
+            return __sync_lock_test_and_set((uint8_t *)host, val);
+        }
+        return tswap32(__sync_lock_test_and_set((uint32_t *)host,
+                                                tswap32(val)));
+    }
+
+    /* Device memory or an unaligned address, see HELPER(strex) */
+    locked = tcg_io_lock();
+    if (size == 0) {
+        old = helper_ldb_mmu(env, addr, mmu_idx);
+        helper_stb_mmu(env, addr, val, mmu_idx);
+    } else {
+        old = helper_ldl_mmu(env, addr, mmu_idx);
+        helper_stl_mmu(env, addr, val, mmu_idx);
+    }
+    tcg_io_unlock(locked);
+    return old;
+}
+#endif /* CONFIG_MTTCG */
 #endif
 
 uint32_t HELPER(add_setq)(CPUARMState *env, uint32_t a, uint32_t b)
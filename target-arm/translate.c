@@ -766,7 +766,8 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 /* Set PC and Thumb state from var.  var is marked as dead.  */
 static inline void gen_bx(DisasContext *s, TCGv var)
 {
-    s->is_jmp = DISAS_UPDATE;
+    /* the Thumb bit is part of the TB flags, so only the pc changes */
+    s->is_jmp = DISAS_JUMP;
     tcg_gen_andi_i32(cpu_R[15], var, ~1);
     tcg_gen_andi_i32(var, var, 1);
     store_cpu_field(var, thumb);
@@ -6509,6 +6510,23 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
        } else {
          {Rd} = 1;
        } */
+#ifdef CONFIG_MTTCG
+    if (mttcg_enabled) {
+        /* other vCPU threads may store between the check and the store,
+           so do both at once in a helper */
+        TCGv tmp2, info;
+
+        tmp = load_reg(s, rt);
+        tmp2 = size == 3 ? load_reg(s, rt2) : tcg_const_i32(0);
+        info = tcg_const_i32(size | (IS_USER(s) << 2));
+        gen_helper_strex(cpu_R[rd], cpu_env, addr, tmp, tmp2, info);
+        tcg_temp_free_i32(info);
+        tcg_temp_free_i32(tmp2);
+        tcg_temp_free_i32(tmp);
+        tcg_gen_movi_i32(cpu_exclusive_addr, -1);
+        return;
+    }
+#endif
     fail_label = gen_new_label();
     done_label = gen_new_label();
     tcg_gen_brcond_i32(TCG_COND_NE, addr, cpu_exclusive_addr, fail_label);
@@ -7295,11 +7313,23 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
                         /* SWP instruction */
                         rm = (insn) & 0xf;
 
+                        addr = load_reg(s, rn);
+                        tmp = load_reg(s, rm);
+#ifdef CONFIG_MTTCG
+                        if (mttcg_enabled) {
+                            TCGv info;
+
+                            info = tcg_const_i32((insn & (1 << 22) ? 0 : 2) |
+                                                 (IS_USER(s) << 2));
+                            tmp2 = tcg_temp_new_i32();
+                            gen_helper_swp(tmp2, cpu_env, addr, tmp, info);
+                            tcg_temp_free_i32(info);
+                            tcg_temp_free_i32(tmp);
+                        } else
+#endif
                         /* ??? This is not really atomic.  However we know
                            we never have multiple CPUs running in parallel,
                            so it is good enough.  */
-                        addr = load_reg(s, rn);
-                        tmp = load_reg(s, rm);
                         if (insn & (1 << 22)) {
                             tmp2 = gen_ld8u(addr, IS_USER(s));
                             gen_st8(tmp, addr, IS_USER(s));
@@ -9778,7 +9808,7 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
     if (max_insns == 0)
         max_insns = CF_COUNT_MASK;
 
-    gen_icount_start();
+    gen_icount_start(tb);
 
     tcg_clear_temp_count();
 
@@ -9960,8 +9990,11 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
-        default:
         case DISAS_JUMP:
+            /* indirect branch: try the jump cache before the hash table */
+            tcg_gen_lookup_and_goto_ptr(cpu_env);
+            break;
+        default:
         case DISAS_UPDATE:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
@@ -3292,7 +3292,7 @@ gen_intermediate_code_internal(CPUCRISState *env, TranslationBlock *tb,
         max_insns = CF_COUNT_MASK;
     }
 
-    gen_icount_start();
+    gen_icount_start(tb);
     do {
         check_breakpoint(env, dc);
 
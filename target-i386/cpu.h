@@ -36,6 +36,12 @@
 
 #define TARGET_HAS_ICE 1
 
+/* LOCK-prefixed accesses are atomic with multithreaded TCG */
+#define TARGET_SUPPORTS_MTTCG 1
+
+/* The translator follows direct jumps in CF_SUPERBLOCK TBs */
+#define TARGET_SUPPORTS_SUPERBLOCKS 1
+
 #ifdef TARGET_X86_64
 #define ELF_MACHINE	EM_X86_64
 #else
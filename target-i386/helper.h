@@ -1,10 +1,21 @@
 #include "def-helper.h"
 
-DEF_HELPER_FLAGS_2(cc_compute_all, TCG_CALL_NO_SE, i32, env, int)
-DEF_HELPER_FLAGS_2(cc_compute_c, TCG_CALL_NO_SE, i32, env, int)
+/* The flag computation helpers only read cc_src and cc_dst, see
+   optimize_flags_init() */
+#define X86_CALL_GLOBALS_CC 1
+
+DEF_HELPER_FLAGS_2(cc_compute_all,
+                   TCG_CALL_NO_SE | TCG_CALL_GLOBALS(X86_CALL_GLOBALS_CC),
+                   i32, env, int)
+DEF_HELPER_FLAGS_2(cc_compute_c,
+                   TCG_CALL_NO_SE | TCG_CALL_GLOBALS(X86_CALL_GLOBALS_CC),
+                   i32, env, int)
 
 DEF_HELPER_0(lock, void)
 DEF_HELPER_0(unlock, void)
+#if defined(CONFIG_MTTCG) && !defined(CONFIG_USER_ONLY)
+DEF_HELPER_5(atomic_st, void, env, tl, tl, tl, i32)
+#endif
 DEF_HELPER_3(write_eflags, void, env, tl, i32)
 DEF_HELPER_1(read_eflags, tl, env)
 DEF_HELPER_2(divb_AL, void, env, tl)
@@ -44,6 +44,29 @@ void helper_cmpxchg8b(CPUX86State *env, target_ulong a0)
     int eflags;
 
     eflags = cpu_cc_compute_all(env, CC_OP);
+#if defined(CONFIG_MTTCG) && !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled && (a0 & ~TARGET_PAGE_MASK) <= TARGET_PAGE_SIZE - 8) {
+        uint64_t *host = tlb_vaddr_to_host_rmw(env, a0, 8, cpu_mmu_index(env),
+                                               0);
+
+        if (host) {
+            uint64_t cmp = ((uint64_t)EDX << 32) | (uint32_t)EAX;
+
+            d = __sync_val_compare_and_swap(host, cmp,
+                                            ((uint64_t)ECX << 32) |
+                                            (uint32_t)EBX);
+            if (d == cmp) {
+                eflags |= CC_Z;
+            } else {
+                EDX = (uint32_t)(d >> 32);
+                EAX = (uint32_t)d;
+                eflags &= ~CC_Z;
+            }
+            CC_SRC = eflags;
+            return;
+        }
+    }
+#endif
     d = cpu_ldq_data(env, a0);
     if (d == (((uint64_t)EDX << 32) | (uint32_t)EAX)) {
         cpu_stq_data(env, a0, ((uint64_t)ECX << 32) | (uint32_t)EBX);
@@ -63,11 +86,43 @@ void helper_cmpxchg16b(CPUX86State *env, target_ulong a0)
 {
     uint64_t d0, d1;
     int eflags;
+#if defined(CONFIG_MTTCG) && !defined(CONFIG_USER_ONLY)
+    bool locked = false;
+#endif
 
     if ((a0 & 0xf) != 0) {
         raise_exception(env, EXCP0D_GPF);
     }
     eflags = cpu_cc_compute_all(env, CC_OP);
+#if defined(CONFIG_MTTCG) && !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled) {
+        /* aligned, so the operand does not cross a page */
+        unsigned __int128 *host = tlb_vaddr_to_host_rmw(env, a0, 16,
+                                                        cpu_mmu_index(env), 0);
+
+        if (host) {
+            unsigned __int128 cmp = ((unsigned __int128)EDX << 64) | EAX;
+            unsigned __int128 d;
+
+            d = __sync_val_compare_and_swap(host, cmp,
+                                            ((unsigned __int128)ECX << 64) |
+                                            EBX);
+            if (d == cmp) {
+                eflags |= CC_Z;
+            } else {
+                EDX = (uint64_t)(d >> 64);
+                EAX = (uint64_t)d;
+                eflags &= ~CC_Z;
+            }
+            CC_SRC = eflags;
+            return;
+        }
+        /* Device memory: only atomic with respect to device emulation,
+           which runs under the iothread lock.  The lock is dropped by
+           cpu_exec() if one of the accesses below faults.  */
+        locked = tcg_io_lock();
+    }
+#endif
     d0 = cpu_ldq_data(env, a0);
     d1 = cpu_ldq_data(env, a0 + 8);
     if (d0 == EAX && d1 == EDX) {
@@ -83,6 +138,9 @@ void helper_cmpxchg16b(CPUX86State *env, target_ulong a0)
         eflags &= ~CC_Z;
     }
     CC_SRC = eflags;
+#if defined(CONFIG_MTTCG) && !defined(CONFIG_USER_ONLY)
+    tcg_io_unlock(locked);
+#endif
 }
 #endif
 
@@ -153,3 +211,98 @@ void tlb_fill(CPUX86State *env, target_ulong addr, int is_write, int mmu_idx,
     }
 }
 #endif
+
+#if defined(CONFIG_MTTCG) && !defined(CONFIG_USER_ONLY)
+/* Re-execute the current instruction from the start */
+static void QEMU_NORETURN atomic_restart(CPUX86State *env, uintptr_t retaddr)
+{
+    cpu_restore_state(tb_find_pc(retaddr), env, retaddr);
+    env->exception_index = -1;
+    cpu_loop_exit(env);
+}
+
+/* Store of a LOCK-prefixed read-modify-write with multithreaded TCG.
+   'old' is the value the instruction loaded; if memory no longer holds
+   it, another vCPU got in between and the instruction is restarted.
+   'info' holds the operand size in bits [1:0] and the MMU index above.
+   Guest and CONFIG_MTTCG host are both little-endian.  */
+void helper_atomic_st(CPUX86State *env, target_ulong a0, target_ulong old,
+                      target_ulong val, uint32_t info)
+{
+    uintptr_t retaddr = GETPC();
+    int ot = info & 3;
+    int mmu_idx = info >> 2;
+    int len = 1 << ot;
+    target_ulong cur;
+    void *host = NULL;
+    bool ok, locked;
+
+    if ((a0 & ~TARGET_PAGE_MASK) <= TARGET_PAGE_SIZE - len) {
+        host = tlb_vaddr_to_host_rmw(env, a0, len, mmu_idx, retaddr);
+    }
+    if (host) {
+        switch (ot) {
+        case 0:
+            ok = __sync_bool_compare_and_swap((uint8_t *)host, (uint8_t)old,
+                                              (uint8_t)val);
+            break;
+        case 1:
+            ok = __sync_bool_compare_and_swap((uint16_t *)host,
+                                              (uint16_t)old, (uint16_t)val);
+            break;
+        case 2:
+            ok = __sync_bool_compare_and_swap((uint32_t *)host,
+                                              (uint32_t)old, (uint32_t)val);
+            break;
+        default:
+            ok = __sync_bool_compare_and_swap((uint64_t *)host,
+                                              (uint64_t)old, (uint64_t)val);
+            break;
+        }
+        if (!ok) {
+            atomic_restart(env, retaddr);
+        }
+        return;
+    }
+
+    /* Device memory or an operand crossing a page: only atomic with
+       respect to device emulation, which runs under the iothread lock.
+       Restore the CPU state first so that a fault is reported precisely,
+       the accessors below do not know about the translated code.  */
+    locked = tcg_io_lock();
+    cpu_restore_state(tb_find_pc(retaddr), env, retaddr);
+    switch (ot) {
+    case 0:
+        cur = helper_ldb_mmu(env, a0, mmu_idx);
+        break;
+    case 1:
+        cur = helper_ldw_mmu(env, a0, mmu_idx);
+        break;
+    case 2:
+        cur = helper_ldl_mmu(env, a0, mmu_idx);
+        break;
+    default:
+        cur = helper_ldq_mmu(env, a0, mmu_idx);
+        break;
+    }
+    if (cur != old) {
+        tcg_io_unlock(locked);
+        atomic_restart(env, retaddr);
+    }
+    switch (ot) {
+    case 0:
+        helper_stb_mmu(env, a0, val, mmu_idx);
+        break;
+    case 1:
+        helper_stw_mmu(env, a0, val, mmu_idx);
+        break;
+    case 2:
+        helper_stl_mmu(env, a0, val, mmu_idx);
+        break;
+    default:
+        helper_stq_mmu(env, a0, val, mmu_idx);
+        break;
+    }
+    tcg_io_unlock(locked);
+}
+#endif
@@ -69,32 +69,53 @@ void helper_check_iol(CPUX86State *env, uint32_t t0)
 
 void helper_outb(uint32_t port, uint32_t data)
 {
+    bool locked = tcg_io_lock();
+
     cpu_outb(port, data & 0xff);
+    tcg_io_unlock(locked);
 }
 
 target_ulong helper_inb(uint32_t port)
 {
-    return cpu_inb(port);
+    bool locked = tcg_io_lock();
+    target_ulong val = cpu_inb(port);
+
+    tcg_io_unlock(locked);
+    return val;
 }
 
 void helper_outw(uint32_t port, uint32_t data)
 {
+    bool locked = tcg_io_lock();
+
     cpu_outw(port, data & 0xffff);
+    tcg_io_unlock(locked);
 }
 
 target_ulong helper_inw(uint32_t port)
 {
-    return cpu_inw(port);
+    bool locked = tcg_io_lock();
+    target_ulong val = cpu_inw(port);
+
+    tcg_io_unlock(locked);
+    return val;
 }
 
 void helper_outl(uint32_t port, uint32_t data)
 {
+    bool locked = tcg_io_lock();
+
     cpu_outl(port, data);
+    tcg_io_unlock(locked);
 }
 
 target_ulong helper_inl(uint32_t port)
 {
-    return cpu_inl(port);
+    bool locked = tcg_io_lock();
+    target_ulong val = cpu_inl(port);
+
+    tcg_io_unlock(locked);
+    return val;
 }
 
 void helper_into(CPUX86State *env, int next_eip_addend)
@@ -154,7 +175,10 @@ target_ulong helper_read_crN(CPUX86State *env, int reg)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = tcg_io_lock();
+
             val = cpu_get_apic_tpr(env->apic_state);
+            tcg_io_unlock(locked);
         } else {
             val = env->v_tpr;
         }
@@ -178,7 +202,10 @@ void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = tcg_io_lock();
+
             cpu_set_apic_tpr(env->apic_state, t0);
+            tcg_io_unlock(locked);
         }
         env->v_tpr = t0 & 0x0f;
         break;
@@ -284,7 +311,12 @@ void helper_wrmsr(CPUX86State *env)
         env->sysenter_eip = val;
         break;
     case MSR_IA32_APICBASE:
-        cpu_set_apic_base(env->apic_state, val);
+        {
+            bool locked = tcg_io_lock();
+
+            cpu_set_apic_base(env->apic_state, val);
+            tcg_io_unlock(locked);
+        }
         break;
     case MSR_EFER:
         {
@@ -429,7 +461,12 @@ void helper_rdmsr(CPUX86State *env)
         val = env->sysenter_eip;
         break;
     case MSR_IA32_APICBASE:
-        val = cpu_get_apic_base(env->apic_state);
+        {
+            bool locked = tcg_io_lock();
+
+            val = cpu_get_apic_base(env->apic_state);
+            tcg_io_unlock(locked);
+        }
         break;
     case MSR_EFER:
         val = env->efer;
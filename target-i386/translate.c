@@ -63,6 +63,12 @@ static TCGv_i32 cpu_tmp2_i32, cpu_tmp3_i32;
 static TCGv_i64 cpu_tmp1_i64;
 static TCGv cpu_tmp5;
 
+/* With mttcg_enabled, the memory operand of a LOCK-prefixed instruction
+   or of xchg is written back with a compare-and-swap against the value
+   it was loaded with, see gen_lock_start() */
+static bool lock_rmw;
+static TCGv cpu_lock_val;
+
 static uint8_t gen_opc_cc_op[OPC_BUF_SIZE];
 
 #include "gen-icount.h"
@@ -98,6 +104,8 @@ typedef struct DisasContext {
     int tf;     /* TF cpu flag */
     int singlestep_enabled; /* "hardware" single step enabled */
     int jmp_opt; /* use direct block chaining for direct jumps */
+    int sb_jumps; /* direct jumps still to be followed in a superblock */
+    target_ulong pc_max; /* end of the furthest code followed so far */
     int mem_index; /* select memory access functions */
     uint64_t flags; /* all execution flags */
     struct TranslationBlock *tb;
@@ -540,6 +548,9 @@ static inline void gen_op_ld_v(int idx, TCGv t0, TCGv a0)
 #endif
         break;
     }
+    if (lock_rmw) {
+        tcg_gen_mov_tl(cpu_lock_val, t0);
+    }
 }
 
 /* XXX: always use ldu or lds */
@@ -561,6 +572,16 @@ static inline void gen_op_ld_T1_A0(int idx)
 static inline void gen_op_st_v(int idx, TCGv t0, TCGv a0)
 {
     int mem_index = (idx >> 2) - 1;
+
+#if defined(CONFIG_MTTCG) && !defined(CONFIG_USER_ONLY)
+    if (lock_rmw) {
+        TCGv_i32 info = tcg_const_i32((idx & 3) | (mem_index << 2));
+
+        gen_helper_atomic_st(cpu_env, a0, cpu_lock_val, t0, info);
+        tcg_temp_free_i32(info);
+        return;
+    }
+#endif
     switch(idx & 3) {
     case 0:
         tcg_gen_qemu_st8(t0, a0, mem_index);
@@ -581,6 +602,28 @@ static inline void gen_op_st_v(int idx, TCGv t0, TCGv a0)
     }
 }
 
+/* Make the memory read-modify-write of the current instruction atomic */
+static void gen_lock_start(void)
+{
+    if (mttcg_enabled) {
+        /* survives the branches in cmpxchg */
+        cpu_lock_val = tcg_temp_local_new();
+        lock_rmw = true;
+    } else {
+        gen_helper_lock();
+    }
+}
+
+static void gen_lock_end(void)
+{
+    if (mttcg_enabled) {
+        lock_rmw = false;
+        tcg_temp_free(cpu_lock_val);
+    } else {
+        gen_helper_unlock();
+    }
+}
+
 static inline void gen_op_st_T0_A0(int idx)
 {
     gen_op_st_v(idx, cpu_T[0], cpu_A0);
@@ -2750,8 +2793,9 @@ static void gen_debug(DisasContext *s, target_ulong cur_eip)
 }
 
 /* generate a generic end of block. Trace exception is also generated
-   if needed */
-static void gen_eob(DisasContext *s)
+   if needed.  If 'jr', the block ends with an indirect branch and may
+   jump straight to the next TB through the jump cache. */
+static void gen_eob_worker(DisasContext *s, bool jr)
 {
     if (s->cc_op != CC_OP_DYNAMIC)
         gen_op_set_cc_op(s->cc_op);
@@ -2765,12 +2809,25 @@ static void gen_eob(DisasContext *s)
         gen_helper_debug(cpu_env);
     } else if (s->tf) {
         gen_helper_single_step(cpu_env);
+    } else if (jr) {
+        tcg_gen_lookup_and_goto_ptr(cpu_env);
     } else {
         tcg_gen_exit_tb(0);
     }
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+static void gen_eob(DisasContext *s)
+{
+    gen_eob_worker(s, false);
+}
+
+/* End of block after an indirect jump, call or return */
+static void gen_jr(DisasContext *s)
+{
+    gen_eob_worker(s, true);
+}
+
 /* generate a jump to eip. No segment change must happen before as a
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
@@ -2790,6 +2847,28 @@ static void gen_jmp(DisasContext *s, target_ulong eip)
     gen_jmp_tb(s, eip, 0);
 }
 
+/* Maximum number of jumps followed by a superblock */
+#define SUPERBLOCK_MAX_JUMPS 8
+
+/* jmp and call with an immediate target.  A superblock carries on at the
+   target instead, without writing back eip or cc_op and so keeping the
+   guest registers in host registers.  The target must be in the first
+   page of the TB and not before its start, so that [pc, pc + size) still
+   covers all the code that was translated.  */
+static void gen_jmp_direct(DisasContext *s, target_ulong eip)
+{
+    target_ulong pc = s->cs_base + eip;
+
+    if (s->sb_jumps > 0 && s->jmp_opt && pc >= s->tb->pc &&
+        (pc & TARGET_PAGE_MASK) == (s->tb->pc & TARGET_PAGE_MASK)) {
+        s->sb_jumps--;
+        s->pc_max = MAX(s->pc_max, s->pc);
+        s->pc = pc;
+        return;
+    }
+    gen_jmp(s, eip);
+}
+
 static inline void gen_ldq_env_A0(int idx, int offset)
 {
     int mem_index = (idx >> 2) - 1;
@@ -4223,6 +4302,9 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     x86_64_hregs = 0;
 #endif
     s->rip_offset = 0; /* for relative ip address */
+    /* a page fault while fetching a LOCK-prefixed instruction longjmps
+       out of the translator before gen_lock_end() */
+    lock_rmw = false;
  next_byte:
     b = cpu_ldub_code(env, s->pc);
     s->pc++;
@@ -4331,7 +4413,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
 
     /* lock generation */
     if (prefixes & PREFIX_LOCK)
-        gen_helper_lock();
+        gen_lock_start();
 
     /* now check op code */
  reswitch:
@@ -4753,7 +4835,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_movtl_T1_im(next_eip);
             gen_push_T1(s);
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 3: /* lcall Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -4780,7 +4862,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             if (s->dflag == 0)
                 gen_op_andl_T0_ffff();
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 5: /* ljmp Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -5443,11 +5525,11 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_op_mov_TN_reg(ot, 0, reg);
             /* for xchg, lock is implicit */
             if (!(prefixes & PREFIX_LOCK))
-                gen_helper_lock();
+                gen_lock_start();
             gen_op_ld_T1_A0(ot + s->mem_index);
             gen_op_st_T0_A0(ot + s->mem_index);
             if (!(prefixes & PREFIX_LOCK))
-                gen_helper_unlock();
+                gen_lock_end();
             gen_op_mov_reg_T1(ot, reg);
         }
         break;
@@ -6308,7 +6390,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xc3: /* ret */
         gen_pop_T0(s);
@@ -6316,7 +6398,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xca: /* lret im */
         val = cpu_ldsw_code(env, s->pc);
@@ -6386,7 +6468,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 tval &= 0xffffffff;
             gen_movtl_T0_im(next_eip);
             gen_push_T0(s);
-            gen_jmp(s, tval);
+            gen_jmp_direct(s, tval);
         }
         break;
     case 0x9a: /* lcall im */
@@ -6413,7 +6495,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tval &= 0xffff;
         else if(!CODE64(s))
             tval &= 0xffffffff;
-        gen_jmp(s, tval);
+        gen_jmp_direct(s, tval);
         break;
     case 0xea: /* ljmp im */
         {
@@ -6434,7 +6516,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         tval += s->pc - s->cs_base;
         if (s->dflag == 0)
             tval &= 0xffff;
-        gen_jmp(s, tval);
+        gen_jmp_direct(s, tval);
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
         tval = (int8_t)insn_get(env, s, OT_BYTE);
@@ -7805,11 +7887,11 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     }
     /* lock generation */
     if (s->prefix & PREFIX_LOCK)
-        gen_helper_unlock();
+        gen_lock_end();
     return s->pc;
  illegal_op:
     if (s->prefix & PREFIX_LOCK)
-        gen_helper_unlock();
+        gen_lock_end();
     /* XXX: ensure that no lock was generated */
     gen_exception(s, EXCP06_ILLOP, pc_start - s->cs_base);
     return s->pc;
@@ -7826,6 +7908,8 @@ void optimize_flags_init(void)
                                     "cc_dst");
     cpu_cc_tmp = tcg_global_mem_new(TCG_AREG0, offsetof(CPUX86State, cc_tmp),
                                     "cc_tmp");
+    tcg_call_globals_add(X86_CALL_GLOBALS_CC, cpu_cc_src, false);
+    tcg_call_globals_add(X86_CALL_GLOBALS_CC, cpu_cc_dst, false);
 
 #ifdef TARGET_X86_64
     cpu_regs[R_EAX] = tcg_global_mem_new_i64(TCG_AREG0,
@@ -7942,6 +8026,8 @@ static inline void gen_intermediate_code_internal(CPUX86State *env,
                     || (flags & HF_SOFTMMU_MASK)
 #endif
                     );
+    dc->sb_jumps = (tb->cflags & CF_SUPERBLOCK) ? SUPERBLOCK_MAX_JUMPS : 0;
+    dc->pc_max = pc_start;
 #if 0
     /* check addseg logic */
     if (!dc->addseg && (dc->vm86 || !dc->pe || !dc->code32))
@@ -7972,7 +8058,7 @@ static inline void gen_intermediate_code_internal(CPUX86State *env,
     if (max_insns == 0)
         max_insns = CF_COUNT_MASK;
 
-    gen_icount_start();
+    gen_icount_start(tb);
     for(;;) {
         if (unlikely(!QTAILQ_EMPTY(&env->breakpoints))) {
             QTAILQ_FOREACH(bp, &env->breakpoints, entry) {
@@ -8016,7 +8102,7 @@ static inline void gen_intermediate_code_internal(CPUX86State *env,
         }
         /* if too long translation, stop generation too */
         if (tcg_ctx.gen_opc_ptr >= gen_opc_end ||
-            (pc_ptr - pc_start) >= (TARGET_PAGE_SIZE - 32) ||
+            (MAX(dc->pc_max, pc_ptr) - pc_start) >= (TARGET_PAGE_SIZE - 32) ||
             num_insns >= max_insns) {
             gen_jmp_im(pc_ptr - dc->cs_base);
             gen_eob(dc);
@@ -8051,13 +8137,14 @@ static inline void gen_intermediate_code_internal(CPUX86State *env,
         else
 #endif
             disas_flags = !dc->code32;
-        log_target_disas(env, pc_start, pc_ptr - pc_start, disas_flags);
+        log_target_disas(env, pc_start, MAX(dc->pc_max, pc_ptr) - pc_start,
+                         disas_flags);
         qemu_log("\n");
     }
 #endif
 
     if (!search_pc) {
-        tb->size = pc_ptr - pc_start;
+        tb->size = MAX(dc->pc_max, pc_ptr) - pc_start;
         tb->icount = num_insns;
     }
 }
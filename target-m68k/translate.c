@@ -2999,7 +2999,7 @@ gen_intermediate_code_internal(CPUM68KState *env, TranslationBlock *tb,
     if (max_insns == 0)
         max_insns = CF_COUNT_MASK;
 
-    gen_icount_start();
+    gen_icount_start(tb);
     do {
         pc_offset = dc->pc - pc_start;
         gen_throws_exception = NULL;
@@ -1772,7 +1772,7 @@ gen_intermediate_code_internal(CPUMBState *env, TranslationBlock *tb,
     if (max_insns == 0)
         max_insns = CF_COUNT_MASK;
 
-    gen_icount_start();
+    gen_icount_start(tb);
     do
     {
 #if SIM_COMPAT
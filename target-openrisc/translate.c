@@ -1698,7 +1698,7 @@ static inline void gen_intermediate_code_internal(OpenRISCCPU *cpu,
         max_insns = CF_COUNT_MASK;
     }
 
-    gen_icount_start();
+    gen_icount_start(tb);
 
     do {
         check_breakpoint(cpu, dc);
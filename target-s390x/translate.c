@@ -5144,7 +5144,7 @@ static inline void gen_intermediate_code_internal(CPUS390XState *env,
         max_insns = CF_COUNT_MASK;
     }
 
-    gen_icount_start();
+    gen_icount_start(tb);
 
     do {
         if (unlikely(!QTAILQ_EMPTY(&env->breakpoints))) {
@@ -2881,7 +2881,7 @@ static void gen_intermediate_code_internal(
         dc.next_icount = tcg_temp_local_new_i32();
     }
 
-    gen_icount_start();
+    gen_icount_start(tb);
 
     if (env->singlestep_enabled && env->exception_taken) {
         env->exception_taken = 0;
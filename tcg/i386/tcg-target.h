@@ -96,6 +96,7 @@ typedef enum {
 #else
 #define TCG_TARGET_HAS_movcond_i32      0
 #endif
+#define TCG_TARGET_HAS_goto_ptr         1
 
 #if TCG_TARGET_REG_BITS == 64
 #define TCG_TARGET_HAS_div2_i64         1
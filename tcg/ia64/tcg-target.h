@@ -133,6 +133,7 @@ typedef enum {
 #define TCG_TARGET_HAS_rot_i64          1
 #define TCG_TARGET_HAS_movcond_i32      1
 #define TCG_TARGET_HAS_movcond_i64      1
+#define TCG_TARGET_HAS_goto_ptr         0
 #define TCG_TARGET_HAS_deposit_i32      1
 #define TCG_TARGET_HAS_deposit_i64      1
 
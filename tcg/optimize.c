@@ -915,8 +915,16 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
 
         case INDEX_op_call:
             nb_call_args = (args[0] >> 16) + (args[0] & 0xffff);
-            if (!(args[nb_call_args + 1] & (TCG_CALL_NO_READ_GLOBALS |
-                                            TCG_CALL_NO_WRITE_GLOBALS))) {
+            tmp = args[nb_call_args + 1];
+            if (tmp & TCG_CALL_GLOBALS_MASK) {
+                tmp = (tmp & TCG_CALL_GLOBALS_MASK) >> TCG_CALL_GLOBALS_SHIFT;
+                for (i = 0; i < nb_globals; i++) {
+                    if (test_bit(i, s->call_globals_write[tmp])) {
+                        reset_temp(i);
+                    }
+                }
+            } else if (!(tmp & (TCG_CALL_NO_READ_GLOBALS |
+                                TCG_CALL_NO_WRITE_GLOBALS))) {
                 for (i = 0; i < nb_globals; i++) {
                     reset_temp(i);
                 }
@@ -958,10 +966,153 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
     return gen_args;
 }
 
+/* Stores to env that have not been read back yet */
+#define DSE_MAX_STORES 16
+
+struct tcg_env_store {
+    tcg_target_long ofs;
+    int size;
+    int op_index;
+};
+
+static struct tcg_env_store env_stores[DSE_MAX_STORES];
+static int nb_env_stores;
+
+static int op_ld_st_size(TCGOpcode op)
+{
+    switch (op) {
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld8s):
+    CASE_OP_32_64(st8):
+        return 1;
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(ld16s):
+    CASE_OP_32_64(st16):
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+/* Global temps are written back to env by the register allocator, behind
+   the back of this pass, so stores overlapping them are left alone.  */
+static bool env_overlaps_global(TCGContext *s, tcg_target_long ofs, int size)
+{
+    TCGTemp *ts;
+    int i;
+
+    for (i = 0; i < s->nb_globals; i++) {
+        ts = &s->temps[i];
+        if (ts->fixed_reg || ts->mem_reg != TCG_AREG0) {
+            continue;
+        }
+        if (ofs < ts->mem_offset + (ts->type == TCG_TYPE_I64 ? 8 : 4) &&
+            ts->mem_offset < ofs + size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Forget the pending stores that [ofs, ofs + size) reads.  Nothing is
+   read if KILL is set, and the stores it covers completely are dead.  */
+static void env_stores_remove(TCGContext *s, tcg_target_long ofs, int size,
+                              bool kill)
+{
+    struct tcg_env_store *st;
+    int i;
+
+    for (i = 0; i < nb_env_stores; i++) {
+        st = &env_stores[i];
+        if (kill) {
+            if (st->ofs < ofs || st->ofs + st->size > ofs + size) {
+                continue;
+            }
+            /* st has the same three arguments as nop3 */
+            s->gen_opc_buf[st->op_index] = INDEX_op_nop3;
+#ifdef CONFIG_PROFILER
+            s->del_op_count++;
+#endif
+        } else if (st->ofs >= ofs + size || ofs >= st->ofs + st->size) {
+            continue;
+        }
+        env_stores[i--] = env_stores[--nb_env_stores];
+    }
+}
+
+/* Remove stores to env that are overwritten before anything can see them:
+   there is no load from env in between, no helper call or guest memory
+   access that could raise an exception, and no end of basic block.  This
+   matters mostly for superblocks, where the code of several guest blocks
+   sets the same fields.  */
+static void tcg_dead_store_elim(TCGContext *s, uint16_t *tcg_opc_ptr,
+                                TCGArg *args, TCGOpDef *tcg_op_defs)
+{
+    int nb_ops, op_index, size;
+    TCGOpcode op;
+    const TCGOpDef *def;
+    TCGTemp *base;
+    bool is_store;
+
+    nb_env_stores = 0;
+    nb_ops = tcg_opc_ptr - s->gen_opc_buf;
+    for (op_index = 0; op_index < nb_ops; op_index++) {
+        op = s->gen_opc_buf[op_index];
+        def = &tcg_op_defs[op];
+
+        if (op == INDEX_op_call) {
+            nb_env_stores = 0;
+            args += (args[0] >> 16) + (args[0] & 0xffff) + 3;
+            continue;
+        } else if (op == INDEX_op_nopn) {
+            args += args[0];
+            continue;
+        }
+
+        size = op_ld_st_size(op);
+        if (size) {
+            is_store = def->nb_oargs == 0;
+            base = &s->temps[args[1]];
+            if (!base->fixed_reg || base->reg != TCG_AREG0) {
+                /* it could point anywhere, including into env */
+                if (!is_store) {
+                    nb_env_stores = 0;
+                }
+            } else if (!is_store) {
+                env_stores_remove(s, args[2], size, false);
+            } else if (!env_overlaps_global(s, args[2], size)) {
+                env_stores_remove(s, args[2], size, true);
+                if (nb_env_stores == DSE_MAX_STORES) {
+                    env_stores_remove(s, env_stores[0].ofs,
+                                      env_stores[0].size, false);
+                }
+                env_stores[nb_env_stores].ofs = args[2];
+                env_stores[nb_env_stores].size = size;
+                env_stores[nb_env_stores].op_index = op_index;
+                nb_env_stores++;
+            }
+        } else if (def->flags & (TCG_OPF_BB_END | TCG_OPF_CALL_CLOBBER |
+                                 TCG_OPF_SIDE_EFFECTS)) {
+            nb_env_stores = 0;
+        }
+        args += def->nb_args;
+    }
+}
+
 TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr,
         TCGArg *args, TCGOpDef *tcg_op_defs)
 {
     TCGArg *res;
     res = tcg_constant_folding(s, tcg_opc_ptr, args, tcg_op_defs);
+    tcg_dead_store_elim(s, tcg_opc_ptr, args, tcg_op_defs);
     return res;
 }
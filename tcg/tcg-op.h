@@ -2324,6 +2324,7 @@ static inline void tcg_gen_movcond_i64(TCGCond cond, TCGv_i64 ret,
 #define tcg_temp_new() tcg_temp_new_i32()
 #define tcg_global_reg_new tcg_global_reg_new_i32
 #define tcg_global_mem_new tcg_global_mem_new_i32
+#define tcg_call_globals_add tcg_call_globals_add_i32
 #define tcg_temp_local_new() tcg_temp_local_new_i32()
 #define tcg_temp_free tcg_temp_free_i32
 #define tcg_gen_qemu_ldst_op tcg_gen_op3i_i32
@@ -2335,6 +2336,7 @@ static inline void tcg_gen_movcond_i64(TCGCond cond, TCGv_i64 ret,
 #define tcg_temp_new() tcg_temp_new_i64()
 #define tcg_global_reg_new tcg_global_reg_new_i64
 #define tcg_global_mem_new tcg_global_mem_new_i64
+#define tcg_call_globals_add tcg_call_globals_add_i64
 #define tcg_temp_local_new() tcg_temp_local_new_i64()
 #define tcg_temp_free tcg_temp_free_i64
 #define tcg_gen_qemu_ldst_op tcg_gen_op3i_i64
@@ -2372,6 +2374,28 @@ static inline void tcg_gen_goto_tb(unsigned idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+/* Look up the TB for the current CPU state in the jump cache and jump
+   straight to it; fall back to the epilogue (i.e. exit_tb(0)) on a miss
+   or when the CPU has to leave the execution loop. */
+static inline void tcg_gen_lookup_and_goto_ptr(TCGv_ptr env)
+{
+    if (TCG_TARGET_HAS_goto_ptr) {
+        TCGv_ptr ptr = tcg_temp_new_ptr();
+        TCGArg args[1];
+        int sizemask = 0;
+
+        sizemask |= tcg_gen_sizemask(0, TCG_TARGET_REG_BITS == 64, 0);
+        sizemask |= tcg_gen_sizemask(1, TCG_TARGET_REG_BITS == 64, 0);
+        args[0] = GET_TCGV_PTR(env);
+        tcg_gen_helperN(tcg_helper_lookup_tb_ptr, TCG_CALL_NO_WG, sizemask,
+                        GET_TCGV_PTR(ptr), 1, args);
+        tcg_gen_op1i(INDEX_op_goto_ptr, GET_TCGV_PTR(ptr));
+        tcg_temp_free_ptr(ptr);
+    } else {
+        tcg_gen_exit_tb(0);
+    }
+}
+
 #if TCG_TARGET_REG_BITS == 32
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
@@ -432,6 +432,33 @@ TCGv_i64 tcg_global_mem_new_i64(int reg, tcg_target_long offset,
     return MAKE_TCGV_I64(idx);
 }
 
+static void tcg_call_globals_add_internal(int set, int idx, bool write)
+{
+    TCGContext *s = &tcg_ctx;
+
+    assert(set > 0 && set < TCG_MAX_CALL_GLOBALS);
+    assert(idx < s->nb_globals);
+    set_bit(idx, s->call_globals_read[set]);
+    if (write) {
+        set_bit(idx, s->call_globals_write[set]);
+    }
+}
+
+/* Tell that helpers called with TCG_CALL_GLOBALS(set) read global ARG,
+   and also write it if WRITE is true. */
+void tcg_call_globals_add_i32(int set, TCGv_i32 arg, bool write)
+{
+    tcg_call_globals_add_internal(set, GET_TCGV_I32(arg), write);
+}
+
+void tcg_call_globals_add_i64(int set, TCGv_i64 arg, bool write)
+{
+    tcg_call_globals_add_internal(set, GET_TCGV_I64(arg), write);
+#if TCG_TARGET_REG_BITS == 32
+    tcg_call_globals_add_internal(set, GET_TCGV_I64(arg) + 1, write);
+#endif
+}
+
 static inline int tcg_temp_new_internal(TCGType type, int temp_local)
 {
     TCGContext *s = &tcg_ctx;
@@ -1173,6 +1200,19 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs)
 #endif
 }
 
+/* Branches that end a basic block but may also fall through */
+static inline bool tcg_op_is_cond_branch(TCGOpcode op)
+{
+    switch (op) {
+    case INDEX_op_brcond_i32:
+    case INDEX_op_brcond_i64:
+    case INDEX_op_brcond2_i32:
+        return true;
+    default:
+        return false;
+    }
+}
+
 #ifdef USE_LIVENESS_ANALYSIS
 
 /* set a nop for an operation using 'nb_args' */
@@ -1212,6 +1252,41 @@ static inline void tcg_la_bb_end(TCGContext *s, uint8_t *dead_temps,
     }
 }
 
+/* liveness analysis: conditional branch.  The branch target starts a
+   new basic block and expects globals in memory, but they may stay in
+   registers on the fall through path: only temps die here. */
+static inline void tcg_la_cond_branch(TCGContext *s, uint8_t *dead_temps,
+                                      uint8_t *mem_temps)
+{
+    int i;
+
+    memset(dead_temps + s->nb_globals, 1, s->nb_temps - s->nb_globals);
+    memset(mem_temps, 1, s->nb_globals);
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        mem_temps[i] = s->temps[i].temp_local;
+    }
+}
+
+/* liveness analysis: call to a TCG_CALL_GLOBALS helper.  Only the globals
+   it reads have to be synced, and only those it writes must be reloaded
+   afterwards. */
+static inline void tcg_la_call_globals(TCGContext *s, int call_flags,
+                                       uint8_t *dead_temps,
+                                       uint8_t *mem_temps)
+{
+    int set = (call_flags & TCG_CALL_GLOBALS_MASK) >> TCG_CALL_GLOBALS_SHIFT;
+    int i;
+
+    for (i = 0; i < s->nb_globals; i++) {
+        if (test_bit(i, s->call_globals_read[set])) {
+            mem_temps[i] = 1;
+        }
+        if (test_bit(i, s->call_globals_write[set])) {
+            dead_temps[i] = 1;
+        }
+    }
+}
+
 /* Liveness analysis : update the opc_dead_args array to tell if a
    given input arguments is dead. Instructions updating dead
    temporaries are removed. */
@@ -1282,14 +1357,19 @@ static void tcg_liveness_analysis(TCGContext *s)
                         mem_temps[arg] = 0;
                     }
 
-                    if (!(call_flags & TCG_CALL_NO_READ_GLOBALS)) {
-                        /* globals should be synced to memory */
-                        memset(mem_temps, 1, s->nb_globals);
-                    }
-                    if (!(call_flags & (TCG_CALL_NO_WRITE_GLOBALS |
-                                        TCG_CALL_NO_READ_GLOBALS))) {
-                        /* globals should go back to memory */
-                        memset(dead_temps, 1, s->nb_globals);
+                    if (call_flags & TCG_CALL_GLOBALS_MASK) {
+                        tcg_la_call_globals(s, call_flags, dead_temps,
+                                            mem_temps);
+                    } else {
+                        if (!(call_flags & TCG_CALL_NO_READ_GLOBALS)) {
+                            /* globals should be synced to memory */
+                            memset(mem_temps, 1, s->nb_globals);
+                        }
+                        if (!(call_flags & (TCG_CALL_NO_WRITE_GLOBALS |
+                                            TCG_CALL_NO_READ_GLOBALS))) {
+                            /* globals should go back to memory */
+                            memset(dead_temps, 1, s->nb_globals);
+                        }
                     }
 
                     /* input args are live */
@@ -1413,7 +1493,9 @@ static void tcg_liveness_analysis(TCGContext *s)
                 }
 
                 /* if end of basic block, update */
-                if (def->flags & TCG_OPF_BB_END) {
+                if (tcg_op_is_cond_branch(op)) {
+                    tcg_la_cond_branch(s, dead_temps, mem_temps);
+                } else if (def->flags & TCG_OPF_BB_END) {
                     tcg_la_bb_end(s, dead_temps, mem_temps);
                 } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
                     /* globals should be synced to memory */
@@ -1561,6 +1643,9 @@ static inline void tcg_reg_sync(TCGContext *s, int reg)
             temp_allocate_frame(s, temp);
         }
         tcg_out_st(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+#ifdef CONFIG_PROFILER
+        s->spill_count++;
+#endif
     }
     ts->mem_coherent = 1;
 }
@@ -1678,6 +1763,21 @@ static void save_globals(TCGContext *s, TCGRegSet allocated_regs)
     }
 }
 
+/* sync a global to its canonical location. 'allocated_regs' is used in
+   case a temporary registers needs to be allocated to store a constant. */
+static inline void sync_global(TCGContext *s, int temp,
+                               TCGRegSet allocated_regs)
+{
+#ifdef USE_LIVENESS_ANALYSIS
+    /* The liveness analysis already ensures that globals are synced.
+       Keep an assert for safety. */
+    assert(s->temps[temp].val_type != TEMP_VAL_REG ||
+           s->temps[temp].fixed_reg || s->temps[temp].mem_coherent);
+#else
+    temp_sync(s, temp, allocated_regs);
+#endif
+}
+
 /* sync globals to their canonical location and assume they can be
    read by the following code. 'allocated_regs' is used in case a
    temporary registers needs to be allocated to store a constant. */
@@ -1686,18 +1786,28 @@ static void sync_globals(TCGContext *s, TCGRegSet allocated_regs)
     int i;
 
     for (i = 0; i < s->nb_globals; i++) {
-#ifdef USE_LIVENESS_ANALYSIS
-        assert(s->temps[i].val_type != TEMP_VAL_REG || s->temps[i].fixed_reg ||
-               s->temps[i].mem_coherent);
-#else
-        temp_sync(s, i, allocated_regs);
-#endif
+        sync_global(s, i, allocated_regs);
     }
 }
 
-/* at the end of a basic block, we assume all temporaries are dead and
-   all globals are stored at their canonical location. */
-static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
+/* save or sync the globals accessed by a TCG_CALL_GLOBALS helper */
+static void call_globals(TCGContext *s, int flags, TCGRegSet allocated_regs)
+{
+    int set = (flags & TCG_CALL_GLOBALS_MASK) >> TCG_CALL_GLOBALS_SHIFT;
+    int i;
+
+    for (i = 0; i < s->nb_globals; i++) {
+        if (test_bit(i, s->call_globals_write[set])) {
+            temp_save(s, i, allocated_regs);
+        } else if (test_bit(i, s->call_globals_read[set])) {
+            sync_global(s, i, allocated_regs);
+        }
+    }
+}
+
+/* at the end of a basic block, all temporaries are dead and local
+   temporaries are stored at their canonical location. */
+static void tcg_reg_alloc_temps_end(TCGContext *s, TCGRegSet allocated_regs)
 {
     TCGTemp *ts;
     int i;
@@ -1716,10 +1826,24 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
 #endif
         }
     }
+}
 
+/* at the end of a basic block, we assume all temporaries are dead and
+   all globals are stored at their canonical location. */
+static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
+{
+    tcg_reg_alloc_temps_end(s, allocated_regs);
     save_globals(s, allocated_regs);
 }
 
+/* a conditional branch also ends the basic block, but globals that are
+   in registers stay there for the fall through path. */
+static void tcg_reg_alloc_cond_branch(TCGContext *s, TCGRegSet allocated_regs)
+{
+    tcg_reg_alloc_temps_end(s, allocated_regs);
+    sync_globals(s, allocated_regs);
+}
+
 #define IS_DEAD_ARG(n) ((dead_args >> (n)) & 1)
 #define NEED_SYNC_ARG(n) ((sync_args >> (n)) & 1)
 
@@ -1775,6 +1899,9 @@ static void tcg_reg_alloc_mov(TCGContext *s, const TCGOpDef *def,
         if (ts->val_type == TEMP_VAL_MEM) {
             tcg_out_ld(s, ts->type, ts->reg, ts->mem_reg, ts->mem_offset);
             ts->mem_coherent = 1;
+#ifdef CONFIG_PROFILER
+            s->reload_count++;
+#endif
         } else if (ts->val_type == TEMP_VAL_CONST) {
             tcg_out_movi(s, ts->type, ts->reg, ts->val);
         }
@@ -1867,6 +1994,9 @@ static void tcg_reg_alloc_op(TCGContext *s,
             ts->reg = reg;
             ts->mem_coherent = 1;
             s->reg_to_temp[reg] = arg;
+#ifdef CONFIG_PROFILER
+            s->reload_count++;
+#endif
         } else if (ts->val_type == TEMP_VAL_CONST) {
             if (tcg_target_const_match(ts->val, arg_ct)) {
                 /* constant is OK for instruction */
@@ -1922,7 +2052,9 @@ static void tcg_reg_alloc_op(TCGContext *s,
         }
     }
 
-    if (def->flags & TCG_OPF_BB_END) {
+    if (tcg_op_is_cond_branch(opc)) {
+        tcg_reg_alloc_cond_branch(s, allocated_regs);
+    } else if (def->flags & TCG_OPF_BB_END) {
         tcg_reg_alloc_bb_end(s, allocated_regs);
     } else {
         if (def->flags & TCG_OPF_CALL_CLOBBER) {
@@ -2142,6 +2274,8 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
        they might be read. */
     if (flags & TCG_CALL_NO_READ_GLOBALS) {
         /* Nothing to do */
+    } else if (flags & TCG_CALL_GLOBALS_MASK) {
+        call_globals(s, flags, allocated_regs);
     } else if (flags & TCG_CALL_NO_WRITE_GLOBALS) {
         sync_globals(s, allocated_regs);
     } else {
@@ -2382,6 +2516,12 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
                 s->tb_count ? 
                 (double)s->temp_count / s->tb_count : 0,
                 s->temp_count_max);
+    cpu_fprintf(f, "avg spills/TB       %0.2f\n",
+                s->tb_count ? (double)s->spill_count / s->tb_count : 0);
+    cpu_fprintf(f, "avg reloads/TB      %0.2f\n",
+                s->tb_count ? (double)s->reload_count / s->tb_count : 0);
+    cpu_fprintf(f, "avg host code/TB    %0.1f bytes\n",
+                s->tb_count ? (double)s->code_out_len / s->tb_count : 0);
     
     cpu_fprintf(f, "cycles/op           %0.1f\n", 
                 s->op_count ? (double)tot / s->op_count : 0);
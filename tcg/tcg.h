@@ -22,6 +22,7 @@
  * THE SOFTWARE.
  */
 #include "qemu-common.h"
+#include "bitops.h"
 
 /* Target word size (must be identical to pointer size). */
 #if UINTPTR_MAX == UINT32_MAX
@@ -278,6 +279,13 @@ typedef int TCGv_i64;
 #define TCG_CALL_NO_WRITE_GLOBALS   0x0020
 /* Helper can be safely suppressed if the return value is not used. */
 #define TCG_CALL_NO_SIDE_EFFECTS    0x0040
+/* Helper only reads and writes the globals registered for set N with
+   tcg_call_globals_add_i32/i64(), 0 < N < TCG_MAX_CALL_GLOBALS.  As with
+   TCG_CALL_NO_READ_GLOBALS, it must not raise exceptions. */
+#define TCG_CALL_GLOBALS_SHIFT      8
+#define TCG_CALL_GLOBALS_MASK       0x0f00
+#define TCG_CALL_GLOBALS(n)         ((n) << TCG_CALL_GLOBALS_SHIFT)
+#define TCG_MAX_CALL_GLOBALS        16
 
 /* convenience version of most used call flags */
 #define TCG_CALL_NO_RWG         TCG_CALL_NO_READ_GLOBALS
@@ -398,6 +406,7 @@ struct TCGContext {
 
     /* goto_tb support */
     uint8_t *code_buf;
+    void *code_gen_epilogue;   /* goto_ptr target that returns to cpu_exec */
     uintptr_t *tb_next;
     uint16_t *tb_next_offset;
     uint16_t *tb_jmp_offset; /* != NULL if USE_DIRECT_JUMP */
@@ -426,6 +435,13 @@ struct TCGContext {
     int allocated_helpers;
     int helpers_sorted;
 
+    /* globals accessed by TCG_CALL_GLOBALS helpers; a written global is
+       also in the read set */
+    unsigned long call_globals_read[TCG_MAX_CALL_GLOBALS]
+                                   [BITS_TO_LONGS(TCG_MAX_TEMPS)];
+    unsigned long call_globals_write[TCG_MAX_CALL_GLOBALS]
+                                    [BITS_TO_LONGS(TCG_MAX_TEMPS)];
+
 #ifdef CONFIG_PROFILER
     /* profiling info */
     int64_t tb_count1;
@@ -435,6 +451,8 @@ struct TCGContext {
     int64_t temp_count;
     int temp_count_max;
     int64_t del_op_count;
+    int64_t spill_count; /* registers stored back to memory */
+    int64_t reload_count; /* temps loaded from memory */
     int64_t code_in_len;
     int64_t code_out_len;
     int64_t interm_time;
@@ -500,6 +518,7 @@ void tcg_set_frame(TCGContext *s, int reg,
 TCGv_i32 tcg_global_reg_new_i32(int reg, const char *name);
 TCGv_i32 tcg_global_mem_new_i32(int reg, tcg_target_long offset,
                                 const char *name);
+void tcg_call_globals_add_i32(int set, TCGv_i32 arg, bool write);
 TCGv_i32 tcg_temp_new_internal_i32(int temp_local);
 static inline TCGv_i32 tcg_temp_new_i32(void)
 {
@@ -515,6 +534,7 @@ char *tcg_get_arg_str_i32(TCGContext *s, char *buf, int buf_size, TCGv_i32 arg);
 TCGv_i64 tcg_global_reg_new_i64(int reg, const char *name);
 TCGv_i64 tcg_global_mem_new_i64(int reg, tcg_target_long offset,
                                 const char *name);
+void tcg_call_globals_add_i64(int set, TCGv_i64 arg, bool write);
 TCGv_i64 tcg_temp_new_internal_i64(int temp_local);
 static inline TCGv_i64 tcg_temp_new_i64(void)
 {
@@ -18,6 +18,7 @@
 
 import os
 import re
+import socket
 import subprocess
 import string
 import unittest
@@ -51,22 +52,48 @@ def qemu_io(*args):
     args = qemu_io_args + list(args)
     return subprocess.Popen(args, stdout=subprocess.PIPE).communicate()[0]
 
+class QEMUQtestProtocol(object):
+    '''The qtest protocol on a unix socket that QEMU connects to'''
+
+    def __init__(self, address):
+        self._address = address
+        self._listener = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._listener.bind(address)
+        self._listener.listen(1)
+        self._sock = None
+
+    def accept(self):
+        self._sock, _ = self._listener.accept()
+        self._file = self._sock.makefile('r')
+
+    def cmd(self, cmd):
+        '''Send a qtest command and return its response line'''
+        self._sock.sendall(cmd + '\n')
+        return self._file.readline().strip()
+
+    def close(self):
+        if self._sock:
+            self._sock.close()
+        self._listener.close()
+
 class VM(object):
     '''A QEMU VM'''
 
-    def __init__(self):
-        self._monitor_path = os.path.join(test_dir, 'qemu-mon.%d' % os.getpid())
-        self._qemu_log_path = os.path.join(test_dir, 'qemu-log.%d' % os.getpid())
+    def __init__(self, path_suffix=''):
+        self._monitor_path = os.path.join(test_dir, 'qemu-mon%s.%d' % (path_suffix, os.getpid()))
+        self._qtest_path = os.path.join(test_dir, 'qemu-qtest%s.%d' % (path_suffix, os.getpid()))
+        self._qemu_log_path = os.path.join(test_dir, 'qemu-log%s.%d' % (path_suffix, os.getpid()))
         self._args = qemu_args + ['-chardev',
                      'socket,id=mon,path=' + self._monitor_path,
                      '-mon', 'chardev=mon,mode=control',
-                     '-qtest', 'stdio', '-machine', 'accel=qtest',
+                     '-qtest', 'unix:' + self._qtest_path,
+                     '-machine', 'accel=qtest',
                      '-display', 'none', '-vga', 'none']
         self._num_drives = 0
 
-    def add_drive(self, path, opts=''):
-        '''Add a virtio-blk drive to the VM'''
-        options = ['if=virtio',
+    def add_drive(self, path, opts='', interface='virtio'):
+        '''Add a drive to the VM, by default a virtio-blk one'''
+        options = ['if=%s' % interface,
                    'format=%s' % imgfmt,
                    'cache=none',
                    'file=%s' % path,
@@ -79,17 +106,26 @@ class VM(object):
         self._num_drives += 1
         return self
 
+    def add_incoming_migration(self, desc):
+        '''Configure the VM to wait for an incoming migration'''
+        self._args.append('-incoming')
+        self._args.append(desc)
+        return self
+
     def launch(self):
         '''Launch the VM and establish a QMP connection'''
         devnull = open('/dev/null', 'rb')
         qemulog = open(self._qemu_log_path, 'wb')
         try:
             self._qmp = qmp.QEMUMonitorProtocol(self._monitor_path, server=True)
+            self._qtest = QEMUQtestProtocol(self._qtest_path)
             self._popen = subprocess.Popen(self._args, stdin=devnull, stdout=qemulog,
                                            stderr=subprocess.STDOUT)
             self._qmp.accept()
+            self._qtest.accept()
         except:
             os.remove(self._monitor_path)
+            os.remove(self._qtest_path)
             raise
 
     def shutdown(self):
@@ -97,7 +133,9 @@ class VM(object):
         if not self._popen is None:
             self._qmp.cmd('quit')
             self._popen.wait()
+            self._qtest.close()
             os.remove(self._monitor_path)
+            os.remove(self._qtest_path)
             os.remove(self._qemu_log_path)
             self._popen = None
 
@@ -110,6 +148,10 @@ class VM(object):
 
         return self._qmp.cmd(cmd, args=qmp_args)
 
+    def qtest(self, cmd):
+        '''Send a qtest command, e.g. to access guest memory or I/O ports'''
+        return self._qtest.cmd(cmd)
+
     def get_qmp_event(self, wait=False):
         '''Poll for one queued QMP events and return it'''
         return self._qmp.pull_event(wait=wait)
@@ -0,0 +1,188 @@
+/*
+ * Stress test for guest atomic instructions with multithreaded TCG
+ *
+ * Every processor increments shared counters with LOCK-prefixed
+ * instructions, compare-and-swap loops and an xchg spinlock.  An update
+ * lost to a race between two vCPU threads leaves a counter short of
+ * nr_cpus * NR_ITERATIONS.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+#define NR_ITERATIONS   100000
+/* how long to wait for the application processors to come up */
+#define STARTUP_SPINS   100000000
+
+#define DEBUGCON_PORT   0xe9
+
+/* crt.S */
+extern volatile uint32_t nr_cpus_started;
+void start_aps(void);
+void shutdown(void) __attribute__((noreturn));
+
+static volatile uint32_t nr_cpus_ready;
+static volatile uint32_t nr_cpus_done;
+static volatile int go;
+
+static volatile uint32_t lock_inc_count;
+static volatile uint32_t xadd_count;
+static volatile uint32_t cmpxchg_count;
+static volatile uint64_t cmpxchg8b_count;
+static volatile uint32_t spinlock;
+static volatile uint32_t spinlock_count;
+
+static void put_string(const char *s)
+{
+    while (*s) {
+        asm volatile("outb %0, %1" : : "a" (*s++), "Nd" (DEBUGCON_PORT));
+    }
+}
+
+static void put_number(uint32_t n)
+{
+    char buf[11];
+    int i = sizeof(buf) - 1;
+
+    buf[i] = 0;
+    do {
+        buf[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    put_string(&buf[i]);
+}
+
+static inline void cpu_relax(void)
+{
+    asm volatile("pause" : : : "memory");
+}
+
+/* The number of processors comes from "cpus=N" on the command line */
+static uint32_t get_nr_cpus(const uint32_t *mbi)
+{
+    const char *p;
+    uint32_t n = 0;
+
+    if (!(mbi[0] & (1 << 2))) {
+        return 1;
+    }
+    for (p = (const char *)mbi[4]; *p; p++) {
+        if (p[0] == 'c' && p[1] == 'p' && p[2] == 'u' && p[3] == 's' &&
+            p[4] == '=') {
+            for (p += 5; *p >= '0' && *p <= '9'; p++) {
+                n = n * 10 + *p - '0';
+            }
+            break;
+        }
+    }
+    return n ? n : 1;
+}
+
+static void run_test(void)
+{
+    uint32_t old, one;
+    uint64_t old64;
+    int i;
+
+    for (i = 0; i < NR_ITERATIONS; i++) {
+        asm volatile("lock incl %0" : "+m" (lock_inc_count));
+
+        one = 1;
+        asm volatile("lock xaddl %0, %1" : "+r" (one), "+m" (xadd_count));
+
+        do {
+            old = cmpxchg_count;
+        } while (!__sync_bool_compare_and_swap(&cmpxchg_count, old, old + 1));
+
+        /* the two halves may be read from different updates, the
+           cmpxchg8b then fails and the loop retries */
+        do {
+            old64 = cmpxchg8b_count;
+        } while (!__sync_bool_compare_and_swap(&cmpxchg8b_count, old64,
+                                               old64 + 1));
+
+        /* xchg with a memory operand is locked without the prefix */
+        while (__sync_lock_test_and_set(&spinlock, 1)) {
+            cpu_relax();
+        }
+        spinlock_count++;
+        __sync_lock_release(&spinlock);
+    }
+    __sync_fetch_and_add(&nr_cpus_done, 1);
+}
+
+/* without libgcc, 64-bit counts are only printed modulo 2^32 */
+static int check(const char *name, uint64_t count, uint32_t expected)
+{
+    put_string(name);
+    put_string(": ");
+    put_number(count);
+    if (count != expected) {
+        put_string(", expected ");
+        put_number(expected);
+        put_string("\n");
+        return 1;
+    }
+    put_string("\n");
+    return 0;
+}
+
+void ap_main(uint32_t cpu)
+{
+    __sync_fetch_and_add(&nr_cpus_ready, 1);
+    while (!go) {
+        cpu_relax();
+    }
+    run_test();
+}
+
+void main(const uint32_t *mbi)
+{
+    uint32_t nr_cpus = get_nr_cpus(mbi);
+    uint32_t expected;
+    int i, failed = 0;
+
+    if (nr_cpus > 1) {
+        start_aps();
+    }
+    for (i = 0; i < STARTUP_SPINS && nr_cpus_ready < nr_cpus - 1; i++) {
+        cpu_relax();
+    }
+    if (nr_cpus_ready != nr_cpus - 1) {
+        put_string("FAIL: ");
+        put_number(nr_cpus_ready + 1);
+        put_string(" of ");
+        put_number(nr_cpus);
+        put_string(" processors started\n");
+        shutdown();
+    }
+
+    go = 1;
+    run_test();
+    while (nr_cpus_done < nr_cpus) {
+        cpu_relax();
+    }
+
+    expected = nr_cpus * NR_ITERATIONS;
+    failed |= check("lock inc", lock_inc_count, expected);
+    failed |= check("lock xadd", xadd_count, expected);
+    failed |= check("lock cmpxchg", cmpxchg_count, expected);
+    failed |= check("lock cmpxchg8b", cmpxchg8b_count, expected);
+    failed |= check("xchg spinlock", spinlock_count, expected);
+    put_string(failed ? "FAIL\n" : "PASS\n");
+    shutdown();
+}
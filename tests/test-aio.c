@@ -622,6 +622,63 @@ static void test_source_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+/* Benchmarks, only run with "-m perf".  */
+
+#define PERF_WAKEUPS 10000
+
+typedef struct {
+    EventNotifier e;
+    int n;
+} PerfNotifierData;
+
+static int perf_active_cb(EventNotifier *e)
+{
+    return 1;
+}
+
+static void perf_ready_cb(EventNotifier *e)
+{
+    PerfNotifierData *data = container_of(e, PerfNotifierData, e);
+    event_notifier_test_and_clear(e);
+    data->n++;
+}
+
+/* Time from an event on one out of @nr_handlers descriptors to the
+ * corresponding callback.  */
+static void test_perf_wakeup(gconstpointer opaque)
+{
+    int nr_handlers = GPOINTER_TO_INT(opaque);
+    PerfNotifierData *data = g_new0(PerfNotifierData, nr_handlers);
+    PerfNotifierData *last = &data[nr_handlers - 1];
+    double elapsed;
+    int i;
+
+    for (i = 0; i < nr_handlers; i++) {
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, perf_ready_cb, perf_active_cb);
+    }
+    while (aio_poll(ctx, false));
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_WAKEUPS; i++) {
+        event_notifier_set(&last->e);
+        aio_poll(ctx, true);
+    }
+    elapsed = g_test_timer_elapsed();
+    g_assert_cmpint(last->n, ==, PERF_WAKEUPS);
+
+    g_test_minimized_result(elapsed * 1e6 / PERF_WAKEUPS,
+                            "%d handlers: %.3f us per wakeup",
+                            nr_handlers, elapsed * 1e6 / PERF_WAKEUPS);
+
+    for (i = 0; i < nr_handlers; i++) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL, NULL);
+        event_notifier_cleanup(&data[i].e);
+    }
+    while (g_main_context_iteration(NULL, false));
+    g_free(data);
+}
+
 /* End of tests.  */
 
 int main(int argc, char **argv)
@@ -663,5 +720,19 @@ int main(int argc, char **argv)
     g_test_add_func("/aio-gsource/event/wait",              test_source_wait_event_notifier);
     g_test_add_func("/aio-gsource/event/wait/no-flush-cb",  test_source_wait_event_notifier_noflush);
     g_test_add_func("/aio-gsource/event/flush",             test_source_flush_event_notifier);
+
+    if (g_test_perf()) {
+        /* Kept well below the usual limit of 1024 open files */
+        static const int nr_handlers[] = { 1, 16, 64, 256 };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(nr_handlers); i++) {
+            char *path = g_strdup_printf("/aio/perf/wakeup/%d",
+                                         nr_handlers[i]);
+            g_test_add_data_func(path, GINT_TO_POINTER(nr_handlers[i]),
+                                 test_perf_wakeup);
+            g_free(path);
+        }
+    }
     return g_test_run();
 }
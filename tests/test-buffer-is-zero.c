@@ -0,0 +1,80 @@
+/*
+ * buffer_is_zero() unit tests
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+
+/* Lengths that take every path: the generic loop and the SIMD ones */
+static const size_t test_lens[] = { 32, 64, 96, 128, 512, 4096, 65536 };
+
+static void test_zero(void)
+{
+    uint8_t *buf = g_malloc0(65536 + 1);
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(test_lens); i++) {
+        g_assert(buffer_is_zero(buf, test_lens[i]));
+        /* unaligned */
+        g_assert(buffer_is_zero(buf + 1, test_lens[i]));
+    }
+    g_free(buf);
+}
+
+static void test_nonzero(void)
+{
+    uint8_t *buf = g_malloc0(65536);
+    size_t len, pos;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(test_lens); i++) {
+        len = test_lens[i];
+        for (pos = 0; pos < len; pos += (len < 512 ? 1 : 509)) {
+            buf[pos] = 0x80;
+            g_assert(!buffer_is_zero(buf, len));
+            buf[pos] = 0;
+        }
+        /* the last byte counts, the one after it does not */
+        buf[len - 1] = 1;
+        g_assert(!buffer_is_zero(buf, len));
+        buf[len - 1] = 0;
+        if (len < 65536) {
+            buf[len] = 1;
+            g_assert(buffer_is_zero(buf, len));
+            buf[len] = 0;
+        }
+    }
+    g_free(buf);
+}
+
+static void perf_scan(void)
+{
+    size_t len = 64 * 1024 * 1024;
+    uint8_t *buf = g_malloc0(len);
+    unsigned int i, max = 32;
+    double duration;
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        g_assert(buffer_is_zero(buf, len));
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Scanned %u MB of zeroes in %f s: %.2f GB/s\n",
+                   max * 64, duration, max * 64 / 1024.0 / duration);
+    g_free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/buffer-is-zero/zero", test_zero);
+    g_test_add_func("/buffer-is-zero/nonzero", test_nonzero);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/buffer-is-zero", perf_scan);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,259 @@
+/*
+ * NetQueue unit tests
+ *
+ * The receiving side is a fake net client, so that net/queue.c can be
+ * exercised without the rest of the network layer.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "net.h"
+#include "net/queue.h"
+
+typedef struct TestReceiver {
+    NetClientState nc;
+    bool batch;             /* accepts batches */
+    int space;              /* packets it can take before it is full */
+    int packets;
+    int batches;
+    size_t bytes;
+    uint8_t last;           /* first byte of the last packet */
+    bool in_order;
+} TestReceiver;
+
+static int sent_cb_calls;
+
+static void test_sent_cb(NetClientState *sender, ssize_t ret)
+{
+    sent_cb_calls++;
+}
+
+static ssize_t test_receive(TestReceiver *r, const uint8_t *data, size_t size)
+{
+    if (r->space == 0) {
+        return 0;
+    }
+    r->space--;
+    r->packets++;
+    r->bytes += size;
+    if (data[0] != (uint8_t)(r->last + 1)) {
+        r->in_order = false;
+    }
+    r->last = data[0];
+    return size;
+}
+
+/* What net.c would do, minus link state and the NetClientInfo callbacks */
+int qemu_can_send_packet(NetClientState *sender)
+{
+    return 1;
+}
+
+ssize_t qemu_deliver_packet(NetClientState *sender, unsigned flags,
+                            const uint8_t *data, size_t size, void *opaque)
+{
+    TestReceiver *r = opaque;
+
+    if (r->nc.receive_disabled) {
+        return 0;
+    }
+    if (test_receive(r, data, size) == 0) {
+        r->nc.receive_disabled = 1;
+        return 0;
+    }
+    return size;
+}
+
+ssize_t qemu_deliver_packet_iov(NetClientState *sender, unsigned flags,
+                                const struct iovec *iov, int iovcnt,
+                                void *opaque)
+{
+    g_assert(iovcnt == 1);
+    return qemu_deliver_packet(sender, flags, iov[0].iov_base,
+                               iov[0].iov_len, opaque);
+}
+
+int qemu_deliver_packet_batch(const struct iovec *packets, int count,
+                              void *opaque)
+{
+    TestReceiver *r = opaque;
+    int i;
+
+    if (!r->batch) {
+        return -ENOTSUP;
+    }
+    if (r->nc.receive_disabled) {
+        return 0;
+    }
+    r->batches++;
+    for (i = 0; i < count; i++) {
+        if (test_receive(r, packets[i].iov_base, packets[i].iov_len) == 0) {
+            break;
+        }
+    }
+    if (i == 0) {
+        r->nc.receive_disabled = 1;
+    }
+    return i;
+}
+
+static TestReceiver *test_receiver_new(bool batch)
+{
+    TestReceiver *r = g_malloc0(sizeof(*r));
+
+    r->batch = batch;
+    r->in_order = true;
+    r->nc.send_queue = qemu_new_net_queue(r);
+    return r;
+}
+
+static void test_receiver_free(TestReceiver *r)
+{
+    qemu_del_net_queue(r->nc.send_queue);
+    g_free(r);
+}
+
+static void test_receiver_unblock(TestReceiver *r, int space)
+{
+    r->space = space;
+    r->nc.receive_disabled = 0;
+}
+
+static ssize_t test_send(TestReceiver *r, uint8_t seq, size_t size,
+                         NetPacketSent *sent_cb)
+{
+    uint8_t buf[size];
+
+    memset(buf, 0, size);
+    buf[0] = seq;
+    return qemu_net_queue_send(r->nc.send_queue, NULL,
+                               QEMU_NET_PACKET_FLAG_NONE, buf, size, sent_cb);
+}
+
+static void test_bound(void)
+{
+    TestReceiver *r = test_receiver_new(false);
+    NetQueue *queue = r->nc.send_queue;
+    int i;
+
+    qemu_net_queue_set_max_bytes(queue, 10 * 1000);
+
+    /* The receiver is full: the first packet is refused and queued */
+    g_assert_cmpint(test_send(r, 1, 1000, NULL), ==, 0);
+    for (i = 2; i <= 20; i++) {
+        g_assert_cmpint(test_send(r, i, 1000, NULL), ==, 0);
+    }
+    g_assert_cmpint(qemu_net_queue_bytes(queue), ==, 10 * 1000);
+
+    /* Packets with a sent callback are never dropped */
+    g_assert_cmpint(test_send(r, 11, 1000, test_sent_cb), ==, 0);
+    g_assert_cmpint(qemu_net_queue_bytes(queue), ==, 11 * 1000);
+
+    test_receiver_unblock(r, 100);
+    sent_cb_calls = 0;
+    g_assert(qemu_net_queue_flush(queue));
+    g_assert_cmpint(r->packets, ==, 11);
+    g_assert(r->in_order);
+    g_assert_cmpint(sent_cb_calls, ==, 1);
+    g_assert_cmpint(qemu_net_queue_bytes(queue), ==, 0);
+
+    test_receiver_free(r);
+}
+
+static void test_flush(bool batch)
+{
+    TestReceiver *r = test_receiver_new(batch);
+    NetQueue *queue = r->nc.send_queue;
+    int i;
+
+    for (i = 1; i <= 200; i++) {
+        /* Alternate pooled and large packets */
+        g_assert_cmpint(test_send(r, i, i % 2 ? 60 : 9000, NULL), ==, 0);
+    }
+
+    /* Partial flush, the receiver fills up again */
+    test_receiver_unblock(r, 50);
+    g_assert(!qemu_net_queue_flush(queue));
+    g_assert_cmpint(r->packets, ==, 50);
+
+    test_receiver_unblock(r, 1000);
+    g_assert(qemu_net_queue_flush(queue));
+    g_assert_cmpint(r->packets, ==, 200);
+    g_assert(r->in_order);
+    g_assert_cmpint(qemu_net_queue_bytes(queue), ==, 0);
+    if (batch) {
+        g_assert_cmpint(r->batches, <=, 2 + 200 / 64 + 1);
+    } else {
+        g_assert_cmpint(r->batches, ==, 0);
+    }
+
+    /* Purged packets go back to the pool and leave the byte count alone */
+    test_receiver_unblock(r, 0);
+    g_assert_cmpint(test_send(r, 201, 60, NULL), ==, 0);
+    qemu_net_queue_purge(queue, NULL);
+    g_assert_cmpint(qemu_net_queue_bytes(queue), ==, 0);
+
+    test_receiver_free(r);
+}
+
+static void test_flush_single(void)
+{
+    test_flush(false);
+}
+
+static void test_flush_batch(void)
+{
+    test_flush(true);
+}
+
+static void perf_queue(bool batch)
+{
+    TestReceiver *r = test_receiver_new(batch);
+    NetQueue *queue = r->nc.send_queue;
+    unsigned int i, j, rounds = 20000, burst = 256;
+    double duration;
+
+    g_test_timer_start();
+    for (i = 0; i < rounds; i++) {
+        /* The receiver is busy while a burst is queued, then drains it */
+        test_receiver_unblock(r, 0);
+        for (j = 0; j < burst; j++) {
+            test_send(r, r->last + 1 + j, 64, NULL);
+        }
+        test_receiver_unblock(r, burst);
+        g_assert(qemu_net_queue_flush(queue));
+    }
+    duration = g_test_timer_elapsed();
+
+    g_assert(r->in_order);
+    g_test_message("%s: %u packets in %f s: %.2f Mpps\n",
+                   batch ? "batched" : "single", rounds * burst, duration,
+                   rounds * burst / duration / 1e6);
+    test_receiver_free(r);
+}
+
+static void perf_queue_single(void)
+{
+    perf_queue(false);
+}
+
+static void perf_queue_batch(void)
+{
+    perf_queue(true);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/queue/bound", test_bound);
+    g_test_add_func("/net/queue/flush/single", test_flush_single);
+    g_test_add_func("/net/queue/flush/batch", test_flush_batch);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/net/queue/single", perf_queue_single);
+        g_test_add_func("/perf/net/queue/batch", perf_queue_batch);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,158 @@
+/*
+ * Simple trace backend tests
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "trace.h"
+#include "trace/control.h"
+
+#define NR_THREADS 4
+#define NR_EVENTS  100000
+
+/* Matches the layout written by trace/simple.c and read by simpletrace.py */
+typedef struct {
+    uint64_t event;
+    uint64_t timestamp_ns;
+    uint32_t length;
+    uint32_t reserved;
+    uint64_t arg;
+} TestRecord;
+
+static char trace_file[] = "/tmp/qemu-test-trace.XXXXXX";
+
+static void emit(uint64_t val)
+{
+    TraceBufferRecord rec;
+
+    if (trace_record_start(&rec, 0, sizeof(uint64_t)) == 0) {
+        trace_record_write_u64(&rec, val);
+        trace_record_finish(&rec);
+    }
+}
+
+static gpointer producer(gpointer opaque)
+{
+    uint64_t id = (uintptr_t)opaque;
+    uint64_t i;
+
+    for (i = 0; i < NR_EVENTS; i++) {
+        emit((id << 32) | i);
+    }
+    return NULL;
+}
+
+static void test_concurrent(void)
+{
+    GThread *threads[NR_THREADS];
+    int64_t last[NR_THREADS];
+    uint64_t hdr[3], written = 0, dropped = 0;
+    TestRecord rec;
+    FILE *fp;
+    int i;
+
+    g_assert(st_set_trace_file(trace_file));
+    for (i = 0; i < NR_THREADS; i++) {
+        threads[i] = g_thread_create(producer, (gpointer)(uintptr_t)i,
+                                     TRUE, NULL);
+        last[i] = -1;
+    }
+    for (i = 0; i < NR_THREADS; i++) {
+        g_thread_join(threads[i]);
+    }
+    st_flush_trace_buffer();
+    st_set_trace_file_enabled(false);
+
+    fp = fopen(trace_file, "rb");
+    g_assert(fp);
+    g_assert_cmpint(fread(hdr, sizeof(hdr), 1, fp), ==, 1);
+    g_assert_cmphex(hdr[0], ==, ~(uint64_t)0);
+
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        g_assert_cmpint(rec.length, ==, sizeof(rec));
+        if (rec.event == ~(uint64_t)0 - 1) {
+            dropped += rec.arg;
+            continue;
+        }
+        g_assert_cmpint(rec.event, ==, 0);
+        i = rec.arg >> 32;
+        g_assert_cmpint(i, <, NR_THREADS);
+
+        /* Records of one thread come out in the order they were made */
+        g_assert_cmpint((int64_t)(uint32_t)rec.arg, >, last[i]);
+        last[i] = (uint32_t)rec.arg;
+        written++;
+    }
+    fclose(fp);
+    unlink(trace_file);
+
+    /* Drops are only accounted when the next batch is written out */
+    g_assert_cmpint(written + dropped, <=, NR_THREADS * NR_EVENTS);
+    g_assert_cmpint(written, >, 0);
+}
+
+static gpointer perf_producer(gpointer opaque)
+{
+    int i;
+
+    for (i = 0; i < NR_EVENTS; i++) {
+        emit(i);
+    }
+    return NULL;
+}
+
+static void perf_events(int nr_threads)
+{
+    GThread *threads[NR_THREADS];
+    double duration;
+    int i;
+
+    g_assert(st_set_trace_file(trace_file));
+    g_test_timer_start();
+    for (i = 0; i < nr_threads; i++) {
+        threads[i] = g_thread_create(perf_producer, NULL, TRUE, NULL);
+    }
+    for (i = 0; i < nr_threads; i++) {
+        g_thread_join(threads[i]);
+    }
+    duration = g_test_timer_elapsed();
+    st_set_trace_file_enabled(false);
+    unlink(trace_file);
+
+    g_test_message("%d thread(s): %d events each in %f s, %.1f ns/event",
+                   nr_threads, NR_EVENTS, duration,
+                   duration * 1e9 / NR_EVENTS);
+}
+
+static void perf_one_thread(void)
+{
+    perf_events(1);
+}
+
+static void perf_all_threads(void)
+{
+    perf_events(NR_THREADS);
+}
+
+int main(int argc, char **argv)
+{
+    int fd;
+
+    g_test_init(&argc, &argv, NULL);
+
+    fd = mkstemp(trace_file);
+    g_assert(fd >= 0);
+    close(fd);
+    trace_backend_init(NULL, trace_file);
+
+    g_test_add_func("/trace/simple/concurrent", test_concurrent);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/trace/simple/one-thread", perf_one_thread);
+        g_test_add_func("/perf/trace/simple/all-threads", perf_all_threads);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,281 @@
+/*
+ * QTest testcase for virtio-blk with x-data-plane
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Covers device creation with one, several and many data plane devices
+ * (one I/O thread each), and a write and read back through the virtqueue
+ * of a data plane device, driven by a minimal legacy virtio-pci driver.
+ * The I/O thread itself needs KVM ioeventfd, so under qtest the request
+ * goes through the main loop fallback; IOPS scaling is not exercised.
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "qemu-common.h"
+#include "libqtest.h"
+
+/* O_DIRECT is not supported on tmpfs, so create the image in the
+ * current directory rather than in /tmp.
+ */
+static char *create_test_img(int64_t size)
+{
+    char *template = strdup("virtio-blk-test.XXXXXX");
+    int fd, ret;
+
+    fd = mkstemp(template);
+    g_assert(fd >= 0);
+    ret = ftruncate(fd, size);
+    g_assert(ret == 0);
+    close(fd);
+    return template;
+}
+
+static char *img_file_name;
+
+#define PCI_CONFIG_ADDR         0xcf8
+#define PCI_CONFIG_DATA         0xcfc
+
+#define VIRTIO_VENDOR_ID        0x1af4
+#define VIRTIO_BLK_DEVICE_ID    0x1001
+
+/* Legacy virtio-pci I/O BAR layout */
+#define VIRTIO_PCI_QUEUE_PFN    8
+#define VIRTIO_PCI_QUEUE_NUM    12
+#define VIRTIO_PCI_QUEUE_SEL    14
+#define VIRTIO_PCI_QUEUE_NOTIFY 16
+#define VIRTIO_PCI_STATUS       18
+
+#define VIRTIO_STATUS_ACK       1
+#define VIRTIO_STATUS_DRIVER    2
+#define VIRTIO_STATUS_DRIVER_OK 4
+
+#define VRING_DESC_F_NEXT       1
+#define VRING_DESC_F_WRITE      2
+#define VRING_ALIGN             4096
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+
+/* Where the test puts things: the BAR in I/O space, guest RAM for the
+ * vring and for the request headers and buffers */
+#define IO_BASE                 0xc000
+#define VRING_ADDR              0x100000
+#define REQ_HDR_ADDR            0x200000
+#define REQ_DATA_ADDR           0x201000
+#define REQ_STATUS_ADDR         0x202000
+
+static uint32_t pci_config_readl(int devfn, uint8_t offset)
+{
+    outl(PCI_CONFIG_ADDR, 0x80000000 | (devfn << 8) | offset);
+    return inl(PCI_CONFIG_DATA);
+}
+
+static void pci_config_writel(int devfn, uint8_t offset, uint32_t value)
+{
+    outl(PCI_CONFIG_ADDR, 0x80000000 | (devfn << 8) | offset);
+    outl(PCI_CONFIG_DATA, value);
+}
+
+static void writew(uint64_t addr, uint16_t value)
+{
+    value = cpu_to_le16(value);
+    memwrite(addr, &value, sizeof(value));
+}
+
+static void writel(uint64_t addr, uint32_t value)
+{
+    value = cpu_to_le32(value);
+    memwrite(addr, &value, sizeof(value));
+}
+
+static void writeq(uint64_t addr, uint64_t value)
+{
+    value = cpu_to_le64(value);
+    memwrite(addr, &value, sizeof(value));
+}
+
+static uint16_t readw(uint64_t addr)
+{
+    uint16_t value;
+
+    memread(addr, &value, sizeof(value));
+    return le16_to_cpu(value);
+}
+
+typedef struct {
+    uint16_t num;
+    uint64_t desc;
+    uint64_t avail;
+    uint64_t used;
+    uint16_t avail_idx;
+} TestVring;
+
+/* Enables the only virtio-blk device on bus 0 and sets up its queue */
+static void virtio_blk_init(TestVring *vring)
+{
+    int devfn;
+
+    for (devfn = 0; devfn < 256; devfn += 8) {
+        if (pci_config_readl(devfn, 0) ==
+            (VIRTIO_BLK_DEVICE_ID << 16 | VIRTIO_VENDOR_ID)) {
+            break;
+        }
+    }
+    g_assert_cmpint(devfn, <, 256);
+
+    /* No firmware runs under qtest, so map the BAR ourselves and enable
+     * I/O space and bus mastering */
+    pci_config_writel(devfn, 0x10, IO_BASE);
+    pci_config_writel(devfn, 0x04, 0x5);
+
+    outb(IO_BASE + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+    outw(IO_BASE + VIRTIO_PCI_QUEUE_SEL, 0);
+    vring->num = inw(IO_BASE + VIRTIO_PCI_QUEUE_NUM);
+    g_assert_cmpint(vring->num, >=, 3);
+    vring->desc = VRING_ADDR;
+    vring->avail = vring->desc + vring->num * 16;
+    vring->used = (vring->avail + 4 + vring->num * 2 + 2 + VRING_ALIGN - 1) &
+                  ~(uint64_t)(VRING_ALIGN - 1);
+    vring->avail_idx = 0;
+    outl(IO_BASE + VIRTIO_PCI_QUEUE_PFN, VRING_ADDR / VRING_ALIGN);
+
+    outb(IO_BASE + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK |
+         VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+}
+
+static void vring_set_desc(TestVring *vring, int i, uint64_t addr,
+                           uint32_t len, uint16_t flags)
+{
+    uint64_t desc = vring->desc + i * 16;
+
+    writeq(desc, addr);
+    writel(desc + 8, len);
+    writew(desc + 12, flags);
+    writew(desc + 14, i + 1);
+}
+
+/* Submits a one sector request in descriptors 0-2 and waits for it */
+static uint8_t virtio_blk_request(TestVring *vring, uint32_t type,
+                                  uint64_t sector)
+{
+    uint8_t status = 0xff;
+    int i;
+
+    writel(REQ_HDR_ADDR, type);
+    writel(REQ_HDR_ADDR + 4, 0);
+    writeq(REQ_HDR_ADDR + 8, sector);
+    memwrite(REQ_STATUS_ADDR, &status, 1);
+
+    vring_set_desc(vring, 0, REQ_HDR_ADDR, 16, VRING_DESC_F_NEXT);
+    vring_set_desc(vring, 1, REQ_DATA_ADDR, 512, VRING_DESC_F_NEXT |
+                   (type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0));
+    vring_set_desc(vring, 2, REQ_STATUS_ADDR, 1, VRING_DESC_F_WRITE);
+
+    writew(vring->avail + 4 + (vring->avail_idx % vring->num) * 2, 0);
+    vring->avail_idx++;
+    writew(vring->avail + 2, vring->avail_idx);
+    outw(IO_BASE + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+
+    /* Every qtest command lets the main loop run once more */
+    for (i = 0; i < 10000; i++) {
+        if (readw(vring->used + 2) == vring->avail_idx) {
+            break;
+        }
+        g_usleep(1000);
+    }
+    g_assert_cmpint(readw(vring->used + 2), ==, vring->avail_idx);
+
+    memread(REQ_STATUS_ADDR, &status, 1);
+    return status;
+}
+
+static void test_data_plane_rw(void)
+{
+    char *cmdline;
+    TestVring vring;
+    uint8_t buf[512], data[512];
+
+    cmdline = g_strdup_printf("-nodefaults"
+                              " -drive if=none,id=drive0,file=%s,"
+                              "format=raw,cache=none,aio=native"
+                              " -device virtio-blk-pci,drive=drive0,"
+                              "scsi=off,x-data-plane=on",
+                              img_file_name);
+    qtest_start(cmdline);
+    virtio_blk_init(&vring);
+
+    memset(buf, 0xa5, sizeof(buf));
+    memwrite(REQ_DATA_ADDR, buf, sizeof(buf));
+    g_assert_cmpint(virtio_blk_request(&vring, VIRTIO_BLK_T_OUT, 8), ==, 0);
+
+    memset(data, 0, sizeof(data));
+    memwrite(REQ_DATA_ADDR, data, sizeof(data));
+    g_assert_cmpint(virtio_blk_request(&vring, VIRTIO_BLK_T_IN, 8), ==, 0);
+    memread(REQ_DATA_ADDR, data, sizeof(data));
+    g_assert(memcmp(buf, data, sizeof(buf)) == 0);
+
+    qtest_quit(global_qtest);
+    g_free(cmdline);
+}
+
+static void test_data_plane_devices(int num_devices)
+{
+    GString *cmdline = g_string_new("-nodefaults");
+    int i;
+
+    for (i = 0; i < num_devices; i++) {
+        g_string_append_printf(cmdline,
+                               " -drive if=none,id=drive%d,file=%s,"
+                               "format=raw,cache=none,aio=native,"
+                               "readonly=on"
+                               " -device virtio-blk-pci,drive=drive%d,"
+                               "scsi=off,x-data-plane=on",
+                               i, img_file_name, i);
+    }
+
+    qtest_start(cmdline->str);
+    qtest_quit(global_qtest);
+    g_string_free(cmdline, true);
+}
+
+static void test_data_plane_1(void)
+{
+    test_data_plane_devices(1);
+}
+
+static void test_data_plane_4(void)
+{
+    test_data_plane_devices(4);
+}
+
+static void test_data_plane_16(void)
+{
+    test_data_plane_devices(16);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    img_file_name = create_test_img(1024 * 1024);
+
+    qtest_add_func("virtio-blk/data-plane/1", test_data_plane_1);
+    qtest_add_func("virtio-blk/data-plane/4", test_data_plane_4);
+    qtest_add_func("virtio-blk/data-plane/16", test_data_plane_16);
+    qtest_add_func("virtio-blk/data-plane/rw", test_data_plane_rw);
+
+    ret = g_test_run();
+
+    unlink(img_file_name);
+    free(img_file_name);
+    return ret;
+}
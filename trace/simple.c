@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #ifndef _WIN32
 #include <signal.h>
@@ -38,25 +39,40 @@
 /*
  * Trace records are written out by a dedicated thread.  The thread waits for
  * records to become available, writes them out, and then waits again.
+ *
+ * Producers never take trace_lock on the fast path: space in the ring is
+ * reserved with a compare-and-swap on trace_idx, and a record is published
+ * by setting TRACE_RECORD_VALID in its event ID once it is complete.  Only
+ * the producer that finds the buffer past the flush threshold, and no kick
+ * already pending, takes the lock to wake up the writeout thread.  The
+ * writeout thread drains every published record in one batch, clears the
+ * ring behind it and only then hands the space back to the producers.
  */
 static GStaticMutex trace_lock = G_STATIC_MUTEX_INIT;
 static GCond *trace_available_cond;
 static GCond *trace_empty_cond;
 static bool trace_available;
 static bool trace_writeout_enabled;
+static gint trace_kick_pending;
 
 enum {
     TRACE_BUF_LEN = 4096 * 64,
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
+/* Records start on a multiple of this, so that the event ID never wraps */
+#define TRACE_RECORD_ALIGN 8
+
+uint8_t trace_buf[TRACE_BUF_LEN] __attribute__((aligned(TRACE_RECORD_ALIGN)));
 static unsigned int trace_idx;
 static unsigned int writeout_idx;
-static uint64_t dropped_events;
+static unsigned int dropped_events;
 static FILE *trace_fp;
 static char *trace_file_name;
 
+/* Records are copied here so that a whole batch goes out with one fwrite */
+static uint8_t writeout_buf[TRACE_BUF_LEN];
+
 /* * Trace buffer entry */
 typedef struct {
     uint64_t event; /*   TraceEventID */
@@ -74,52 +90,60 @@ typedef struct {
 
 
 static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+static unsigned int write_to_buffer(unsigned int idx, const void *dataptr,
+                                    size_t size);
+
+static unsigned int record_space(uint32_t length)
+{
+    return (length + TRACE_RECORD_ALIGN - 1) & ~(TRACE_RECORD_ALIGN - 1);
+}
 
 static void clear_buffer_range(unsigned int idx, size_t len)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
-        num++;
-    }
+    size_t n = MIN(len, TRACE_BUF_LEN - idx);
+
+    memset(&trace_buf[idx], 0, n);
+    memset(&trace_buf[0], 0, len - n);
 }
+
 /**
- * Read a trace record from the trace buffer
+ * Copy the trace records published since the last writeout
  *
- * @idx         Trace buffer index
- * @record      Trace record to fill
+ * @buf         Destination, at least TRACE_BUF_LEN bytes
  *
- * Returns false if the record is not valid.
+ * Returns the number of bytes copied to @buf.  The ring space of the copied
+ * records is cleared, otherwise any byte with its MSB set may be considered
+ * as a valid event id when the writer thread crosses this range of buffer
+ * again, and then given back to the producers.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static size_t get_trace_records(uint8_t *buf)
 {
-    uint64_t event_flag = 0;
+    unsigned int idx = writeout_idx;
+    size_t len = 0;
     TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
+    /* A full ring ends where it starts, on a record that we copied already */
+    while (idx - writeout_idx < TRACE_BUF_LEN) {
+        /* read the event flag to see if its a valid record */
+        record.event = *(volatile uint64_t *)&trace_buf[idx % TRACE_BUF_LEN];
+        if (!(record.event & TRACE_RECORD_VALID)) {
+            break;
+        }
+
+        smp_rmb(); /* read memory barrier before accessing record */
+        read_from_buffer(idx % TRACE_BUF_LEN, &record, sizeof(TraceRecord));
+        read_from_buffer(idx % TRACE_BUF_LEN, buf + len, record.length);
+        ((TraceRecord *)(buf + len))->event &= ~TRACE_RECORD_VALID;
+        len += record.length;
+        idx += record_space(record.length);
     }
 
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* dont use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
-    return true;
+    if (idx != writeout_idx) {
+        clear_buffer_range(writeout_idx % TRACE_BUF_LEN, idx - writeout_idx);
+        smp_wmb(); /* the space must be clear before producers can reuse it */
+        writeout_idx = idx;
+    }
+    return len;
 }
 
 /**
@@ -149,44 +173,41 @@ static void wait_for_trace_records_available(void)
                     g_static_mutex_get_mutex(&trace_lock));
     }
     trace_available = false;
+    g_atomic_int_set(&trace_kick_pending, 0);
     g_static_mutex_unlock(&trace_lock);
 }
 
 static gpointer writeout_thread(gpointer opaque)
 {
-    TraceRecord *recordptr;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
-    uint64_t dropped_count;
+    unsigned int dropped_count;
+    uint64_t dropped_count64;
+    size_t len;
     size_t unused __attribute__ ((unused));
 
     for (;;) {
         wait_for_trace_records_available();
 
-        if (dropped_events) {
+        if (g_atomic_int_get((gint *)&dropped_events)) {
             dropped.rec.event = DROPPED_EVENT_ID,
             dropped.rec.timestamp_ns = get_clock();
-            dropped.rec.length = sizeof(TraceRecord) + sizeof(dropped_events),
+            dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t),
             dropped.rec.reserved = 0;
-            while (1) {
-                dropped_count = dropped_events;
-                if (g_atomic_int_compare_and_exchange((gint *)&dropped_events,
-                                                      dropped_count, 0)) {
-                    break;
-                }
-            }
-            memcpy(dropped.rec.arguments, &dropped_count, sizeof(uint64_t));
+            do {
+                dropped_count = g_atomic_int_get((gint *)&dropped_events);
+            } while (!g_atomic_int_compare_and_exchange((gint *)&dropped_events,
+                                                        dropped_count, 0));
+            dropped_count64 = dropped_count;
+            memcpy(dropped.rec.arguments, &dropped_count64, sizeof(uint64_t));
             unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
         }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* dont use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
+        /* Keep going while producers refill the buffer behind us */
+        while ((len = get_trace_records(writeout_buf)) > 0) {
+            unused = fwrite(writeout_buf, len, 1, trace_fp);
         }
 
         fflush(trace_fp);
@@ -204,38 +225,38 @@ void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen
     /* Write string length first */
     rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->rec_off, s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
-    uint32_t rec_len = sizeof(TraceRecord) + datasize;
-    uint64_t timestamp_ns = get_clock();
-
-    while (1) {
-        old_idx = trace_idx;
-        smp_rmb();
-        new_idx = old_idx + rec_len;
-
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
+    unsigned int idx, old_idx, new_idx;
+    TraceRecord record = {
+        .event = event,
+        .timestamp_ns = get_clock(),
+        .length = sizeof(TraceRecord) + datasize,
+    };
+
+    do {
+        old_idx = g_atomic_int_get((gint *)&trace_idx);
+        new_idx = old_idx + record_space(record.length);
+
+        if (new_idx - g_atomic_int_get((gint *)&writeout_idx) >
+            TRACE_BUF_LEN) {
             /* Trace Buffer Full, Event dropped ! */
             g_atomic_int_inc((gint *)&dropped_events);
             return -ENOSPC;
         }
+    } while (!g_atomic_int_compare_and_exchange((gint *)&trace_idx,
+                                                old_idx, new_idx));
 
-        if (g_atomic_int_compare_and_exchange((gint *)&trace_idx,
-                                              old_idx, new_idx)) {
-            break;
-        }
-    }
-
+    /* The event ID goes in without TRACE_RECORD_VALID, which is only set by
+     * trace_record_finish() */
     idx = old_idx % TRACE_BUF_LEN;
-
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event, sizeof(event));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
+    memcpy(&trace_buf[idx], &record, sizeof(record.event));
+    write_to_buffer((idx + sizeof(record.event)) % TRACE_BUF_LEN,
+                    &record.timestamp_ns,
+                    sizeof(TraceRecord) - sizeof(record.event));
 
     rec->tbuf_idx = idx;
     rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
@@ -244,38 +265,33 @@ int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasi
 
 static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
 {
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
-    }
+    size_t n = MIN(size, TRACE_BUF_LEN - idx);
+
+    memcpy(dataptr, &trace_buf[idx], n);
+    memcpy((uint8_t *)dataptr + n, &trace_buf[0], size - n);
 }
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
+static unsigned int write_to_buffer(unsigned int idx, const void *dataptr,
+                                    size_t size)
 {
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
-    }
-    return idx; /* most callers wants to know where to write next */
+    size_t n = MIN(size, TRACE_BUF_LEN - idx);
+
+    memcpy(&trace_buf[idx], dataptr, n);
+    memcpy(&trace_buf[0], (const uint8_t *)dataptr + n, size - n);
+    /* most callers wants to know where to write next */
+    return (idx + size) % TRACE_BUF_LEN;
 }
 
 void trace_record_finish(TraceBufferRecord *rec)
 {
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    uint64_t *event = (uint64_t *)&trace_buf[rec->tbuf_idx];
+
     smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    *(volatile uint64_t *)event = *event | TRACE_RECORD_VALID;
 
-    if ((trace_idx - writeout_idx) > TRACE_BUF_FLUSH_THRESHOLD) {
+    if (g_atomic_int_get((gint *)&trace_idx) -
+        g_atomic_int_get((gint *)&writeout_idx) > TRACE_BUF_FLUSH_THRESHOLD &&
+        g_atomic_int_compare_and_exchange(&trace_kick_pending, 0, 1)) {
         flush_trace_file(false);
     }
 }
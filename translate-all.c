@@ -103,10 +103,8 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     return 0;
 }
 
-/* The cpu state corresponding to 'searched_pc' is restored.
- */
-int cpu_restore_state(TranslationBlock *tb,
-                      CPUArchState *env, uintptr_t searched_pc)
+static int cpu_restore_state_locked(TranslationBlock *tb,
+                                    CPUArchState *env, uintptr_t searched_pc)
 {
     TCGContext *s = &tcg_ctx;
     int j;
@@ -158,3 +156,24 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     return 0;
 }
+
+/* The cpu state corresponding to 'searched_pc' is restored.
+ */
+int cpu_restore_state(TranslationBlock *tb,
+                      CPUArchState *env, uintptr_t searched_pc)
+{
+    bool locked = false;
+    int ret;
+
+    /* Retranslating uses tcg_ctx, which other vCPU threads may be
+       generating code with */
+    if (mttcg_enabled && !tb_lock_held()) {
+        tb_lock();
+        locked = true;
+    }
+    ret = cpu_restore_state_locked(tb, env, searched_pc);
+    if (locked) {
+        tb_unlock();
+    }
+    return ret;
+}
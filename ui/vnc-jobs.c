@@ -37,35 +37,51 @@
  * - jobs queue lock: for each operation on the queue (push, pop, isEmpty?)
  * - VncDisplay global lock: mainly used for framebuffer updates to avoid
  *                      screen corruption if the framebuffer is updated
- *                      while the worker is doing something.
+ *                      while the workers are doing something.
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  *                          if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is held
- * to avoid screen corruption (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not held because the thread works on
- * its own output buffer.
+ * While a VNC worker thread is working, it holds the VncDisplay global lock
+ * shared, so that several workers can encode at the same time but the server
+ * surface is not updated under their feet (this does not block vnc_refresh()
+ * because it uses trylock()).  The output lock is not held because each thread
+ * works on its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
+ *
+ * Ordering:
+ *
+ * Jobs of a client are encoded in the order they were pushed: a worker only
+ * picks a job if no older job of the same client is still in the queue.  The
+ * zlib, tight and zrle encoders keep compression streams across updates, so
+ * this also guarantees that only one thread at a time touches that state.
+ * Raw and hextile have no such state; for them vnc_job_push() splits a large
+ * update into a batch of jobs that the workers encode in parallel.  Each job
+ * of a batch sends its own FramebufferUpdate message, and since the rectangles
+ * of a batch do not overlap their order does not matter.
  */
 
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
-    Buffer buffer;
     bool exit;
+    int nb_workers;         /* running worker threads */
+    int max_workers;        /* how many we want */
+    uint64_t batch;         /* last batch number */
     QTAILQ_HEAD(, VncJob) jobs;
 };
 
 typedef struct VncJobQueue VncJobQueue;
 
 /*
- * We use a single global queue, but most of the functions are
- * already reentrant, so we can easily add more than one encoding thread
+ * A single global queue is shared by all the worker threads and all the
+ * clients.
  */
 static VncJobQueue *queue;
 
+/* Updates smaller than this are not worth splitting across workers */
+#define VNC_JOB_SPLIT_MIN_AREA (128 * 128)
+
 static void vnc_lock_queue(VncJobQueue *queue)
 {
     qemu_mutex_lock(&queue->mutex);
@@ -102,13 +118,113 @@ int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
     return 1;
 }
 
+static void vnc_job_free(VncJob *job)
+{
+    VncRectEntry *entry, *tmp;
+
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        g_free(entry);
+    }
+    g_free(job);
+}
+
+/*
+ * Encodings that carry no state from one rectangle to the next, so that
+ * the rectangles of an update can be encoded by several threads at once.
+ */
+static bool vnc_encoding_is_stateless(int encoding)
+{
+    switch (encoding) {
+    case VNC_ENCODING_ZLIB:
+    case VNC_ENCODING_TIGHT:
+    case VNC_ENCODING_TIGHT_PNG:
+    case VNC_ENCODING_ZRLE:
+    case VNC_ENCODING_ZYWRLE:
+        return false;
+    default:
+        return true;
+    }
+}
+
+/*
+ * Spread the rectangles of @job over at most @max jobs with about the same
+ * number of pixels each, cutting rectangles into horizontal bands where
+ * needed.  @job is reused as the first job of the batch; the jobs are
+ * returned in @jobs and their number is returned.
+ */
+static int vnc_job_split(VncJob *job, VncJob **jobs, int max)
+{
+    QLIST_HEAD(, VncRectEntry) rectangles;
+    VncRectEntry *entry, *band;
+    int64_t total = 0, target, filled = 0;
+    int n = 0;
+
+    jobs[0] = job;
+    if (max <= 1 || !vnc_encoding_is_stateless(job->vs->vnc_encoding)) {
+        return 1;
+    }
+
+    QLIST_FOREACH(entry, &job->rectangles, next) {
+        total += entry->rect.w * entry->rect.h;
+    }
+    if (total < VNC_JOB_SPLIT_MIN_AREA) {
+        return 1;
+    }
+    target = DIV_ROUND_UP(total, max);
+
+    QLIST_INIT(&rectangles);
+    while ((entry = QLIST_FIRST(&job->rectangles))) {
+        QLIST_REMOVE(entry, next);
+        QLIST_INSERT_HEAD(&rectangles, entry, next);
+    }
+
+    while ((entry = QLIST_FIRST(&rectangles))) {
+        int64_t room = target - filled;
+        int rows;
+
+        if (room <= 0 && n + 1 < max) {
+            jobs[++n] = g_malloc0(sizeof(VncJob));
+            jobs[n]->vs = job->vs;
+            QLIST_INIT(&jobs[n]->rectangles);
+            filled = 0;
+            room = target;
+        }
+
+        /* Keep bands a multiple of the hextile tile height */
+        rows = QEMU_ALIGN_UP(MAX(room / entry->rect.w, 1), 16);
+        if (n + 1 == max || rows >= entry->rect.h) {
+            QLIST_REMOVE(entry, next);
+            band = entry;
+        } else {
+            band = g_malloc0(sizeof(VncRectEntry));
+            band->rect = entry->rect;
+            band->rect.h = rows;
+            entry->rect.y += rows;
+            entry->rect.h -= rows;
+        }
+        QLIST_INSERT_HEAD(&jobs[n]->rectangles, band, next);
+        filled += band->rect.w * band->rect.h;
+    }
+
+    return n + 1;
+}
+
 void vnc_job_push(VncJob *job)
 {
+    VncJob *jobs[VNC_MAX_WORKERS];
+    int i, n;
+
     vnc_lock_queue(queue);
     if (queue->exit || QLIST_EMPTY(&job->rectangles)) {
-        g_free(job);
+        vnc_job_free(job);
     } else {
-        QTAILQ_INSERT_TAIL(&queue->jobs, job, next);
+        n = vnc_job_split(job, jobs, queue->max_workers);
+        queue->batch++;
+        for (i = 0; i < n; i++) {
+            jobs[i]->batch = queue->batch;
+            jobs[i]->split = n > 1;
+            QTAILQ_INSERT_TAIL(&queue->jobs, jobs[i], next);
+        }
         qemu_cond_broadcast(&queue->cond);
     }
     vnc_unlock_queue(queue);
@@ -142,8 +258,10 @@ void vnc_jobs_clear(VncState *vs)
 
     vnc_lock_queue(queue);
     QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
+        /* Jobs being encoded are removed by their worker when done */
+        if ((job->vs == vs || !vs) && !job->running) {
             QTAILQ_REMOVE(&queue->jobs, job, next);
+            vnc_job_free(job);
         }
     }
     vnc_unlock_queue(queue);
@@ -179,7 +297,8 @@ void vnc_jobs_consume_buffer(VncState *vs)
 /*
  * Copy data for local use
  */
-static void vnc_async_encoding_start(VncState *orig, VncState *local)
+static void vnc_async_encoding_start(VncState *orig, VncState *local,
+                                     Buffer *output)
 {
     local->vnc_encoding = orig->vnc_encoding;
     local->features = orig->features;
@@ -193,42 +312,78 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
     local->zrle = orig->zrle;
-    local->output =  queue->buffer;
+    local->output = *output;
     local->csock = -1; /* Don't do any network work on this thread */
 
     buffer_reset(&local->output);
 }
 
-static void vnc_async_encoding_end(VncState *orig, VncState *local)
+static void vnc_async_encoding_end(VncState *orig, VncState *local,
+                                   bool split)
+{
+    /* Jobs that may run in parallel with others of the same client
+     * must not write back the state they started from */
+    if (!split) {
+        orig->tight = local->tight;
+        orig->zlib = local->zlib;
+        orig->hextile = local->hextile;
+        orig->zrle = local->zrle;
+        orig->lossy_rect = local->lossy_rect;
+    }
+}
+
+/*
+ * Return the oldest job that can be started now, that is one that is not
+ * already being encoded and that has no older job of the same client
+ * queued outside its own batch.
+ */
+static VncJob *vnc_queue_next_job(VncJobQueue *queue)
 {
-    orig->tight = local->tight;
-    orig->zlib = local->zlib;
-    orig->hextile = local->hextile;
-    orig->zrle = local->zrle;
-    orig->lossy_rect = local->lossy_rect;
+    VncJob *job, *older;
 
-    queue->buffer = local->output;
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        if (job->running) {
+            continue;
+        }
+        for (older = QTAILQ_FIRST(&queue->jobs); older != job;
+             older = QTAILQ_NEXT(older, next)) {
+            if (older->vs == job->vs && older->batch != job->batch) {
+                break;
+            }
+        }
+        if (older == job) {
+            return job;
+        }
+    }
+    return NULL;
 }
 
-static int vnc_worker_thread_loop(VncJobQueue *queue)
+/*
+ * Encode one job.  Returns 0 when done, -1 if the thread should exit and
+ * 1 if it should exit and is the last worker of a queue being torn down.
+ */
+static int vnc_worker_thread_loop(VncJobQueue *queue, Buffer *output)
 {
-    VncJob *job;
+    VncJob *job = NULL;
     VncRectEntry *entry, *tmp;
     VncState vs;
     int n_rectangles;
     int saved_offset;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    while (!queue->exit && queue->nb_workers <= queue->max_workers &&
+           !(job = vnc_queue_next_job(queue))) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
-    /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
-    vnc_unlock_queue(queue);
+    if (queue->exit || queue->nb_workers > queue->max_workers) {
+        /* Either everybody leaves or the pool is being shrunk */
+        bool last = --queue->nb_workers == 0 && queue->exit;
 
-    if (queue->exit) {
-        return -1;
+        vnc_unlock_queue(queue);
+        return last ? 1 : -1;
     }
+    job->running = true;
+    vnc_unlock_queue(queue);
 
     vnc_lock_output(job->vs);
     if (job->vs->csock == -1 || job->vs->abort == true) {
@@ -238,7 +393,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     vnc_unlock_output(job->vs);
 
     /* Make a local copy of vs and switch output buffers */
-    vnc_async_encoding_start(job->vs, &vs);
+    vnc_async_encoding_start(job->vs, &vs, output);
 
     /* Start sending rectangles */
     n_rectangles = 0;
@@ -247,12 +402,13 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     saved_offset = vs.output.offset;
     vnc_write_u16(&vs, 0);
 
-    vnc_lock_display(job->vs->vd);
+    vnc_lock_display_shared(job->vs->vd);
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
         if (job->vs->csock == -1) {
-            vnc_unlock_display(job->vs->vd);
+            vnc_unlock_display_shared(job->vs->vd);
+            *output = vs.output;
             goto disconnected;
         }
 
@@ -262,9 +418,10 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         if (n >= 0) {
             n_rectangles += n;
         }
+        QLIST_REMOVE(entry, next);
         g_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_unlock_display_shared(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
     vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
@@ -276,18 +433,19 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         buffer_append(&job->vs->jobs_buffer, vs.output.buffer,
                       vs.output.offset);
         /* Copy persistent encoding data */
-        vnc_async_encoding_end(job->vs, &vs);
+        vnc_async_encoding_end(job->vs, &vs, job->split);
 
 	qemu_bh_schedule(job->vs->bh);
     }
     vnc_unlock_output(job->vs);
+    *output = vs.output;
 
 disconnected:
     vnc_lock_queue(queue);
     QTAILQ_REMOVE(&queue->jobs, job, next);
     vnc_unlock_queue(queue);
     qemu_cond_broadcast(&queue->cond);
-    g_free(job);
+    vnc_job_free(job);
     return 0;
 }
 
@@ -305,7 +463,6 @@ static void vnc_queue_clear(VncJobQueue *q)
 {
     qemu_cond_destroy(&queue->cond);
     qemu_mutex_destroy(&queue->mutex);
-    buffer_free(&queue->buffer);
     g_free(q);
     queue = NULL; /* Unset global queue */
 }
@@ -313,11 +470,14 @@ static void vnc_queue_clear(VncJobQueue *q)
 static void *vnc_worker_thread(void *arg)
 {
     VncJobQueue *queue = arg;
+    Buffer output = { 0 };
+    int ret;
 
-    qemu_thread_get_self(&queue->thread);
-
-    while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+    while (!(ret = vnc_worker_thread_loop(queue, &output))) ;
+    buffer_free(&output);
+    if (ret > 0) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
@@ -326,6 +486,18 @@ static bool vnc_worker_thread_running(void)
     return queue; /* Check global queue */
 }
 
+/* Called with the queue lock held */
+static void vnc_start_workers(VncJobQueue *q)
+{
+    QemuThread thread;
+
+    while (q->nb_workers < q->max_workers) {
+        q->nb_workers++;
+        qemu_thread_create(&thread, vnc_worker_thread, q,
+                           QEMU_THREAD_DETACHED);
+    }
+}
+
 void vnc_start_worker_thread(void)
 {
     VncJobQueue *q;
@@ -334,16 +506,34 @@ void vnc_start_worker_thread(void)
         return ;
 
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, vnc_worker_thread, q, QEMU_THREAD_DETACHED);
+    q->max_workers = 1;
+    vnc_lock_queue(q);
+    vnc_start_workers(q);
+    vnc_unlock_queue(q);
     queue = q; /* Set global queue */
 }
 
+void vnc_set_worker_threads(int n)
+{
+    assert(n >= 1 && n <= VNC_MAX_WORKERS);
+
+    if (!vnc_worker_thread_running())
+        return ;
+
+    vnc_lock_queue(queue);
+    queue->max_workers = n;
+    vnc_start_workers(queue);
+    vnc_unlock_queue(queue);
+    /* Superfluous workers notice it and exit */
+    qemu_cond_broadcast(&queue->cond);
+}
+
 void vnc_stop_worker_thread(void)
 {
     if (!vnc_worker_thread_running())
         return ;
 
-    /* Remove all jobs and wake up the thread */
+    /* Remove all jobs and wake up the threads */
     vnc_lock_queue(queue);
     queue->exit = true;
     vnc_unlock_queue(queue);
@@ -40,21 +40,43 @@ void vnc_jobs_join(VncState *vs);
 
 void vnc_jobs_consume_buffer(VncState *vs);
 void vnc_start_worker_thread(void);
+void vnc_set_worker_threads(int n);
 void vnc_stop_worker_thread(void);
 
-/* Locks */
+/*
+ * Locks
+ *
+ * The display lock is taken shared by the worker threads while they read
+ * the server surface, and exclusive by vnc_refresh() to update it.  The
+ * exclusive side never waits for the workers: vnc_refresh() just tries
+ * again later.
+ */
 static inline int vnc_trylock_display(VncDisplay *vd)
 {
-    return qemu_mutex_trylock(&vd->mutex);
+    qemu_mutex_lock(&vd->mutex);
+    if (vd->encoders) {
+        qemu_mutex_unlock(&vd->mutex);
+        return -EBUSY;
+    }
+    return 0;
+}
+
+static inline void vnc_unlock_display(VncDisplay *vd)
+{
+    qemu_mutex_unlock(&vd->mutex);
 }
 
-static inline void vnc_lock_display(VncDisplay *vd)
+static inline void vnc_lock_display_shared(VncDisplay *vd)
 {
     qemu_mutex_lock(&vd->mutex);
+    vd->encoders++;
+    qemu_mutex_unlock(&vd->mutex);
 }
 
-static inline void vnc_unlock_display(VncDisplay *vd)
+static inline void vnc_unlock_display_shared(VncDisplay *vd)
 {
+    qemu_mutex_lock(&vd->mutex);
+    vd->encoders--;
     qemu_mutex_unlock(&vd->mutex);
 }
 
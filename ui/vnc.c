@@ -2878,6 +2878,7 @@ void vnc_display_open(DisplayState *ds, const char *display, Error **errp)
     int acl = 0;
 #endif
     int lock_key_sync = 1;
+    long workers = 1;
 
     if (!vnc_display) {
         error_setg(errp, "VNC display not active");
@@ -2947,6 +2948,16 @@ void vnc_display_open(DisplayState *ds, const char *display, Error **errp)
             vs->lossy = true;
         } else if (strncmp(options, "non-adaptive", 12) == 0) {
             vs->non_adaptive = true;
+        } else if (strncmp(options, "workers=", 8) == 0) {
+            char *end;
+
+            workers = strtol(options + 8, &end, 10);
+            if (end == options + 8 || (*end && *end != ',') ||
+                workers < 1 || workers > VNC_MAX_WORKERS) {
+                error_setg(errp, "vnc workers= must be between 1 and %d",
+                           VNC_MAX_WORKERS);
+                goto fail;
+            }
         } else if (strncmp(options, "share=", 6) == 0) {
             if (strncmp(options+6, "ignore", 6) == 0) {
                 vs->share_policy = VNC_SHARE_POLICY_IGNORE;
@@ -3063,6 +3074,7 @@ void vnc_display_open(DisplayState *ds, const char *display, Error **errp)
     }
 #endif
     vs->lock_key_sync = lock_key_sync;
+    vnc_set_worker_threads(workers);
 
     if (reverse) {
         /* connect to viewer */
@@ -88,6 +88,9 @@ typedef void VncSendHextileTile(VncState *vs,
 #define VNC_STAT_COLS (VNC_MAX_WIDTH / VNC_STAT_RECT)
 #define VNC_STAT_ROWS (VNC_MAX_HEIGHT / VNC_STAT_RECT)
 
+/* Maximum number of encoding threads, see the workers= option */
+#define VNC_MAX_WORKERS 16
+
 #define VNC_AUTH_CHALLENGE_SIZE 16
 
 typedef struct VncDisplay VncDisplay;
@@ -146,6 +149,7 @@ struct VncDisplay
     kbd_layout_t *kbd_layout;
     int lock_key_sync;
     QemuMutex mutex;
+    int encoders;       /* worker threads reading the server surface */
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -230,6 +234,9 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    uint64_t batch;     /* jobs pushed together by vnc_job_push() */
+    bool split;         /* batch has more than one job */
+    bool running;
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -3406,6 +3406,12 @@ int main(int argc, char **argv, char **envp)
                     tcg_tb_size = 0;
                 }
                 break;
+            case QEMU_OPTION_tb_hot:
+                tb_hot_threshold = strtol(optarg, NULL, 0);
+                if (tb_hot_threshold < 0) {
+                    tb_hot_threshold = 0;
+                }
+                break;
             case QEMU_OPTION_icount:
                 icount_option = optarg;
                 break;
@@ -3744,6 +3750,8 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
     configure_icount(icount_option);
+    configure_tcg_threads(machine_opts ?
+                          qemu_opt_get(machine_opts, "tcg-thread") : NULL);
 
     if (net_init_clients() < 0) {
         exit(1);